@@ -1,18 +1,24 @@
+#include <algorithm>
+#include <charconv>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <utility>
 
 #include <dake/math/matrix.hpp>
 
 #include "amc.hpp"
 #include "asf.hpp"
+#include "memory.hpp"
+#include "trace.hpp"
 
 
 using namespace dake::math;
@@ -51,19 +57,326 @@ static bool getline(std::ifstream &s, std::string &line)
 }
 
 
-AMC::AMC(std::ifstream &s, ASF *a):
+// Identifies binary AMC files
+static const char binary_magic[4] = {'A', 'M', 'C', 'B'};
+static const uint32_t binary_version = 1;
+
+
+// Value to write into a file so that the reader's value * unit is stored;
+// if there is none, returns the nearest one and increments inexact
+static float file_value(float stored, float unit, size_t &inexact)
+{
+    float value = stored / unit;
+    if (value * unit == stored) {
+        return value;
+    }
+
+    // The division is correctly rounded, so a solution (if there is one)
+    // must be close
+    float best = value, best_error = fabsf(value * unit - stored);
+    float down = value, up = value;
+    for (int i = 0; i < 4; i++) {
+        down = nextafterf(down, -HUGE_VALF);
+        up = nextafterf(up, HUGE_VALF);
+
+        for (float candidate: {down, up}) {
+            float error = fabsf(candidate * unit - stored);
+            if (!error) {
+                return candidate;
+            } else if (error < best_error) {
+                best = candidate;
+                best_error = error;
+            }
+        }
+    }
+
+    inexact++;
+    return best;
+}
+
+
+size_t AMC::write_text(std::ostream &s, int first, int count) const
+{
+    static const float angle_unit = static_cast<float>(M_PI) / 180.f;
+
+    size_t begin = std::max(0, std::min(first - ff, static_cast<int>(fs.size())));
+    size_t end = std::max(begin, std::min(begin + std::max(count, 0), fs.size()));
+    float length_unit = asf->internal_length_unit();
+    size_t inexact = 0;
+
+    // Everything is formatted into this buffer (to_chars() gives the
+    // shortest representation that reads back as the same float)
+    char buffer[65536];
+    char *p = buffer;
+    const char *flush_mark = buffer + sizeof(buffer) - 1024;
+
+    auto append = [&](const char *str, size_t len) {
+        memcpy(p, str, len);
+        p += len;
+    };
+    auto append_value = [&](float value) {
+        *p++ = ' ';
+        p = std::to_chars(p, p + 32, value).ptr;
+    };
+
+    append(":FULLY-SPECIFIED\n:DEGREES\n", 26);
+
+    for (size_t fi = begin; fi < end; fi++) {
+        const Frame &frame = fs[fi];
+
+        p = std::to_chars(p, p + 16, static_cast<int>(fi) + ff).ptr;
+        append("\nroot", 5);
+
+        for (ASF::Axis axis: asf->root_order()) {
+            switch (axis) {
+                case ASF::RX: append_value(file_value(frame.root_rotation.x(), angle_unit, inexact)); break;
+                case ASF::RY: append_value(file_value(frame.root_rotation.y(), angle_unit, inexact)); break;
+                case ASF::RZ: append_value(file_value(frame.root_rotation.z(), angle_unit, inexact)); break;
+                case ASF::TX: append_value(file_value(frame.root_translation.x(), length_unit, inexact)); break;
+                case ASF::TY: append_value(file_value(frame.root_translation.y(), length_unit, inexact)); break;
+                case ASF::TZ: append_value(file_value(frame.root_translation.z(), length_unit, inexact)); break;
+            }
+        }
+        *p++ = '\n';
+
+        for (size_t bi = 0; bi < asf->bones().size(); bi++) {
+            const ASF::Bone &bone = asf->bones()[bi];
+            if ((static_cast<int>(bi) == asf->root_index()) || bone.dof_order.empty()) {
+                continue;
+            }
+
+            // Bone names are not limited in length
+            if (p + bone.name.length() + 64 > buffer + sizeof(buffer)) {
+                s.write(buffer, p - buffer);
+                p = buffer;
+            }
+            if (bone.name.length() + 64 > sizeof(buffer)) {
+                s.write(bone.name.data(), bone.name.length());
+            } else {
+                append(bone.name.data(), bone.name.length());
+            }
+
+            const Transformation &trans = frame.transformations[bi];
+            for (ASF::Axis axis: bone.dof_order) {
+                switch (axis) {
+                    case ASF::RX: append_value(file_value(trans.rx, angle_unit, inexact)); break;
+                    case ASF::RY: append_value(file_value(trans.ry, angle_unit, inexact)); break;
+                    case ASF::RZ: append_value(file_value(trans.rz, angle_unit, inexact)); break;
+                    default: break;
+                }
+            }
+            *p++ = '\n';
+
+            if (p > flush_mark) {
+                s.write(buffer, p - buffer);
+                p = buffer;
+            }
+        }
+
+        if (p > flush_mark) {
+            s.write(buffer, p - buffer);
+            p = buffer;
+        }
+    }
+
+    s.write(buffer, p - buffer);
+
+    if (!s) {
+        throw std::runtime_error("Could not write AMC data");
+    }
+
+    return inexact;
+}
+
+
+// Binary files are only valid for the skeleton they were written for
+uint32_t AMC::skeleton_hash(const ASF &asf)
+{
+    uint32_t hash = 2166136261u;
+
+    auto add = [&](uint8_t byte) {
+        hash = (hash ^ byte) * 16777619u;
+    };
+
+    for (const ASF::Bone &bone: asf.bones()) {
+        for (char c: bone.name) {
+            add(c);
+        }
+        add(0);
+
+        for (ASF::Axis axis: bone.dof_order) {
+            add(axis);
+        }
+        add(0xff);
+    }
+
+    return hash;
+}
+
+
+// How often (in lines or frames) to report progress and check for
+// cancellation
+static const int progress_interval = 4096;
+
+
+static void update_progress(std::ifstream &s, AMC::LoadProgress *progress)
+{
+    if (progress->cancel) {
+        throw AMC::Cancelled();
+    }
+
+    progress->bytes_read = s.tellg();
+}
+
+
+// Thrown by progressive text parsing when a frame already published is
+// referenced again
+struct OutOfOrder {};
+
+
+static bool is_binary(std::ifstream &s)
+{
+    char magic[sizeof(binary_magic)];
+
+    if (s.read(magic, sizeof(magic)) && !memcmp(magic, binary_magic, sizeof(magic))) {
+        return true;
+    }
+
+    s.clear();
+    s.seekg(0);
+    return false;
+}
+
+
+AMC::AMC(std::ifstream &s, ASF *a, LoadProgress *progress):
     asf(a)
 {
+    if (is_binary(s)) {
+        read_binary(s, progress, fs, ff, false);
+    } else {
+        read_text(s, progress, fs, ff, false);
+    }
+}
+
+
+AMC::AMC(ASF *a):
+    asf(a),
+    load_complete(false)
+{}
+
+
+AMC::AMC(ASF *a, std::vector<Frame> &&frames, int first_frame):
+    asf(a),
+    fs(std::move(frames)),
+    ff(first_frame)
+{}
+
+
+void AMC::load_progressive(std::ifstream &s, LoadProgress *progress)
+{
+    std::vector<Frame> frames;
+    int first = -1;
+
+    try {
+        if (is_binary(s)) {
+            read_binary(s, progress, frames, first, true);
+        } else {
+            try {
+                read_text(s, progress, frames, first, true);
+            } catch (OutOfOrder &) {
+                // Cannot change published frames, so start over and publish
+                // everything at once
+                s.clear();
+                s.seekg(0);
+
+                frames.clear();
+                first = -1;
+                read_text(s, progress, frames, first, false);
+                publish(frames, frames.size(), first, true);
+            }
+        }
+    } catch (...) {
+        load_complete = true;
+        throw;
+    }
+
+    load_complete = true;
+}
+
+
+void AMC::publish(std::vector<Frame> &frames, size_t count, int first, bool replace)
+{
+    {
+        std::lock_guard<std::mutex> guard(pending_lock);
+
+        if (replace) {
+            pending.clear();
+            pending_replace = true;
+            published_frames = 0;
+        }
+        if (!published_frames) {
+            pending_first = first;
+        }
+
+        pending.insert(pending.end(), std::make_move_iterator(frames.begin()),
+                       std::make_move_iterator(frames.begin() + count));
+        published_frames += count;
+    }
+
+    frames.erase(frames.begin(), frames.begin() + count);
+}
+
+
+bool AMC::merge_loaded_frames(void)
+{
+    std::lock_guard<std::mutex> guard(pending_lock);
+
+    if (!pending_replace && pending.empty()) {
+        return false;
+    }
+
+    if (pending_replace || fs.empty()) {
+        replace_count += pending_replace;
+        fs.clear();
+        ff = pending_first;
+        pending_replace = false;
+    }
+
+    fs.insert(fs.end(), std::make_move_iterator(pending.begin()), std::make_move_iterator(pending.end()));
+    pending.clear();
+
+    return true;
+}
+
+
+void AMC::read_text(std::ifstream &s, LoadProgress *progress, std::vector<Frame> &frames, int &first,
+                    bool progressive)
+{
+    TRACE_SCOPE("AMC::read_text");
+
     std::string line;
     int current_frame = -1, cfi = -1;
     float angle_unit = 1.f; // rad
 
-    std::unordered_map<std::string, int> bone_indices;
-    for (size_t i = 0; i < asf->bones().size(); i++) {
-        bone_indices[asf->bones()[i].name] = i;
-    }
+    // Number of frames already published (and removed from frames), so
+    // frames[0] is frame first + base
+    int base = 0;
 
+    int lines = 0;
     while (getline(s, line)) {
+        if (!(++lines % progress_interval)) {
+            if (progress) {
+                update_progress(s, progress);
+            }
+
+            // All frames before the current one are assumed to be complete
+            if (progressive && (cfi > 0)) {
+                publish(frames, cfi, first, false);
+                base += cfi;
+                cfi = 0;
+            }
+        }
+
         if (line.front() == ':') {
             if (line == ":DEGREES") {
                 angle_unit = static_cast<float>(M_PI) / 180.f;
@@ -80,171 +393,379 @@ AMC::AMC(std::ifstream &s, ASF *a):
                 }
 
                 current_frame = frame;
-                if (ff < 0) {
-                    ff = current_frame;
+                if (first < 0) {
+                    first = current_frame;
+                }
+
+                if (base && (current_frame < first + base)) {
+                    throw OutOfOrder();
                 }
 
                 size_t elements_required;
-                if (current_frame >= ff) {
-                    elements_required = current_frame - ff + 1;
+                if (current_frame >= first) {
+                    elements_required = current_frame - (first + base) + 1;
                 } else {
-                    elements_required = ff - current_frame + fs.size();
+                    elements_required = first - current_frame + frames.size();
                 }
 
-                if (fs.size() < elements_required) {
-                    size_t old_size = fs.size();
+                if (frames.size() < elements_required) {
+                    size_t old_size = frames.size();
 
-                    fs.resize(elements_required);
-                    if (current_frame >= ff) {
+                    if (current_frame >= first) {
+                        frames.resize(elements_required);
                         for (size_t i = old_size; i < elements_required; i++) {
-                            fs[i].transformations.resize(asf->bones().size());
+                            frames[i].transformations.resize(asf->bones().size());
                         }
                     } else {
-                        // lel
-                        memmove(fs.data() + ff - current_frame, fs.data(), old_size);
-                        for (int i = 0; i < ff - current_frame; i++) {
-                            fs[i].transformations.reserve(asf->bones().size());
+                        // Frames before the first one seen so far
+                        frames.insert(frames.begin(), first - current_frame, Frame());
+                        for (int i = 0; i < first - current_frame; i++) {
+                            frames[i].transformations.resize(asf->bones().size());
                         }
 
-                        ff = current_frame;
+                        first = current_frame;
                     }
                 }
 
-                cfi = current_frame - ff;
+                cfi = current_frame - (first + base);
             } else {
-                std::stringstream line_ss(line);
-                std::string bone_name;
-
-                line_ss >> bone_name;
-                if (bone_name == "root") {
-                    for (ASF::Axis axis: asf->root_order()) {
-                        if (line_ss.eof()) {
-                            throw std::invalid_argument("Missing axis/axes for root (frame " + std::to_string(current_frame) + ")");
-                        }
+                if (cfi < 0) {
+                    throw std::invalid_argument("Expected frame number, got " + line);
+                }
 
-                        switch (axis) {
-                            case ASF::RX: line_ss >> fs[cfi].root_rotation.x(); break;
-                            case ASF::RY: line_ss >> fs[cfi].root_rotation.y(); break;
-                            case ASF::RZ: line_ss >> fs[cfi].root_rotation.z(); break;
-                            case ASF::TX: line_ss >> fs[cfi].root_translation.x(); break;
-                            case ASF::TY: line_ss >> fs[cfi].root_translation.y(); break;
-                            case ASF::TZ: line_ss >> fs[cfi].root_translation.z(); break;
-                            default: throw std::invalid_argument("Unknown root axis");
-                        }
-                    }
+                parse_line(*asf, line, frames[cfi], angle_unit, current_frame);
+            }
+        }
+    }
 
-                    if (!line_ss.eof()) {
-                        throw std::invalid_argument("Too many axes given for root (frame " + std::to_string(current_frame) + ")");
-                    }
+    if (progressive) {
+        publish(frames, frames.size(), first, false);
+    }
+}
 
-                    fs[cfi].root_rotation *= angle_unit;
-                    fs[cfi].root_translation *= asf->internal_length_unit();
-                } else {
-                    const auto &bi = bone_indices.find(bone_name);
-                    if (bi == bone_indices.end()) {
-                        throw std::invalid_argument("Unkown bone " + bone_name + " specified (frame " + std::to_string(current_frame) + ")");
-                    }
 
-                    Transformation &trans = fs[cfi].transformations[bi->second];
-                    const ASF::Bone &bone = asf->bones()[bi->second];
-                    for (ASF::Axis axis: bone.dof_order) {
-                        if (line_ss.eof()) {
-                            throw std::invalid_argument("Missing axis/axes for bone " + bone_name + " (frame " + std::to_string(current_frame) + ")");
-                        }
+void AMC::parse_line(const ASF &asf, const std::string &line, Frame &frame, float angle_unit, int frame_number)
+{
+    std::stringstream line_ss(line);
+    std::string bone_name;
+
+    line_ss >> bone_name;
+    if (bone_name == "root") {
+        for (ASF::Axis axis: asf.root_order()) {
+            if (line_ss.eof()) {
+                throw std::invalid_argument("Missing axis/axes for root (frame " + std::to_string(frame_number) + ")");
+            }
 
-                        float val;
-                        line_ss >> val;
+            switch (axis) {
+                case ASF::RX: line_ss >> frame.root_rotation.x(); break;
+                case ASF::RY: line_ss >> frame.root_rotation.y(); break;
+                case ASF::RZ: line_ss >> frame.root_rotation.z(); break;
+                case ASF::TX: line_ss >> frame.root_translation.x(); break;
+                case ASF::TY: line_ss >> frame.root_translation.y(); break;
+                case ASF::TZ: line_ss >> frame.root_translation.z(); break;
+                default: throw std::invalid_argument("Unknown root axis");
+            }
+        }
 
-                        switch (axis) {
-                            case ASF::RX: trans.rx = val * angle_unit; break;
-                            case ASF::RY: trans.ry = val * angle_unit; break;
-                            case ASF::RZ: trans.rz = val * angle_unit; break;
-                            default: throw std::invalid_argument("Unknown DOF " + std::to_string(static_cast<int>(axis)) + " for bone " + bone_name);
-                        }
-                    }
+        if (!line_ss.eof()) {
+            throw std::invalid_argument("Too many axes given for root (frame " + std::to_string(frame_number) + ")");
+        }
 
-                    if (!line_ss.eof()) {
-                        throw std::invalid_argument("Too many axes for bone " + bone_name + " (frame " + std::to_string(current_frame) + ")");
-                    }
-                }
+        frame.root_rotation *= angle_unit;
+        frame.root_translation *= asf.internal_length_unit();
+    } else {
+        int bi = asf.bone_index(bone_name);
+        if (bi < 0) {
+            throw std::invalid_argument("Unkown bone " + bone_name + " specified (frame " + std::to_string(frame_number) + ")");
+        }
+
+        if (frame.transformations.size() < asf.bones().size()) {
+            frame.transformations.resize(asf.bones().size());
+        }
+
+        Transformation &trans = frame.transformations[bi];
+        const ASF::Bone &bone = asf.bones()[bi];
+        for (ASF::Axis axis: bone.dof_order) {
+            if (line_ss.eof()) {
+                throw std::invalid_argument("Missing axis/axes for bone " + bone_name + " (frame " + std::to_string(frame_number) + ")");
+            }
+
+            float val;
+            line_ss >> val;
+
+            switch (axis) {
+                case ASF::RX: trans.rx = val * angle_unit; break;
+                case ASF::RY: trans.ry = val * angle_unit; break;
+                case ASF::RZ: trans.rz = val * angle_unit; break;
+                default: throw std::invalid_argument("Unknown DOF " + std::to_string(static_cast<int>(axis)) + " for bone " + bone_name);
             }
         }
+
+        if (!line_ss.eof()) {
+            throw std::invalid_argument("Too many axes for bone " + bone_name + " (frame " + std::to_string(frame_number) + ")");
+        }
+    }
+}
+
+
+void AMC::read_binary(std::ifstream &s, LoadProgress *progress, std::vector<Frame> &frames, int &first,
+                      bool progressive)
+{
+    TRACE_SCOPE("AMC::read_binary");
+
+    uint32_t header[4];
+    int32_t first_frame;
+
+    if (!s.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+        !s.read(reinterpret_cast<char *>(&first_frame), sizeof(first_frame)))
+    {
+        throw std::invalid_argument("Unexpected EOF in binary AMC header");
+    }
+
+    if (header[0] != binary_version) {
+        throw std::invalid_argument("Unsupported binary AMC version " + std::to_string(header[0]));
+    }
+    if ((header[1] != asf->bones().size()) || (header[2] != skeleton_hash(*asf))) {
+        throw std::invalid_argument("Binary AMC was written for a different skeleton");
+    }
+
+    size_t bone_count = header[1];
+    std::vector<float> values(6 + 3 * bone_count);
+
+    size_t frame_count = header[3];
+
+    first = first_frame;
+    frames.clear();
+    frames.reserve(progressive ? std::min<size_t>(frame_count, progress_interval) : frame_count);
+
+    for (size_t fi = 0; fi < frame_count; fi++) {
+        if (!((fi + 1) % progress_interval)) {
+            if (progress) {
+                update_progress(s, progress);
+            }
+            if (progressive) {
+                publish(frames, frames.size(), first, false);
+            }
+        }
+
+        frames.emplace_back();
+        Frame &frame = frames.back();
+
+        if (!s.read(reinterpret_cast<char *>(values.data()), values.size() * sizeof(float))) {
+            throw std::invalid_argument("Unexpected EOF in binary AMC frame data");
+        }
+
+        frame.root_translation = vec3(values[0], values[1], values[2]);
+        frame.root_rotation    = vec3(values[3], values[4], values[5]);
+
+        frame.transformations.resize(bone_count);
+        for (size_t i = 0; i < bone_count; i++) {
+            frame.transformations[i].rx = values[6 + 3 * i    ];
+            frame.transformations[i].ry = values[6 + 3 * i + 1];
+            frame.transformations[i].rz = values[6 + 3 * i + 2];
+        }
+    }
+
+    if (progressive) {
+        publish(frames, frames.size(), first, false);
+    }
+}
+
+
+void AMC::write_binary(std::ostream &s) const
+{
+    uint32_t header[4] = {
+        binary_version,
+        static_cast<uint32_t>(asf->bones().size()),
+        skeleton_hash(*asf),
+        static_cast<uint32_t>(fs.size())
+    };
+    int32_t first = ff;
+
+    s.write(binary_magic, sizeof(binary_magic));
+    s.write(reinterpret_cast<const char *>(header), sizeof(header));
+    s.write(reinterpret_cast<const char *>(&first), sizeof(first));
+
+    size_t bone_count = asf->bones().size();
+    std::vector<float> values(6 + 3 * bone_count);
+
+    for (const Frame &frame: fs) {
+        values[0] = frame.root_translation.x();
+        values[1] = frame.root_translation.y();
+        values[2] = frame.root_translation.z();
+        values[3] = frame.root_rotation.x();
+        values[4] = frame.root_rotation.y();
+        values[5] = frame.root_rotation.z();
+
+        for (size_t i = 0; i < bone_count; i++) {
+            const Transformation &trans = i < frame.transformations.size() ? frame.transformations[i] : Transformation();
+
+            values[6 + 3 * i    ] = trans.rx;
+            values[6 + 3 * i + 1] = trans.ry;
+            values[6 + 3 * i + 2] = trans.rz;
+        }
+
+        s.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(float));
+    }
+
+    if (!s) {
+        throw std::runtime_error("Could not write binary AMC data");
     }
 }
 
 
-void AMC::apply_frame(int frame)
+vec3 AMC::root_position(int frame) const
 {
     if ((frame < ff) || (frame - ff >= static_cast<int>(fs.size()))) {
         throw std::range_error("AMC frame out of bounds");
     }
 
+    return asf->root_position() + fs[frame - ff].root_translation;
+}
+
+
+mat4 AMC::still_transform(const ASF &asf, const Frame &frame, int bone, const mat4 *motion_trans)
+{
+    const ASF::Bone &b = asf.bones()[bone];
+
+    if (b.parent >= 0) {
+        const ASF::Bone &parent = asf.bones()[b.parent];
+        return motion_trans[b.parent].translated(parent.length * parent.direction);
+    }
+
     mat4 root_mv(mat4::identity());
-    root_mv.translate(asf->root_position());
-    root_mv.translate(fs[frame - ff].root_translation);
+    root_mv.translate(asf.root_position());
+    root_mv.translate(frame.root_translation);
 
-    for (auto it = asf->root_axis().rbegin(); it != asf->root_axis().rend(); ++it) {
+    return root_mv * rotation(asf.root_axis(), frame.root_rotation.x(), frame.root_rotation.y(),
+                              frame.root_rotation.z());
+}
+
+
+mat4 AMC::rotation(const std::vector<ASF::Axis> &axis_order, float rx, float ry, float rz)
+{
+    mat4 m(mat4::identity());
+
+    for (auto it = axis_order.rbegin(); it != axis_order.rend(); ++it) {
         switch (*it) {
-            case ASF::RX: root_mv.rotate(fs[frame - ff].root_rotation.x(), vec3(1.f, 0.f, 0.f)); break;
-            case ASF::RY: root_mv.rotate(fs[frame - ff].root_rotation.y(), vec3(0.f, 1.f, 0.f)); break;
-            case ASF::RZ: root_mv.rotate(fs[frame - ff].root_rotation.z(), vec3(0.f, 0.f, 1.f)); break;
+            case ASF::RX: m.rotate(rx, vec3(1.f, 0.f, 0.f)); break;
+            case ASF::RY: m.rotate(ry, vec3(0.f, 1.f, 0.f)); break;
+            case ASF::RZ: m.rotate(rz, vec3(0.f, 0.f, 1.f)); break;
             default: throw std::invalid_argument("Bad rotation axis");
         }
     }
 
-    apply_frame_to_bone(asf->root_index(), frame, root_mv);
+    return m;
 }
 
 
-void AMC::apply_frame_to_bone(int bi, int frame, const mat4 &mv)
+mat4 AMC::motion_transform(const ASF::Bone &bone, const Transformation &trans, const mat4 &still)
 {
-    ASF::Bone &bone = asf->bones()[bi];
+    mat4 motion(rotation(bone.axis_order, trans.rx, trans.ry, trans.rz));
 
+    // hell yeah just make it the other way round (it works)
+    return still * bone.local_trans * motion * bone.local_trans_inv;
+}
 
-    vec3 rot_axis;
-    float angle;
 
-    if (bone.direction != vec3(0.f, 1.f, 0.f)) {
-        rot_axis = vec3(0.f, 1.f, 0.f).cross(bone.direction);
-        angle = acosf(bone.direction.y()); // acosf(vec3(0.f, 1.f, 0.f).dot(bone.direction))
-    } else {
-        rot_axis = vec3(0.f, 0.f, 1.f);
-        angle = 0.f;
-    }
+void AMC::evaluate(const ASF &asf, const Frame &frame, mat4 *motion_trans, mat4 *still_trans, float min_extent, std::vector<bool> *skipped)
+{
+    const std::vector<ASF::Bone> &bones = asf.bones();
+    const std::vector<int> &order = asf.hierarchy_order();
 
-    bone.bone_dir_trans = mat4::identity().rotated(angle, rot_axis);
+    for (size_t i = 0; i < order.size(); i++) {
+        int bi = order[i];
+        const ASF::Bone &bone = bones[bi];
 
-    bone.local_trans = mat4::identity();
-    for (auto it = bone.axis_order.rbegin(); it != bone.axis_order.rend(); ++it) {
-        switch (*it) {
-            case ASF::RX: bone.local_trans.rotate(bone.axis.x(), vec3(1.f, 0.f, 0.f)); break;
-            case ASF::RY: bone.local_trans.rotate(bone.axis.y(), vec3(0.f, 1.f, 0.f)); break;
-            case ASF::RZ: bone.local_trans.rotate(bone.axis.z(), vec3(0.f, 0.f, 1.f)); break;
-            default: throw std::invalid_argument("Bad rotation axis");
+        if ((bone.parent >= 0) && (bone.subtree_extent < min_extent)) {
+            if (skipped) {
+                for (int j = 0; j < bone.subtree_size; j++) {
+                    (*skipped)[order[i + j]] = true;
+                }
+            }
+
+            i += bone.subtree_size - 1;
+            continue;
         }
+
+        mat4 mv(still_transform(asf, frame, bi, motion_trans));
+
+        if (still_trans) {
+            still_trans[bi] = mv;
+        }
+
+        motion_trans[bi] = motion_transform(bone, frame.transformations[bi], mv);
+
+        if (skipped) {
+            (*skipped)[bi] = false;
+        }
+    }
+}
+
+
+void AMC::evaluate(int frame, mat4 *motion_trans) const
+{
+    if ((frame < ff) || (frame - ff >= static_cast<int>(fs.size()))) {
+        throw std::range_error("AMC frame out of bounds");
     }
 
-    bone.local_trans_inv = bone.local_trans.inverse();
+    evaluate(*asf, fs[frame - ff], motion_trans);
+}
 
 
-    bone.still_trans = mv;
+void AMC::apply_frame(int frame, float min_extent)
+{
+    if ((frame < ff) || (frame - ff >= static_cast<int>(fs.size()))) {
+        throw std::range_error("AMC frame out of bounds");
+    }
 
-    mat4 motion(mat4::identity());
-    for (auto it = bone.axis_order.rbegin(); it != bone.axis_order.rend(); ++it) {
-        switch (*it) {
-            case ASF::RX: motion.rotate(fs[frame - ff].transformations[bi].rx, vec3(1.f, 0.f, 0.f)); break;
-            case ASF::RY: motion.rotate(fs[frame - ff].transformations[bi].ry, vec3(0.f, 1.f, 0.f)); break;
-            case ASF::RZ: motion.rotate(fs[frame - ff].transformations[bi].rz, vec3(0.f, 0.f, 1.f)); break;
-            default: throw std::invalid_argument("Bad rotation axis");
+    apply(fs[frame - ff], min_extent);
+}
+
+
+void AMC::apply(const Frame &frame, float min_extent)
+{
+    TRACE_SCOPE("AMC::apply");
+
+    std::vector<ASF::Bone> &bones = asf->bones();
+
+    scratch_motion.resize(bones.size());
+    scratch_still.resize(bones.size());
+    scratch_skipped.assign(bones.size(), true);
+
+    evaluate(*asf, frame, scratch_motion.data(), scratch_still.data(), min_extent, &scratch_skipped);
+
+    for (size_t i = 0; i < bones.size(); i++) {
+        bones[i].lod_skipped = scratch_skipped[i];
+        if (!scratch_skipped[i]) {
+            bones[i].motion_trans = scratch_motion[i];
+            bones[i].still_trans  = scratch_still[i];
         }
     }
 
-    // hell yeah just make it the other way round (it works)
-    bone.motion_trans = mv * bone.local_trans * motion * bone.local_trans_inv;
+    asf->update_bounds();
+}
 
 
-    mat4 child_mv(bone.motion_trans.translated(bone.length * bone.direction));
-    for (int child = bone.first_child; child >= 0; child = asf->bones()[child].next_sibling) {
-        apply_frame_to_bone(child, frame, child_mv);
+AMC::MemoryUsage AMC::memory_usage(void) const
+{
+    MemoryUsage usage;
+
+    usage.frames = heap_bytes(fs);
+    for (const Frame &f: fs) {
+        usage.transformations += heap_bytes(f.transformations);
     }
+
+    {
+        std::lock_guard<std::mutex> guard(pending_lock);
+
+        usage.pending = heap_bytes(pending);
+        for (const Frame &f: pending) {
+            usage.pending += heap_bytes(f.transformations);
+        }
+    }
+
+    usage.scratch = heap_bytes(scratch_motion) + heap_bytes(scratch_still) + heap_bytes(scratch_skipped);
+
+    return usage;
 }
@@ -1,8 +1,14 @@
 #ifndef AMC_HPP
 #define AMC_HPP
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include <dake/math/matrix.hpp>
@@ -25,21 +31,153 @@ class AMC {
             std::vector<Transformation> transformations;
         };
 
-        AMC(std::ifstream &s, ASF *asf);
+        // Lets other threads follow and cancel loading
+        struct LoadProgress {
+            std::atomic<bool> cancel{false};
+            std::atomic<size_t> bytes_read{0};
+        };
+
+        // Thrown by the constructor when loading has been cancelled
+        struct Cancelled: public std::runtime_error {
+            Cancelled(void): std::runtime_error("Loading cancelled") {}
+        };
+
+        AMC(std::ifstream &s, ASF *asf, LoadProgress *progress = nullptr);
+
+        // Creates an empty AMC to be filled by load_progressive()
+        AMC(ASF *asf);
+
+        // Takes frames from elsewhere (e.g. other file formats); every frame
+        // must have a transformation for every bone
+        AMC(ASF *asf, std::vector<Frame> &&frames, int first_frame);
+
+        // Loads the file (usually in a background thread), making frames
+        // available in chunks while doing so. They are only moved into
+        // frames() by merge_loaded_frames(), so everything else may only be
+        // used by the thread calling that.
+        void load_progressive(std::ifstream &s, LoadProgress *progress = nullptr);
+
+        // Returns true if frames() has changed (its first frame may change
+        // as well for files with out-of-order frames)
+        bool merge_loaded_frames(void);
+        // Number of times merge_loaded_frames() has replaced frames() instead
+        // of appending to it (for caches of per-frame data)
+        unsigned replacements(void) const { return replace_count; }
+
+        // True until load_progressive() has returned
+        bool loading(void) const { return !load_complete; }
+
+        // Number of frames loaded so far (including those not merged yet)
+        size_t loaded_frames(void) const { return published_frames; }
 
         int first_frame(void) const { return ff; }
 
         const std::vector<Frame> &frames(void) const { return fs; }
 
-        void apply_frame(int frame);
+        // For modifying frames in place (e.g. clamping them into the limits;
+        // not while loading)
+        std::vector<Frame> &mutable_frames(void) { return fs; }
+
+        // World position of the root bone in the given frame
+        dake::math::vec3 root_position(int frame) const;
+
+        // Sets the ASF's bone transformations; bones whose subtree extent is
+        // smaller than min_extent are skipped (see ASF::Bone::lod_skipped)
+        void apply_frame(int frame, float min_extent = 0.f);
+
+        // Same for a frame which need not be part of this clip (e.g. one
+        // received live)
+        void apply(const Frame &frame, float min_extent = 0.f);
+
+        // Computes the motion transformation (see ASF::Bone) of every bone
+        // for the given frame into motion_trans (indexed like ASF.bones)
+        // without touching the ASF's bone state, so this may be called from
+        // multiple threads at once
+        void evaluate(int frame, dake::math::mat4 *motion_trans) const;
+
+        // Same for an arbitrary frame; still_trans (if given) receives the
+        // non-motion transformations, skipped (if given) is set for all
+        // bones skipped due to min_extent (their transformations are left
+        // untouched)
+        static void evaluate(const ASF &asf, const Frame &frame, dake::math::mat4 *motion_trans,
+                             dake::math::mat4 *still_trans = nullptr, float min_extent = 0.f,
+                             std::vector<bool> *skipped = nullptr);
+
+        // The two steps of evaluate() for a single bone: its non-motion
+        // transformation (for the root, from the frame's root channels;
+        // otherwise the end of its parent, whose motion transformation must
+        // be in motion_trans already), and its motion transformation based
+        // on that
+        static dake::math::mat4 still_transform(const ASF &asf, const Frame &frame, int bone,
+                                                const dake::math::mat4 *motion_trans);
+        static dake::math::mat4 motion_transform(const ASF::Bone &bone, const Transformation &trans,
+                                                 const dake::math::mat4 &still);
+        // Rotation by the given angles (in radians) in the given axis order,
+        // as used for the root and bone motion
+        static dake::math::mat4 rotation(const std::vector<ASF::Axis> &axis_order, float rx, float ry, float rz);
+
+        // Writes the frames in a binary format which is much faster to read
+        // back than the text format (the constructor recognizes both); it is
+        // only valid for the same skeleton and machine
+        void write_binary(std::ostream &s) const;
+
+        // Writes frames [first, first + count) (clamped to the clip) in the
+        // text format (with angles in degrees), so that the constructor reads
+        // back exactly the same values. That is not possible for values
+        // which did not come from a text file (the units are applied by
+        // multiplication); their number is returned, and the nearest value is
+        // written instead.
+        size_t write_text(std::ostream &s, int first, int count) const;
+
+        const ASF *skeleton(void) const { return asf; }
+
+        // Parses a root or bone line of the text format into frame
+        static void parse_line(const ASF &asf, const std::string &line, Frame &frame, float angle_unit,
+                               int frame_number);
+
+        // Identifies the skeleton binary data has been written for
+        static uint32_t skeleton_hash(const ASF &asf);
+
+        // Heap bytes used (see heap_bytes() in memory.hpp), by component
+        struct MemoryUsage {
+            size_t frames = 0;           // Frame array
+            size_t transformations = 0;  // Per-frame transformation arrays
+            size_t pending = 0;          // Loaded but not yet merged
+            size_t scratch = 0;          // Used by apply()
+
+            size_t total(void) const { return frames + transformations + pending + scratch; }
+        };
+
+        MemoryUsage memory_usage(void) const;
+        size_t memory_size(void) const { return memory_usage().total(); }
 
 
     private:
-        void apply_frame_to_bone(int bi, int frame, const dake::math::mat4 &mv);
+        // Both read into frames, first is set to the number of frames[0]; in
+        // progressive mode, frames are handed to publish() while reading
+        void read_text(std::ifstream &s, LoadProgress *progress, std::vector<Frame> &frames, int &first,
+                       bool progressive);
+        void read_binary(std::ifstream &s, LoadProgress *progress, std::vector<Frame> &frames, int &first,
+                         bool progressive);
+
+        // Moves the first count frames into pending (replacing everything
+        // published so far if replace is set)
+        void publish(std::vector<Frame> &frames, size_t count, int first, bool replace);
 
         ASF *asf;
         std::vector<Frame> fs;
         int ff = -1;
+
+        mutable std::mutex pending_lock;
+        std::vector<Frame> pending;
+        int pending_first = -1;
+        bool pending_replace = false;
+        unsigned replace_count = 0;
+        std::atomic<size_t> published_frames{0};
+        std::atomic<bool> load_complete{true};
+
+        std::vector<dake::math::mat4> scratch_motion, scratch_still;
+        std::vector<bool> scratch_skipped;
 };
 
 #endif
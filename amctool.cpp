@@ -0,0 +1,1430 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "bvh.hpp"
+#include "clip_view.hpp"
+#include "dtw.hpp"
+#include "ik.hpp"
+#include "joint_limits.hpp"
+#include "kinematics.hpp"
+#include "live_stream.hpp"
+#include "mass.hpp"
+#include "memory.hpp"
+#include "motion_graph.hpp"
+#include "parallel.hpp"
+#include "pose_index.hpp"
+#include "pose_publisher.hpp"
+#include "self_collision.hpp"
+#include "synth.hpp"
+#include "trace.hpp"
+#include "track_export.hpp"
+
+
+using namespace dake::math;
+
+
+static std::unique_ptr<ASF> load_asf(const char *path)
+{
+    std::ifstream s(path);
+    if (!s.is_open()) {
+        throw std::runtime_error(std::string("Could not open ") + path + ": " + strerror(errno));
+    }
+
+    return std::unique_ptr<ASF>(new ASF(s));
+}
+
+
+static std::unique_ptr<AMC> load_amc(const char *path, ASF *asf, size_t *bytes = nullptr)
+{
+    std::ifstream s(path, std::ios::binary);
+    if (!s.is_open()) {
+        throw std::runtime_error(std::string("Could not open ") + path + ": " + strerror(errno));
+    }
+
+    if (bytes) {
+        s.seekg(0, std::ios::end);
+        *bytes = s.tellg();
+        s.seekg(0);
+    }
+
+    return std::unique_ptr<AMC>(new AMC(s, asf));
+}
+
+
+static int cmd_stats(int argc, char *argv[])
+{
+    if (argc < 1) {
+        throw std::invalid_argument("stats: Expected <model.asf> [motion.amc...]");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+
+    int dofs = 0, depth = 0;
+    for (int bi: asf->hierarchy_order()) {
+        const ASF::Bone &bone = asf->bones()[bi];
+
+        depth = std::max(depth, bone.depth);
+        dofs += bone.dof_order.size();
+    }
+
+    printf("%s: %zu bones, depth %i, %i bone DOFs + %zu root channels, reach %.3f m\n",
+           argv[0], asf->bones().size(), depth, dofs, asf->root_order().size(), asf->reach());
+
+    for (int i = 1; i < argc; i++) {
+        size_t bytes;
+        std::unique_ptr<AMC> amc(load_amc(argv[i], asf.get(), &bytes));
+
+        printf("%s: %zu frames (%i to %i), %zu bytes\n", argv[i], amc->frames().size(),
+               amc->first_frame(), amc->first_frame() + static_cast<int>(amc->frames().size()) - 1, bytes);
+    }
+
+    return 0;
+}
+
+
+static int cmd_parse(int argc, char *argv[])
+{
+    if (argc < 2) {
+        throw std::invalid_argument("parse: Expected <model.asf> <motion.amc...>");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+
+    for (int i = 1; i < argc; i++) {
+        size_t bytes;
+
+        auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<AMC> amc(load_amc(argv[i], asf.get(), &bytes));
+        double secs = seconds_since(start);
+
+        printf("%s: %zu frames in %.3f s (%.1f MB/s, %.0f frames/s)\n", argv[i], amc->frames().size(),
+               secs, bytes / secs / 1e6, amc->frames().size() / secs);
+    }
+
+    return 0;
+}
+
+
+static int cmd_bake(int argc, char *argv[])
+{
+    if (argc != 2) {
+        throw std::invalid_argument("bake: Expected <model.asf> <motion.amc>");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::unique_ptr<AMC> amc(load_amc(argv[1], asf.get()));
+
+    size_t frame_count = amc->frames().size(), bone_count = asf->bones().size();
+    std::vector<mat4> baked(frame_count * bone_count);
+
+    auto start = std::chrono::steady_clock::now();
+    parallel_ranges(frame_count, [&](size_t first, size_t end) {
+        for (size_t i = first; i < end; i++) {
+            amc->evaluate(amc->first_frame() + i, baked.data() + i * bone_count);
+        }
+    });
+    double secs = seconds_since(start);
+
+    printf("%s: %zu frames baked in %.3f s (%.0f frames/s, %.0f bones/s)\n", argv[1], frame_count,
+           secs, frame_count / secs, frame_count * bone_count / secs);
+
+    return 0;
+}
+
+
+static int cmd_convert(int argc, char *argv[])
+{
+    if (argc != 3) {
+        throw std::invalid_argument("convert: Expected <model.asf> <input.amc> <output.amcb>");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::unique_ptr<AMC> amc(load_amc(argv[1], asf.get()));
+
+    std::ofstream out(argv[2], std::ios::binary);
+    if (!out.is_open()) {
+        throw std::runtime_error(std::string("Could not open ") + argv[2] + ": " + strerror(errno));
+    }
+
+    amc->write_binary(out);
+
+    return 0;
+}
+
+
+static int cmd_generate(int argc, char *argv[])
+{
+    if (argc < 2) {
+        throw std::invalid_argument("generate: Expected <out.asf> <out.amc> [options]");
+    }
+
+    SynthOptions opts;
+
+    for (int i = 2; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if (opt == "--random-axis-order") {
+            opts.random_axis_order = true;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            throw std::invalid_argument("generate: Missing value for " + opt);
+        }
+        const char *val = argv[++i];
+
+        if (opt == "--bones") {
+            opts.bones = atoi(val);
+        } else if (opt == "--depth") {
+            opts.max_depth = atoi(val);
+        } else if (opt == "--children") {
+            opts.max_children = atoi(val);
+        } else if (opt == "--dofs") {
+            // Comma-separated list of DOF sets
+            opts.dof_sets.clear();
+
+            std::string sets(val);
+            size_t start = 0, comma;
+            do {
+                comma = sets.find(',', start);
+                opts.dof_sets.push_back(sets.substr(start, comma - start));
+                start = comma + 1;
+            } while (comma != std::string::npos);
+        } else if (opt == "--frames") {
+            opts.frames = atoi(val);
+        } else if (opt == "--first-frame") {
+            opts.first_frame = atoi(val);
+        } else if (opt == "--out-of-order") {
+            opts.out_of_order = atof(val);
+        } else if (opt == "--missing") {
+            opts.missing = atof(val);
+        } else if (opt == "--seed") {
+            opts.seed = strtoul(val, nullptr, 0);
+        } else {
+            throw std::invalid_argument("generate: Unknown option " + opt);
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        // Large buffer, the output may well be multiple GB
+        std::vector<char> buffer(1 << 20);
+
+        std::ofstream out;
+        out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+        out.open(argv[i], std::ios::binary);
+        if (!out.is_open()) {
+            throw std::runtime_error(std::string("Could not open ") + argv[i] + ": " + strerror(errno));
+        }
+
+        if (i) {
+            synth_amc(out, opts);
+        } else {
+            synth_asf(out, opts);
+        }
+
+        out.close();
+        if (out.fail()) {
+            throw std::runtime_error(std::string("Could not write ") + argv[i]);
+        }
+    }
+
+    return 0;
+}
+
+
+static int cmd_stream(int argc, char *argv[])
+{
+    if (argc < 3) {
+        throw std::invalid_argument("stream: Expected <model.asf> <motion.amc> <address> [options]");
+    }
+
+    int fps = 120;
+    bool text = false, loop = false;
+
+    for (int i = 3; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if (opt == "--text") {
+            text = true;
+        } else if (opt == "--loop") {
+            loop = true;
+        } else if ((opt == "--fps") && (i + 1 < argc)) {
+            fps = atoi(argv[++i]);
+            if (fps <= 0) {
+                throw std::invalid_argument("stream: Invalid frame rate");
+            }
+        } else {
+            throw std::invalid_argument("stream: Unknown option " + opt);
+        }
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::unique_ptr<AMC> amc(load_amc(argv[1], asf.get()));
+    LiveSender sender(argv[2]);
+
+    std::chrono::steady_clock::duration interval =
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1. / fps));
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now(), next = start;
+    unsigned long sent = 0, failed = 0;
+
+    do {
+        for (size_t i = 0; i < amc->frames().size(); i++) {
+            std::this_thread::sleep_until(next);
+            next += interval;
+
+            if (sender.send(*asf, amc->first_frame() + i, amc->frames()[i], text)) {
+                sent++;
+            } else {
+                failed++;
+            }
+        }
+    } while (loop);
+
+    double duration = seconds_since(start);
+    printf("%lu frames sent (%lu failed) in %.2f s (%.1f fps)\n", sent, failed, duration, sent / duration);
+
+    return 0;
+}
+
+
+static int cmd_publish(int argc, char *argv[])
+{
+    if (argc < 3) {
+        throw std::invalid_argument("publish: Expected <model.asf> <motion.amc> <shm name> [options]");
+    }
+
+    int fps = 120;
+    bool loop = false;
+
+    for (int i = 3; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if (opt == "--loop") {
+            loop = true;
+        } else if ((opt == "--fps") && (i + 1 < argc)) {
+            fps = atoi(argv[++i]);
+            if (fps <= 0) {
+                throw std::invalid_argument("publish: Invalid frame rate");
+            }
+        } else {
+            throw std::invalid_argument("publish: Unknown option " + opt);
+        }
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::unique_ptr<AMC> amc(load_amc(argv[1], asf.get()));
+    PosePublisher publisher(argv[2], *asf);
+
+    std::vector<mat4> transforms(asf->bones().size());
+
+    std::chrono::steady_clock::duration interval =
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1. / fps));
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now(), next = start;
+    unsigned long published = 0;
+
+    do {
+        for (size_t i = 0; i < amc->frames().size(); i++) {
+            amc->evaluate(amc->first_frame() + i, transforms.data());
+
+            std::this_thread::sleep_until(next);
+            next += interval;
+
+            publisher.publish(amc->first_frame() + i, transforms.data());
+            published++;
+        }
+    } while (loop);
+
+    double duration = seconds_since(start);
+    printf("%lu poses published in %.2f s (%.1f fps)\n", published, duration, published / duration);
+
+    return 0;
+}
+
+
+static int cmd_export(int argc, char *argv[])
+{
+    if (argc < 3) {
+        throw std::invalid_argument("export: Expected <model.asf> <motion.amc> <output> [options]");
+    }
+
+    TrackExportOptions opts;
+    std::vector<std::string> ranges;
+
+    for (int i = 3; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--range") && (i + 1 < argc)) {
+            ranges.push_back(argv[++i]);
+        } else if (opt == "--csv") {
+            opts.format = TrackExportOptions::CSV;
+        } else if ((opt == "--block") && (i + 1 < argc)) {
+            opts.block_frames = strtoul(argv[++i], nullptr, 0);
+        } else if ((opt == "--threads") && (i + 1 < argc)) {
+            opts.threads = strtoul(argv[++i], nullptr, 0);
+        } else {
+            throw std::invalid_argument("export: Unknown option " + opt);
+        }
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::unique_ptr<AMC> amc(load_amc(argv[1], asf.get()));
+
+    // Concatenate all ranges (without copying any frames)
+    ClipView clip(*amc);
+    if (!ranges.empty()) {
+        ClipView whole(clip);
+        clip = ClipView();
+
+        for (const std::string &range: ranges) {
+            char *end;
+            long first = strtol(range.c_str(), &end, 0), last = first, stride = 1;
+            if (*end == ':') {
+                last = strtol(end + 1, &end, 0);
+            }
+            if (*end == ':') {
+                stride = strtol(end + 1, &end, 0);
+            }
+            if (*end || (last < first) || (stride < 1)) {
+                throw std::invalid_argument("export: Invalid range " + range);
+            }
+
+            clip.append(whole.slice(first, last - first + 1, stride));
+        }
+    }
+
+    TrackExportStats stats;
+    export_tracks(clip, argv[2], opts, &stats);
+
+    printf("%s: %zu frames, %.1f MB in %.3f s (%.1f MB/s; %.3f s computing, %.3f s waiting for writes)\n",
+           argv[2], stats.frames, stats.bytes / 1e6, stats.seconds, stats.bytes / stats.seconds / 1e6,
+           stats.compute_seconds, stats.write_wait_seconds);
+
+    return 0;
+}
+
+
+static int cmd_bvh_read(int argc, char *argv[])
+{
+    if (argc < 1) {
+        throw std::invalid_argument("bvh-read: Expected <in.bvh> [out.bvh] [--scale S]");
+    }
+
+    float scale = 2.54e-2f;
+    const char *out_path = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--scale") && (i + 1 < argc)) {
+            scale = strtof(argv[++i], nullptr);
+        } else if (!out_path && (opt.compare(0, 2, "--") != 0)) {
+            out_path = argv[i];
+        } else {
+            throw std::invalid_argument("bvh-read: Unknown option " + opt);
+        }
+    }
+
+    std::ifstream in(argv[0], std::ios::binary | std::ios::ate);
+    double in_size = in.tellg();
+
+    auto start = std::chrono::steady_clock::now();
+    BVHClip clip(read_bvh(argv[0], scale));
+    double secs = seconds_since(start);
+
+    for (const std::string &warning: clip.warnings) {
+        fprintf(stderr, "Warning: %s\n", warning.c_str());
+    }
+
+    printf("%s: %zu bones, %zu frames (%.4f s each), read in %.3f s (%.1f MB/s)\n", argv[0],
+           clip.asf->bones().size(), clip.amc->frames().size(), clip.frame_time, secs, in_size / secs / 1e6);
+
+    if (out_path) {
+        start = std::chrono::steady_clock::now();
+        write_bvh(out_path, *clip.amc, clip.frame_time);
+        secs = seconds_since(start);
+
+        std::ifstream out(out_path, std::ios::binary | std::ios::ate);
+        double out_size = out.tellg();
+        printf("%s: written in %.3f s (%.1f MB/s)\n", out_path, secs, out_size / secs / 1e6);
+    }
+
+    return 0;
+}
+
+
+static int cmd_bvh_write(int argc, char *argv[])
+{
+    if (argc < 3) {
+        throw std::invalid_argument("bvh-write: Expected <model.asf> <motion.amc> <out.bvh> [--frame-time T]");
+    }
+
+    float frame_time = 1.f / 120.f;
+
+    for (int i = 3; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--frame-time") && (i + 1 < argc)) {
+            frame_time = strtof(argv[++i], nullptr);
+        } else {
+            throw std::invalid_argument("bvh-write: Unknown option " + opt);
+        }
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::unique_ptr<AMC> amc(load_amc(argv[1], asf.get()));
+
+    auto start = std::chrono::steady_clock::now();
+    write_bvh(argv[2], *amc, frame_time);
+    double secs = seconds_since(start);
+
+    std::ifstream out(argv[2], std::ios::binary | std::ios::ate);
+    double out_size = out.tellg();
+    printf("%s: %zu frames, %.1f MB in %.3f s (%.1f MB/s)\n", argv[2], amc->frames().size(), out_size / 1e6,
+           secs, out_size / secs / 1e6);
+
+    return 0;
+}
+
+
+static int cmd_trim(int argc, char *argv[])
+{
+    if (argc < 3) {
+        throw std::invalid_argument("trim: Expected <model.asf> <motion.amc> <out.amc> [--first N] [--last N]");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::unique_ptr<AMC> amc(load_amc(argv[1], asf.get()));
+
+    int clip_first = amc->first_frame();
+    int clip_last = amc->first_frame() + static_cast<int>(amc->frames().size()) - 1;
+    int first = clip_first, last = clip_last;
+
+    for (int i = 3; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--first") && (i + 1 < argc)) {
+            first = strtol(argv[++i], nullptr, 0);
+        } else if ((opt == "--last") && (i + 1 < argc)) {
+            last = strtol(argv[++i], nullptr, 0);
+        } else {
+            throw std::invalid_argument("trim: Unknown option " + opt);
+        }
+    }
+
+    if ((first < clip_first) || (last > clip_last) || (last < first)) {
+        throw std::invalid_argument("trim: Invalid range " + std::to_string(first) + ".." + std::to_string(last) +
+                                    " (the clip has frames " + std::to_string(clip_first) + ".." +
+                                    std::to_string(clip_last) + ")");
+    }
+
+    std::vector<char> buffer(1 << 20);
+    std::ofstream out;
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out.open(argv[2], std::ios::binary);
+    if (!out.is_open()) {
+        throw std::runtime_error(std::string("Could not open ") + argv[2] + ": " + strerror(errno));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t inexact = amc->write_text(out, first, last - first + 1);
+    out.close();
+    if (out.fail()) {
+        throw std::runtime_error(std::string("Could not write ") + argv[2]);
+    }
+    double secs = seconds_since(start);
+
+    std::ifstream written(argv[2], std::ios::binary | std::ios::ate);
+    double size = written.tellg();
+    printf("%s: %.1f MB in %.3f s (%.1f MB/s)\n", argv[2], size / 1e6, secs, size / secs / 1e6);
+
+    if (inexact) {
+        fprintf(stderr, "Warning: %zu values cannot be represented exactly in the text format\n", inexact);
+    }
+
+    return 0;
+}
+
+
+static int cmd_memory(int argc, char *argv[])
+{
+    if (argc < 1) {
+        throw std::invalid_argument("memory: Expected <model.asf> [motion.amc...]");
+    }
+
+    // Everything is done on this thread, so only count its allocations
+    AllocationStats before = thread_allocation_stats();
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    AllocationStats asf_alloc = thread_allocation_stats() - before;
+
+    ASF::MemoryUsage asf_usage = asf->memory_usage();
+    printf("%s: %zu bytes accounted (bones %zu, names %zu, orders %zu, DOFs %zu, hierarchy %zu, other %zu)\n"
+           "    %lli bytes retained, %llu allocations while loading\n",
+           argv[0], asf_usage.total(), asf_usage.bones, asf_usage.names, asf_usage.orders, asf_usage.dofs,
+           asf_usage.hierarchy, asf_usage.other, static_cast<long long>(asf_alloc.live_bytes()),
+           static_cast<unsigned long long>(asf_alloc.allocations));
+
+    for (int i = 1; i < argc; i++) {
+        before = thread_allocation_stats();
+        std::unique_ptr<AMC> amc(load_amc(argv[i], asf.get()));
+        AllocationStats amc_alloc = thread_allocation_stats() - before;
+        AMC::MemoryUsage amc_usage = amc->memory_usage();
+
+        // The first frame sets up the scratch buffers, after that playback
+        // should not allocate at all
+        size_t frame_count = amc->frames().size();
+        AllocationStats play_alloc;
+        if (frame_count) {
+            amc->apply_frame(amc->first_frame());
+
+            before = thread_allocation_stats();
+            for (size_t f = 1; f < frame_count; f++) {
+                amc->apply_frame(amc->first_frame() + f);
+            }
+            play_alloc = thread_allocation_stats() - before;
+        }
+
+        printf("%s: %zu bytes accounted (frames %zu, transformations %zu, pending %zu, scratch %zu)\n"
+               "    %lli bytes retained, %llu allocations while loading, %llu while applying %zu frames\n",
+               argv[i], amc_usage.total(), amc_usage.frames, amc_usage.transformations, amc_usage.pending,
+               amc_usage.scratch, static_cast<long long>(amc_alloc.live_bytes()),
+               static_cast<unsigned long long>(amc_alloc.allocations),
+               static_cast<unsigned long long>(play_alloc.allocations), frame_count ? frame_count - 1 : 0);
+    }
+
+    return 0;
+}
+
+
+static int cmd_limits(int argc, char *argv[])
+{
+    std::vector<const char *> paths;
+    bool clamp = false, quiet = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--clamp")) {
+            clamp = true;
+        } else if (!strcmp(argv[i], "--quiet")) {
+            quiet = true;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    if ((argc < 1) || paths.empty()) {
+        throw std::invalid_argument("limits: Expected <model.asf> <motion.amc...> [--clamp] [--quiet]");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+
+    struct Result {
+        size_t frames = 0;
+        std::vector<LimitViolation> violations;
+        std::string error;
+    };
+    std::vector<Result> results(paths.size());
+
+    // One clip per thread (clips are scanned on a single thread then)
+    auto start = std::chrono::steady_clock::now();
+    parallel_ranges(paths.size(), [&](size_t first, size_t end) {
+        for (size_t i = first; i < end; i++) {
+            try {
+                std::unique_ptr<AMC> amc(load_amc(paths[i], asf.get()));
+                results[i].frames = amc->frames().size();
+                results[i].violations = scan_limits(*amc, clamp, 1);
+
+                if (clamp && !results[i].violations.empty()) {
+                    std::string out_path = std::string(paths[i]) + ".clamped.amc";
+                    std::ofstream out(out_path, std::ios::binary);
+                    if (!out.is_open()) {
+                        throw std::runtime_error("Could not open " + out_path + ": " + strerror(errno));
+                    }
+                    amc->write_text(out, amc->first_frame(), amc->frames().size());
+                }
+            } catch (std::exception &e) {
+                results[i].error = e.what();
+            }
+        }
+    });
+    double secs = seconds_since(start);
+
+    size_t total_frames = 0, total_violations = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < paths.size(); i++) {
+        const Result &res = results[i];
+
+        if (!res.error.empty()) {
+            fprintf(stderr, "%s: %s\n", paths[i], res.error.c_str());
+            ret = 1;
+            continue;
+        }
+
+        total_frames += res.frames;
+        total_violations += res.violations.size();
+
+        printf("%s: %zu frames, %zu violations%s\n", paths[i], res.frames, res.violations.size(),
+               clamp && !res.violations.empty() ? " (clamped copy written)" : "");
+
+        if (!quiet) {
+            for (const LimitViolation &v: res.violations) {
+                printf("    %s r%c: frames %i-%i, up to %.3g° beyond the limit\n",
+                       asf->bones()[v.bone].name.c_str(), 'x' + static_cast<int>(v.axis), v.first_frame,
+                       v.last_frame, v.max_excess * 180.f / static_cast<float>(M_PI));
+            }
+        }
+    }
+
+    printf("%zu violations in %zu frames, %.3f s (%.0f frames/s, including loading)\n", total_violations,
+           total_frames, secs, total_frames / secs);
+
+    return ret;
+}
+
+
+static int cmd_index(int argc, char *argv[])
+{
+    std::vector<const char *> paths;
+    PoseIndex::BuildOptions opts;
+
+    for (int i = 2; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--dims") && (i + 1 < argc)) {
+            opts.dimensions = atoi(argv[++i]);
+        } else if ((opt == "--leaf") && (i + 1 < argc)) {
+            opts.leaf_size = atoi(argv[++i]);
+        } else if ((opt == "--threads") && (i + 1 < argc)) {
+            opts.threads = atoi(argv[++i]);
+        } else if (opt.compare(0, 2, "--")) {
+            paths.push_back(argv[i]);
+        } else {
+            throw std::invalid_argument("index: Unknown option " + opt);
+        }
+    }
+
+    if ((argc < 3) || paths.empty()) {
+        throw std::invalid_argument("index: Expected <model.asf> <out.idx> <motion.amc...> [--dims N] [--leaf N] "
+                                    "[--threads N]");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    PoseIndex index(*asf);
+
+    // Clips are dropped once their features have been added
+    auto start = std::chrono::steady_clock::now();
+    parallel_ranges(paths.size(), [&](size_t first, size_t end) {
+        for (size_t i = first; i < end; i++) {
+            std::unique_ptr<AMC> amc(load_amc(paths[i], asf.get()));
+            index.add(paths[i], *amc);
+        }
+    }, opts.threads);
+    double load_secs = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    index.build(opts);
+    double build_secs = seconds_since(start);
+
+    index.write(argv[1]);
+
+    printf("%zu frames from %zu clips: loaded in %.3f s, built in %.3f s\n", index.size(), index.clips().size(),
+           load_secs, build_secs);
+    printf("%i dimensions (%.1f %% of the variance), %.1f MB\n", index.dimensions(),
+           index.explained_variance() * 100.f, index.memory_size() / 1e6);
+
+    return 0;
+}
+
+
+static int cmd_similar(int argc, char *argv[])
+{
+    if (argc < 4) {
+        throw std::invalid_argument("similar: Expected <index> <model.asf> <motion.amc> <frame> [--k N] "
+                                    "[--max-leaves N] [--bench]");
+    }
+
+    size_t k = 10, max_leaves = 0;
+    bool bench = false;
+
+    for (int i = 4; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--k") && (i + 1 < argc)) {
+            k = atoi(argv[++i]);
+        } else if ((opt == "--max-leaves") && (i + 1 < argc)) {
+            max_leaves = atoi(argv[++i]);
+        } else if (opt == "--bench") {
+            bench = true;
+        } else {
+            throw std::invalid_argument("similar: Unknown option " + opt);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    PoseIndex index{std::string(argv[0])};
+    printf("%s: %zu frames from %zu clips, read in %.3f s\n", argv[0], index.size(), index.clips().size(),
+           seconds_since(start));
+
+    std::unique_ptr<ASF> asf(load_asf(argv[1]));
+    std::unique_ptr<AMC> amc(load_amc(argv[2], asf.get()));
+
+    int frame = atoi(argv[3]);
+    if ((frame < amc->first_frame()) || (frame - amc->first_frame() >= static_cast<int>(amc->frames().size()))) {
+        throw std::range_error("similar: Frame out of bounds");
+    }
+
+    start = std::chrono::steady_clock::now();
+    std::vector<PoseMatch> matches(index.query(*asf, amc->frames()[frame - amc->first_frame()], k, max_leaves));
+    double secs = seconds_since(start);
+
+    for (const PoseMatch &m: matches) {
+        printf("%10.4f  %s:%i\n", m.distance, index.clips()[m.clip].c_str(), m.frame);
+    }
+    printf("Query took %.3f ms\n", secs * 1e3);
+
+    if (bench) {
+        // Every frame of the clip once, on one thread
+        start = std::chrono::steady_clock::now();
+        for (const AMC::Frame &f: amc->frames()) {
+            index.query(*asf, f, k, max_leaves);
+        }
+        secs = seconds_since(start);
+
+        printf("%zu queries: %.3f ms each\n", amc->frames().size(), secs * 1e3 / amc->frames().size());
+    }
+
+    return 0;
+}
+
+
+static int cmd_graph(int argc, char *argv[])
+{
+    std::vector<const char *> paths;
+    MotionGraphOptions opts;
+
+    for (int i = 2; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--window") && (i + 1 < argc)) {
+            opts.window = atoi(argv[++i]);
+        } else if ((opt == "--threshold") && (i + 1 < argc)) {
+            opts.threshold = atof(argv[++i]);
+        } else if ((opt == "--tile") && (i + 1 < argc)) {
+            opts.tile = atoi(argv[++i]);
+        } else if ((opt == "--threads") && (i + 1 < argc)) {
+            opts.threads = atoi(argv[++i]);
+        } else if (opt.compare(0, 2, "--")) {
+            paths.push_back(argv[i]);
+        } else {
+            throw std::invalid_argument("graph: Unknown option " + opt);
+        }
+    }
+
+    if ((argc < 3) || paths.empty()) {
+        throw std::invalid_argument("graph: Expected <model.asf> <out.graph> <motion.amc...> [--window N] "
+                                    "[--threshold M] [--tile N] [--threads N]");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::vector<std::unique_ptr<AMC>> amcs(paths.size());
+    std::vector<const AMC *> clips;
+    std::vector<std::string> names;
+
+    auto start = std::chrono::steady_clock::now();
+    parallel_ranges(paths.size(), [&](size_t first, size_t end) {
+        for (size_t i = first; i < end; i++) {
+            amcs[i] = load_amc(paths[i], asf.get());
+        }
+    }, opts.threads);
+    double load_secs = seconds_since(start);
+
+    // Absolute, so the graph can be used from anywhere
+    for (size_t i = 0; i < paths.size(); i++) {
+        char *abs = realpath(paths[i], nullptr);
+        names.push_back(abs ? abs : paths[i]);
+        free(abs);
+        clips.push_back(amcs[i].get());
+    }
+
+    MotionGraphStats stats;
+    MotionGraph graph(find_transitions(names, clips, opts, &stats));
+    graph.write(argv[1]);
+
+    double total_pairs = 0.;
+    for (const AMC *a: clips) {
+        for (const AMC *b: clips) {
+            total_pairs += static_cast<double>(a->frames().size()) * b->frames().size();
+        }
+    }
+
+    printf("%zu frames from %zu clips, loaded in %.3f s\n", stats.frames, clips.size(), load_secs);
+    printf("Features: %.3f s, matrices: %.3f s (%zu tiles computed, %zu skipped)\n", stats.feature_seconds,
+           stats.seconds - stats.feature_seconds, stats.tiles, stats.pruned_tiles);
+    printf("%.3g of %.3g frame pairs computed (%.3g/s)\n", static_cast<double>(stats.frame_pairs), total_pairs,
+           stats.frame_pairs / (stats.seconds - stats.feature_seconds));
+    printf("%zu transitions\n", graph.transitions().size());
+
+    return 0;
+}
+
+
+static int cmd_graph_walk(int argc, char *argv[])
+{
+    if (argc < 3) {
+        throw std::invalid_argument("graph-walk: Expected <model.asf> <motion.graph> <out.amc> [--frames N] "
+                                    "[--seed N]");
+    }
+
+    size_t frames = 1200;
+    unsigned seed = 0;
+
+    for (int i = 3; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--frames") && (i + 1 < argc)) {
+            frames = strtoul(argv[++i], nullptr, 0);
+        } else if ((opt == "--seed") && (i + 1 < argc)) {
+            seed = strtoul(argv[++i], nullptr, 0);
+        } else {
+            throw std::invalid_argument("graph-walk: Unknown option " + opt);
+        }
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    MotionGraph graph{std::string(argv[1])};
+
+    std::vector<std::unique_ptr<AMC>> amcs;
+    std::vector<const AMC *> clips;
+    for (const std::string &path: graph.clips()) {
+        amcs.push_back(load_amc(path.c_str(), asf.get()));
+        clips.push_back(amcs.back().get());
+    }
+
+    std::vector<std::string> warnings;
+    std::unique_ptr<AMC> walk(graph.walk(asf.get(), clips, frames, seed, &warnings));
+    for (const std::string &warning: warnings) {
+        fprintf(stderr, "Warning: %s\n", warning.c_str());
+    }
+
+    std::ofstream out(argv[2], std::ios::binary);
+    if (!out.is_open()) {
+        throw std::runtime_error(std::string("Could not open ") + argv[2] + ": " + strerror(errno));
+    }
+    walk->write_text(out, walk->first_frame(), walk->frames().size());
+
+    printf("%s: %zu frames\n", argv[2], walk->frames().size());
+
+    return 0;
+}
+
+
+static int cmd_align(int argc, char *argv[])
+{
+    if (argc < 3) {
+        throw std::invalid_argument("align: Expected <model.asf> <a.amc> <b.amc> [--skeleton b.asf] [--radius N] "
+                                    "[--threads N] [--out path.txt]");
+    }
+
+    const char *b_asf_path = nullptr, *out_path = nullptr;
+    DTWOptions opts;
+
+    for (int i = 3; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--skeleton") && (i + 1 < argc)) {
+            b_asf_path = argv[++i];
+        } else if ((opt == "--radius") && (i + 1 < argc)) {
+            opts.radius = atoi(argv[++i]);
+        } else if ((opt == "--threads") && (i + 1 < argc)) {
+            opts.threads = atoi(argv[++i]);
+        } else if ((opt == "--out") && (i + 1 < argc)) {
+            out_path = argv[++i];
+        } else {
+            throw std::invalid_argument("align: Unknown option " + opt);
+        }
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::unique_ptr<ASF> b_asf(b_asf_path ? load_asf(b_asf_path) : nullptr);
+    std::unique_ptr<AMC> a(load_amc(argv[1], asf.get()));
+    std::unique_ptr<AMC> b(load_amc(argv[2], b_asf ? b_asf.get() : asf.get()));
+
+    DTWAlignment al(align_clips(*a, *b, opts));
+
+    double full = static_cast<double>(a->frames().size()) * b->frames().size();
+    printf("%zu x %zu frames aligned in %.3f s (%.3g of %.3g cells computed)\n", a->frames().size(),
+           b->frames().size(), al.seconds, static_cast<double>(al.cells), full);
+    printf("Path: %zu steps, mean RMS distance %.4f m\n", al.path.size(), al.cost);
+
+    // Where the second take is ahead of or behind the first
+    int ahead = 0, behind = 0;
+    for (size_t i = 0; i < al.partner.size(); i++) {
+        int delay = (al.partner[i] - b->first_frame()) - static_cast<int>(i);
+        ahead = std::max(ahead, -delay);
+        behind = std::max(behind, delay);
+    }
+    printf("Second clip lags by up to %i frames, leads by up to %i frames\n", behind, ahead);
+
+    if (out_path) {
+        std::ofstream out(out_path);
+        if (!out.is_open()) {
+            throw std::runtime_error(std::string("Could not open ") + out_path + ": " + strerror(errno));
+        }
+        for (const auto &step: al.path) {
+            out << step.first << ' ' << step.second << '\n';
+        }
+    }
+
+    return 0;
+}
+
+
+static int cmd_kinematics(int argc, char *argv[])
+{
+    if (argc < 2) {
+        throw std::invalid_argument("kinematics: Expected <model.asf> <motion.amc> [--fps N] [--contact bone...] "
+                                    "[--contact-height H] [--contact-speed S] [--threads N] [--csv out.csv]");
+    }
+
+    KinematicsOptions opts;
+    const char *csv_path = nullptr;
+
+    for (int i = 2; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--fps") && (i + 1 < argc)) {
+            opts.fps = atof(argv[++i]);
+        } else if ((opt == "--contact") && (i + 1 < argc)) {
+            opts.contact_bones.push_back(argv[++i]);
+        } else if ((opt == "--contact-height") && (i + 1 < argc)) {
+            opts.contact_height = atof(argv[++i]);
+        } else if ((opt == "--contact-speed") && (i + 1 < argc)) {
+            opts.contact_speed = atof(argv[++i]);
+        } else if ((opt == "--threads") && (i + 1 < argc)) {
+            opts.threads = atoi(argv[++i]);
+        } else if ((opt == "--csv") && (i + 1 < argc)) {
+            csv_path = argv[++i];
+        } else {
+            throw std::invalid_argument("kinematics: Unknown option " + opt);
+        }
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::unique_ptr<AMC> amc(load_amc(argv[1], asf.get()));
+
+    ClipKinematics kin(*amc, opts);
+
+    double joint_frames = static_cast<double>(kin.frame_count()) * kin.bone_count();
+    printf("%zu frames x %zu bones in %.3f s (%.3g joint-frames/s), %.1f MB\n", kin.frame_count(),
+           kin.bone_count(), kin.seconds(), joint_frames / kin.seconds(), kin.memory_size() / 1048576.);
+
+    for (const ClipKinematics::Contacts &c: kin.contacts()) {
+        size_t in_contact = 0, phases = 0;
+        for (size_t i = 0; i < c.frames.size(); i++) {
+            in_contact += c.frames[i];
+            phases += c.frames[i] && (!i || !c.frames[i - 1]);
+        }
+
+        printf("%-12s in contact %5.1f %% of the time, %zu contact phases\n", asf->bones()[c.bone].name.c_str(),
+               100. * in_contact / std::max<size_t>(c.frames.size(), 1), phases);
+    }
+
+    if (csv_path) {
+        kin.write_csv(csv_path, *asf);
+    }
+
+    return 0;
+}
+
+
+static int cmd_com(int argc, char *argv[])
+{
+    std::vector<const char *> paths;
+    const char *mass_path = nullptr;
+    bool csv = false;
+    unsigned threads = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--masses") && (i + 1 < argc)) {
+            mass_path = argv[++i];
+        } else if ((opt == "--threads") && (i + 1 < argc)) {
+            threads = atoi(argv[++i]);
+        } else if (opt == "--csv") {
+            csv = true;
+        } else if (opt.compare(0, 2, "--")) {
+            paths.push_back(argv[i]);
+        } else {
+            throw std::invalid_argument("com: Unknown option " + opt);
+        }
+    }
+
+    if ((argc < 2) || paths.empty()) {
+        throw std::invalid_argument("com: Expected <model.asf> <motion.amc...> [--masses file] [--threads N] [--csv]");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    MassModel masses(*asf);
+    if (mass_path) {
+        masses.read_overrides(mass_path);
+    }
+
+    printf("Total mass %g (mass unit %g)\n", masses.total(), asf->mass_unit());
+
+    size_t total_frames = 0;
+    double total_secs = 0.;
+
+    for (const char *path: paths) {
+        std::unique_ptr<AMC> amc(load_amc(path, asf.get()));
+        CenterOfMassTrack track(center_of_mass_track(*amc, masses, threads));
+
+        size_t n = track.x.size();
+        float min_height = HUGE_VALF, max_height = -HUGE_VALF, travel = 0.f;
+        for (size_t i = 0; i < n; i++) {
+            min_height = std::min(min_height, track.y[i] - track.ground);
+            max_height = std::max(max_height, track.y[i] - track.ground);
+            if (i) {
+                travel += hypotf(track.x[i] - track.x[i - 1], track.z[i] - track.z[i - 1]);
+            }
+        }
+
+        printf("%s: %zu frames in %.3f s, height above ground %.3f..%.3f m, travelled %.2f m\n", path, n,
+               track.seconds, min_height, max_height, travel);
+
+        if (csv) {
+            std::string out_path = std::string(path) + ".com.csv";
+            std::ofstream out(out_path, std::ios::binary);
+            if (!out.is_open()) {
+                throw std::runtime_error("Could not open " + out_path + ": " + strerror(errno));
+            }
+
+            out << "frame,x,y,z,ground_x,ground_y,ground_z\n";
+
+            std::string line;
+            char buf[32];
+            for (size_t i = 0; i < n; i++) {
+                line = std::to_string(track.first_frame + static_cast<int>(i));
+
+                for (float value: {track.x[i], track.y[i], track.z[i], track.x[i], track.ground, track.z[i]}) {
+                    std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), value);
+                    line += ',';
+                    line.append(buf, res.ptr);
+                }
+                line += "\n";
+
+                out << line;
+            }
+
+            out.close();
+            if (!out) {
+                throw std::runtime_error("Could not write " + out_path);
+            }
+        }
+
+        total_frames += n;
+        total_secs += track.seconds;
+    }
+
+    if (paths.size() > 1) {
+        printf("%zu frames in %.3f s (%.0f frames/s)\n", total_frames, total_secs, total_frames / total_secs);
+    }
+
+    return 0;
+}
+
+
+static int cmd_ik(int argc, char *argv[])
+{
+    if (argc < 2) {
+        throw std::invalid_argument("ik: Expected <model.asf> <motion.amc> [--effector bone...] [--offset N] "
+                                    "[--tolerance m] [--iterations N] [--chain N] [--threads N] [--no-limits] "
+                                    "[--out solved.amc]");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    std::unique_ptr<AMC> amc(load_amc(argv[1], asf.get()));
+
+    std::vector<int> effectors;
+    const char *out_path = nullptr;
+    int offset = 10;
+    unsigned threads = 0;
+    IKOptions opts;
+
+    for (int i = 2; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--effector") && (i + 1 < argc)) {
+            int b = asf->bone_index(argv[++i]);
+            if (b < 0) {
+                throw std::invalid_argument(std::string("ik: Unknown bone ") + argv[i]);
+            }
+            effectors.push_back(b);
+        } else if ((opt == "--offset") && (i + 1 < argc)) {
+            offset = atoi(argv[++i]);
+        } else if ((opt == "--tolerance") && (i + 1 < argc)) {
+            opts.tolerance = atof(argv[++i]);
+        } else if ((opt == "--iterations") && (i + 1 < argc)) {
+            opts.max_iterations = atoi(argv[++i]);
+        } else if ((opt == "--chain") && (i + 1 < argc)) {
+            opts.chain_length = atoi(argv[++i]);
+        } else if ((opt == "--threads") && (i + 1 < argc)) {
+            threads = atoi(argv[++i]);
+        } else if (opt == "--no-limits") {
+            opts.respect_limits = false;
+        } else if ((opt == "--out") && (i + 1 < argc)) {
+            out_path = argv[++i];
+        } else {
+            throw std::invalid_argument("ik: Unknown option " + opt);
+        }
+    }
+
+    const std::vector<ASF::Bone> &bones = asf->bones();
+    if (effectors.empty()) {
+        for (size_t b = 0; b < bones.size(); b++) {
+            if ((bones[b].first_child < 0) && (static_cast<int>(b) != asf->root_index())) {
+                effectors.push_back(b);
+            }
+        }
+    }
+
+    size_t n = amc->frames().size();
+    if (!n || effectors.empty()) {
+        throw std::invalid_argument("ik: Nothing to solve");
+    }
+
+    // Every frame is posed to reach the end effector positions of the frame
+    // offset frames later (whose root it takes over, as the solver never
+    // moves the root)
+    IKSolver solver(*asf);
+    std::vector<AMC::Frame> frames(amc->frames());
+    std::vector<IKProblem> problems(n);
+    std::vector<mat4> trans(bones.size());
+
+    for (size_t i = 0; i < n; i++) {
+        long count = static_cast<long>(n);
+        size_t target_frame = ((static_cast<long>(i) + offset) % count + count) % count;
+        amc->evaluate(amc->first_frame() + target_frame, trans.data());
+
+        frames[i].root_translation = amc->frames()[target_frame].root_translation;
+        frames[i].root_rotation = amc->frames()[target_frame].root_rotation;
+
+        problems[i].solver = &solver;
+        problems[i].frame = &frames[i];
+        for (int b: effectors) {
+            vec3 tip(bones[b].length * bones[b].direction);
+            vec4 end(trans[b] * vec4(tip.x(), tip.y(), tip.z(), 1.f));
+            problems[i].goals.push_back(IKGoal{b, vec3(end.x(), end.y(), end.z())});
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    solve_ik_batch(problems, opts, threads);
+    double secs = seconds_since(start);
+
+    size_t converged = 0, iterations = 0;
+    float max_error = 0.f;
+    double error_sum = 0.;
+    for (const IKProblem &p: problems) {
+        converged += p.result.converged;
+        iterations += p.result.iterations;
+        error_sum += p.result.error;
+        max_error = std::max(max_error, p.result.error);
+    }
+
+    printf("%zu solves (%zu end effectors each) in %.3f s: %.0f solves/s\n", n, effectors.size(), secs, n / secs);
+    printf("%zu converged to %g m (%.1f %%), %.1f iterations on average, error mean %.4f m, max %.4f m\n",
+           converged, opts.tolerance, 100. * converged / n, static_cast<double>(iterations) / n, error_sum / n,
+           max_error);
+
+    if (out_path) {
+        std::ofstream out(out_path, std::ios::binary);
+        if (!out.is_open()) {
+            throw std::runtime_error(std::string("Could not open ") + out_path + ": " + strerror(errno));
+        }
+
+        AMC solved(asf.get(), std::move(frames), amc->first_frame());
+        solved.write_text(out, solved.first_frame(), n);
+    }
+
+    return 0;
+}
+
+
+static int cmd_collisions(int argc, char *argv[])
+{
+    std::vector<const char *> paths;
+    SelfCollisionOptions opts;
+    bool quiet = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string opt(argv[i]);
+
+        if ((opt == "--radius") && (i + 1 < argc)) {
+            opts.radius = atof(argv[++i]);
+        } else if ((opt == "--min-depth") && (i + 1 < argc)) {
+            opts.min_depth = atof(argv[++i]);
+        } else if ((opt == "--skip-links") && (i + 1 < argc)) {
+            opts.skip_links = atoi(argv[++i]);
+        } else if ((opt == "--threads") && (i + 1 < argc)) {
+            opts.threads = atoi(argv[++i]);
+        } else if (opt == "--quiet") {
+            quiet = true;
+        } else if (opt.compare(0, 2, "--")) {
+            paths.push_back(argv[i]);
+        } else {
+            throw std::invalid_argument("collisions: Unknown option " + opt);
+        }
+    }
+
+    if ((argc < 2) || paths.empty()) {
+        throw std::invalid_argument("collisions: Expected <model.asf> <motion.amc...> [--radius r] [--min-depth d] "
+                                    "[--skip-links N] [--threads N] [--quiet]");
+    }
+
+    std::unique_ptr<ASF> asf(load_asf(argv[0]));
+    const std::vector<ASF::Bone> &bones = asf->bones();
+
+    for (const char *path: paths) {
+        std::unique_ptr<AMC> amc(load_amc(path, asf.get()));
+        SelfCollisionReport report(find_self_collisions(*amc, opts));
+        std::vector<std::pair<int, int>> ranges(report.frame_ranges());
+
+        size_t frames = report.pairs.size();
+        size_t colliding = std::count_if(report.pairs.begin(), report.pairs.end(), [](int p) { return p > 0; });
+
+        printf("%s: %zu frames in %.3f s (%.0f frames/s), %zu colliding in %zu ranges; broad phase kept %zu of "
+               "%zu pairs (%.2f %%)\n", path, frames, report.seconds, frames / report.seconds, colliding,
+               ranges.size(), report.candidates, report.possible_pairs,
+               report.possible_pairs ? 100. * report.candidates / report.possible_pairs : 0.);
+
+        if (quiet) {
+            continue;
+        }
+
+        for (const std::pair<int, int> &r: ranges) {
+            printf("  frames %i..%i\n", r.first, r.second);
+
+            // Collisions are sorted by their first frames
+            for (const SelfCollision &c: report.collisions) {
+                if (c.first > r.second) {
+                    break;
+                }
+                if (c.last >= r.first) {
+                    printf("    %s / %s: frames %i..%i, %.3f m deep in frame %i\n",
+                           bones[c.bone_a].name.c_str(), bones[c.bone_b].name.c_str(), c.first, c.last,
+                           c.max_depth, c.deepest_frame);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+static const struct {
+    const char *name, *description;
+    int (*func)(int argc, char *argv[]);
+} commands[] = {
+    {"stats",   "<model.asf> [motion.amc...]       Print skeleton and clip statistics", cmd_stats},
+    {"parse",   "<model.asf> <motion.amc...>       Measure parsing speed", cmd_parse},
+    {"limits",  "<model.asf> <motion.amc...>       Report (or with --clamp, fix) frames outside of the\n"
+                "           joint limits [--quiet]", cmd_limits},
+    {"index",   "<model.asf> <out.idx> <motion.amc...> Build a pose similarity index\n"
+                "           [--dims N] [--leaf N] [--threads N]", cmd_index},
+    {"similar", "<index> <model.asf> <motion.amc> <frame> Find the frames most similar to a\n"
+                "           pose [--k N] [--max-leaves N] [--bench]", cmd_similar},
+    {"graph",   "<model.asf> <out.graph> <motion.amc...> Find transitions between clips\n"
+                "           [--window N] [--threshold M] [--tile N] [--threads N]", cmd_graph},
+    {"graph-walk", "<model.asf> <motion.graph> <out.amc> Bake a random walk through a motion\n"
+                   "           graph [--frames N] [--seed N]", cmd_graph_walk},
+    {"kinematics", "<model.asf> <motion.amc>       Derive velocities, accelerations and foot\n"
+                   "           contacts [--fps N] [--contact bone...] [--contact-height H]\n"
+                   "           [--contact-speed S] [--threads N] [--csv out.csv]", cmd_kinematics},
+    {"com",     "<model.asf> <motion.amc...>       Compute the center of mass trajectories\n"
+                "           (with --csv, into <motion.amc>.com.csv) [--masses file] [--threads N]",
+                cmd_com},
+    {"collisions", "<model.asf> <motion.amc...>    Find frames in which bones interpenetrate\n"
+                   "           [--radius r] [--min-depth d] [--skip-links N] [--threads N] [--quiet]",
+                   cmd_collisions},
+    {"align",   "<model.asf> <a.amc> <b.amc>       Align two takes of the same motion in time\n"
+                "           [--skeleton b.asf] [--radius N] [--threads N] [--out path.txt]", cmd_align},
+    {"ik",      "<model.asf> <motion.amc>          Benchmark the IK solver by reaching for the end\n"
+                "           effector positions of later frames [--effector bone...] [--offset N]\n"
+                "           [--tolerance m] [--iterations N] [--chain N] [--threads N] [--no-limits]\n"
+                "           [--out solved.amc]", cmd_ik},
+    {"memory",  "<model.asf> [motion.amc...]       Report heap usage and allocation counts", cmd_memory},
+    {"bake",    "<model.asf> <motion.amc>          Evaluate every frame's bone transformations", cmd_bake},
+    {"convert", "<model.asf> <in.amc> <out.amcb>   Convert to the binary clip format", cmd_convert},
+    {"generate", "<out.asf> <out.amc> [options]     Generate a synthetic skeleton and clip\n"
+                 "           --bones N, --depth N, --children N, --random-axis-order,\n"
+                 "           --dofs \"rx ry rz,rz rx,\" (DOF sets; empty for none),\n"
+                 "           --frames N, --first-frame N, --out-of-order P, --missing P,\n"
+                 "           --seed N", cmd_generate},
+    {"stream",  "<model.asf> <motion.amc> <address> Replay a clip to a live viewer\n"
+                "           (udp:[host:]port or unix:path) [--fps N] [--text] [--loop]", cmd_stream},
+    {"publish", "<model.asf> <motion.amc> <shm name> Play a clip into shared memory\n"
+                "           (see pose_reader) [--fps N] [--loop]", cmd_publish},
+    {"trim",    "<model.asf> <motion.amc> <out.amc>  Write (a frame range of) a clip as text\n"
+                "           [--first N] [--last N]", cmd_trim},
+    {"export",  "<model.asf> <motion.amc> <output> Bake world positions/orientations into a\n"
+                "           columnar file (or CSV with --csv) [--block N] [--threads N]\n"
+                "           [--range FIRST:LAST[:STRIDE]...] (concatenated)", cmd_export},
+    {"bvh-read", "<in.bvh> [out.bvh] [--scale S]    Measure BVH parsing speed (lengths times S,\n"
+                 "           default inches to meters), optionally write it again", cmd_bvh_read},
+    {"bvh-write", "<model.asf> <motion.amc> <out.bvh> Convert a clip to BVH [--frame-time T]",
+                  cmd_bvh_write},
+};
+
+
+int main(int argc, char *argv[])
+{
+    const char *trace_path = nullptr;
+    if ((argc >= 3) && !strcmp(argv[1], "--trace")) {
+        trace_path = argv[2];
+        trace_acquire();
+
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc >= 2) {
+        for (const auto &cmd: commands) {
+            if (!strcmp(argv[1], cmd.name)) {
+                try {
+                    int ret = cmd.func(argc - 2, argv + 2);
+                    if (trace_path) {
+                        write_chrome_trace(trace_path);
+                    }
+                    return ret;
+                } catch (std::exception &e) {
+                    fprintf(stderr, "%s: %s\n", argv[0], e.what());
+                    return 1;
+                }
+            }
+        }
+    }
+
+    fprintf(stderr, "Usage: %s [--trace <out.json>] <command> [arguments]\n\nCommands:\n", argv[0]);
+    for (const auto &cmd: commands) {
+        fprintf(stderr, "  %-8s %s\n", cmd.name, cmd.description);
+    }
+
+    return 1;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <ctype.h>
@@ -9,11 +10,16 @@
 #include <dake/math/matrix.hpp>
 
 #include "asf.hpp"
+#include "memory.hpp"
 
 
 using namespace dake::math;
 
 
+// Radius of the rendered bone geometry (see assets/cone.obj)
+static const float bone_radius = .025f;
+
+
 static std::string strip(const std::string &s)
 {
     size_t front = 0, back = s.length();
@@ -71,9 +77,11 @@ ASF::ASF(std::ifstream &s)
         }
     }
 
+    if (root < 0) {
+        throw std::invalid_argument("No root bone defined");
+    }
 
-    printf("ASF bone hierarchy:\n");
-    dump_hierarchy();
+    prepare_bones();
 }
 
 
@@ -336,13 +344,41 @@ void ASF::read_bonedata_section(std::ifstream &s)
 
 ASF::Bone &ASF::find_bone(const std::string &name)
 {
-    for (Bone &bone: bs) {
-        if (bone.name == name) {
-            return bone;
-        }
+    auto bi = bone_indices.find(name);
+    if (bi == bone_indices.end()) {
+        throw std::invalid_argument("Could not find bone " + name);
+    }
+
+    return bs[bi->second];
+}
+
+
+int ASF::bone_index(const std::string &name) const
+{
+    auto bi = bone_indices.find(name);
+    return bi == bone_indices.end() ? -1 : bi->second;
+}
+
+
+ASF::MemoryUsage ASF::memory_usage(void) const
+{
+    MemoryUsage usage;
+
+    usage.bones = heap_bytes(bs);
+    for (const Bone &bone: bs) {
+        usage.names += heap_bytes(bone.name);
+        usage.orders += heap_bytes(bone.axis_order) + heap_bytes(bone.dof_order);
+        usage.dofs += heap_bytes(bone.dof);
     }
 
-    throw std::invalid_argument("Could not find bone " + name);
+    usage.hierarchy = heap_bytes(order) + heap_bytes(bone_indices);
+    for (const auto &entry: bone_indices) {
+        usage.hierarchy += heap_bytes(entry.first);
+    }
+
+    usage.other = heap_bytes(r_axis) + heap_bytes(r_order) + heap_bytes(next_input_line);
+
+    return usage;
 }
 
 
@@ -357,6 +393,12 @@ void ASF::read_hierarchy_section(std::ifstream &s)
         throw std::invalid_argument("Expected begin of hierarchy section, got " + next_input_line);
     }
 
+    bone_indices.clear();
+    for (size_t i = 0; i < bs.size(); i++) {
+        // Like a linear search, prefer the first bone of a given name
+        bone_indices.emplace(bs[i].name, i);
+    }
+
     while (getline(s)) {
         refresh_nil = true;
 
@@ -395,48 +437,130 @@ void ASF::read_hierarchy_section(std::ifstream &s)
 }
 
 
-void ASF::reset_transforms(void)
+void ASF::prepare_bones(void)
 {
-    reset_bone_transform(root, mat4::identity().translated(r_pos));
+    // Hierarchy in preorder, without recursion (hierarchies may be deep)
+    order.clear();
+
+    std::vector<int> stack(1, root);
+    while (!stack.empty()) {
+        int bi = stack.back();
+        stack.pop_back();
+
+        order.push_back(bi);
+        bs[bi].depth = bs[bi].parent < 0 ? 0 : bs[bs[bi].parent].depth + 1;
+
+        // Push in reverse so the first child is visited first
+        size_t first = stack.size();
+        for (int child = bs[bi].first_child; child >= 0; child = bs[child].next_sibling) {
+            stack.push_back(child);
+        }
+        std::reverse(stack.begin() + first, stack.end());
+    }
+
+
+    for (Bone &bone: bs) {
+        vec3 rot_axis;
+        float angle;
+
+        if (bone.direction != vec3(0.f, 1.f, 0.f)) {
+            rot_axis = vec3(0.f, 1.f, 0.f).cross(bone.direction);
+            angle = acosf(bone.direction.y()); // acosf(vec3(0.f, 1.f, 0.f).dot(bone.direction))
+        } else {
+            rot_axis = vec3(0.f, 0.f, 1.f);
+            angle = 0.f;
+        }
+
+        bone.bone_dir_trans = mat4::identity().rotated(angle, rot_axis);
+
+        bone.local_trans = mat4::identity();
+        for (auto it = bone.axis_order.rbegin(); it != bone.axis_order.rend(); ++it) {
+            switch (*it) {
+                case RX: bone.local_trans.rotate(bone.axis.x(), vec3(1.f, 0.f, 0.f)); break;
+                case RY: bone.local_trans.rotate(bone.axis.y(), vec3(0.f, 1.f, 0.f)); break;
+                case RZ: bone.local_trans.rotate(bone.axis.z(), vec3(0.f, 0.f, 1.f)); break;
+                default: throw std::invalid_argument("Bad rotation axis");
+            }
+        }
+
+        bone.local_trans_inv = bone.local_trans.inverse();
+    }
+
+
+    // Children come after their parents in preorder
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        Bone &bone = bs[*it];
+
+        float child_extent = 0.f;
+        bone.subtree_size = 1;
+
+        for (int child = bone.first_child; child >= 0; child = bs[child].next_sibling) {
+            child_extent = std::max(child_extent, bs[child].subtree_extent);
+            bone.subtree_size += bs[child].subtree_size;
+        }
+
+        bone.subtree_extent = bone.length + child_extent;
+    }
 }
 
 
-void ASF::reset_bone_transform(int bi, const mat4 &mv)
+void ASF::reset_transforms(void)
 {
-    Bone &bone = bs[bi];
+    mat4 root_mv(mat4::identity().translated(r_pos));
 
+    for (int bi: order) {
+        Bone &bone = bs[bi];
 
-    vec3 rot_axis;
-    float angle;
+        if (bone.parent < 0) {
+            bone.still_trans = root_mv;
+        } else {
+            const Bone &parent = bs[bone.parent];
+            bone.still_trans = parent.motion_trans.translated(parent.length * parent.direction);
+        }
 
-    if (bone.direction != vec3(0.f, 1.f, 0.f)) {
-        rot_axis = vec3(0.f, 1.f, 0.f).cross(bone.direction);
-        angle = acosf(bone.direction.y()); // acosf(vec3(0.f, 1.f, 0.f).dot(bone.direction))
-    } else {
-        rot_axis = vec3(0.f, 0.f, 1.f);
-        angle = 0.f;
+        bone.motion_trans = bone.still_trans;
+        bone.lod_skipped  = false;
     }
 
-    bone.bone_dir_trans = mat4::identity().rotated(angle, rot_axis);
+    update_bounds();
+}
+
+
+float ASF::reach(void) const
+{
+    return bs[root].subtree_extent + bone_radius;
+}
+
 
-    bone.local_trans = mat4::identity();
-    for (auto it = bone.axis_order.rbegin(); it != bone.axis_order.rend(); ++it) {
-        switch (*it) {
-            case RX: bone.local_trans.rotate(bone.axis.x(), vec3(1.f, 0.f, 0.f)); break;
-            case RY: bone.local_trans.rotate(bone.axis.y(), vec3(0.f, 1.f, 0.f)); break;
-            case RZ: bone.local_trans.rotate(bone.axis.z(), vec3(0.f, 0.f, 1.f)); break;
-            default: throw std::invalid_argument("Bad rotation axis");
+void ASF::update_bounds(void)
+{
+    vec3 bb_min(HUGE_VALF, HUGE_VALF, HUGE_VALF), bb_max(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+
+    for (Bone &bone: bs) {
+        if (bone.lod_skipped) {
+            continue;
         }
-    }
 
-    bone.local_trans_inv = bone.local_trans.inverse();
+        vec4 center(bone.motion_trans * vec4(.5f * bone.length * bone.direction.x(),
+                                             .5f * bone.length * bone.direction.y(),
+                                             .5f * bone.length * bone.direction.z(),
+                                             1.f));
 
-    bone.still_trans  = mv;
-    bone.motion_trans = mv;
+        bone.bound_center = vec3(center.x(), center.y(), center.z());
+        bone.bound_radius = .5f * bone.length + bone_radius;
 
+        for (int i = 0; i < 3; i++) {
+            bb_min[i] = std::min(bb_min[i], bone.bound_center[i] - bone.bound_radius);
+            bb_max[i] = std::max(bb_max[i], bone.bound_center[i] + bone.bound_radius);
+        }
+    }
 
-    mat4 child_mv(bone.motion_trans.translated(bone.length * bone.direction));
-    for (int child = bone.first_child; child >= 0; child = bs[child].next_sibling) {
-        reset_bone_transform(child, child_mv);
+    b_center = .5f * (bb_min + bb_max);
+    b_radius = 0.f;
+
+    for (const Bone &bone: bs) {
+        if (!bone.lod_skipped) {
+            b_radius = std::max(b_radius, (bone.bound_center - b_center).length() + bone.bound_radius);
+        }
     }
 }
@@ -19,6 +19,8 @@ class ASF {
 
         struct Bone {
             int parent = -1, first_child = -1, next_sibling = -1;
+            // Distance from the root in the hierarchy
+            int depth = 0;
 
             int id = 0;
             std::string name = std::string("");
@@ -28,15 +30,27 @@ class ASF {
             std::vector<Axis> axis_order, dof_order;
             std::unordered_map<int, std::pair<float, float>> dof;
 
-            // Local transformation (from the axis)
+            // Local transformation (from the axis; constant)
             dake::math::mat4 local_trans, local_trans_inv;
             // Non-motion transformation
             dake::math::mat4 still_trans;
             // Motion transformation (some site calls it "local transform", but
             // it isn't even in the local coordinate system)
             dake::math::mat4 motion_trans;
-            // Transforms global (0; 1; 0) to Bone.direction
+            // Transforms global (0; 1; 0) to Bone.direction (constant)
             dake::math::mat4 bone_dir_trans;
+
+            // Maximum distance any point of this bone's subtree can have from
+            // the bone's origin (in any pose), and the number of bones in it
+            float subtree_extent = 0.f;
+            int subtree_size = 1;
+
+            // World space bounding sphere (as of the last pose evaluation)
+            dake::math::vec3 bound_center = dake::math::vec3::zero();
+            float bound_radius = 0.f;
+            // Set if the last pose evaluation skipped this bone (its
+            // transformations are stale then)
+            bool lod_skipped = false;
         };
 
         ASF(std::ifstream &s);
@@ -50,12 +64,53 @@ class ASF {
         const dake::math::vec3 &root_orientation(void) const { return r_orient; }
         int root_index(void) const { return root; }
 
+        // Indices of all bones reachable from the root, parents before their
+        // children, each subtree contiguous (with Bone.subtree_size entries)
+        const std::vector<int> &hierarchy_order(void) const { return order; }
+
         void reset_transforms(void);
 
+        // Recomputes the bounding spheres from the current bone transforms
+        // (skipped bones are left out)
+        void update_bounds(void);
+
+        // Bounding sphere of the whole skeleton (as of the last pose evaluation)
+        const dake::math::vec3 &bound_center(void) const { return b_center; }
+        float bound_radius(void) const { return b_radius; }
+
+        // Radius around the root position which contains the skeleton in any
+        // pose
+        float reach(void) const;
+
         float internal_length_unit(void) const { return length_unit; }
+        // Mass unit from the units section (see MassModel)
+        float mass_unit(void) const { return mass_default; }
+
+        void dump_hierarchy(int parent = -1, int indentation = 0) const;
+
+        // Index into bones() (or -1 if there is no such bone)
+        int bone_index(const std::string &name) const;
+
+        // Heap bytes used (see heap_bytes() in memory.hpp), by component
+        struct MemoryUsage {
+            size_t bones = 0;      // Bone array
+            size_t names = 0;      // Bone names
+            size_t orders = 0;     // Axis and DOF orders
+            size_t dofs = 0;       // DOF limit maps
+            size_t hierarchy = 0;  // Hierarchy order and name index
+            size_t other = 0;      // Root axes, parser state
+
+            size_t total(void) const { return bones + names + orders + dofs + hierarchy + other; }
+        };
+
+        MemoryUsage memory_usage(void) const;
 
 
     private:
+        // Builds skeletons from BVH files (see bvh.cpp)
+        friend class BVHImporter;
+        ASF(void) {}
+
         void read_version_section(std::ifstream &s);
         void read_units_section(std::ifstream &s);
         void read_root_section(std::ifstream &s);
@@ -63,15 +118,19 @@ class ASF {
         void read_hierarchy_section(std::ifstream &s);
         Bone &find_bone(const std::string &name);
         bool getline(std::ifstream &s);
-        void reset_bone_transform(int bi, const dake::math::mat4 &mv);
-
-        void dump_hierarchy(int parent = -1, int indentation = 0) const;
+        void prepare_bones(void);
 
         std::vector<Bone> bs;
 
         std::vector<Axis> r_axis, r_order;
         dake::math::vec3 r_pos, r_orient;
         int root = -1;
+        std::vector<int> order;
+        // For find_bone() and bone_index()
+        std::unordered_map<std::string, int> bone_indices;
+
+        dake::math::vec3 b_center = dake::math::vec3::zero();
+        float b_radius = 0.f;
 
         float mass_default = 1.f;
         float length_unit = 2.54e-2f; // inches -> meters
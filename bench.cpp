@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "draw_list.hpp"
+#include "frustum.hpp"
+#include "synth.hpp"
+
+
+using namespace dake::math;
+
+
+// Reproducible benchmarks on generated data. Every case prints one JSON object
+// per line to stdout; progress goes to stderr.
+
+
+static std::string tmp_dir;
+static std::vector<std::string> tmp_files;
+static const char *filter = nullptr;
+
+
+static std::string generate(const std::string &name, const SynthOptions &opts, bool amc)
+{
+    std::string path = tmp_dir + "/" + name;
+
+    std::ofstream s(path);
+    if (!s.is_open()) {
+        throw std::runtime_error("Could not create " + path + ": " + strerror(errno));
+    }
+
+    if (amc) {
+        synth_amc(s, opts);
+    } else {
+        synth_asf(s, opts);
+    }
+
+    tmp_files.push_back(path);
+    return path;
+}
+
+
+static size_t file_size(const std::string &path)
+{
+    std::ifstream s(path, std::ios::binary | std::ios::ate);
+    return s.tellg();
+}
+
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    size_t i = std::min<size_t>(sorted.size() - 1, lrint(p * (sorted.size() - 1)));
+    return sorted[i];
+}
+
+
+// samples: duration of each iteration in seconds; work: amount of work per
+// iteration (in the given unit, divided by time)
+static void report(const char *name, const std::string &params, std::vector<double> samples,
+                   double work, const char *unit)
+{
+    std::sort(samples.begin(), samples.end());
+
+    double total = 0.;
+    for (double sample: samples) {
+        total += sample;
+    }
+
+    printf("{\"case\": \"%s\", \"params\": {%s}, \"iterations\": %zu, "
+           "\"throughput\": %.6g, \"unit\": \"%s\", "
+           "\"latency_us\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}}\n",
+           name, params.c_str(), samples.size(),
+           work * samples.size() / total, unit,
+           samples.front() * 1e6, percentile(samples, .5) * 1e6, percentile(samples, .9) * 1e6,
+           percentile(samples, .99) * 1e6, samples.back() * 1e6);
+    fflush(stdout);
+}
+
+
+static bool selected(const char *name)
+{
+    if (filter && !strstr(name, filter)) {
+        return false;
+    }
+
+    fprintf(stderr, "Running %s...\n", name);
+    return true;
+}
+
+
+static std::vector<double> measure(int iterations, const std::function<void(int)> &func)
+{
+    std::vector<double> samples;
+
+    for (int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        func(i);
+        samples.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    return samples;
+}
+
+
+static std::unique_ptr<ASF> load_asf(const std::string &path)
+{
+    std::ifstream s(path);
+    return std::unique_ptr<ASF>(new ASF(s));
+}
+
+
+static std::unique_ptr<AMC> load_amc(const std::string &path, ASF *asf)
+{
+    std::ifstream s(path, std::ios::binary);
+    return std::unique_ptr<AMC>(new AMC(s, asf));
+}
+
+
+static void bench_asf_parse(bool quick)
+{
+    if (!selected("asf_parse")) {
+        return;
+    }
+
+    for (int bones: {31, 1000}) {
+        SynthOptions opts;
+        opts.bones = bones;
+
+        std::string path = generate("asf_parse_" + std::to_string(bones) + ".asf", opts, false);
+        double mb = file_size(path) / 1e6;
+
+        std::vector<double> samples = measure(quick ? 10 : 100, [&](int) {
+            load_asf(path);
+        });
+
+        report("asf_parse", "\"bones\": " + std::to_string(bones), samples, mb, "MB/s");
+    }
+}
+
+
+static void bench_amc_parse(bool quick)
+{
+    if (!selected("amc_parse")) {
+        return;
+    }
+
+    SynthOptions opts;
+    std::string asf_path = generate("amc_parse.asf", opts, false);
+    std::unique_ptr<ASF> asf(load_asf(asf_path));
+
+    // Roughly 1, 10 and 100 MB
+    for (int frames: {1000, 10000, 100000}) {
+        if (quick && (frames > 10000)) {
+            continue;
+        }
+
+        opts.frames = frames;
+        std::string path = generate("amc_parse_" + std::to_string(frames) + ".amc", opts, true);
+        double mb = file_size(path) / 1e6;
+
+        std::vector<double> samples = measure(frames > 10000 ? 3 : quick ? 3 : 10, [&](int) {
+            load_amc(path, asf.get());
+        });
+
+        report("amc_parse", "\"frames\": " + std::to_string(frames) + ", \"bytes\": " + std::to_string(file_size(path)),
+               samples, mb, "MB/s");
+    }
+}
+
+
+static void bench_apply_frame(bool quick)
+{
+    if (!selected("apply_frame")) {
+        return;
+    }
+
+    for (int bones: {31, 1000}) {
+        SynthOptions opts;
+        opts.bones = bones;
+        opts.frames = 1000;
+
+        std::unique_ptr<ASF> asf(load_asf(generate("apply_frame.asf", opts, false)));
+        std::unique_ptr<AMC> amc(load_amc(generate("apply_frame.amc", opts, true), asf.get()));
+
+        int count = amc->frames().size();
+        std::vector<double> samples = measure(quick ? 1000 : 10000, [&](int i) {
+            amc->apply_frame(amc->first_frame() + i % count);
+        });
+
+        report("apply_frame", "\"bones\": " + std::to_string(bones), samples, bones, "bones/s");
+    }
+}
+
+
+static void bench_bake(bool quick)
+{
+    if (!selected("bake")) {
+        return;
+    }
+
+    SynthOptions opts;
+    opts.frames = quick ? 2000 : 20000;
+
+    std::unique_ptr<ASF> asf(load_asf(generate("bake.asf", opts, false)));
+    std::unique_ptr<AMC> amc(load_amc(generate("bake.amc", opts, true), asf.get()));
+
+    size_t frame_count = amc->frames().size(), bone_count = asf->bones().size();
+    std::vector<mat4> baked(frame_count * bone_count);
+
+    for (unsigned threads: {1u, std::max(1u, std::thread::hardware_concurrency())}) {
+        std::vector<double> samples = measure(5, [&](int) {
+            std::vector<std::thread> workers;
+            for (unsigned t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    for (size_t i = frame_count * t / threads; i < frame_count * (t + 1) / threads; i++) {
+                        amc->evaluate(amc->first_frame() + i, baked.data() + i * bone_count);
+                    }
+                });
+            }
+            for (std::thread &worker: workers) {
+                worker.join();
+            }
+        });
+
+        report("bake", "\"frames\": " + std::to_string(frame_count) + ", \"threads\": " + std::to_string(threads),
+               samples, frame_count, "frames/s");
+
+        if (threads == 1u && std::thread::hardware_concurrency() <= 1) {
+            break;
+        }
+    }
+}
+
+
+// Everything up to the GL calls: LOD-free pose evaluation, culling and draw
+// list generation for a grid of characters
+static void bench_render(bool quick)
+{
+    if (!selected("render")) {
+        return;
+    }
+
+    SynthOptions opts;
+    opts.frames = 1000;
+
+    std::unique_ptr<ASF> asf(load_asf(generate("render.asf", opts, false)));
+    std::unique_ptr<AMC> amc(load_amc(generate("render.amc", opts, true), asf.get()));
+    int count = amc->frames().size();
+
+    mat4 proj(mat4::projection(static_cast<float>(M_PI) / 4.f, 16.f / 9.f, .02f, 200.f));
+
+    for (int characters: {1, 100, 1000}) {
+        // Looking along the rows, so some characters are outside of the view
+        int grid = ceilf(sqrtf(characters));
+        mat4 cam(mat4::identity().translated(vec3(0.f, -1.f, -3.f)));
+
+        DrawList list;
+        size_t drawn = 0;
+
+        std::vector<double> samples = measure(quick ? 10 : 100, [&](int i) {
+            list.clear();
+
+            for (int c = 0; c < characters; c++) {
+                mat4 mv(cam.translated(vec3(2.f * (c % grid) - grid, 0.f, -2.f * (c / grid))));
+                Frustum frustum(proj * mv);
+
+                DrawList::Options draw_opts;
+                draw_opts.frustum = &frustum;
+
+                amc->apply_frame(amc->first_frame() + (i + c * 7) % count);
+                list.add_skeleton(*asf, proj, mv, draw_opts);
+            }
+
+            drawn += list.bones.size();
+        });
+
+        report("render", "\"characters\": " + std::to_string(characters) +
+                         ", \"drawn_bones\": " + std::to_string(drawn / samples.size()),
+               samples, characters * asf->bones().size(), "bones/s");
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    bool quick = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick")) {
+            quick = true;
+        } else if (!strcmp(argv[i], "--filter") && (i + 1 < argc)) {
+            filter = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--filter <case>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    std::string tmp_template = std::string(tmp ? tmp : "/tmp") + "/cg2p2-bench-XXXXXX";
+    if (!mkdtemp(&tmp_template[0])) {
+        fprintf(stderr, "%s: Could not create temporary directory: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+    tmp_dir = tmp_template;
+
+    int ret = 0;
+    try {
+        bench_asf_parse(quick);
+        bench_amc_parse(quick);
+        bench_apply_frame(quick);
+        bench_bake(quick);
+        bench_render(quick);
+    } catch (std::exception &e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        ret = 1;
+    }
+
+    for (const std::string &path: tmp_files) {
+        unlink(path.c_str());
+    }
+    rmdir(tmp_dir.c_str());
+
+    return ret;
+}
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "bone_picker.hpp"
+#include "capsule.hpp"
+
+
+using namespace dake::math;
+
+
+// Maximum number of capsules per leaf
+static const int leaf_size = 4;
+
+
+void BonePicker::AABB::add(const AABB &box)
+{
+    for (int i = 0; i < 3; i++) {
+        min[i] = std::min(min[i], box.min[i]);
+        max[i] = std::max(max[i], box.max[i]);
+    }
+}
+
+
+float BonePicker::AABB::surface(void) const
+{
+    vec3 d(max - min);
+    if ((d.x() < 0.f) || (d.y() < 0.f) || (d.z() < 0.f)) {
+        return 0.f;
+    }
+
+    return 2.f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+
+BonePicker::AABB BonePicker::capsule_box(const Capsule &cap)
+{
+    AABB box;
+
+    if (cap.radius >= 0.f) {
+        for (int i = 0; i < 3; i++) {
+            box.min[i] = std::min(cap.a[i], cap.b[i]) - cap.radius;
+            box.max[i] = std::max(cap.a[i], cap.b[i]) + cap.radius;
+        }
+    }
+
+    return box;
+}
+
+
+void BonePicker::build(const std::vector<Capsule> &capsules)
+{
+    caps = capsules;
+
+    indices.resize(caps.size());
+    for (size_t i = 0; i < caps.size(); i++) {
+        indices[i] = i;
+    }
+
+    nodes.clear();
+    nodes.reserve(2 * caps.size() / leaf_size + 1);
+
+    if (!caps.empty()) {
+        build_node(0, caps.size());
+    }
+
+    refit_boxes();
+    built_surface = nodes.empty() ? 0.f : nodes.front().box.surface();
+}
+
+
+int BonePicker::build_node(int first, int count)
+{
+    int ni = nodes.size();
+    nodes.emplace_back();
+
+    if (count <= leaf_size) {
+        nodes[ni].first = first;
+        nodes[ni].count = count;
+        return ni;
+    }
+
+    // Split at the median of the capsule centers along the longest axis
+    AABB centers;
+    for (int i = first; i < first + count; i++) {
+        const Capsule &cap = caps[indices[i]];
+        vec3 center(.5f * (cap.a + cap.b));
+
+        AABB point;
+        point.min = point.max = center;
+        centers.add(point);
+    }
+
+    vec3 extent(centers.max - centers.min);
+    int axis = 0;
+    if (extent.y() > extent[axis]) {
+        axis = 1;
+    }
+    if (extent.z() > extent[axis]) {
+        axis = 2;
+    }
+
+    int half = count / 2;
+    std::nth_element(indices.begin() + first, indices.begin() + first + half, indices.begin() + first + count,
+                     [&](int i1, int i2) {
+                         return caps[i1].a[axis] + caps[i1].b[axis] < caps[i2].a[axis] + caps[i2].b[axis];
+                     });
+
+    build_node(first, half);
+    int right = build_node(first + half, count - half);
+    nodes[ni].right = right;
+
+    return ni;
+}
+
+
+void BonePicker::refit_boxes(void)
+{
+    // Children always come after their parent
+    for (int ni = nodes.size() - 1; ni >= 0; ni--) {
+        Node &node = nodes[ni];
+
+        node.box = AABB();
+        if (node.right < 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                node.box.add(capsule_box(caps[indices[i]]));
+            }
+        } else {
+            node.box.add(nodes[ni + 1].box);
+            node.box.add(nodes[node.right].box);
+        }
+    }
+}
+
+
+void BonePicker::refit(const std::vector<Capsule> &capsules)
+{
+    if (capsules.size() != caps.size()) {
+        throw std::invalid_argument("Number of capsules changed, cannot refit");
+    }
+
+    caps = capsules;
+    refit_boxes();
+
+    // Capsules which were close together at build time may have drifted apart
+    // (e.g. characters walking in different directions), making the boxes
+    // overlap a lot; in that case, start afresh
+    if (!nodes.empty() && (nodes.front().box.surface() > 4.f * built_surface)) {
+        build(capsules);
+    }
+}
+
+
+static bool ray_box(const vec3 &origin, const vec3 &inv_dir, const vec3 &bmin, const vec3 &bmax, float max_t)
+{
+    float t_near = 0.f, t_far = max_t;
+
+    for (int i = 0; i < 3; i++) {
+        float t1 = (bmin[i] - origin[i]) * inv_dir[i];
+        float t2 = (bmax[i] - origin[i]) * inv_dir[i];
+
+        t_near = std::max(t_near, std::min(t1, t2));
+        t_far  = std::min(t_far,  std::max(t1, t2));
+    }
+
+    return t_near <= t_far;
+}
+
+
+int BonePicker::pick(const vec3 &origin, const vec3 &dir, float *distance) const
+{
+    int best = -1;
+    float best_t = HUGE_VALF;
+
+    if (nodes.empty()) {
+        return -1;
+    }
+
+    vec3 inv_dir(1.f / dir.x(), 1.f / dir.y(), 1.f / dir.z());
+
+    int stack[64];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while (sp) {
+        const Node &node = nodes[stack[--sp]];
+
+        if (!ray_box(origin, inv_dir, node.box.min, node.box.max, best_t)) {
+            continue;
+        }
+
+        if (node.right < 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                float t = ray_capsule(origin, dir, caps[indices[i]]);
+                if ((t >= 0.f) && (t < best_t)) {
+                    best_t = t;
+                    best = indices[i];
+                }
+            }
+        } else {
+            // Median splits keep the depth logarithmic, so this cannot overflow
+            stack[sp++] = node.right;
+            stack[sp++] = &node - nodes.data() + 1;
+        }
+    }
+
+    if (distance && (best >= 0)) {
+        *distance = best_t;
+    }
+
+    return best;
+}
+
+
+int BonePicker::pick_brute_force(const vec3 &origin, const vec3 &dir, float *distance) const
+{
+    int best = -1;
+    float best_t = HUGE_VALF;
+
+    for (size_t i = 0; i < caps.size(); i++) {
+        float t = ray_capsule(origin, dir, caps[i]);
+        if ((t >= 0.f) && (t < best_t)) {
+            best_t = t;
+            best = i;
+        }
+    }
+
+    if (distance && (best >= 0)) {
+        *distance = best_t;
+    }
+
+    return best;
+}
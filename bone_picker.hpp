@@ -0,0 +1,60 @@
+#ifndef BONE_PICKER_HPP
+#define BONE_PICKER_HPP
+
+#include <cmath>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "capsule.hpp"
+
+
+// Bounding volume hierarchy (of axis-aligned boxes) over a set of capsules.
+// When the capsules move (i.e., for a new frame), the hierarchy can be refit
+// instead of being rebuilt.
+class BonePicker {
+    public:
+        void build(const std::vector<Capsule> &capsules);
+        // The number of capsules must not change; rebuilds the hierarchy if it
+        // has degenerated too much compared to when it was built
+        void refit(const std::vector<Capsule> &capsules);
+
+        size_t size(void) const { return caps.size(); }
+
+        // Returns the index of the closest capsule hit by the ray (or -1); the
+        // direction needs to be normalized
+        int pick(const dake::math::vec3 &origin, const dake::math::vec3 &dir, float *distance = nullptr) const;
+
+        // Tests every capsule, for comparison
+        int pick_brute_force(const dake::math::vec3 &origin, const dake::math::vec3 &dir, float *distance = nullptr) const;
+
+
+    private:
+        struct AABB {
+            dake::math::vec3 min = dake::math::vec3(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+            dake::math::vec3 max = dake::math::vec3(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+
+            void add(const AABB &box);
+            float surface(void) const;
+        };
+
+        struct Node {
+            AABB box;
+            // Inner nodes: The left child is always the next node, right is
+            // the index of the right child; leaves: right is -1
+            int right = -1;
+            // Range in the index array (leaves only)
+            int first = 0, count = 0;
+        };
+
+        static AABB capsule_box(const Capsule &cap);
+
+        int build_node(int first, int count);
+        void refit_boxes(void);
+
+        std::vector<Capsule> caps;
+        std::vector<Node> nodes;
+        std::vector<int> indices;
+        float built_surface = 0.f;
+};
+
+#endif
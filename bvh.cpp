@@ -0,0 +1,707 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "bvh.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+
+
+using namespace dake::math;
+
+
+static const float deg_to_rad = static_cast<float>(M_PI) / 180.f;
+
+
+// Read-only mapping of a whole file
+class MappedFile {
+    public:
+        MappedFile(const std::string &path)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) < 0) {
+                int err = errno;
+                close(fd);
+                throw std::runtime_error("Could not stat " + path + ": " + strerror(err));
+            }
+
+            size = st.st_size;
+            if (size) {
+                void *mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mem == MAP_FAILED) {
+                    int err = errno;
+                    close(fd);
+                    throw std::runtime_error("Could not map " + path + ": " + strerror(err));
+                }
+
+                madvise(mem, size, MADV_SEQUENTIAL);
+                data = static_cast<const char *>(mem);
+            }
+
+            close(fd);
+        }
+
+        ~MappedFile(void)
+        {
+            if (size) {
+                munmap(const_cast<char *>(data), size);
+            }
+        }
+
+        const char *data = "";
+        size_t size = 0;
+};
+
+
+struct Tokenizer {
+    const char *p, *end;
+    int line = 1;
+
+    std::string_view next(void)
+    {
+        for (; (p < end) && isspace(static_cast<unsigned char>(*p)); p++) {
+            if (*p == '\n') {
+                line++;
+            }
+        }
+
+        const char *start = p;
+        for (; (p < end) && !isspace(static_cast<unsigned char>(*p)); p++);
+
+        return std::string_view(start, p - start);
+    }
+
+    void expect(std::string_view token)
+    {
+        std::string_view got = next();
+        if (got != token) {
+            error("Expected " + std::string(token) + ", got " + (got.empty() ? std::string("EOF") : std::string(got)));
+        }
+    }
+
+    template<typename T> T number(void)
+    {
+        std::string_view tok = next();
+        const char *s = tok.data(), *e = tok.data() + tok.size();
+        T value;
+
+        // from_chars() does not accept a plus sign
+        if ((s < e) && (*s == '+')) {
+            s++;
+        }
+
+        std::from_chars_result res = std::from_chars(s, e, value);
+        if ((res.ec != std::errc()) || (res.ptr != e)) {
+            error("Expected a number, got " + std::string(tok));
+        }
+
+        return value;
+    }
+
+    [[noreturn]] void error(const std::string &msg)
+    {
+        throw std::invalid_argument("BVH line " + std::to_string(line) + ": " + msg);
+    }
+};
+
+
+enum Channel {
+    XPOS, YPOS, ZPOS,
+    XROT, YROT, ZROT
+};
+
+struct Joint {
+    std::string name;
+    int parent = -1;
+    vec3 offset = vec3::zero();
+    std::vector<Channel> channels;
+    std::vector<int> children;
+    std::vector<vec3> end_sites;
+};
+
+
+static ASF::Axis rotation_axis(Channel channel)
+{
+    switch (channel) {
+        case XROT: return ASF::RX;
+        case YROT: return ASF::RY;
+        case ZROT: return ASF::RZ;
+        default: throw std::invalid_argument("Not a rotation channel");
+    }
+}
+
+
+// Builds the ASF, so it needs to be a friend of it
+class BVHImporter {
+    public:
+        static BVHClip import(const char *data, size_t size, float length_unit);
+
+    private:
+        static void parse_hierarchy(Tokenizer &tok, std::vector<Joint> &joints);
+        static ASF *build_skeleton(const std::vector<Joint> &joints, float length_unit,
+                                   std::vector<int> &joint_bones, std::vector<std::string> &warnings);
+        static int add_bone(ASF &asf, ASF::Bone &&bone, int parent, std::vector<int> &last_child);
+};
+
+
+void BVHImporter::parse_hierarchy(Tokenizer &tok, std::vector<Joint> &joints)
+{
+    tok.expect("HIERARCHY");
+    tok.expect("ROOT");
+
+    joints.emplace_back();
+    joints.back().name = std::string(tok.next());
+    tok.expect("{");
+
+    // Without recursion, hierarchies may be deep
+    std::vector<int> open(1, 0);
+
+    while (!open.empty()) {
+        std::string_view keyword = tok.next();
+        Joint &joint = joints[open.back()];
+
+        if (keyword == "OFFSET") {
+            joint.offset.x() = tok.number<float>();
+            joint.offset.y() = tok.number<float>();
+            joint.offset.z() = tok.number<float>();
+        } else if (keyword == "CHANNELS") {
+            int count = tok.number<int>();
+            joint.channels.clear();
+
+            for (int i = 0; i < count; i++) {
+                std::string_view name = tok.next();
+
+                if (name == "Xposition") {
+                    joint.channels.push_back(XPOS);
+                } else if (name == "Yposition") {
+                    joint.channels.push_back(YPOS);
+                } else if (name == "Zposition") {
+                    joint.channels.push_back(ZPOS);
+                } else if (name == "Xrotation") {
+                    joint.channels.push_back(XROT);
+                } else if (name == "Yrotation") {
+                    joint.channels.push_back(YROT);
+                } else if (name == "Zrotation") {
+                    joint.channels.push_back(ZROT);
+                } else {
+                    tok.error("Unknown channel " + std::string(name));
+                }
+            }
+        } else if (keyword == "JOINT") {
+            int parent = open.back();
+            int index = joints.size();
+
+            joints.emplace_back();
+            joints.back().name = std::string(tok.next());
+            joints.back().parent = parent;
+            joints[parent].children.push_back(index);
+
+            tok.expect("{");
+            open.push_back(index);
+        } else if (keyword == "End") {
+            tok.expect("Site");
+            tok.expect("{");
+            tok.expect("OFFSET");
+
+            vec3 offset;
+            offset.x() = tok.number<float>();
+            offset.y() = tok.number<float>();
+            offset.z() = tok.number<float>();
+            joint.end_sites.push_back(offset);
+
+            tok.expect("}");
+        } else if (keyword == "}") {
+            open.pop_back();
+        } else if (keyword == "ROOT") {
+            tok.error("Multiple roots are not supported");
+        } else {
+            tok.error("Unexpected " + (keyword.empty() ? std::string("EOF") : std::string(keyword)));
+        }
+    }
+}
+
+
+int BVHImporter::add_bone(ASF &asf, ASF::Bone &&bone, int parent, std::vector<int> &last_child)
+{
+    int index = asf.bs.size();
+
+    bone.id = index;
+    bone.parent = parent;
+    asf.bs.push_back(std::move(bone));
+    last_child.push_back(-1);
+
+    if (parent >= 0) {
+        if (last_child[parent] < 0) {
+            asf.bs[parent].first_child = index;
+        } else {
+            asf.bs[last_child[parent]].next_sibling = index;
+        }
+        last_child[parent] = index;
+    }
+
+    return index;
+}
+
+
+// A fixed bone with the given offset (in file units)
+static ASF::Bone offset_bone(const std::string &name, const vec3 &offset, float length_unit)
+{
+    ASF::Bone bone;
+
+    bone.name = name;
+    bone.length = offset.length() * length_unit;
+    bone.direction = bone.length > 0.f ? offset / offset.length() : vec3(0.f, 1.f, 0.f);
+    bone.axis_order = {ASF::RX, ASF::RY, ASF::RZ};
+
+    return bone;
+}
+
+
+ASF *BVHImporter::build_skeleton(const std::vector<Joint> &joints, float length_unit, std::vector<int> &joint_bones,
+                                 std::vector<std::string> &warnings)
+{
+    std::unique_ptr<ASF> asf(new ASF);
+    std::vector<int> last_child;
+
+    asf->length_unit = length_unit;
+
+    const Joint &root_joint = joints[0];
+    asf->r_pos = root_joint.offset * length_unit;
+    for (Channel channel: root_joint.channels) {
+        switch (channel) {
+            case XPOS: asf->r_order.push_back(ASF::TX); break;
+            case YPOS: asf->r_order.push_back(ASF::TY); break;
+            case ZPOS: asf->r_order.push_back(ASF::TZ); break;
+            default:
+                asf->r_order.push_back(rotation_axis(channel));
+                asf->r_axis.insert(asf->r_axis.begin(), rotation_axis(channel));
+        }
+    }
+
+    ASF::Bone root_bone;
+    root_bone.name = "root";
+    root_bone.direction = vec3(0.f, 1.f, 0.f);
+    asf->root = add_bone(*asf, std::move(root_bone), -1, last_child);
+
+    joint_bones.assign(joints.size(), -1);
+    joint_bones[0] = asf->root;
+
+    bool ignored_positions = false;
+
+    // Joints are in preorder, so parents are always done before their
+    // children
+    for (size_t ji = 0; ji < joints.size(); ji++) {
+        const Joint &joint = joints[ji];
+        int bone_index;
+
+        if (ji) {
+            const Joint &parent = joints[joint.parent];
+            int asf_parent = joint_bones[joint.parent];
+
+            // Multi-child joints (and the root) have zero length bones, so
+            // a fixed bone has to lead to each child
+            bool parent_points_here = joint.parent && (parent.children.size() + parent.end_sites.size() == 1);
+            if (!parent_points_here && (joint.offset.length() > 0.f)) {
+                asf_parent = add_bone(*asf, offset_bone(parent.name + "_" + joint.name, joint.offset, length_unit),
+                                      asf_parent, last_child);
+            }
+
+            ASF::Bone bone;
+            if (joint.children.size() + joint.end_sites.size() == 1) {
+                const vec3 &target = joint.children.empty() ? joint.end_sites[0] : joints[joint.children[0]].offset;
+                bone = offset_bone(joint.name, target, length_unit);
+            } else {
+                bone = offset_bone(joint.name, vec3::zero(), length_unit);
+            }
+
+            bone.axis_order.clear();
+            for (Channel channel: joint.channels) {
+                if ((channel == XPOS) || (channel == YPOS) || (channel == ZPOS)) {
+                    ignored_positions = true;
+                    continue;
+                }
+
+                bone.dof_order.push_back(rotation_axis(channel));
+                bone.axis_order.insert(bone.axis_order.begin(), rotation_axis(channel));
+                bone.dof[static_cast<int>(rotation_axis(channel))] = std::make_pair(-HUGE_VALF, HUGE_VALF);
+            }
+            if (bone.axis_order.empty()) {
+                bone.axis_order = {ASF::RX, ASF::RY, ASF::RZ};
+            }
+
+            bone_index = add_bone(*asf, std::move(bone), asf_parent, last_child);
+            joint_bones[ji] = bone_index;
+        } else {
+            bone_index = asf->root;
+        }
+
+        if (joint.children.size() + joint.end_sites.size() != 1 || !ji) {
+            for (size_t i = 0; i < joint.end_sites.size(); i++) {
+                if (joint.end_sites[i].length() > 0.f) {
+                    std::string name = joint.name + "_end" + (i ? std::to_string(i + 1) : std::string());
+                    add_bone(*asf, offset_bone(name, joint.end_sites[i], length_unit), bone_index, last_child);
+                }
+            }
+        }
+    }
+
+    if (ignored_positions) {
+        warnings.push_back("Ignoring position channels of non-root BVH joints");
+    }
+
+    for (size_t i = 0; i < asf->bs.size(); i++) {
+        asf->bone_indices.emplace(asf->bs[i].name, i);
+    }
+    asf->prepare_bones();
+
+    return asf.release();
+}
+
+
+BVHClip BVHImporter::import(const char *data, size_t size, float length_unit)
+{
+    Tokenizer tok{data, data + size};
+    std::vector<Joint> joints;
+
+    parse_hierarchy(tok, joints);
+
+    tok.expect("MOTION");
+    tok.expect("Frames:");
+    long frame_count = tok.number<long>();
+    tok.expect("Frame");
+    tok.expect("Time:");
+
+    BVHClip clip;
+    clip.frame_time = tok.number<float>();
+
+    if (frame_count < 0) {
+        tok.error("Negative frame count");
+    }
+
+    std::vector<int> joint_bones;
+    clip.asf.reset(build_skeleton(joints, length_unit, joint_bones, clip.warnings));
+
+    // Where each value of a frame line goes
+    struct Target {
+        int bone;
+        Channel channel;
+    };
+    std::vector<Target> targets;
+    for (size_t ji = 0; ji < joints.size(); ji++) {
+        for (Channel channel: joints[ji].channels) {
+            targets.push_back(Target{joint_bones[ji], channel});
+        }
+    }
+
+    // Find all frame lines first, so they can be parsed in parallel
+    std::vector<const char *> lines;
+    lines.reserve(frame_count);
+
+    const char *p = tok.p, *end = tok.end;
+    int first_line = tok.line;
+    while ((p < end) && (lines.size() < static_cast<size_t>(frame_count))) {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!eol) {
+            eol = end;
+        }
+
+        const char *q = p;
+        for (; (q < eol) && isspace(static_cast<unsigned char>(*q)); q++);
+        if (q < eol) {
+            lines.push_back(q);
+        }
+
+        p = eol + 1;
+    }
+
+    if (lines.size() < static_cast<size_t>(frame_count)) {
+        throw std::invalid_argument("BVH: Expected " + std::to_string(frame_count) + " frames, got " +
+                                    std::to_string(lines.size()));
+    }
+
+    size_t bone_count = clip.asf->bones().size();
+    int root = clip.asf->root_index();
+    std::vector<AMC::Frame> frames(frame_count);
+
+    std::mutex error_lock;
+    std::string error;
+
+    parallel_ranges(frame_count, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            AMC::Frame &frame = frames[i];
+            frame.transformations.resize(bone_count);
+
+            const char *q = lines[i];
+            for (const Target &target: targets) {
+                for (; (q < end) && ((*q == ' ') || (*q == '\t')); q++);
+                if ((q < end) && (*q == '+')) {
+                    q++;
+                }
+
+                float value;
+                std::from_chars_result res = std::from_chars(q, end, value);
+                if (res.ec != std::errc()) {
+                    std::lock_guard<std::mutex> guard(error_lock);
+                    error = "BVH: Invalid or missing value in frame " + std::to_string(i + 1);
+                    return;
+                }
+                q = res.ptr;
+
+                if (target.bone == root) {
+                    switch (target.channel) {
+                        case XPOS: frame.root_translation.x() = value * length_unit; break;
+                        case YPOS: frame.root_translation.y() = value * length_unit; break;
+                        case ZPOS: frame.root_translation.z() = value * length_unit; break;
+                        case XROT: frame.root_rotation.x() = value * deg_to_rad; break;
+                        case YROT: frame.root_rotation.y() = value * deg_to_rad; break;
+                        case ZROT: frame.root_rotation.z() = value * deg_to_rad; break;
+                    }
+                } else {
+                    AMC::Transformation &trans = frame.transformations[target.bone];
+                    switch (target.channel) {
+                        case XROT: trans.rx = value * deg_to_rad; break;
+                        case YROT: trans.ry = value * deg_to_rad; break;
+                        case ZROT: trans.rz = value * deg_to_rad; break;
+                        default: break;
+                    }
+                }
+            }
+        }
+    });
+
+    if (!error.empty()) {
+        throw std::invalid_argument(error + " (frames start at line " + std::to_string(first_line) + ")");
+    }
+
+    clip.amc.reset(new AMC(clip.asf.get(), std::move(frames), 1));
+
+    return clip;
+}
+
+
+BVHClip read_bvh(const std::string &path, float length_unit)
+{
+    TRACE_SCOPE("read_bvh");
+
+    MappedFile file(path);
+    return BVHImporter::import(file.data, file.size, length_unit);
+}
+
+
+// Decomposes m = Rz(z) * Rx(x) * Ry(y) into z, x, y (in degrees)
+static void zxy_angles(const mat4 &m, float out[3])
+{
+    vec4 c0(m * vec4(1.f, 0.f, 0.f, 0.f));
+    vec4 c1(m * vec4(0.f, 1.f, 0.f, 0.f));
+    vec4 c2(m * vec4(0.f, 0.f, 1.f, 0.f));
+
+    float sx = std::min(1.f, std::max(-1.f, c1.z()));
+    float x = asinf(sx), y, z;
+
+    if (fabsf(sx) < .9999999f) {
+        z = atan2f(-c1.x(), c1.y());
+        y = atan2f(-c0.z(), c2.z());
+    } else {
+        // Gimbal lock, only z + y (or z - y) is defined
+        y = 0.f;
+        z = atan2f(c0.y(), c0.x());
+    }
+
+    out[0] = z / deg_to_rad;
+    out[1] = x / deg_to_rad;
+    out[2] = y / deg_to_rad;
+}
+
+
+// True if AMC::rotation() yields Rz * Rx * Ry already, so the angles can be used
+// as they are
+static bool is_zxy(const std::vector<ASF::Axis> &axis_order)
+{
+    return axis_order == std::vector<ASF::Axis>{ASF::RY, ASF::RX, ASF::RZ};
+}
+
+
+static void append_float(std::string &out, float value)
+{
+    char buf[32];
+    out.append(buf, std::to_chars(buf, buf + sizeof(buf), value).ptr);
+}
+
+
+static void append_vec(std::string &out, const vec3 &v)
+{
+    append_float(out, v.x());
+    out += ' ';
+    append_float(out, v.y());
+    out += ' ';
+    append_float(out, v.z());
+}
+
+
+void write_bvh(const std::string &path, const AMC &amc, float frame_time)
+{
+    TRACE_SCOPE("write_bvh");
+
+    const ASF &asf = *amc.skeleton();
+    const std::vector<ASF::Bone> &bones = asf.bones();
+    const std::vector<int> &order = asf.hierarchy_order();
+    float unit = asf.internal_length_unit();
+
+    // Large buffer, the output may well be multiple GB
+    std::vector<char> buffer(1 << 20);
+
+    std::ofstream out;
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out.open(path, std::ios::binary);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    std::string text("HIERARCHY\n");
+    std::vector<int> open;
+
+    for (int bi: order) {
+        const ASF::Bone &bone = bones[bi];
+
+        while (!open.empty() && (open.back() >= bone.depth)) {
+            text += std::string(open.back(), '\t') + "}\n";
+            open.pop_back();
+        }
+
+        std::string indent(bone.depth, '\t');
+        if (bone.parent < 0) {
+            text += "ROOT " + bone.name + "\n{\n\tOFFSET ";
+            append_vec(text, asf.root_position() / unit);
+            text += "\n\tCHANNELS 6 Xposition Yposition Zposition Zrotation Xrotation Yrotation\n";
+        } else {
+            const ASF::Bone &parent = bones[bone.parent];
+
+            text += indent + "JOINT " + bone.name + "\n" + indent + "{\n" + indent + "\tOFFSET ";
+            append_vec(text, parent.direction * (parent.length / unit));
+            text += "\n" + indent + "\tCHANNELS 3 Zrotation Xrotation Yrotation\n";
+        }
+
+        if (bone.first_child < 0) {
+            text += indent + "\tEnd Site\n" + indent + "\t{\n" + indent + "\t\tOFFSET ";
+            append_vec(text, bone.direction * (bone.length / unit));
+            text += "\n" + indent + "\t}\n";
+        }
+
+        open.push_back(bone.depth);
+    }
+
+    while (!open.empty()) {
+        text += std::string(open.back(), '\t') + "}\n";
+        open.pop_back();
+    }
+
+    size_t frame_count = amc.frames().size();
+
+    text += "MOTION\nFrames: " + std::to_string(frame_count) + "\nFrame Time: ";
+    append_float(text, frame_time);
+    text += "\n";
+    out.write(text.data(), text.size());
+
+    // Skeletons read from BVH files can mostly skip the decomposition
+    bool root_zxy = is_zxy(asf.root_axis());
+    std::vector<bool> bone_zxy(bones.size());
+    for (size_t i = 0; i < bones.size(); i++) {
+        bone_zxy[i] = is_zxy(bones[i].axis_order) && (bones[i].axis.length() == 0.f);
+    }
+
+    // Format blocks of frames in parallel
+    static const size_t block_frames = 4096;
+    size_t chunk_count = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> chunks(chunk_count);
+
+    for (size_t block_start = 0; block_start < frame_count; block_start += block_frames) {
+        size_t n = std::min(block_frames, frame_count - block_start);
+
+        parallel_ranges(chunk_count, [&](size_t first_chunk, size_t end_chunk) {
+            float angles[3];
+
+            for (size_t c = first_chunk; c < end_chunk; c++) {
+                std::string &line = chunks[c];
+                line.clear();
+
+                for (size_t i = n * c / chunk_count; i < n * (c + 1) / chunk_count; i++) {
+                    const AMC::Frame &frame = amc.frames()[block_start + i];
+
+                    append_vec(line, frame.root_translation / unit);
+
+                    if (root_zxy) {
+                        angles[0] = frame.root_rotation.z() / deg_to_rad;
+                        angles[1] = frame.root_rotation.x() / deg_to_rad;
+                        angles[2] = frame.root_rotation.y() / deg_to_rad;
+                    } else {
+                        zxy_angles(AMC::rotation(asf.root_axis(), frame.root_rotation.x(), frame.root_rotation.y(),
+                                                 frame.root_rotation.z()), angles);
+                    }
+                    for (float angle: angles) {
+                        line += ' ';
+                        append_float(line, angle);
+                    }
+
+                    for (int bi: order) {
+                        const ASF::Bone &bone = bones[bi];
+                        if (bone.parent < 0) {
+                            continue;
+                        }
+
+                        const AMC::Transformation &trans = frame.transformations[bi];
+                        if (bone_zxy[bi]) {
+                            angles[0] = trans.rz / deg_to_rad;
+                            angles[1] = trans.rx / deg_to_rad;
+                            angles[2] = trans.ry / deg_to_rad;
+                        } else {
+                            zxy_angles(bone.local_trans * AMC::rotation(bone.axis_order, trans.rx, trans.ry, trans.rz) *
+                                       bone.local_trans_inv, angles);
+                        }
+
+                        for (float angle: angles) {
+                            line += ' ';
+                            append_float(line, angle);
+                        }
+                    }
+
+                    line += '\n';
+                }
+            }
+        }, chunk_count);
+
+        for (const std::string &chunk: chunks) {
+            out.write(chunk.data(), chunk.size());
+        }
+    }
+
+    out.close();
+    if (out.fail()) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
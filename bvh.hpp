@@ -0,0 +1,41 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "amc.hpp"
+#include "asf.hpp"
+
+
+// BVH files mapped onto the ASF/AMC model:
+//  - The BVH root becomes the ASF root (named "root", so the clip is a valid
+//    AMC), its channels become the root order.
+//  - Every other joint becomes a bone starting at the joint. If it has
+//    exactly one child (joint or end site), the bone points to that child;
+//    otherwise it has length 0 and a fixed (DOF-less) bone named
+//    <joint>_<child> (or <joint>_end) leads to every child at a non-zero
+//    offset.
+//  - Rotation channels become the DOFs (in channel order), their reverse the
+//    axis order; bones have no axis rotation. Position channels of non-root
+//    joints are ignored.
+struct BVHClip {
+    std::unique_ptr<ASF> asf;
+    std::unique_ptr<AMC> amc;
+    float frame_time;
+    // Parts of the file which could not be mapped (and were ignored)
+    std::vector<std::string> warnings;
+};
+
+
+// Lengths in the file are multiplied by length_unit (to get meters; the
+// default assumes inches, like ASF files without a units section)
+BVHClip read_bvh(const std::string &path, float length_unit = 2.54e-2f);
+
+// Writes the skeleton (in its ASF length units) and all frames; every joint
+// gets ZXY rotation channels (the bones' axis rotations are folded into
+// them), the root also XYZ position channels
+void write_bvh(const std::string &path, const AMC &amc, float frame_time = 1.f / 120.f);
+
+#endif
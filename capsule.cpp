@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "asf.hpp"
+#include "capsule.hpp"
+
+
+using namespace dake::math;
+
+
+// Radius of the rendered bone geometry (see assets/cone.obj)
+static const float bone_radius = .025f;
+
+
+void bone_capsules(const ASF &asf, std::vector<Capsule> &capsules)
+{
+    for (const ASF::Bone &bone: asf.bones()) {
+        Capsule cap;
+
+        if (!bone.lod_skipped) {
+            vec4 a(bone.motion_trans * vec4(0.f, 0.f, 0.f, 1.f));
+            vec4 b(bone.motion_trans * vec4(bone.length * bone.direction.x(),
+                                            bone.length * bone.direction.y(),
+                                            bone.length * bone.direction.z(),
+                                            1.f));
+
+            cap.a = vec3(a.x(), a.y(), a.z());
+            cap.b = vec3(b.x(), b.y(), b.z());
+            cap.radius = bone_radius;
+        }
+
+        capsules.push_back(cap);
+    }
+}
+
+
+void bone_capsules(const ASF &asf, const mat4 *motion_trans, float radius, std::vector<Capsule> &capsules)
+{
+    const std::vector<ASF::Bone> &bones = asf.bones();
+
+    for (size_t i = 0; i < bones.size(); i++) {
+        const ASF::Bone &bone = bones[i];
+        Capsule cap;
+
+        if (bone.length > 0.f) {
+            vec4 a(motion_trans[i] * vec4(0.f, 0.f, 0.f, 1.f));
+            vec4 b(motion_trans[i] * vec4(bone.length * bone.direction.x(),
+                                          bone.length * bone.direction.y(),
+                                          bone.length * bone.direction.z(),
+                                          1.f));
+
+            cap.a = vec3(a.x(), a.y(), a.z());
+            cap.b = vec3(b.x(), b.y(), b.z());
+            cap.radius = radius;
+        }
+
+        capsules.push_back(cap);
+    }
+}
+
+
+// Closest points of two segments (Ericson, Real-Time Collision Detection,
+// 5.1.9); returns their squared distance
+static float segment_distance2(const vec3 &p1, const vec3 &q1, const vec3 &p2, const vec3 &q2)
+{
+    vec3 d1(q1 - p1), d2(q2 - p2), r(p1 - p2);
+    float a = d1.dot(d1), e = d2.dot(d2), f = d2.dot(r);
+    float s, t;
+
+    if ((a < 1e-12f) && (e < 1e-12f)) {
+        return r.dot(r);
+    }
+
+    if (a < 1e-12f) {
+        s = 0.f;
+        t = std::min(std::max(f / e, 0.f), 1.f);
+    } else {
+        float c = d1.dot(r);
+
+        if (e < 1e-12f) {
+            t = 0.f;
+            s = std::min(std::max(-c / a, 0.f), 1.f);
+        } else {
+            float b = d1.dot(d2);
+            float denom = a * e - b * b;
+
+            // Parallel segments: any s will do
+            s = denom > 0.f ? std::min(std::max((b * f - c * e) / denom, 0.f), 1.f) : 0.f;
+            t = (b * s + f) / e;
+
+            if (t < 0.f) {
+                t = 0.f;
+                s = std::min(std::max(-c / a, 0.f), 1.f);
+            } else if (t > 1.f) {
+                t = 1.f;
+                s = std::min(std::max((b - c) / a, 0.f), 1.f);
+            }
+        }
+    }
+
+    vec3 diff(p1 + s * d1 - p2 - t * d2);
+    return diff.dot(diff);
+}
+
+
+float capsule_distance(const Capsule &c1, const Capsule &c2)
+{
+    return sqrtf(segment_distance2(c1.a, c1.b, c2.a, c2.b)) - c1.radius - c2.radius;
+}
+
+
+static float ray_sphere(const vec3 &origin, const vec3 &dir, const vec3 &center, float radius)
+{
+    vec3 oc(origin - center);
+    float b = dir.dot(oc);
+    float c = oc.dot(oc) - radius * radius;
+    float h = b * b - c;
+
+    if (h < 0.f) {
+        return -1.f;
+    }
+
+    return -b - sqrtf(h);
+}
+
+
+static float ray_capsule_near(const vec3 &origin, const vec3 &dir, const Capsule &cap)
+{
+    vec3 ba(cap.b - cap.a), oa(origin - cap.a);
+
+    float baba = ba.dot(ba), bard = ba.dot(dir), baoa = ba.dot(oa);
+    float rdoa = dir.dot(oa), oaoa = oa.dot(oa);
+
+    float aa = baba - bard * bard;
+
+    // Degenerate capsules and rays parallel to the axis only hit the caps
+    if ((baba < 1e-12f) || (aa < 1e-9f * baba)) {
+        float ta = ray_sphere(origin, dir, cap.a, cap.radius);
+        float tb = ray_sphere(origin, dir, cap.b, cap.radius);
+
+        if ((ta >= 0.f) && (tb >= 0.f)) {
+            return fminf(ta, tb);
+        }
+        return ta >= 0.f ? ta : tb;
+    }
+
+    float bb = baba * rdoa - baoa * bard;
+    float cc = baba * oaoa - baoa * baoa - cap.radius * cap.radius * baba;
+    float h = bb * bb - aa * cc;
+
+    if (h < 0.f) {
+        return -1.f;
+    }
+
+    float t = (-bb - sqrtf(h)) / aa;
+    float y = baoa + t * bard;
+
+    // Cylinder body
+    if ((y > 0.f) && (y < baba)) {
+        return t;
+    }
+
+    // Caps
+    return ray_sphere(origin, dir, y <= 0.f ? cap.a : cap.b, cap.radius);
+}
+
+
+float ray_capsule(const vec3 &origin, const vec3 &dir, const Capsule &cap)
+{
+    if (cap.radius < 0.f) {
+        return -1.f;
+    }
+
+    // Move the origin close to the capsule first; the quadratic terms cancel
+    // out badly for far away origins otherwise
+    float t0 = std::max(0.f, dir.dot(cap.a - origin) - (cap.b - cap.a).length() - cap.radius);
+    float t = ray_capsule_near(origin + t0 * dir, dir, cap);
+
+    return t < 0.f ? t : t0 + t;
+}
@@ -0,0 +1,34 @@
+#ifndef CAPSULE_HPP
+#define CAPSULE_HPP
+
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "asf.hpp"
+
+
+// Line segment from a to b, swept by a sphere
+struct Capsule {
+    dake::math::vec3 a = dake::math::vec3::zero(), b = dake::math::vec3::zero();
+    // Negative radius means "empty" (e.g. for bones skipped by LOD)
+    float radius = -1.f;
+};
+
+
+// Appends one capsule per bone of the ASF's current pose, in the order of
+// ASF.bones
+void bone_capsules(const ASF &asf, std::vector<Capsule> &capsules);
+// Same for a pose given by its motion transformations (see AMC::evaluate()),
+// with the given radius; bones without length get empty capsules
+void bone_capsules(const ASF &asf, const dake::math::mat4 *motion_trans, float radius,
+                   std::vector<Capsule> &capsules);
+
+// Distance between the surfaces of two (non-empty) capsules; negative if they
+// interpenetrate, by how much
+float capsule_distance(const Capsule &c1, const Capsule &c2);
+
+// Returns the distance along the (normalized) ray direction to the first
+// intersection, or a negative value if the ray misses the capsule
+float ray_capsule(const dake::math::vec3 &origin, const dake::math::vec3 &dir, const Capsule &cap);
+
+#endif
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "clip_loader.hpp"
+#include "trace.hpp"
+
+
+ClipLoader::ClipLoader(QObject *p):
+    QObject(p)
+{
+    unsigned count = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned i = 0; i < count; i++) {
+        workers.emplace_back(&ClipLoader::work, this);
+    }
+}
+
+
+ClipLoader::~ClipLoader(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        quit = true;
+        for (auto &job: jobs) {
+            job.second->progress.cancel = true;
+        }
+    }
+    queue_cond.notify_all();
+
+    for (std::thread &worker: workers) {
+        worker.join();
+    }
+}
+
+
+std::vector<int> ClipLoader::load(const QStringList &paths, ASF *asf)
+{
+    std::vector<std::shared_ptr<Job>> new_jobs;
+    std::vector<int> ids;
+
+    for (const QString &path: paths) {
+        std::shared_ptr<Job> job(new Job);
+
+        job->path = path;
+        job->asf = asf;
+
+        struct stat st;
+        if (!stat(path.toUtf8().constData(), &st)) {
+            job->size = st.st_size;
+        }
+
+        new_jobs.push_back(job);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        for (const std::shared_ptr<Job> &job: new_jobs) {
+            job->id = next_id++;
+            jobs[job->id] = job;
+            ids.push_back(job->id);
+        }
+
+        std::stable_sort(new_jobs.begin(), new_jobs.end(),
+                         [](const std::shared_ptr<Job> &j1, const std::shared_ptr<Job> &j2) {
+                             return j1->size > j2->size;
+                         });
+
+        queue.insert(queue.end(), new_jobs.begin(), new_jobs.end());
+    }
+    queue_cond.notify_all();
+
+    return ids;
+}
+
+
+void ClipLoader::cancel(int id)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto job = jobs.find(id);
+    if (job != jobs.end()) {
+        job->second->progress.cancel = true;
+    }
+}
+
+
+float ClipLoader::progress(int id)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto job = jobs.find(id);
+    if ((job == jobs.end()) || !job->second->size) {
+        return 0.f;
+    }
+
+    return std::min(1.f, static_cast<float>(job->second->progress.bytes_read) / job->second->size);
+}
+
+
+void ClipLoader::work(void)
+{
+    trace_thread_name("Clip loader");
+
+    for (;;) {
+        std::shared_ptr<Job> job;
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            queue_cond.wait(guard, [this]() { return quit || !queue.empty(); });
+
+            if (quit) {
+                return;
+            }
+
+            job = queue.front();
+            queue.pop_front();
+        }
+
+        if (job->progress.cancel) {
+            emit cancelled(job->id, job->path);
+        } else {
+            std::ifstream inp(job->path.toUtf8().constData(), std::ios::binary);
+
+            if (!inp.is_open()) {
+                emit failed(job->id, job->path, QString("Could not open file: ") + QString(strerror(errno)));
+            } else {
+                AMC *amc = new AMC(job->asf);
+                emit started(job->id, job->path, static_cast<qulonglong>(reinterpret_cast<uintptr_t>(amc)));
+
+                try {
+                    TRACE_SCOPE("ClipLoader::load");
+                    amc->load_progressive(inp, &job->progress);
+                    emit loaded(job->id, job->path);
+                } catch (AMC::Cancelled &) {
+                    emit cancelled(job->id, job->path);
+                } catch (std::exception &e) {
+                    emit failed(job->id, job->path, QString(e.what()));
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.erase(job->id);
+    }
+}
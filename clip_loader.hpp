@@ -0,0 +1,72 @@
+#ifndef CLIP_LOADER_HPP
+#define CLIP_LOADER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+
+#include "amc.hpp"
+#include "asf.hpp"
+
+
+// Loads AMC files on a pool of worker threads. Results are delivered through
+// signals, which are queued into the receiver's (i.e. the GUI) thread.
+class ClipLoader:
+    public QObject
+{
+    Q_OBJECT
+
+    public:
+        ClipLoader(QObject *parent = nullptr);
+        // Cancels all loads still running
+        ~ClipLoader(void);
+
+        // Queues all files (largest first, so the total time is close to the
+        // time needed for the largest one); returns their load IDs in the
+        // same order as the given paths
+        std::vector<int> load(const QStringList &paths, ASF *asf);
+
+        void cancel(int id);
+
+        // Fraction of the file read so far (0 to 1)
+        float progress(int id);
+
+    signals:
+        // Emitted as soon as frames may start to arrive (see
+        // AMC::load_progressive()); the AMC pointer is passed as qulonglong
+        // (like the combobox item data). The receiver takes ownership of the
+        // AMC, even if loading fails or is cancelled afterwards (it then
+        // keeps the frames loaded so far).
+        void started(int id, QString path, qulonglong amc);
+        void loaded(int id, QString path);
+        void failed(int id, QString path, QString error);
+        void cancelled(int id, QString path);
+
+    private:
+        struct Job {
+            int id;
+            QString path;
+            ASF *asf;
+            size_t size = 0;
+            AMC::LoadProgress progress;
+        };
+
+        void work(void);
+
+        std::vector<std::thread> workers;
+        std::mutex lock;
+        std::condition_variable queue_cond;
+        std::deque<std::shared_ptr<Job>> queue;
+        std::map<int, std::shared_ptr<Job>> jobs;
+        int next_id = 0;
+        bool quit = false;
+};
+
+#endif
@@ -0,0 +1,208 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "clip_manager.hpp"
+#include "trace.hpp"
+
+
+ClipManager::ClipManager(size_t budget):
+    max_bytes(budget)
+{}
+
+
+ClipManager::~ClipManager(void)
+{
+    for (const Clip &clip: clips) {
+        if (!clip.cache_path.empty()) {
+            unlink(clip.cache_path.c_str());
+        }
+    }
+
+    if (!cache_dir.empty()) {
+        rmdir(cache_dir.c_str());
+    }
+}
+
+
+int ClipManager::add(const std::string &path, AMC *amc, ASF *asf)
+{
+    clips.emplace_back();
+
+    Clip &clip = clips.back();
+    clip.path = path;
+    clip.asf = asf;
+    clip.amc.reset(amc);
+    clip.bytes = amc->memory_size();
+    clip.last_use = ++use_counter;
+
+    bytes += clip.bytes;
+    evict();
+
+    return clips.size() - 1;
+}
+
+
+AMC *ClipManager::get(int id)
+{
+    if ((id < 0) || (id >= static_cast<int>(clips.size()))) {
+        throw std::range_error("Invalid clip ID");
+    }
+
+    Clip &clip = clips[id];
+    current = id;
+    clip.last_use = ++use_counter;
+
+    if (clip.amc) {
+        hit_count++;
+        return clip.amc.get();
+    }
+
+    miss_count++;
+
+    TRACE_SCOPE("ClipManager::reload");
+
+    // The cache file may have been lost (e.g. tmp cleaners), so fall back to
+    // the original file
+    const std::string *sources[] = {&clip.cache_path, &clip.path};
+    std::string error;
+
+    for (const std::string *source: sources) {
+        if (source->empty()) {
+            continue;
+        }
+
+        std::ifstream inp(*source, std::ios::binary);
+        if (!inp.is_open()) {
+            error = "Could not open " + *source + ": " + strerror(errno);
+            continue;
+        }
+
+        try {
+            clip.amc.reset(new AMC(inp, clip.asf));
+            break;
+        } catch (std::exception &e) {
+            error = "Could not load " + *source + ": " + e.what();
+        }
+    }
+
+    if (!clip.amc) {
+        throw std::runtime_error(error);
+    }
+
+    clip.bytes = clip.amc->memory_size();
+    bytes += clip.bytes;
+    evict();
+
+    return clip.amc.get();
+}
+
+
+bool ClipManager::merge_loaded_frames(void)
+{
+    bool current_changed = false;
+
+    for (size_t i = 0; i < clips.size(); i++) {
+        Clip &clip = clips[i];
+
+        if (clip.amc && clip.amc->merge_loaded_frames()) {
+            bytes -= clip.bytes;
+            clip.bytes = clip.amc->memory_size();
+            bytes += clip.bytes;
+
+            if (static_cast<int>(i) == current) {
+                current_changed = true;
+            }
+        }
+    }
+
+    evict();
+
+    return current_changed;
+}
+
+
+void ClipManager::set_budget(size_t budget)
+{
+    max_bytes = budget;
+    evict();
+}
+
+
+void ClipManager::evict(void)
+{
+    while (bytes > max_bytes) {
+        Clip *lru = nullptr;
+
+        for (size_t i = 0; i < clips.size(); i++) {
+            if ((static_cast<int>(i) != current) && clips[i].amc && !clips[i].amc->loading() &&
+                (!lru || (clips[i].last_use < lru->last_use)))
+            {
+                lru = &clips[i];
+            }
+        }
+
+        if (!lru) {
+            // Only the current clip is left, which must stay resident
+            break;
+        }
+
+        drop(*lru);
+    }
+}
+
+
+void ClipManager::drop(Clip &clip)
+{
+    // Frames loaded since the last merge would be lost otherwise
+    clip.amc->merge_loaded_frames();
+
+    if (clip.cache_path.empty()) {
+        if (cache_dir.empty()) {
+            const char *tmp = getenv("TMPDIR");
+            std::string tmp_template = std::string(tmp ? tmp : "/tmp") + "/cg2p2-clips-XXXXXX";
+            if (mkdtemp(&tmp_template[0])) {
+                cache_dir = tmp_template;
+            } else {
+                fprintf(stderr, "Warning: Could not create clip cache directory: %s\n", strerror(errno));
+            }
+        }
+
+        if (!cache_dir.empty()) {
+            std::string cache_path = cache_dir + "/" + std::to_string(&clip - clips.data()) + ".amcb";
+            std::ofstream out(cache_path, std::ios::binary);
+            bool written = false;
+
+            if (out.is_open()) {
+                try {
+                    clip.amc->write_binary(out);
+                    out.close();
+                    written = out.good();
+                } catch (std::runtime_error &) {
+                    // E.g. a full disk; the clip can still be reloaded
+                }
+            }
+
+            if (written) {
+                clip.cache_path = cache_path;
+            } else {
+                fprintf(stderr, "Warning: Could not write clip cache %s; will reload %s\n",
+                        cache_path.c_str(), clip.path.c_str());
+                unlink(cache_path.c_str());
+            }
+        }
+    }
+
+    clip.amc.reset();
+    bytes -= clip.bytes;
+    clip.bytes = 0;
+}
@@ -0,0 +1,70 @@
+#ifndef CLIP_MANAGER_HPP
+#define CLIP_MANAGER_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "amc.hpp"
+#include "asf.hpp"
+
+
+// Keeps the frame data of loaded clips within a memory budget. When it is
+// exceeded, the least recently used clips are written to a binary cache file
+// and dropped; they are transparently reloaded by get(). Clips which are
+// still being loaded progressively are never dropped.
+class ClipManager {
+    public:
+        ClipManager(size_t budget);
+        // Removes all cache files
+        ~ClipManager(void);
+
+        // Takes ownership of the AMC (which must have been loaded for the
+        // given ASF); path is used for reloading if there is no cache file.
+        // Returns the clip ID.
+        int add(const std::string &path, AMC *amc, ASF *asf);
+
+        // Returns the clip's AMC, reloading it if necessary. The returned
+        // clip is never evicted until another one is requested through
+        // get(). Throws an exception if reloading fails.
+        AMC *get(int id);
+
+        // Merges progressively loaded frames into all clips (see
+        // AMC::merge_loaded_frames()); returns true if the frames of the
+        // clip last returned by get() have changed
+        bool merge_loaded_frames(void);
+
+        const std::string &path(int id) const { return clips[id].path; }
+        bool resident(int id) const { return static_cast<bool>(clips[id].amc); }
+        size_t size(void) const { return clips.size(); }
+
+        size_t budget(void) const { return max_bytes; }
+        void set_budget(size_t bytes);
+
+        size_t resident_bytes(void) const { return bytes; }
+        unsigned long hits(void) const { return hit_count; }
+        unsigned long misses(void) const { return miss_count; }
+
+
+    private:
+        struct Clip {
+            std::string path, cache_path;
+            ASF *asf;
+            std::unique_ptr<AMC> amc;
+            size_t bytes = 0;
+            unsigned long last_use = 0;
+        };
+
+        void evict(void);
+        void drop(Clip &clip);
+
+        std::vector<Clip> clips;
+        std::string cache_dir;
+        int current = -1;
+
+        size_t max_bytes, bytes = 0;
+        unsigned long hit_count = 0, miss_count = 0, use_counter = 0;
+};
+
+#endif
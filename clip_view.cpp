@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "clip_view.hpp"
+
+
+using namespace dake::math;
+
+
+ClipView::ClipView(const std::shared_ptr<const AMC> &clip)
+{
+    asf = clip->skeleton();
+    ff = clip->first_frame();
+
+    if (!clip->frames().empty()) {
+        add_segment(Segment{clip, 0, 1, clip->frames().size(), 0});
+    }
+}
+
+
+ClipView::ClipView(const AMC &clip):
+    // Aliasing constructor without ownership
+    ClipView(std::shared_ptr<const AMC>(std::shared_ptr<const AMC>(), &clip))
+{}
+
+
+void ClipView::add_segment(const Segment &seg)
+{
+    if (!segments.empty()) {
+        Segment &last = segments.back();
+
+        if ((last.clip == seg.clip) && ((last.count == 1) || (last.stride == seg.stride)) &&
+            (last.begin + last.count * seg.stride == seg.begin))
+        {
+            last.stride = seg.stride;
+            last.count += seg.count;
+            frame_count += seg.count;
+            return;
+        }
+    }
+
+    segments.push_back(seg);
+    segments.back().start = frame_count;
+    frame_count += seg.count;
+}
+
+
+ClipView ClipView::slice(int first, size_t count, size_t stride) const
+{
+    if (!stride) {
+        throw std::invalid_argument("Clip view stride must not be 0");
+    }
+
+    ClipView view;
+    view.asf = asf;
+
+    // Index range in this view
+    long begin = std::max(0L, static_cast<long>(first) - ff);
+    if (static_cast<size_t>(begin) >= frame_count || !count) {
+        view.ff = first;
+        return view;
+    }
+    size_t end = begin + std::min(count, frame_count - begin);
+
+    view.ff = ff + begin;
+
+    auto it = std::upper_bound(segments.begin(), segments.end(), static_cast<size_t>(begin),
+                               [](size_t index, const Segment &seg) { return index < seg.start; }) - 1;
+
+    // Next index to take
+    size_t index = begin;
+    for (; (it != segments.end()) && (index < end); ++it) {
+        size_t seg_end = std::min(end, it->start + it->count);
+        if (index >= seg_end) {
+            continue;
+        }
+
+        size_t taken = (seg_end - index + stride - 1) / stride;
+        view.add_segment(Segment{it->clip, it->begin + (index - it->start) * it->stride, it->stride * stride, taken, 0});
+
+        index += taken * stride;
+    }
+
+    return view;
+}
+
+
+void ClipView::append(const ClipView &other)
+{
+    if (other.empty()) {
+        return;
+    }
+
+    if (empty()) {
+        asf = other.asf;
+        ff = other.ff;
+    } else if (asf != other.asf) {
+        throw std::invalid_argument("Cannot concatenate clip views of different skeletons");
+    }
+
+    for (const Segment &seg: other.segments) {
+        add_segment(seg);
+    }
+}
+
+
+ClipView ClipView::concat(const ClipView &other) const
+{
+    ClipView view(*this);
+    view.append(other);
+    return view;
+}
+
+
+const AMC::Frame &ClipView::frame(int frame) const
+{
+    if ((frame < ff) || (frame - ff >= static_cast<long>(frame_count))) {
+        throw std::range_error("Clip view frame out of bounds");
+    }
+
+    size_t index = frame - ff;
+    auto it = std::upper_bound(segments.begin(), segments.end(), index,
+                               [](size_t i, const Segment &seg) { return i < seg.start; }) - 1;
+
+    return it->clip->frames()[it->begin + (index - it->start) * it->stride];
+}
+
+
+vec3 ClipView::root_position(int frame) const
+{
+    return asf->root_position() + this->frame(frame).root_translation;
+}
+
+
+void ClipView::evaluate(int frame, mat4 *motion_trans) const
+{
+    AMC::evaluate(*asf, this->frame(frame), motion_trans);
+}
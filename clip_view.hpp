@@ -0,0 +1,78 @@
+#ifndef CLIP_VIEW_HPP
+#define CLIP_VIEW_HPP
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+
+
+// Sequence of frames taken from one or more clips (of the same skeleton)
+// without copying them: a view consists of segments, each a range of one
+// clip's frames with a stride. Slicing and concatenating views only copies
+// segments, never frames.
+//
+// Frames are numbered from first_frame() on like in an AMC, which is the
+// number of the first frame in the clip it comes from (for concatenations,
+// the first part's).
+//
+// Views of clips which are still being loaded only cover the frames merged
+// when the view was created.
+class ClipView {
+    public:
+        // Empty view
+        ClipView(void) {}
+
+        // All frames of the clip, which is kept alive by the view
+        ClipView(const std::shared_ptr<const AMC> &clip);
+
+        // Same, but the clip must outlive the view (and all views made from
+        // it)
+        ClipView(const AMC &clip);
+
+        // Every stride-th frame of the count frames starting at frame number
+        // first (clamped to this view)
+        ClipView slice(int first, size_t count, size_t stride = 1) const;
+
+        // This view's frames followed by the other view's
+        ClipView concat(const ClipView &other) const;
+        void append(const ClipView &other);
+
+        bool empty(void) const { return !frame_count; }
+        size_t size(void) const { return frame_count; }
+        int first_frame(void) const { return ff; }
+        size_t segment_count(void) const { return segments.size(); }
+
+        // nullptr for empty views
+        const ASF *skeleton(void) const { return asf; }
+
+        // Throw std::range_error for frames outside of the view
+        const AMC::Frame &frame(int frame) const;
+        dake::math::vec3 root_position(int frame) const;
+        void evaluate(int frame, dake::math::mat4 *motion_trans) const;
+
+
+    private:
+        struct Segment {
+            std::shared_ptr<const AMC> clip;
+            // Index into clip->frames() of the first frame, distance between
+            // two frames and number of frames
+            size_t begin, stride, count;
+            // Index of the first frame in the view
+            size_t start;
+        };
+
+        // Appends the segment (merging it into the last one if possible)
+        void add_segment(const Segment &seg);
+
+        const ASF *asf = nullptr;
+        int ff = 0;
+        size_t frame_count = 0;
+        std::vector<Segment> segments;
+};
+
+#endif
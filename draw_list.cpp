@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "asf.hpp"
+#include "draw_list.hpp"
+#include "frustum.hpp"
+
+
+using namespace dake::math;
+
+
+static const vec3 colors[] = {
+    vec3(.6f, .7f, 1.f),
+    vec3(1.f, .25f, 0.f),
+    vec3(.2f, 1.f, 0.f),
+    vec3(0.f, .25f, 1.f),
+    vec3(1.f, 1.f, 0.f),
+    vec3(1.f, 1.f, 1.f),
+    vec3(1.f, 0.f, .8f),
+    vec3(1.f, 0.f, 0.f)
+};
+
+
+void DrawList::clear(void)
+{
+    bones.clear();
+    tips.clear();
+    limits.clear();
+
+    stats = CullStats();
+}
+
+
+void DrawList::add_skeleton(const ASF &asf, const mat4 &proj, const mat4 &mv, const Options &opts)
+{
+    const std::vector<int> &order = asf.hierarchy_order();
+
+    for (size_t i = 0; i < order.size(); i++) {
+        int bi = order[i];
+        const ASF::Bone &bone = asf.bones()[bi];
+
+        if (bone.lod_skipped) {
+            stats.lod_bones += bone.subtree_size;
+            i += bone.subtree_size - 1;
+            continue;
+        }
+
+        if (bone.parent < 0) {
+            // root
+            continue;
+        }
+
+        if (opts.frustum && !opts.frustum->sphere_visible(bone.bound_center, bone.bound_radius)) {
+            stats.culled_bones++;
+            continue;
+        }
+
+        Bone draw;
+        draw.mv = mv * bone.motion_trans * bone.bone_dir_trans;
+        draw.nrm = mat3(draw.mv).transposed_inverse();
+        draw.length = bone.length;
+
+        if (opts.violating && (*opts.violating)[bi]) {
+            draw.color = bi == opts.picked ? vec3(1.f, .5f, .5f) : vec3(1.f, .1f, .1f);
+        } else if (opts.colliding && (*opts.colliding)[bi]) {
+            draw.color = bi == opts.picked ? vec3(1.f, .8f, .5f) : vec3(1.f, .55f, .05f);
+        } else if (bi == opts.picked) {
+            draw.color = .5f * colors[bone.depth % 8] + vec3(.5f, .5f, .5f);
+        } else {
+            draw.color = colors[bone.depth % 8];
+        }
+
+        bones.push_back(draw);
+        if (opts.tips) {
+            tips.push_back(draw);
+        } else {
+            stats.lod_bones++;
+        }
+
+        if (opts.limits) {
+            add_limits(bone, proj * mv * bone.still_trans * bone.local_trans, opts.offset_limits);
+        }
+    }
+}
+
+
+void DrawList::add_segment(const vec3 &from, const vec3 &to, const vec3 &color, const mat4 &mv, bool tip)
+{
+    vec3 dir(to - from);
+    float length = dir.length();
+    if (!(length > 0.f)) {
+        return;
+    }
+    dir /= length;
+
+    // Like ASF::Bone.bone_dir_trans
+    vec3 rot_axis(0.f, 0.f, 1.f);
+    float angle = acosf(std::max(-1.f, std::min(dir.y(), 1.f)));
+    if (fabsf(dir.y()) < 1.f) {
+        rot_axis = vec3(0.f, 1.f, 0.f).cross(dir);
+    }
+
+    Bone draw;
+    draw.mv = mv * mat4::identity().translated(from).rotated(angle, rot_axis);
+    draw.nrm = mat3(draw.mv).transposed_inverse();
+    draw.color = color;
+    draw.length = length;
+
+    bones.push_back(draw);
+    if (tip) {
+        tips.push_back(draw);
+    }
+}
+
+
+void DrawList::add_limits(const ASF::Bone &bone, const mat4 &mvp, bool offset_limits)
+{
+    for (const std::pair<const int, std::pair<float, float>> &dof: bone.dof) {
+        ASF::Axis axis = static_cast<ASF::Axis>(dof.first);
+        const std::pair<float, float> &limit = dof.second;
+
+        if ((axis != ASF::RX) && (axis != ASF::RY) && (axis != ASF::RZ)) {
+            continue;
+        }
+
+        Limit draw;
+        draw.mvp = mvp;
+
+        float a = limit.first, b = limit.second;
+
+        if (offset_limits) {
+            vec3 local_bone_dir = mat3(bone.local_trans_inv) * bone.direction;
+            vec2 projected_bone_dir;
+
+            switch (axis) {
+                case ASF::RX: projected_bone_dir = vec2(local_bone_dir.y(), local_bone_dir.z()); break;
+                case ASF::RY: projected_bone_dir = vec2(local_bone_dir.z(), local_bone_dir.x()); break;
+                case ASF::RZ: projected_bone_dir = vec2(local_bone_dir.y(), local_bone_dir.x()); break;
+                default: throw std::invalid_argument("Bad rotation axis");
+            }
+
+            if (projected_bone_dir.length() > .1f) {
+                float ofs = atan2f(projected_bone_dir.y(), projected_bone_dir.x());
+                a += ofs;
+                b += ofs;
+
+                draw.fadeout = .5f;
+            } else {
+                draw.fadeout = .2f;
+            }
+        } else {
+            draw.fadeout = .3f;
+        }
+
+        while (b < a) {
+            b += 2 * static_cast<float>(M_PI);
+        }
+
+        draw.axis = axis == ASF::RX ? vec3(1.f, 0.f, 0.f)
+                  : axis == ASF::RY ? vec3(0.f, 1.f, 0.f)
+                  :                   vec3(0.f, 0.f, 1.f);
+
+        draw.l1 = a;
+        draw.l2 = b;
+
+        limits.push_back(draw);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef DRAW_LIST_HPP
+#define DRAW_LIST_HPP
+
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "asf.hpp"
+#include "frustum.hpp"
+
+
+struct CullStats {
+    // Bones outside of the view frustum
+    int culled_bones = 0;
+    // Bones skipped or drawn without their tip due to their distance
+    int lod_bones = 0;
+};
+
+
+// Everything that needs to be drawn for a frame, grouped by shader program,
+// independently of OpenGL (RenderOutput just submits it)
+class DrawList {
+    public:
+        struct Bone {
+            dake::math::mat4 mv;
+            dake::math::mat3 nrm;
+            dake::math::vec3 color;
+            float length;
+        };
+
+        struct Limit {
+            dake::math::mat4 mvp;
+            dake::math::vec3 axis;
+            float l1, l2, fadeout;
+        };
+
+        struct Options {
+            // Bones outside of this frustum (given in ASF space) are culled
+            const Frustum *frustum = nullptr;
+            bool tips = true;
+            bool limits = false, offset_limits = false;
+            // Bone to highlight
+            int picked = -1;
+            // If given, bones set here are drawn in red (see JointLimits)
+            const std::vector<bool> *violating = nullptr;
+            // If given, bones set here are drawn in orange (see
+            // SelfCollisionReport), unless they are violating
+            const std::vector<bool> *colliding = nullptr;
+        };
+
+        void clear(void);
+
+        // Appends the ASF's current pose
+        void add_skeleton(const ASF &asf, const dake::math::mat4 &proj, const dake::math::mat4 &mv,
+                          const Options &opts);
+
+        // Appends a bone-like cylinder between two points (given in ASF
+        // space), with a tip at the second one if requested
+        void add_segment(const dake::math::vec3 &from, const dake::math::vec3 &to, const dake::math::vec3 &color,
+                         const dake::math::mat4 &mv, bool tip);
+
+        // Cylinders (bone_prg) and cones (cone_prg)
+        std::vector<Bone> bones, tips;
+        // Limit fans (limit_prg)
+        std::vector<Limit> limits;
+
+        CullStats stats;
+
+
+    private:
+        void add_limits(const ASF::Bone &bone, const dake::math::mat4 &mvp, bool offset_limits);
+};
+
+#endif
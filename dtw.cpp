@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "dtw.hpp"
+#include "parallel.hpp"
+#include "pose_index.hpp"
+#include "trace.hpp"
+
+
+using namespace dake::math;
+
+
+namespace
+{
+
+// feature_count floats per frame, and their squared norms
+struct Features {
+    size_t frames = 0;
+    std::vector<float> x, norms;
+};
+
+// Columns [lo[i], hi[i]) of row i are computed; their cells are stored from
+// offset[i] on
+struct Band {
+    std::vector<size_t> lo, hi, offset;
+};
+
+}
+
+
+static Features clip_features(const AMC &amc, const std::vector<std::string> &bone_names, unsigned thread_count)
+{
+    const ASF &asf = *amc.skeleton();
+    std::vector<int> bones;
+    for (const std::string &name: bone_names) {
+        int bi = asf.bone_index(name);
+        if (bi < 0) {
+            throw std::invalid_argument("Skeleton has no bone " + name + " (required for comparing poses)");
+        }
+        bones.push_back(bi);
+    }
+
+    size_t fc = 3 * bones.size();
+    Features f;
+    f.frames = amc.frames().size();
+    f.x.resize(f.frames * fc);
+    f.norms.resize(f.frames);
+
+    parallel_ranges(f.frames, [&](size_t first, size_t end) {
+        std::vector<mat4> trans(asf.bones().size());
+
+        for (size_t i = first; i < end; i++) {
+            float *x = &f.x[i * fc];
+            pose_features(asf, amc.frames()[i], bones, trans.data(), x);
+
+            float norm = 0.f;
+            for (size_t k = 0; k < fc; k++) {
+                norm += x[k] * x[k];
+            }
+            f.norms[i] = norm;
+        }
+    }, thread_count);
+
+    return f;
+}
+
+
+// Averages pairs of frames
+static Features downsample(const Features &f, size_t fc)
+{
+    Features d;
+    d.frames = (f.frames + 1) / 2;
+    d.x.resize(d.frames * fc);
+    d.norms.resize(d.frames);
+
+    for (size_t i = 0; i < d.frames; i++) {
+        const float *x0 = &f.x[2 * i * fc];
+        const float *x1 = 2 * i + 1 < f.frames ? x0 + fc : x0;
+        float *x = &d.x[i * fc];
+
+        float norm = 0.f;
+        for (size_t k = 0; k < fc; k++) {
+            x[k] = .5f * (x0[k] + x1[k]);
+            norm += x[k] * x[k];
+        }
+        d.norms[i] = norm;
+    }
+
+    return d;
+}
+
+
+static void finish_band(Band &band, size_t rows, size_t cols)
+{
+    // Rows must not start before the previous one (nor end before it), and
+    // must reach the corners
+    band.lo[0] = 0;
+    band.hi[rows - 1] = cols;
+    for (size_t i = 1; i < rows; i++) {
+        band.hi[i] = std::max(band.hi[i], band.hi[i - 1]);
+    }
+    for (size_t i = rows - 1; i-- > 0;) {
+        band.lo[i] = std::min(band.lo[i], band.lo[i + 1]);
+    }
+
+    band.offset.resize(rows + 1);
+    band.offset[0] = 0;
+    for (size_t i = 0; i < rows; i++) {
+        band.offset[i + 1] = band.offset[i] + band.hi[i] - band.lo[i];
+    }
+}
+
+
+// Band around a path found for both sequences downsampled by two
+static Band project_path(const std::vector<std::pair<size_t, size_t>> &coarse, size_t rows, size_t cols, size_t radius)
+{
+    std::vector<size_t> path_lo(rows, cols), path_hi(rows, 0);
+    for (const auto &cell: coarse) {
+        for (size_t i = 2 * cell.first; i < std::min(2 * cell.first + 2, rows); i++) {
+            path_lo[i] = std::min(path_lo[i], 2 * cell.second);
+            path_hi[i] = std::max(path_hi[i], std::min(2 * cell.second + 2, cols));
+        }
+    }
+
+    Band band;
+    band.lo.resize(rows);
+    band.hi.resize(rows);
+
+    for (size_t i = 0; i < rows; i++) {
+        size_t lo = cols, hi = 0;
+        for (size_t k = i > radius ? i - radius : 0; k < std::min(i + radius + 1, rows); k++) {
+            lo = std::min(lo, path_lo[k]);
+            hi = std::max(hi, path_hi[k]);
+        }
+
+        band.lo[i] = lo > radius ? lo - radius : 0;
+        band.hi[i] = std::min(hi + radius, cols);
+    }
+
+    finish_band(band, rows, cols);
+    return band;
+}
+
+
+// Cumulative costs within the band, and the cheapest path through them
+// (from (0, 0) to (rows - 1, cols - 1))
+static std::vector<std::pair<size_t, size_t>> band_dtw(const Features &a, const Features &b, size_t fc,
+                                                       const Band &band, double &total, uint64_t &cells)
+{
+    size_t rows = a.frames, cols = b.frames;
+
+    // Transposed, so the cost loop runs over contiguous columns
+    std::vector<float> bt(fc * cols);
+    for (size_t j = 0; j < cols; j++) {
+        for (size_t k = 0; k < fc; k++) {
+            bt[k * cols + j] = b.x[j * fc + k];
+        }
+    }
+
+    std::vector<float> d(band.offset[rows]);
+    std::vector<float> diag;
+
+    for (size_t i = 0; i < rows; i++) {
+        size_t lo = band.lo[i], width = band.hi[i] - lo;
+        float *row = &d[band.offset[i]];
+        const float *x = &a.x[i * fc];
+
+        // Local costs (euclidean distances)
+        std::fill(row, row + width, 0.f);
+        for (size_t k = 0; k < fc; k++) {
+            float xk = x[k];
+            const float *y = &bt[k * cols + lo];
+            for (size_t j = 0; j < width; j++) {
+                row[j] += xk * y[j];
+            }
+        }
+
+        float xn = a.norms[i];
+        const float *yn = &b.norms[lo];
+        for (size_t j = 0; j < width; j++) {
+            row[j] = sqrtf(std::max(xn + yn[j] - 2.f * row[j], 0.f));
+        }
+
+        if (!i) {
+            for (size_t j = 1; j < width; j++) {
+                row[j] += row[j - 1];
+            }
+            continue;
+        }
+
+        // Best of the diagonal and vertical predecessors (from the previous
+        // row), vectorizable where both exist
+        size_t plo = band.lo[i - 1], phi = band.hi[i - 1];
+        const float *prev = &d[band.offset[i - 1]] - plo;
+
+        diag.assign(width, HUGE_VALF);
+        size_t both_lo = std::max(lo, plo + 1), both_hi = std::min(band.hi[i], phi);
+        for (size_t j = both_lo; j < both_hi; j++) {
+            diag[j - lo] = std::min(prev[j - 1], prev[j]);
+        }
+        for (size_t j = lo; j < band.hi[i]; j++) {
+            if ((j >= both_lo) && (j < both_hi)) {
+                continue;
+            }
+
+            float best = HUGE_VALF;
+            if ((j > plo) && (j - 1 < phi)) {
+                best = prev[j - 1];
+            }
+            if ((j >= plo) && (j < phi)) {
+                best = std::min(best, prev[j]);
+            }
+            diag[j - lo] = best;
+        }
+
+        // The horizontal predecessor is a serial dependency
+        row[0] += diag[0];
+        for (size_t j = 1; j < width; j++) {
+            row[j] += std::min(diag[j], row[j - 1]);
+        }
+    }
+
+    cells += d.size();
+
+    auto at = [&](size_t i, size_t j) {
+        return (j >= band.lo[i]) && (j < band.hi[i]) ? d[band.offset[i] + j - band.lo[i]] : HUGE_VALF;
+    };
+
+    total = at(rows - 1, cols - 1);
+
+    std::vector<std::pair<size_t, size_t>> path;
+    size_t i = rows - 1, j = cols - 1;
+    path.emplace_back(i, j);
+
+    while (i || j) {
+        float best = HUGE_VALF;
+        size_t bi = i, bj = j;
+
+        if (i && j && (at(i - 1, j - 1) < best)) {
+            best = at(i - 1, j - 1);
+            bi = i - 1;
+            bj = j - 1;
+        }
+        if (i && (at(i - 1, j) < best)) {
+            best = at(i - 1, j);
+            bi = i - 1;
+            bj = j;
+        }
+        if (j && (at(i, j - 1) < best)) {
+            best = at(i, j - 1);
+            bi = i;
+            bj = j - 1;
+        }
+
+        if ((bi == i) && (bj == j)) {
+            throw std::runtime_error("DTW band is not connected");
+        }
+
+        i = bi;
+        j = bj;
+        path.emplace_back(i, j);
+    }
+
+    std::reverse(path.begin(), path.end());
+    return path;
+}
+
+
+static std::vector<std::pair<size_t, size_t>> fast_dtw(const Features &a, const Features &b, size_t fc, size_t radius,
+                                                       double &total, uint64_t &cells)
+{
+    Band band;
+
+    if ((a.frames <= radius + 2) || (b.frames <= radius + 2)) {
+        band.lo.assign(a.frames, 0);
+        band.hi.assign(a.frames, b.frames);
+        finish_band(band, a.frames, b.frames);
+    } else {
+        double coarse_total;
+        std::vector<std::pair<size_t, size_t>> coarse(fast_dtw(downsample(a, fc), downsample(b, fc), fc, radius,
+                                                               coarse_total, cells));
+        band = project_path(coarse, a.frames, b.frames, radius);
+    }
+
+    return band_dtw(a, b, fc, band, total, cells);
+}
+
+
+DTWAlignment align_clips(const AMC &a, const AMC &b, const DTWOptions &opts)
+{
+    if (a.frames().empty() || b.frames().empty()) {
+        throw std::invalid_argument("Cannot align empty clips");
+    }
+
+    TRACE_SCOPE("align_clips");
+
+    auto start = std::chrono::steady_clock::now();
+    const ASF &reference = *a.skeleton();
+
+    std::vector<std::string> bone_names;
+    for (int bi: pose_feature_bones(reference)) {
+        bone_names.push_back(reference.bones()[bi].name);
+    }
+    size_t fc = 3 * bone_names.size();
+
+    Features fa(clip_features(a, bone_names, opts.threads));
+    Features fb(clip_features(b, bone_names, opts.threads));
+
+    DTWAlignment result;
+    double total;
+    std::vector<std::pair<size_t, size_t>> path(fast_dtw(fa, fb, fc, std::max(opts.radius, 0), total,
+                                                         result.cells));
+
+    result.path.reserve(path.size());
+    result.partner.resize(a.frames().size());
+
+    for (size_t k = 0; k < path.size();) {
+        // All steps matching this frame of a
+        size_t end = k;
+        while ((end < path.size()) && (path[end].first == path[k].first)) {
+            result.path.emplace_back(a.first_frame() + path[end].first, b.first_frame() + path[end].second);
+            end++;
+        }
+
+        result.partner[path[k].first] = b.first_frame() + path[(k + end - 1) / 2].second;
+        k = end;
+    }
+
+    result.cost = total / path.size() / sqrt(static_cast<double>(bone_names.size()));
+    result.seconds = seconds_since(start);
+
+    return result;
+}
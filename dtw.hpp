@@ -0,0 +1,42 @@
+#ifndef DTW_HPP
+#define DTW_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "amc.hpp"
+
+
+struct DTWOptions {
+    // At every level but the coarsest, only cells within this many frames
+    // of the path found on the next coarser level are computed
+    int radius = 16;
+    // For computing the pose features; 0 means one per hardware thread
+    unsigned threads = 0;
+};
+
+struct DTWAlignment {
+    // Pairs of frame numbers (of the first and the second clip) from both
+    // first frames to both last frames; every step advances either frame
+    // or both
+    std::vector<std::pair<int, int>> path;
+    // For every frame of the first clip, the frame of the second one
+    // matched to it (the middle one if there are several)
+    std::vector<int> partner;
+    // Mean RMS distance of the bone ends along the path (in meters)
+    float cost = 0.f;
+    // Cost matrix cells computed (on all levels)
+    uint64_t cells = 0;
+    double seconds = 0.;
+};
+
+// Dynamic time warping between the pose features (see PoseIndex) of two
+// clips (the second one's skeleton must contain all bones of the first).
+// Like FastDTW, the alignment is first found for clips downsampled by
+// powers of two, and then refined within a band around the coarser path at
+// each finer level, so time and memory are linear in the clip lengths.
+DTWAlignment align_clips(const AMC &a, const AMC &b, const DTWOptions &opts = DTWOptions());
+
+#endif
@@ -0,0 +1,46 @@
+#include <cmath>
+#include <dake/math/matrix.hpp>
+
+#include "frustum.hpp"
+
+
+using namespace dake::math;
+
+
+Frustum::Frustum(const mat4 &mvp)
+{
+    mat4 t(mvp.transposed());
+
+    vec4 rows[4];
+    for (int i = 0; i < 4; i++) {
+        vec4 unit(0.f, 0.f, 0.f, 0.f);
+        unit[i] = 1.f;
+        rows[i] = t * unit;
+    }
+
+    // left, right, bottom, top, near, far
+    for (int i = 0; i < 3; i++) {
+        planes[2 * i    ] = rows[3] + rows[i];
+        planes[2 * i + 1] = rows[3] - rows[i];
+    }
+
+    for (vec4 &plane: planes) {
+        float len = vec3(plane.x(), plane.y(), plane.z()).length();
+        if (len > 0.f) {
+            plane /= len;
+        }
+    }
+}
+
+
+bool Frustum::sphere_visible(const vec3 &center, float radius) const
+{
+    for (const vec4 &plane: planes) {
+        float dist = plane.x() * center.x() + plane.y() * center.y() + plane.z() * center.z() + plane.w();
+        if (dist < -radius) {
+            return false;
+        }
+    }
+
+    return true;
+}
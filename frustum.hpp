@@ -0,0 +1,20 @@
+#ifndef FRUSTUM_HPP
+#define FRUSTUM_HPP
+
+#include <dake/math/matrix.hpp>
+
+
+class Frustum {
+    public:
+        // Extracts the six clipping planes from a combined projection and
+        // modelview matrix; the planes are then given in model space
+        Frustum(const dake::math::mat4 &mvp);
+
+        bool sphere_visible(const dake::math::vec3 &center, float radius) const;
+
+
+    private:
+        dake::math::vec4 planes[6];
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include <dake/gl/gl.hpp>
+
+#include <cstdint>
+#include <cstdio>
+
+#include "gpu_timer.hpp"
+#include "trace.hpp"
+
+
+GpuTimer::GpuTimer(void)
+{
+    // Clear errors from elsewhere
+    while (glGetError() != GL_NO_ERROR);
+
+    GLint bits = 0;
+    glGetQueryiv(GL_TIME_ELAPSED, GL_QUERY_COUNTER_BITS, &bits);
+    if ((glGetError() != GL_NO_ERROR) || !bits) {
+        fprintf(stderr, "Warning: No GPU timer queries available, GPU passes will not be timed\n");
+        return;
+    }
+
+    glGenQueries(sets * max_passes, queries[0]);
+    if (glGetError() != GL_NO_ERROR) {
+        fprintf(stderr, "Warning: Could not create GPU timer queries, GPU passes will not be timed\n");
+        return;
+    }
+
+    supported = true;
+    track = trace_add_track("GPU");
+}
+
+
+GpuTimer::~GpuTimer(void)
+{
+    if (supported) {
+        glDeleteQueries(sets * max_passes, queries[0]);
+    }
+}
+
+
+void GpuTimer::begin_frame(void)
+{
+    if (!supported) {
+        return;
+    }
+
+    if (running) {
+        end();
+    }
+
+    current = (current + 1) % sets;
+
+    for (int i = 0; i < used[current]; i++) {
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(queries[current][i], GL_QUERY_RESULT_AVAILABLE, &available);
+
+        if (!available) {
+            dropped_count++;
+            continue;
+        }
+
+        GLuint64 elapsed;
+        glGetQueryObjectui64v(queries[current][i], GL_QUERY_RESULT, &elapsed);
+
+        const Pass &pass = passes[current][i];
+        trace_record(track, pass.name, pass.cpu_start, pass.cpu_start + elapsed);
+    }
+
+    used[current] = 0;
+    active = tracing();
+}
+
+
+void GpuTimer::begin(const char *pass)
+{
+    if (!active || running || (used[current] >= max_passes)) {
+        return;
+    }
+
+    passes[current][used[current]] = Pass{pass, trace_clock()};
+    glBeginQuery(GL_TIME_ELAPSED, queries[current][used[current]]);
+    running = true;
+}
+
+
+void GpuTimer::end(void)
+{
+    if (!running) {
+        return;
+    }
+
+    glEndQuery(GL_TIME_ELAPSED);
+    used[current]++;
+    running = false;
+}
@@ -0,0 +1,78 @@
+#ifndef GPU_TIMER_HPP
+#define GPU_TIMER_HPP
+
+#include <dake/gl/gl.hpp>
+
+#include <cstdint>
+
+
+// Times render passes on the GPU with GL_TIME_ELAPSED queries. Every frame
+// uses its own set out of a ring of query sets, and a set's results are only
+// read back when it is about to be reused a few frames later, so this never
+// stalls the pipeline (results still not available by then are dropped).
+//
+// Results are recorded on the trace track "GPU" (see trace.hpp), starting at
+// the CPU time the pass was submitted. Queries are only issued while tracing
+// is enabled, and not at all if the GL cannot do timer queries (software
+// implementations may report 0 counter bits).
+class GpuTimer {
+    public:
+        // Both need the GL context to be current
+        GpuTimer(void);
+        ~GpuTimer(void);
+
+        bool available(void) const { return supported; }
+
+        // Collects the results of the oldest set; call at the start of every
+        // frame
+        void begin_frame(void);
+
+        // Passes cannot be nested
+        void begin(const char *pass);
+        void end(void);
+
+        // Number of results which were not available in time
+        unsigned long dropped(void) const { return dropped_count; }
+
+
+    private:
+        static const int sets = 4, max_passes = 16;
+
+        struct Pass {
+            const char *name;
+            uint64_t cpu_start;
+        };
+
+        GLuint queries[sets][max_passes];
+        Pass passes[sets][max_passes];
+        int used[sets] = {0};
+
+        int current = 0, track = -1;
+        bool supported = false, active = false, running = false;
+        unsigned long dropped_count = 0;
+};
+
+
+// Times the enclosing scope (if a timer is given)
+class GpuTimerScope {
+    public:
+        GpuTimerScope(GpuTimer *gpu_timer, const char *pass):
+            timer(gpu_timer)
+        {
+            if (timer) {
+                timer->begin(pass);
+            }
+        }
+
+        ~GpuTimerScope(void)
+        {
+            if (timer) {
+                timer->end();
+            }
+        }
+
+    private:
+        GpuTimer *timer;
+};
+
+#endif
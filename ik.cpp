@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "ik.hpp"
+#include "joint_limits.hpp"
+#include "parallel.hpp"
+
+
+using namespace dake::math;
+
+
+static vec3 unit_axis(ASF::Axis axis)
+{
+    switch (axis) {
+        case ASF::RX: return vec3(1.f, 0.f, 0.f);
+        case ASF::RY: return vec3(0.f, 1.f, 0.f);
+        case ASF::RZ: return vec3(0.f, 0.f, 1.f);
+        default: throw std::invalid_argument("Bad rotation axis");
+    }
+}
+
+
+static float &angle(AMC::Transformation &trans, ASF::Axis axis)
+{
+    switch (axis) {
+        case ASF::RX: return trans.rx;
+        case ASF::RY: return trans.ry;
+        case ASF::RZ: return trans.rz;
+        default: throw std::invalid_argument("Bad rotation axis");
+    }
+}
+
+
+static vec3 xyz(const vec4 &v)
+{
+    return vec3(v.x(), v.y(), v.z());
+}
+
+
+// Rotates v around the unit vector axis (Rodrigues)
+static vec3 rotate_around(const vec3 &v, const vec3 &axis, float angle)
+{
+    float c = cosf(angle), s = sinf(angle);
+    return c * v + s * axis.cross(v) + ((1.f - c) * axis.dot(v)) * axis;
+}
+
+
+IKSolver::IKSolver(const ASF &skeleton):
+    asf(&skeleton),
+    limits(skeleton)
+{
+}
+
+
+void IKSolver::chain_transforms(const AMC::Frame &frame, const std::vector<int> &chain, mat4 *base_trans,
+                                mat4 *motion_trans) const
+{
+    for (int b: chain) {
+        base_trans[b] = AMC::still_transform(*asf, frame, b, motion_trans);
+        motion_trans[b] = AMC::motion_transform(asf->bones()[b], frame.transformations[b], base_trans[b]);
+    }
+}
+
+
+IKResult IKSolver::solve(AMC::Frame &frame, const std::vector<IKGoal> &goals, const IKOptions &opts) const
+{
+    const std::vector<ASF::Bone> &bones = asf->bones();
+    const std::vector<float> &lo = limits.lower(), &hi = limits.upper();
+
+    if (frame.transformations.size() < bones.size()) {
+        frame.transformations.resize(bones.size());
+    }
+
+    // Depth of all bones between the root and an end effector, and the goals
+    // every bone may turn for
+    std::vector<int> depth(bones.size(), -1);
+    std::vector<std::vector<int>> joint_goals(bones.size());
+    std::vector<int> path;
+
+    for (size_t g = 0; g < goals.size(); g++) {
+        if ((goals[g].bone < 0) || (goals[g].bone >= static_cast<int>(bones.size()))) {
+            throw std::invalid_argument("Bad IK end effector");
+        }
+
+        path.clear();
+        for (int b = goals[g].bone; b >= 0; b = bones[b].parent) {
+            path.push_back(b);
+        }
+        if (path.back() != asf->root_index()) {
+            throw std::invalid_argument("IK end effector is not connected to the root");
+        }
+
+        // path runs from the end effector to the root, which never turns
+        size_t chain = path.size() - 1;
+        if (opts.chain_length > 0) {
+            chain = std::min<size_t>(chain, opts.chain_length);
+        }
+
+        for (size_t i = 0; i < path.size(); i++) {
+            depth[path[i]] = path.size() - 1 - i;
+            if (i < chain) {
+                joint_goals[path[i]].push_back(g);
+            }
+        }
+    }
+
+    // nodes are evaluated parents first, joints are turned children first
+    std::vector<int> nodes, joints;
+    for (size_t b = 0; b < bones.size(); b++) {
+        if (depth[b] >= 0) {
+            nodes.push_back(b);
+        }
+        if (!joint_goals[b].empty()) {
+            joints.push_back(b);
+        }
+    }
+    std::stable_sort(nodes.begin(), nodes.end(), [&](int x, int y) { return depth[x] < depth[y]; });
+    std::stable_sort(joints.begin(), joints.end(), [&](int x, int y) { return depth[x] > depth[y]; });
+
+    std::vector<mat4> base(bones.size()), motion(bones.size());
+    std::vector<vec3> ends(goals.size());
+    IKResult result;
+
+    for (;;) {
+        chain_transforms(frame, nodes, base.data(), motion.data());
+
+        result.error = 0.f;
+        for (size_t g = 0; g < goals.size(); g++) {
+            const ASF::Bone &bone = bones[goals[g].bone];
+            vec3 tip(bone.length * bone.direction);
+
+            ends[g] = xyz(motion[goals[g].bone] * vec4(tip.x(), tip.y(), tip.z(), 1.f));
+            result.error = std::max(result.error, (ends[g] - goals[g].target).length());
+        }
+
+        if (result.error <= opts.tolerance) {
+            result.converged = true;
+            break;
+        }
+        if (result.iterations >= opts.max_iterations) {
+            break;
+        }
+        result.iterations++;
+
+        // A joint's ancestors only turn after it, so its base transformation
+        // stays valid during the sweep; the end points are moved along
+        for (int b: joints) {
+            const ASF::Bone &bone = bones[b];
+            AMC::Transformation &trans = frame.transformations[b];
+
+            // Rotations outside of the one being turned (see
+            // AMC::evaluate()); the joint is the origin of base
+            mat4 outer(base[b] * bone.local_trans);
+            vec3 joint(xyz(base[b] * vec4(0.f, 0.f, 0.f, 1.f)));
+
+            for (auto it = bone.axis_order.rbegin(); it != bone.axis_order.rend(); ++it) {
+                ASF::Axis axis = *it;
+
+                if (bone.dof.count(axis)) {
+                    vec3 unit(unit_axis(axis));
+                    vec3 a(xyz(outer * vec4(unit.x(), unit.y(), unit.z(), 0.f)));
+                    a /= a.length();
+
+                    // The angle minimizing the summed squared distances of
+                    // all end points below to their targets
+                    float sin_sum = 0.f, cos_sum = 0.f;
+                    for (int g: joint_goals[b]) {
+                        vec3 u(ends[g] - joint), v(goals[g].target - joint);
+                        u -= u.dot(a) * a;
+                        v -= v.dot(a) * a;
+
+                        sin_sum += a.dot(u.cross(v));
+                        cos_sum += u.dot(v);
+                    }
+
+                    if (fabsf(sin_sum) + fabsf(cos_sum) > 1e-12f) {
+                        float turned = angle(trans, axis) + atan2f(sin_sum, cos_sum);
+
+                        if (opts.respect_limits) {
+                            turned = std::max(lo[3 * b + axis], std::min(turned, hi[3 * b + axis]));
+                        }
+
+                        for (int g: joint_goals[b]) {
+                            ends[g] = joint + rotate_around(ends[g] - joint, a, turned - angle(trans, axis));
+                        }
+                        angle(trans, axis) = turned;
+                    }
+                }
+
+                outer.rotate(angle(trans, axis), unit_axis(axis));
+            }
+        }
+    }
+
+    return result;
+}
+
+
+void solve_ik_batch(std::vector<IKProblem> &problems, const IKOptions &opts, unsigned thread_count)
+{
+    parallel_ranges(problems.size(), [&](size_t first, size_t end) {
+        for (size_t i = first; i < end; i++) {
+            IKProblem &p = problems[i];
+            p.result = p.solver->solve(*p.frame, p.goals, opts);
+        }
+    }, thread_count);
+}
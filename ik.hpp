@@ -0,0 +1,79 @@
+#ifndef IK_HPP
+#define IK_HPP
+
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "joint_limits.hpp"
+
+
+struct IKGoal {
+    // The end point of this bone is pulled towards the target (given in ASF
+    // space, like the bone transformations)
+    int bone;
+    dake::math::vec3 target;
+};
+
+struct IKOptions {
+    // Done once all end points are this close to their targets (in meters)
+    float tolerance = .001f;
+    int max_iterations = 32;
+    // Number of bones (starting with the end effector's) which may rotate
+    // per goal; 0 means all of them up to the root (which never moves)
+    int chain_length = 0;
+    bool respect_limits = true;
+};
+
+struct IKResult {
+    // Largest remaining distance of an end point to its target
+    float error = 0.f;
+    int iterations = 0;
+    bool converged = false;
+};
+
+
+// Cyclic coordinate descent directly on the Euler angle channels of AMC
+// frames: every rotation DOF of the chains is turned on its own (children
+// before their parents, and within a bone the outermost rotation first) so
+// the end points below come as close to their targets as possible, clamped
+// into the DOF's limits. Solved frames can thus be written as AMC data as
+// they are.
+class IKSolver {
+    public:
+        IKSolver(const ASF &asf);
+
+        const ASF *skeleton(void) const { return asf; }
+
+        // Goals sharing bones are solved together (in the least squares sense)
+        IKResult solve(AMC::Frame &frame, const std::vector<IKGoal> &goals,
+                       const IKOptions &opts = IKOptions()) const;
+
+
+    private:
+        // Motion transformations of the chain's bones (parents first, starting
+        // with the root) into motion_trans, and the transformations they are
+        // based on (see AMC::evaluate()) into base_trans; both are indexed
+        // like ASF.bones
+        void chain_transforms(const AMC::Frame &frame, const std::vector<int> &chain,
+                              dake::math::mat4 *base_trans, dake::math::mat4 *motion_trans) const;
+
+        const ASF *asf;
+        JointLimits limits;
+};
+
+
+struct IKProblem {
+    const IKSolver *solver;
+    AMC::Frame *frame;
+    std::vector<IKGoal> goals;
+    IKResult result;
+};
+
+// Solves independent problems (e.g. the chains of many characters) on
+// multiple threads (0 means one per hardware thread)
+void solve_ik_batch(std::vector<IKProblem> &problems, const IKOptions &opts = IKOptions(),
+                    unsigned thread_count = 0);
+
+#endif
@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "joint_limits.hpp"
+#include "parallel.hpp"
+
+
+static_assert(sizeof(AMC::Transformation) == 3 * sizeof(float),
+              "Transformations must be plain float triples for vectorized limit checks");
+
+
+JointLimits::JointLimits(const ASF &skeleton):
+    asf(&skeleton),
+    lo(3 * skeleton.bones().size(), -HUGE_VALF),
+    hi(3 * skeleton.bones().size(), HUGE_VALF)
+{
+    const std::vector<ASF::Bone> &bones = asf->bones();
+
+    for (size_t bi = 0; bi < bones.size(); bi++) {
+        if (static_cast<int>(bi) == asf->root_index()) {
+            continue;
+        }
+
+        for (const auto &dof: bones[bi].dof) {
+            int axis = dof.first;
+            if ((axis != ASF::RX) && (axis != ASF::RY) && (axis != ASF::RZ)) {
+                continue;
+            }
+
+            lo[3 * bi + axis] = dof.second.first;
+            hi[3 * bi + axis] = dof.second.second;
+        }
+    }
+}
+
+
+int JointLimits::check(const AMC::Frame &frame, std::vector<bool> *violating) const
+{
+    const float *__restrict v = reinterpret_cast<const float *>(frame.transformations.data());
+    const float *__restrict l = lo.data();
+    const float *__restrict h = hi.data();
+    size_t n = std::min(lo.size(), 3 * frame.transformations.size());
+
+    // Branch-free, so it gets vectorized
+    int count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += (v[i] < l[i]) | (v[i] > h[i]);
+    }
+
+    if (violating) {
+        violating->assign(asf->bones().size(), false);
+
+        if (count) {
+            for (size_t i = 0; i < n; i++) {
+                if ((v[i] < l[i]) || (v[i] > h[i])) {
+                    (*violating)[i / 3] = true;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+
+void JointLimits::clamp(AMC::Frame &frame) const
+{
+    float *__restrict v = reinterpret_cast<float *>(frame.transformations.data());
+    const float *__restrict l = lo.data();
+    const float *__restrict h = hi.data();
+    size_t n = std::min(lo.size(), 3 * frame.transformations.size());
+
+    for (size_t i = 0; i < n; i++) {
+        float x = v[i] < l[i] ? l[i] : v[i];
+        v[i] = x > h[i] ? h[i] : x;
+    }
+}
+
+
+// Scans frames [begin, end); runs still open at the end are closed there
+static void scan_range(const AMC &amc, const JointLimits &limits, AMC *clamp_amc, size_t begin, size_t end,
+                       std::vector<LimitViolation> &out)
+{
+    const std::vector<float> &lo = limits.lower(), &hi = limits.upper();
+    size_t channels = lo.size();
+
+    // Index into out of the open run of every channel (or -1)
+    std::vector<long> open(channels, -1);
+    std::vector<size_t> open_channels;
+
+    for (size_t fi = begin; fi < end; fi++) {
+        const AMC::Frame &frame = amc.frames()[fi];
+        int frame_number = amc.first_frame() + fi;
+
+        int count = limits.check(frame);
+
+        if (count || !open_channels.empty()) {
+            const float *v = reinterpret_cast<const float *>(frame.transformations.data());
+            size_t n = std::min(channels, 3 * frame.transformations.size());
+
+            // Close runs which have ended
+            for (size_t k = 0; k < open_channels.size();) {
+                size_t c = open_channels[k];
+                if ((c < n) && ((v[c] < lo[c]) || (v[c] > hi[c]))) {
+                    k++;
+                } else {
+                    open[c] = -1;
+                    open_channels[k] = open_channels.back();
+                    open_channels.pop_back();
+                }
+            }
+
+            if (count) {
+                for (size_t c = 0; c < n; c++) {
+                    float excess = std::max(lo[c] - v[c], v[c] - hi[c]);
+                    if (!(excess > 0.f)) {
+                        continue;
+                    }
+
+                    if (open[c] < 0) {
+                        open[c] = out.size();
+                        open_channels.push_back(c);
+                        out.push_back(LimitViolation{static_cast<int>(c / 3), static_cast<ASF::Axis>(c % 3),
+                                                     frame_number, frame_number, excess});
+                    } else {
+                        LimitViolation &run = out[open[c]];
+                        run.last_frame = frame_number;
+                        run.max_excess = std::max(run.max_excess, excess);
+                    }
+                }
+
+                if (clamp_amc) {
+                    limits.clamp(clamp_amc->mutable_frames()[fi]);
+                }
+            }
+        }
+    }
+}
+
+
+static std::vector<LimitViolation> scan(const AMC &amc, AMC *clamp_amc, unsigned thread_count)
+{
+    JointLimits limits(*amc.skeleton());
+    size_t frame_count = amc.frames().size();
+
+    if (!thread_count) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // Not worth a thread for small clips
+    thread_count = std::max<size_t>(1, std::min<size_t>(thread_count, frame_count / 4096));
+
+    std::vector<std::vector<LimitViolation>> parts(thread_count);
+
+    parallel_ranges(thread_count, [&](size_t first_part, size_t end_part) {
+        for (size_t p = first_part; p < end_part; p++) {
+            scan_range(amc, limits, clamp_amc, frame_count * p / thread_count, frame_count * (p + 1) / thread_count,
+                       parts[p]);
+        }
+    }, thread_count);
+
+    // Join runs which continue across part boundaries
+    std::vector<LimitViolation> result;
+    std::vector<long> ending(limits.lower().size());
+
+    for (size_t p = 0; p < parts.size(); p++) {
+        int boundary = amc.first_frame() + static_cast<int>(frame_count * p / thread_count);
+
+        // Runs reaching the boundary, per channel
+        std::fill(ending.begin(), ending.end(), -1);
+        for (size_t i = 0; i < result.size(); i++) {
+            if (result[i].last_frame == boundary - 1) {
+                ending[3 * result[i].bone + result[i].axis] = i;
+            }
+        }
+
+        for (const LimitViolation &v: parts[p]) {
+            long prev = v.first_frame == boundary ? ending[3 * v.bone + v.axis] : -1;
+
+            if (prev >= 0) {
+                result[prev].last_frame = v.last_frame;
+                result[prev].max_excess = std::max(result[prev].max_excess, v.max_excess);
+            } else {
+                result.push_back(v);
+            }
+        }
+    }
+
+    std::stable_sort(result.begin(), result.end(),
+                     [](const LimitViolation &a, const LimitViolation &b) { return a.first_frame < b.first_frame; });
+
+    return result;
+}
+
+
+std::vector<LimitViolation> scan_limits(AMC &amc, bool clamp, unsigned thread_count)
+{
+    return scan(amc, clamp ? &amc : nullptr, thread_count);
+}
+
+
+std::vector<LimitViolation> scan_limits(const AMC &amc, unsigned thread_count)
+{
+    return scan(amc, nullptr, thread_count);
+}
@@ -0,0 +1,54 @@
+#ifndef JOINT_LIMITS_HPP
+#define JOINT_LIMITS_HPP
+
+#include <vector>
+
+#include "amc.hpp"
+#include "asf.hpp"
+
+
+// A skeleton's DOF limits laid out like AMC::Frame::transformations (rx, ry,
+// rz per bone; unlimited channels get infinite bounds), so checking a frame
+// is a single branch-free loop the compiler vectorizes
+class JointLimits {
+    public:
+        JointLimits(const ASF &asf);
+
+        const ASF *skeleton(void) const { return asf; }
+
+        // Returns the number of channels outside of their limits; if given,
+        // violating is set to true for every bone with such a channel (and
+        // false for all others)
+        int check(const AMC::Frame &frame, std::vector<bool> *violating = nullptr) const;
+
+        // Clamps all channels into their limits
+        void clamp(AMC::Frame &frame) const;
+
+        // Lower and upper bounds of channel c of bone b at index 3 * b + c
+        const std::vector<float> &lower(void) const { return lo; }
+        const std::vector<float> &upper(void) const { return hi; }
+
+
+    private:
+        const ASF *asf;
+        std::vector<float> lo, hi;
+};
+
+
+// Consecutive frames in which a channel is outside of its limits
+struct LimitViolation {
+    int bone;
+    ASF::Axis axis;
+    // Frame numbers (inclusive)
+    int first_frame, last_frame;
+    // Largest distance from the limit (in radians)
+    float max_excess;
+};
+
+// Checks every channel of every frame (split across threads; 0 means one
+// per hardware thread), results are sorted by first frame. If clamp is set,
+// the frames are also clamped into the limits.
+std::vector<LimitViolation> scan_limits(AMC &amc, bool clamp, unsigned thread_count = 0);
+std::vector<LimitViolation> scan_limits(const AMC &amc, unsigned thread_count = 0);
+
+#endif
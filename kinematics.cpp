@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "kinematics.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+#include "track_export.hpp"
+
+
+using namespace dake::math;
+
+
+const char *const ClipKinematics::channel_names[CHANNEL_COUNT] = {
+    "px", "py", "pz",
+    "vx", "vy", "vz",
+    "ax", "ay", "az",
+    "wx", "wy", "wz",
+    "dwx", "dwy", "dwz"
+};
+
+
+// First derivative by central differences
+static void derive(const float *in, float *out, size_t n, float rate)
+{
+    if (n < 2) {
+        std::fill(out, out + n, 0.f);
+        return;
+    }
+
+    float half_rate = .5f * rate;
+    for (size_t i = 1; i < n - 1; i++) {
+        out[i] = (in[i + 1] - in[i - 1]) * half_rate;
+    }
+
+    out[0] = (in[1] - in[0]) * rate;
+    out[n - 1] = (in[n - 1] - in[n - 2]) * rate;
+}
+
+
+// Second derivative by central differences
+static void derive2(const float *in, float *out, size_t n, float rate)
+{
+    if (n < 3) {
+        std::fill(out, out + n, 0.f);
+        return;
+    }
+
+    float rate2 = rate * rate;
+    for (size_t i = 1; i < n - 1; i++) {
+        out[i] = (in[i + 1] - 2.f * in[i] + in[i - 1]) * rate2;
+    }
+
+    out[0] = out[1];
+    out[n - 1] = out[n - 2];
+}
+
+
+static bool is_contact_bone(const std::string &name)
+{
+    std::string lower(name);
+    for (char &c: lower) {
+        c = tolower(static_cast<unsigned char>(c));
+    }
+    return (lower.find("foot") != std::string::npos) || (lower.find("toe") != std::string::npos);
+}
+
+
+ClipKinematics::ClipKinematics(const AMC &amc, const KinematicsOptions &opts):
+    frames(amc.frames().size()),
+    bones(amc.skeleton()->bones().size()),
+    ff(amc.first_frame()),
+    rate(opts.fps)
+{
+    TRACE_SCOPE("ClipKinematics");
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (!(rate > 0.f)) {
+        throw std::invalid_argument("The frame rate must be positive");
+    }
+    if (!frames) {
+        throw std::invalid_argument("Cannot analyze empty clips");
+    }
+
+    const ASF &asf = *amc.skeleton();
+    columns.resize(bones * CHANNEL_COUNT * frames);
+
+    // Orientations (w, x, y, z columns per bone), only needed for the
+    // angular channels
+    std::vector<float> quats(bones * 4 * frames);
+
+    parallel_ranges(frames, [&](size_t first, size_t end) {
+        std::vector<mat4> trans(bones);
+        float ch[track_channel_count];
+
+        for (size_t i = first; i < end; i++) {
+            amc.evaluate(ff + i, trans.data());
+
+            for (size_t b = 0; b < bones; b++) {
+                bone_track_channels(trans[b], ch);
+
+                for (int k = 0; k < 3; k++) {
+                    column(b, static_cast<Channel>(PX + k))[i] = ch[k];
+                }
+                for (size_t k = 0; k < 4; k++) {
+                    quats[(b * 4 + k) * frames + i] = ch[3 + k];
+                }
+            }
+        }
+    }, opts.threads);
+
+    parallel_ranges(bones, [&](size_t first, size_t end) {
+        std::vector<float> dq(4 * frames);
+
+        for (size_t b = first; b < end; b++) {
+            float *qw = &quats[b * 4 * frames], *qx = qw + frames, *qy = qx + frames, *qz = qy + frames;
+            float *dqw = dq.data(), *dqx = dqw + frames, *dqy = dqx + frames, *dqz = dqy + frames;
+
+            // q and -q are the same orientation, but only neighbors in the
+            // same hemisphere can be differentiated
+            for (size_t i = 1; i < frames; i++) {
+                if (qw[i] * qw[i - 1] + qx[i] * qx[i - 1] + qy[i] * qy[i - 1] + qz[i] * qz[i - 1] < 0.f) {
+                    qw[i] = -qw[i];
+                    qx[i] = -qx[i];
+                    qy[i] = -qy[i];
+                    qz[i] = -qz[i];
+                }
+            }
+
+            for (int k = 0; k < 3; k++) {
+                const float *p = column(b, static_cast<Channel>(PX + k));
+                derive(p, column(b, static_cast<Channel>(VX + k)), frames, rate);
+                derive2(p, column(b, static_cast<Channel>(AX + k)), frames, rate);
+            }
+
+            for (size_t k = 0; k < 4; k++) {
+                derive(&quats[(b * 4 + k) * frames], &dq[k * frames], frames, rate);
+            }
+
+            // omega = 2 * vec(dq/dt * conj(q))
+            float *wx = column(b, WX), *wy = column(b, WY), *wz = column(b, WZ);
+            for (size_t i = 0; i < frames; i++) {
+                wx[i] = 2.f * (qw[i] * dqx[i] - dqw[i] * qx[i] + qy[i] * dqz[i] - qz[i] * dqy[i]);
+                wy[i] = 2.f * (qw[i] * dqy[i] - dqw[i] * qy[i] + qz[i] * dqx[i] - qx[i] * dqz[i]);
+                wz[i] = 2.f * (qw[i] * dqz[i] - dqw[i] * qz[i] + qx[i] * dqy[i] - qy[i] * dqx[i]);
+            }
+
+            for (int k = 0; k < 3; k++) {
+                derive(column(b, static_cast<Channel>(WX + k)), column(b, static_cast<Channel>(DWX + k)), frames,
+                       rate);
+            }
+        }
+    }, opts.threads);
+
+    std::vector<int> contact_bones;
+    if (opts.contact_bones.empty()) {
+        for (size_t b = 0; b < bones; b++) {
+            if (is_contact_bone(asf.bones()[b].name)) {
+                contact_bones.push_back(b);
+            }
+        }
+    } else {
+        for (const std::string &name: opts.contact_bones) {
+            int bi = asf.bone_index(name);
+            if (bi < 0) {
+                throw std::invalid_argument("Unknown contact bone " + name);
+            }
+            contact_bones.push_back(bi);
+        }
+    }
+
+    float ground = HUGE_VALF;
+    for (int b: contact_bones) {
+        const float *py = channel(b, PY);
+        ground = std::min(ground, *std::min_element(py, py + frames));
+    }
+
+    float max_height = ground + opts.contact_height;
+    float max_speed2 = opts.contact_speed * opts.contact_speed;
+
+    for (int b: contact_bones) {
+        Contacts c;
+        c.bone = b;
+        c.frames.resize(frames);
+
+        const float *py = channel(b, PY);
+        const float *vx = channel(b, VX), *vy = channel(b, VY), *vz = channel(b, VZ);
+        for (size_t i = 0; i < frames; i++) {
+            float speed2 = vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i];
+            c.frames[i] = (py[i] <= max_height) & (speed2 <= max_speed2);
+        }
+
+        contact_tracks.push_back(std::move(c));
+    }
+
+    secs = seconds_since(start);
+}
+
+
+float ClipKinematics::speed(int bone, int frame) const
+{
+    if ((frame < ff) || (frame >= ff + static_cast<int>(frames))) {
+        throw std::range_error("Frame " + std::to_string(frame) + " is out of range");
+    }
+
+    size_t i = frame - ff;
+    float vx = channel(bone, VX)[i], vy = channel(bone, VY)[i], vz = channel(bone, VZ)[i];
+    return sqrtf(vx * vx + vy * vy + vz * vz);
+}
+
+
+void ClipKinematics::write_csv(const std::string &path, const ASF &asf) const
+{
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    std::string line("frame");
+    for (size_t b = 0; b < bones; b++) {
+        for (const char *name: channel_names) {
+            line += "," + asf.bones()[b].name + "." + name;
+        }
+    }
+    for (const Contacts &c: contact_tracks) {
+        line += "," + asf.bones()[c.bone].name + ".contact";
+    }
+    line += "\n";
+    out << line;
+
+    char buf[32];
+    for (size_t i = 0; i < frames; i++) {
+        line = std::to_string(ff + static_cast<int>(i));
+
+        for (size_t b = 0; b < bones; b++) {
+            for (int c = 0; c < CHANNEL_COUNT; c++) {
+                float value = channel(b, static_cast<Channel>(c))[i];
+                std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), value);
+                line += ',';
+                line.append(buf, res.ptr);
+            }
+        }
+        for (const Contacts &c: contact_tracks) {
+            line += c.frames[i] ? ",1" : ",0";
+        }
+        line += "\n";
+
+        out << line;
+    }
+
+    if (!out) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
+
+size_t ClipKinematics::memory_size(void) const
+{
+    size_t size = heap_bytes(columns) + heap_bytes(contact_tracks);
+    for (const Contacts &c: contact_tracks) {
+        size += heap_bytes(c.frames);
+    }
+    return size;
+}
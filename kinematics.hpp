@@ -0,0 +1,91 @@
+#ifndef KINEMATICS_HPP
+#define KINEMATICS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "amc.hpp"
+
+
+struct KinematicsOptions {
+    // AMC files do not store their frame rate
+    float fps = 120.f;
+    // Bones whose origins are checked for ground contact; if empty, all
+    // bones with "foot" or "toe" in their name
+    std::vector<std::string> contact_bones;
+    // A bone is in contact while its origin is at most this high above the
+    // lowest point any contact bone reaches in the clip (in meters) and
+    // slower than contact_speed (in m/s)
+    float contact_height = .05f, contact_speed = .4f;
+    // 0 means one per hardware thread
+    unsigned threads = 0;
+};
+
+
+// Kinematic channels derived from the world positions and orientations of
+// every bone's origin (see track_export.hpp) over a whole clip, by central
+// finite differences (one-sided at both ends)
+class ClipKinematics {
+    public:
+        enum Channel {
+            // Position (m)
+            PX, PY, PZ,
+            // Linear velocity (m/s) and acceleration (m/s^2)
+            VX, VY, VZ,
+            AX, AY, AZ,
+            // Angular velocity (rad/s) and acceleration (rad/s^2), both in
+            // world space
+            WX, WY, WZ,
+            DWX, DWY, DWZ,
+
+            CHANNEL_COUNT
+        };
+
+        static const char *const channel_names[CHANNEL_COUNT];
+
+        struct Contacts {
+            int bone;
+            // One per frame; 1 while in contact
+            std::vector<uint8_t> frames;
+        };
+
+        ClipKinematics(const AMC &amc, const KinematicsOptions &opts = KinematicsOptions());
+
+        size_t frame_count(void) const { return frames; }
+        int first_frame(void) const { return ff; }
+        size_t bone_count(void) const { return bones; }
+        float fps(void) const { return rate; }
+
+        // All frames of one channel of one bone
+        const float *channel(int bone, Channel c) const
+        { return &columns[(bone * CHANNEL_COUNT + c) * frames]; }
+
+        float speed(int bone, int frame) const;
+
+        const std::vector<Contacts> &contacts(void) const { return contact_tracks; }
+
+        // Writes one row per frame (frame, all channels of all bones, and
+        // all contacts)
+        void write_csv(const std::string &path, const ASF &asf) const;
+
+        size_t memory_size(void) const;
+
+        // Time the analysis took
+        double seconds(void) const { return secs; }
+
+
+    private:
+        float *column(int bone, Channel c)
+        { return &columns[(bone * CHANNEL_COUNT + c) * frames]; }
+
+        size_t frames, bones;
+        int ff;
+        float rate;
+        std::vector<float> columns;
+        std::vector<Contacts> contact_tracks;
+        double secs;
+};
+
+#endif
@@ -0,0 +1,389 @@
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "live_stream.hpp"
+#include "trace.hpp"
+
+
+// Binary records start with this, followed by the skeleton hash, the frame
+// number, a reserved word, the sending time and the frame in the same layout
+// as binary AMC frames
+static const char record_magic[4] = {'A', 'M', 'C', 'L'};
+
+struct RecordHeader {
+    char magic[4];
+    uint32_t skeleton;
+    int32_t number;
+    uint32_t reserved;
+    // trace_clock(), i.e. the same clock on both ends as long as they are on
+    // the same machine
+    uint64_t sent_ns;
+};
+
+static_assert(sizeof(AMC::Transformation) == 3 * sizeof(float), "Binary records expect packed transformations");
+
+// Datagrams cannot be larger anyway
+static const size_t max_datagram = 65536;
+
+
+// Creates a datagram socket for the given address; the receiver binds it,
+// the sender connects it
+static int open_socket(const std::string &address, bool receiver)
+{
+    int fd;
+
+    if (!address.compare(0, 5, "unix:")) {
+        std::string path = address.substr(5);
+
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (path.empty() || (path.length() >= sizeof(sa.sun_path))) {
+            throw std::invalid_argument("Invalid Unix socket path " + path);
+        }
+        strcpy(sa.sun_path, path.c_str());
+
+        fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("Could not create socket: ") + strerror(errno));
+        }
+
+        if (receiver) {
+            // Left over from an earlier run
+            unlink(path.c_str());
+        }
+
+        int ret = receiver ? bind(fd, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa))
+                           : connect(fd, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa));
+        if (ret < 0) {
+            int err = errno;
+            close(fd);
+            throw std::runtime_error("Could not " + std::string(receiver ? "bind" : "connect") + " to " + path + ": " + strerror(err));
+        }
+    } else if (!address.compare(0, 4, "udp:")) {
+        std::string host("127.0.0.1"), port = address.substr(4);
+
+        size_t colon = port.rfind(':');
+        if (colon != std::string::npos) {
+            host = port.substr(0, colon);
+            port = port.substr(colon + 1);
+        }
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+
+        int gai = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (gai) {
+            throw std::invalid_argument("Could not resolve " + address + ": " + gai_strerror(gai));
+        }
+
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd < 0) {
+            int err = errno;
+            freeaddrinfo(res);
+            throw std::runtime_error(std::string("Could not create socket: ") + strerror(err));
+        }
+
+        int ret = receiver ? bind(fd, res->ai_addr, res->ai_addrlen) : connect(fd, res->ai_addr, res->ai_addrlen);
+        int err = errno;
+        freeaddrinfo(res);
+
+        if (ret < 0) {
+            close(fd);
+            throw std::runtime_error("Could not " + std::string(receiver ? "bind" : "connect") + " to " + address + ": " + strerror(err));
+        }
+    } else {
+        throw std::invalid_argument("Unknown address " + address + " (expected udp:[host:]port or unix:path)");
+    }
+
+    return fd;
+}
+
+
+LiveStream::LiveStream(const std::string &address, const ASF *a):
+    asf(a),
+    addr(address)
+{
+    fd = open_socket(address, true);
+    receiver = std::thread(&LiveStream::receive, this);
+}
+
+
+LiveStream::~LiveStream(void)
+{
+    quit = true;
+    receiver.join();
+
+    close(fd);
+
+    if (!addr.compare(0, 5, "unix:")) {
+        unlink(addr.substr(5).c_str());
+    }
+}
+
+
+void LiveStream::receive(void)
+{
+    std::vector<char> buffer(max_datagram);
+
+    while (!quit) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+
+        // Wake up regularly to check quit
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        ssize_t length = recv(fd, buffer.data(), buffer.size(), 0);
+        if (length < 0) {
+            if ((errno != EINTR) && (errno != EAGAIN)) {
+                error_count++;
+            }
+            continue;
+        }
+
+        Record *rec = ring.write_slot();
+        if (!rec) {
+            dropped_count++;
+            continue;
+        }
+
+        rec->received_ns = trace_clock();
+
+        try {
+            if ((static_cast<size_t>(length) >= sizeof(record_magic)) &&
+                !memcmp(buffer.data(), record_magic, sizeof(record_magic)))
+            {
+                decode_binary(buffer.data(), length, *rec);
+            } else {
+                decode_text(buffer.data(), length, *rec);
+            }
+        } catch (std::exception &) {
+            error_count++;
+            continue;
+        }
+
+        ring.push();
+        received_count++;
+    }
+}
+
+
+void LiveStream::decode_text(const char *data, size_t length, Record &rec)
+{
+    rec.frame.root_translation = dake::math::vec3::zero();
+    rec.frame.root_rotation    = dake::math::vec3::zero();
+    rec.frame.transformations.assign(asf->bones().size(), AMC::Transformation());
+    rec.number = -1;
+    rec.sent_ns = 0;
+
+    float angle_unit = 1.f; // rad
+    const char *end = data + length;
+
+    while (data < end) {
+        const char *eol = static_cast<const char *>(memchr(data, '\n', end - data));
+        if (!eol) {
+            eol = end;
+        }
+
+        const char *b = data, *e = eol;
+        for (; (b < e) && isspace(static_cast<unsigned char>(*b)); b++);
+        for (; (e > b) && isspace(static_cast<unsigned char>(e[-1])); e--);
+        data = eol + 1;
+
+        if ((b == e) || (*b == '#')) {
+            continue;
+        }
+
+        std::string line(b, e);
+
+        if (line == ":DEGREES") {
+            angle_unit = static_cast<float>(M_PI) / 180.f;
+        } else if (line.front() == ':') {
+            continue;
+        } else {
+            char *num_end;
+            errno = 0;
+            long number = strtol(line.c_str(), &num_end, 0);
+
+            if (!*num_end && !errno) {
+                rec.number = number;
+            } else {
+                AMC::parse_line(*asf, line, rec.frame, angle_unit, rec.number);
+            }
+        }
+    }
+}
+
+
+void LiveStream::decode_binary(const char *data, size_t length, Record &rec)
+{
+    RecordHeader header;
+    size_t bone_count = asf->bones().size();
+
+    if (length != sizeof(header) + (6 + 3 * bone_count) * sizeof(float)) {
+        throw std::invalid_argument("Invalid record length");
+    }
+
+    memcpy(&header, data, sizeof(header));
+    if (header.skeleton != AMC::skeleton_hash(*asf)) {
+        throw std::invalid_argument("Record was sent for a different skeleton");
+    }
+
+    rec.number = header.number;
+    rec.sent_ns = header.sent_ns;
+
+    const char *values = data + sizeof(header);
+    float v[6];
+
+    memcpy(v, values, sizeof(v));
+    rec.frame.root_translation = dake::math::vec3(v[0], v[1], v[2]);
+    rec.frame.root_rotation    = dake::math::vec3(v[3], v[4], v[5]);
+
+    rec.frame.transformations.resize(bone_count);
+    memcpy(rec.frame.transformations.data(), values + sizeof(v), bone_count * sizeof(AMC::Transformation));
+}
+
+
+bool LiveStream::latest(AMC::Frame &frame, int *number)
+{
+    Record *rec;
+    uint64_t stamp = 0;
+    bool got = false;
+
+    // Skip to the newest frame; swapping keeps the allocations of both
+    while ((rec = ring.read_slot())) {
+        if (got) {
+            superseded_count++;
+        }
+
+        std::swap(frame, rec->frame);
+        if (number) {
+            *number = rec->number;
+        }
+        stamp = rec->sent_ns ? rec->sent_ns : rec->received_ns;
+
+        ring.pop();
+        got = true;
+    }
+
+    if (got) {
+        last_latency = (trace_clock() - stamp) / 1e6f;
+    }
+
+    return got;
+}
+
+
+LiveStream::Stats LiveStream::stats(void) const
+{
+    Stats s;
+
+    s.received = received_count;
+    s.dropped = dropped_count;
+    s.errors = error_count;
+    s.superseded = superseded_count;
+    s.latency_ms = last_latency;
+
+    return s;
+}
+
+
+LiveSender::LiveSender(const std::string &address)
+{
+    fd = open_socket(address, false);
+}
+
+
+LiveSender::~LiveSender(void)
+{
+    close(fd);
+}
+
+
+bool LiveSender::send(const ASF &asf, int number, const AMC::Frame &frame, bool text)
+{
+    size_t bone_count = asf.bones().size();
+
+    if (text) {
+        static const float deg = 180.f / static_cast<float>(M_PI);
+        char num[32];
+
+        auto print = [&](const char *fmt, double value) {
+            snprintf(num, sizeof(num), fmt, value);
+            buffer.insert(buffer.end(), num, num + strlen(num));
+        };
+
+        buffer.clear();
+        snprintf(num, sizeof(num), ":DEGREES\n%i\nroot", number);
+        buffer.insert(buffer.end(), num, num + strlen(num));
+
+        for (ASF::Axis axis: asf.root_order()) {
+            switch (axis) {
+                case ASF::RX: print(" %.9g", frame.root_rotation.x() * deg); break;
+                case ASF::RY: print(" %.9g", frame.root_rotation.y() * deg); break;
+                case ASF::RZ: print(" %.9g", frame.root_rotation.z() * deg); break;
+                case ASF::TX: print(" %.9g", frame.root_translation.x() / asf.internal_length_unit()); break;
+                case ASF::TY: print(" %.9g", frame.root_translation.y() / asf.internal_length_unit()); break;
+                case ASF::TZ: print(" %.9g", frame.root_translation.z() / asf.internal_length_unit()); break;
+            }
+        }
+        buffer.push_back('\n');
+
+        for (size_t i = 0; i < bone_count; i++) {
+            const ASF::Bone &bone = asf.bones()[i];
+            if ((static_cast<int>(i) == asf.root_index()) || bone.dof_order.empty()) {
+                continue;
+            }
+
+            buffer.insert(buffer.end(), bone.name.begin(), bone.name.end());
+
+            const AMC::Transformation &trans = i < frame.transformations.size() ? frame.transformations[i] : AMC::Transformation();
+            for (ASF::Axis axis: bone.dof_order) {
+                print(" %.9g", (axis == ASF::RX ? trans.rx : axis == ASF::RY ? trans.ry : trans.rz) * deg);
+            }
+            buffer.push_back('\n');
+        }
+    } else {
+        RecordHeader header;
+        memcpy(header.magic, record_magic, sizeof(record_magic));
+        header.skeleton = AMC::skeleton_hash(asf);
+        header.number = number;
+        header.reserved = 0;
+        header.sent_ns = trace_clock();
+
+        float root[6] = {
+            frame.root_translation.x(), frame.root_translation.y(), frame.root_translation.z(),
+            frame.root_rotation.x(),    frame.root_rotation.y(),    frame.root_rotation.z()
+        };
+
+        buffer.resize(sizeof(header) + sizeof(root) + bone_count * sizeof(AMC::Transformation));
+        memcpy(buffer.data(), &header, sizeof(header));
+        memcpy(buffer.data() + sizeof(header), root, sizeof(root));
+
+        AMC::Transformation *trans = reinterpret_cast<AMC::Transformation *>(buffer.data() + sizeof(header) + sizeof(root));
+        for (size_t i = 0; i < bone_count; i++) {
+            trans[i] = i < frame.transformations.size() ? frame.transformations[i] : AMC::Transformation();
+        }
+    }
+
+    return ::send(fd, buffer.data(), buffer.size(), 0) == static_cast<ssize_t>(buffer.size());
+}
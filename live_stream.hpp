@@ -0,0 +1,91 @@
+#ifndef LIVE_STREAM_HPP
+#define LIVE_STREAM_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "spsc_ring.hpp"
+
+
+// Live motion input: every datagram carries one frame, either in the AMC text
+// syntax (an optional :DEGREES line, the frame number and root/bone lines) or
+// as a binary record (see LiveSender). Addresses are "udp:[host:]port" or
+// "unix:path".
+class LiveStream {
+    public:
+        struct Stats {
+            // Counted by the receiving thread
+            unsigned long received, dropped, errors;
+            // Frames never shown because a newer one had arrived
+            unsigned long superseded;
+            // Time from sending (binary records) or receiving (text) to the
+            // last latest() call returning a frame
+            float latency_ms;
+        };
+
+        // Binds the socket and starts receiving
+        LiveStream(const std::string &address, const ASF *asf);
+        ~LiveStream(void);
+
+        // To be called from a single consumer thread: stores the newest frame
+        // received since the last call and returns true, or returns false if
+        // nothing new has arrived
+        bool latest(AMC::Frame &frame, int *number = nullptr);
+
+        // Also for the consumer thread only
+        Stats stats(void) const;
+
+        const std::string &address(void) const { return addr; }
+
+
+    private:
+        struct Record {
+            AMC::Frame frame;
+            int number;
+            uint64_t sent_ns, received_ns;
+        };
+
+        void receive(void);
+        void decode_text(const char *data, size_t length, Record &rec);
+        void decode_binary(const char *data, size_t length, Record &rec);
+
+        const ASF *asf;
+        std::string addr;
+        int fd;
+
+        // Small, so the newest frame is never far behind even if the
+        // consumer stalls (frames arriving while it is full are dropped)
+        SpscRing<Record> ring{16};
+
+        std::atomic<unsigned long> received_count{0}, dropped_count{0}, error_count{0};
+        unsigned long superseded_count = 0;
+        float last_latency = 0.f;
+
+        std::atomic<bool> quit{false};
+        std::thread receiver;
+};
+
+
+// Sends frames to a LiveStream
+class LiveSender {
+    public:
+        LiveSender(const std::string &address);
+        ~LiveSender(void);
+
+        // Returns false if the frame could not be sent (e.g. because nobody
+        // is listening on a Unix socket)
+        bool send(const ASF &asf, int number, const AMC::Frame &frame, bool text);
+
+
+    private:
+        int fd;
+        std::vector<char> buffer;
+};
+
+#endif
@@ -3,9 +3,11 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
 #include <QApplication>
 
 #include "asf.hpp"
+#include "trace.hpp"
 #include "window.hpp"
 
 
@@ -13,12 +15,14 @@ int main(int argc, char *argv[])
 {
     QApplication app(argc, argv);
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <model.asf>\n", argv[0]);
+    if ((argc < 2) || (argc % 2)) {
+        fprintf(stderr, "Usage: %s <model.asf> [--live udp:[host:]port|unix:path] [--publish <shm name>]\n"
+                        "       [--trace <out.json>]\n", argv[0]);
         return 1;
     }
 
     Window *wnd = new Window;
+    const char *trace_path = nullptr;
 
     std::ifstream asf_str(argv[1]);
     if (!asf_str.is_open()) {
@@ -29,7 +33,40 @@ int main(int argc, char *argv[])
     wnd->renderer()->asf() = new ASF(asf_str);
     asf_str.close();
 
+    printf("ASF bone hierarchy:\n");
+    wnd->renderer()->asf()->dump_hierarchy();
+
+    try {
+        for (int i = 2; i < argc; i += 2) {
+            if (!strcmp(argv[i], "--live")) {
+                wnd->start_live(argv[i + 1]);
+            } else if (!strcmp(argv[i], "--publish")) {
+                wnd->start_publishing(argv[i + 1]);
+            } else if (!strcmp(argv[i], "--trace")) {
+                // Everything until the window is closed
+                trace_path = argv[i + 1];
+                trace_acquire();
+            } else {
+                fprintf(stderr, "%s: Unknown option %s\n", argv[0], argv[i]);
+                return 1;
+            }
+        }
+    } catch (std::exception &e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+
     wnd->show();
 
-    return app.exec();
+    int ret = app.exec();
+
+    if (trace_path) {
+        try {
+            write_chrome_trace(trace_path);
+        } catch (std::exception &e) {
+            fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        }
+    }
+
+    return ret;
 }
@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "mass.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+
+
+using namespace dake::math;
+
+
+// Frames whose bone centers are kept at once per thread
+static const size_t com_block_frames = 256;
+
+
+MassModel::MassModel(const ASF &asf):
+    skeleton(&asf)
+{
+    for (const ASF::Bone &bone: asf.bones()) {
+        vec3 center(.5f * bone.length * bone.direction);
+
+        mass.push_back(asf.mass_unit() * bone.length);
+        centers.emplace_back(center.x(), center.y(), center.z(), 1.f);
+        total_mass += mass.back();
+    }
+}
+
+
+void MassModel::set_mass(const std::string &bone, float m)
+{
+    int bi = skeleton->bone_index(bone);
+    if (bi < 0) {
+        throw std::invalid_argument("Unknown bone " + bone);
+    }
+    if (!(m >= 0.f)) {
+        throw std::invalid_argument("Bad mass for bone " + bone);
+    }
+
+    total_mass += m - mass[bi];
+    mass[bi] = m;
+}
+
+
+void MassModel::read_overrides(const std::string &path)
+{
+    std::ifstream s(path);
+    if (!s.is_open()) {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    std::string line;
+    for (int line_no = 1; std::getline(s, line); line_no++) {
+        line = line.substr(0, line.find('#'));
+
+        std::stringstream line_ss(line);
+        std::string name;
+        float m;
+
+        if (!(line_ss >> name)) {
+            continue;
+        }
+        if (!(line_ss >> m)) {
+            throw std::invalid_argument(path + ":" + std::to_string(line_no) + ": Expected <bone> <mass>");
+        }
+
+        set_mass(name, m);
+    }
+}
+
+
+vec3 MassModel::center_of_mass(const ASF &asf) const
+{
+    if (!(total_mass > 0.f)) {
+        return asf.root_position();
+    }
+
+    vec3 sum(vec3::zero());
+
+    for (size_t b = 0; b < mass.size(); b++) {
+        if (mass[b] > 0.f) {
+            vec4 c(asf.bones()[b].motion_trans * centers[b]);
+            sum += mass[b] * vec3(c.x(), c.y(), c.z());
+        }
+    }
+
+    return sum / total_mass;
+}
+
+
+vec3 MassModel::center_of_mass(const mat4 *motion_trans) const
+{
+    if (!(total_mass > 0.f)) {
+        return skeleton->root_position();
+    }
+
+    vec3 sum(vec3::zero());
+
+    for (size_t b = 0; b < mass.size(); b++) {
+        if (mass[b] > 0.f) {
+            vec4 c(motion_trans[b] * centers[b]);
+            sum += mass[b] * vec3(c.x(), c.y(), c.z());
+        }
+    }
+
+    return sum / total_mass;
+}
+
+
+CenterOfMassTrack center_of_mass_track(const AMC &amc, const MassModel &masses, unsigned threads)
+{
+    TRACE_SCOPE("center_of_mass_track");
+
+    CenterOfMassTrack track;
+    track.first_frame = amc.first_frame();
+    extend_center_of_mass_track(amc, masses, track, threads);
+
+    return track;
+}
+
+
+void extend_center_of_mass_track(const AMC &amc, const MassModel &masses, CenterOfMassTrack &track,
+                                 unsigned threads)
+{
+    TRACE_SCOPE("extend_center_of_mass_track");
+
+    auto start = std::chrono::steady_clock::now();
+
+    const std::vector<float> &mass = masses.masses();
+    if (!(masses.total() > 0.f)) {
+        throw std::invalid_argument("The skeleton has no mass");
+    }
+    if (mass.size() != amc.skeleton()->bones().size()) {
+        throw std::invalid_argument("Mass model and clip are for different skeletons");
+    }
+
+    // Only bones with mass contribute
+    std::vector<int> bones;
+    std::vector<vec4> centers;
+    for (size_t b = 0; b < mass.size(); b++) {
+        if (mass[b] > 0.f) {
+            const ASF::Bone &bone = amc.skeleton()->bones()[b];
+            vec3 center(.5f * bone.length * bone.direction);
+
+            bones.push_back(b);
+            centers.emplace_back(center.x(), center.y(), center.z(), 1.f);
+        }
+    }
+
+    if (track.first_frame != amc.first_frame()) {
+        throw std::invalid_argument("The track does not start at the clip's first frame");
+    }
+
+    // Only frames not in the track yet
+    size_t done = track.x.size();
+    size_t frames = amc.frames().size();
+    if (frames <= done) {
+        return;
+    }
+
+    track.x.resize(frames);
+    track.y.resize(frames);
+    track.z.resize(frames);
+
+    std::mutex ground_lock;
+    float ground = HUGE_VALF;
+    float inv_total = 1.f / masses.total();
+
+    parallel_ranges(frames - done, [&](size_t first, size_t end) {
+        first += done;
+        end += done;
+
+        std::vector<mat4> trans(mass.size());
+        // Weighted bone centers, one column of com_block_frames per bone and
+        // coordinate
+        std::vector<float> wc(3 * bones.size() * com_block_frames);
+        float lowest = HUGE_VALF;
+
+        for (size_t block = first; block < end; block += com_block_frames) {
+            size_t n = std::min(com_block_frames, end - block);
+
+            for (size_t k = 0; k < n; k++) {
+                amc.evaluate(track.first_frame + block + k, trans.data());
+
+                for (size_t i = 0; i < bones.size(); i++) {
+                    const mat4 &m = trans[bones[i]];
+                    vec4 c(m * centers[i]);
+                    vec4 origin(m * vec4(0.f, 0.f, 0.f, 1.f));
+                    float w = mass[bones[i]];
+
+                    wc[(3 * i    ) * com_block_frames + k] = w * c.x();
+                    wc[(3 * i + 1) * com_block_frames + k] = w * c.y();
+                    wc[(3 * i + 2) * com_block_frames + k] = w * c.z();
+                    lowest = std::min(lowest, origin.y());
+                }
+            }
+
+            float *x = &track.x[block], *y = &track.y[block], *z = &track.z[block];
+            std::fill(x, x + n, 0.f);
+            std::fill(y, y + n, 0.f);
+            std::fill(z, z + n, 0.f);
+
+            for (size_t i = 0; i < bones.size(); i++) {
+                const float *cx = &wc[(3 * i    ) * com_block_frames];
+                const float *cy = &wc[(3 * i + 1) * com_block_frames];
+                const float *cz = &wc[(3 * i + 2) * com_block_frames];
+
+                for (size_t k = 0; k < n; k++) {
+                    x[k] += cx[k];
+                    y[k] += cy[k];
+                    z[k] += cz[k];
+                }
+            }
+
+            for (size_t k = 0; k < n; k++) {
+                x[k] *= inv_total;
+                y[k] *= inv_total;
+                z[k] *= inv_total;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(ground_lock);
+        ground = std::min(ground, lowest);
+    }, threads);
+
+    track.ground = done ? std::min(track.ground, ground) : ground;
+    track.seconds += seconds_since(start);
+}
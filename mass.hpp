@@ -0,0 +1,64 @@
+#ifndef MASS_HPP
+#define MASS_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+
+
+// Distribution of a skeleton's mass over its bones. Every bone's mass sits at
+// its center (halfway along its length). Unless overridden, it is the ASF's
+// mass unit times the bone's length in meters, i.e. by default the skeleton
+// has a uniform linear density.
+class MassModel {
+    public:
+        MassModel(const ASF &asf);
+
+        // Throws std::invalid_argument for unknown bones and negative masses
+        void set_mass(const std::string &bone, float mass);
+        // Reads "<bone> <mass>" lines ('#' starts a comment)
+        void read_overrides(const std::string &path);
+
+        // Indexed like ASF.bones
+        const std::vector<float> &masses(void) const { return mass; }
+        float total(void) const { return total_mass; }
+
+        // Of the skeleton's current pose (see AMC::apply(); bones skipped for
+        // LOD contribute with their stale transformations)
+        dake::math::vec3 center_of_mass(const ASF &asf) const;
+        // Of the pose given by its motion transformations (see AMC::evaluate())
+        dake::math::vec3 center_of_mass(const dake::math::mat4 *motion_trans) const;
+
+
+    private:
+        const ASF *skeleton;
+        std::vector<float> mass;
+        float total_mass = 0.f;
+        // Bone centers in the bones' motion coordinate systems
+        std::vector<dake::math::vec4> centers;
+};
+
+
+struct CenterOfMassTrack {
+    int first_frame = 0;
+    // One per frame
+    std::vector<float> x, y, z;
+    // Height of the lowest bone origin in the clip, i.e. the height of the
+    // center of mass's ground projection
+    float ground = 0.f;
+    double seconds = 0.;
+};
+
+// Evaluates every frame of the clip (blocks of frames on multiple threads; 0
+// means one per hardware thread) and sums the weighted bone centers per frame
+CenterOfMassTrack center_of_mass_track(const AMC &amc, const MassModel &masses, unsigned threads = 0);
+// Appends the frames the clip has gained since the track was computed (e.g.
+// while it is being loaded); the track must start at the clip's first frame
+void extend_center_of_mass_track(const AMC &amc, const MassModel &masses, CenterOfMassTrack &track,
+                                 unsigned threads = 0);
+
+#endif
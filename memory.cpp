@@ -0,0 +1,121 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <malloc.h>
+
+#include "memory.hpp"
+
+
+static std::atomic<uint64_t> allocations{0}, frees{0}, bytes_allocated{0}, bytes_freed{0};
+static thread_local AllocationStats thread_stats;
+
+
+static void *counted_alloc(size_t size)
+{
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        return nullptr;
+    }
+
+    size_t usable = malloc_usable_size(ptr);
+
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    bytes_allocated.fetch_add(usable, std::memory_order_relaxed);
+    thread_stats.allocations++;
+    thread_stats.bytes_allocated += usable;
+
+    return ptr;
+}
+
+
+static void counted_free(void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+
+    size_t usable = malloc_usable_size(ptr);
+
+    frees.fetch_add(1, std::memory_order_relaxed);
+    bytes_freed.fetch_add(usable, std::memory_order_relaxed);
+    thread_stats.frees++;
+    thread_stats.bytes_freed += usable;
+
+    free(ptr);
+}
+
+
+AllocationStats allocation_stats(void)
+{
+    AllocationStats stats;
+
+    stats.allocations = allocations.load(std::memory_order_relaxed);
+    stats.frees = frees.load(std::memory_order_relaxed);
+    stats.bytes_allocated = bytes_allocated.load(std::memory_order_relaxed);
+    stats.bytes_freed = bytes_freed.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+
+AllocationStats thread_allocation_stats(void)
+{
+    return thread_stats;
+}
+
+
+void *operator new(size_t size)
+{
+    void *ptr = counted_alloc(size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    counted_free(ptr);
+}
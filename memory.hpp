@@ -0,0 +1,75 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+// Heap bytes requested by containers (not counting allocator overhead, nor
+// the heap memory of their elements)
+template<typename T> size_t heap_bytes(const std::vector<T> &v)
+{
+    return v.capacity() * sizeof(T);
+}
+
+inline size_t heap_bytes(const std::vector<bool> &v)
+{
+    // Stored in words
+    return (v.capacity() + 63) / 64 * 8;
+}
+
+inline size_t heap_bytes(const std::string &s)
+{
+    // Short strings are stored inline
+    const char *obj = reinterpret_cast<const char *>(&s);
+    bool inline_data = (s.data() >= obj) && (s.data() < obj + sizeof(s));
+    return inline_data ? 0 : s.capacity() + 1;
+}
+
+// For libstdc++'s layout: one node per element (next pointer, element, and
+// the cached hash for non-integral keys), plus the bucket array unless
+// there is only one bucket (which is stored inline)
+template<typename K, typename V, typename H> size_t heap_bytes(const std::unordered_map<K, V, H> &m)
+{
+    typedef std::pair<const K, V> value_type;
+
+    size_t node = sizeof(void *) + sizeof(value_type);
+    node = (node + alignof(value_type) - 1) / alignof(value_type) * alignof(value_type);
+    if (!std::is_integral<K>::value) {
+        node += sizeof(size_t);
+    }
+
+    return m.size() * node + (m.bucket_count() > 1 ? m.bucket_count() * sizeof(void *) : 0);
+}
+
+
+// Linking this (i.e. calling any of these functions) replaces the global
+// operator new and delete by versions counting all allocations, process-wide
+// and per thread. Byte counts are the allocator's usable sizes, so they are
+// a bit larger than what has been requested.
+struct AllocationStats {
+    uint64_t allocations = 0, frees = 0;
+    uint64_t bytes_allocated = 0, bytes_freed = 0;
+
+    int64_t live_bytes(void) const { return bytes_allocated - bytes_freed; }
+
+    AllocationStats operator-(const AllocationStats &other) const
+    {
+        AllocationStats diff;
+        diff.allocations = allocations - other.allocations;
+        diff.frees = frees - other.frees;
+        diff.bytes_allocated = bytes_allocated - other.bytes_allocated;
+        diff.bytes_freed = bytes_freed - other.bytes_freed;
+        return diff;
+    }
+};
+
+AllocationStats allocation_stats(void);
+AllocationStats thread_allocation_stats(void);
+
+#endif
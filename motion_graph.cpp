@@ -0,0 +1,638 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "motion_graph.hpp"
+#include "parallel.hpp"
+#include "pose_index.hpp"
+#include "trace.hpp"
+
+
+using namespace dake::math;
+
+
+MotionGraph::MotionGraph(std::vector<std::string> &&clips, std::vector<Transition> &&transitions, int window):
+    clip_names(std::move(clips)),
+    trans(std::move(transitions)),
+    win(window)
+{
+    std::sort(trans.begin(), trans.end(), [](const Transition &a, const Transition &b) {
+        return a.from_clip != b.from_clip ? a.from_clip < b.from_clip : a.from_frame < b.from_frame;
+    });
+}
+
+
+namespace
+{
+
+// Pose features of one clip, see PoseIndex
+struct ClipFeatures {
+    // Frames and window positions (frames - window + 1, if positive)
+    size_t frames = 0, positions = 0;
+    int first_frame = 0;
+    // feature_count floats per frame, and their squared norms
+    std::vector<float> x, norms;
+    // Bounding sphere of the frames touched by each tile (of window
+    // positions, including a border of one position)
+    std::vector<float> centers, radii;
+};
+
+struct TileBuffers {
+    std::vector<float> yt, e, dw;
+};
+
+struct TileContext {
+    size_t feature_count, window, tile;
+    // Upper bound for the sum of squared distances over a window
+    float limit;
+    // For turning that sum into an RMS distance
+    float normalization;
+};
+
+}
+
+
+// Window positions (with a border of one) of tile t, and the frames they
+// cover
+static void tile_range(const ClipFeatures &clip, size_t t, const TileContext &ctx, size_t &begin, size_t &end)
+{
+    begin = t > 0 ? t * ctx.tile - 1 : 0;
+    end = std::min((t + 1) * ctx.tile + 1, clip.positions);
+}
+
+
+static void compute_features(ClipFeatures &cf, const AMC &amc, const std::vector<std::string> &bone_names,
+                             const TileContext &ctx)
+{
+    const ASF &asf = *amc.skeleton();
+    std::vector<int> bones;
+    for (const std::string &name: bone_names) {
+        int bi = asf.bone_index(name);
+        if (bi < 0) {
+            throw std::invalid_argument("Skeleton has no bone " + name + " (required for comparing poses)");
+        }
+        bones.push_back(bi);
+    }
+
+    size_t fc = ctx.feature_count;
+    std::vector<mat4> trans(asf.bones().size());
+
+    cf.frames = amc.frames().size();
+    cf.positions = cf.frames >= ctx.window ? cf.frames - ctx.window + 1 : 0;
+    cf.first_frame = amc.first_frame();
+    cf.x.resize(cf.frames * fc);
+    cf.norms.resize(cf.frames);
+
+    for (size_t i = 0; i < cf.frames; i++) {
+        float *x = &cf.x[i * fc];
+        pose_features(asf, amc.frames()[i], bones, trans.data(), x);
+
+        float norm = 0.f;
+        for (size_t f = 0; f < fc; f++) {
+            norm += x[f] * x[f];
+        }
+        cf.norms[i] = norm;
+    }
+
+    size_t tiles = (cf.positions + ctx.tile - 1) / ctx.tile;
+    cf.centers.assign(tiles * fc, 0.f);
+    cf.radii.assign(tiles, 0.f);
+
+    for (size_t t = 0; t < tiles; t++) {
+        size_t begin, end;
+        tile_range(cf, t, ctx, begin, end);
+        end += ctx.window - 1;
+
+        float *center = &cf.centers[t * fc];
+        for (size_t i = begin; i < end; i++) {
+            for (size_t f = 0; f < fc; f++) {
+                center[f] += cf.x[i * fc + f];
+            }
+        }
+        for (size_t f = 0; f < fc; f++) {
+            center[f] /= end - begin;
+        }
+
+        float radius2 = 0.f;
+        for (size_t i = begin; i < end; i++) {
+            float d2 = 0.f;
+            for (size_t f = 0; f < fc; f++) {
+                float d = cf.x[i * fc + f] - center[f];
+                d2 += d * d;
+            }
+            radius2 = std::max(radius2, d2);
+        }
+        cf.radii[t] = sqrtf(radius2);
+    }
+}
+
+
+// Computes the windowed distances of tile (ta, tb) of the matrix between
+// clips a and b, and appends transitions for all local minima below the
+// limit; returns false if the tile could be skipped
+static bool process_tile(const ClipFeatures &a, const ClipFeatures &b, uint32_t ai, uint32_t bi, size_t ta, size_t tb,
+                         const TileContext &ctx, TileBuffers &buf, std::vector<MotionGraph::Transition> &out,
+                         uint64_t &frame_pairs)
+{
+    size_t fc = ctx.feature_count, w = ctx.window;
+
+    // No frame distance within the tile can be smaller than the distance
+    // between the bounding spheres
+    float center_dist2 = 0.f;
+    for (size_t f = 0; f < fc; f++) {
+        float d = a.centers[ta * fc + f] - b.centers[tb * fc + f];
+        center_dist2 += d * d;
+    }
+    float gap = sqrtf(center_dist2) - a.radii[ta] - b.radii[tb];
+    if ((gap > 0.f) && (w * gap * gap > ctx.limit)) {
+        return false;
+    }
+
+    size_t i0 = ta * ctx.tile, i1 = std::min(i0 + ctx.tile, a.positions);
+    size_t j0 = tb * ctx.tile, j1 = std::min(j0 + ctx.tile, b.positions);
+    size_t hi0, hi1, hj0, hj1;
+    tile_range(a, ta, ctx, hi0, hi1);
+    tile_range(b, tb, ctx, hj0, hj1);
+
+    size_t rows = hi1 - hi0 + w - 1, cols = hj1 - hj0 + w - 1;
+
+    // Transposed, so the inner loop runs over contiguous columns
+    buf.yt.resize(fc * cols);
+    for (size_t c = 0; c < cols; c++) {
+        const float *y = &b.x[(hj0 + c) * fc];
+        for (size_t f = 0; f < fc; f++) {
+            buf.yt[f * cols + c] = y[f];
+        }
+    }
+
+    // Squared frame distances |x|^2 + |y|^2 - 2 x * y; four rows at a time
+    // so every load from yt is used four times
+    buf.e.assign((rows + 3) / 4 * 4 * cols, 0.f);
+    for (size_t r = 0; r < rows; r += 4) {
+        float *row0 = &buf.e[r * cols], *row1 = row0 + cols, *row2 = row1 + cols, *row3 = row2 + cols;
+        const float *x0 = &a.x[(hi0 + r) * fc];
+        const float *x1 = r + 1 < rows ? x0 + fc : x0;
+        const float *x2 = r + 2 < rows ? x0 + 2 * fc : x0;
+        const float *x3 = r + 3 < rows ? x0 + 3 * fc : x0;
+
+        for (size_t f = 0; f < fc; f++) {
+            float xf0 = x0[f], xf1 = x1[f], xf2 = x2[f], xf3 = x3[f];
+            const float *yt = &buf.yt[f * cols];
+            for (size_t c = 0; c < cols; c++) {
+                row0[c] += xf0 * yt[c];
+                row1[c] += xf1 * yt[c];
+                row2[c] += xf2 * yt[c];
+                row3[c] += xf3 * yt[c];
+            }
+        }
+    }
+
+    const float *yn = &b.norms[hj0];
+    for (size_t r = 0; r < rows; r++) {
+        float *row = &buf.e[r * cols];
+        float xn = a.norms[hi0 + r];
+        for (size_t c = 0; c < cols; c++) {
+            row[c] = std::max(xn + yn[c] - 2.f * row[c], 0.f);
+        }
+    }
+    frame_pairs += rows * cols;
+
+    // Sums along the diagonals over the window
+    size_t wrows = hi1 - hi0, wcols = hj1 - hj0;
+    buf.dw.assign(wrows * wcols, 0.f);
+    for (size_t r = 0; r < wrows; r++) {
+        float *d = &buf.dw[r * wcols];
+        for (size_t k = 0; k < w; k++) {
+            const float *e = &buf.e[(r + k) * cols + k];
+            for (size_t c = 0; c < wcols; c++) {
+                d[c] += e[c];
+            }
+        }
+    }
+
+    // Overlapping windows of the same clip trivially match
+    if (ai == bi) {
+        for (size_t r = 0; r < wrows; r++) {
+            for (size_t c = 0; c < wcols; c++) {
+                size_t i = hi0 + r, j = hj0 + c;
+                if ((i > j ? i - j : j - i) < w) {
+                    buf.dw[r * wcols + c] = HUGE_VALF;
+                }
+            }
+        }
+    }
+
+    for (size_t i = i0; i < i1; i++) {
+        size_t r = i - hi0;
+
+        for (size_t j = j0; j < j1; j++) {
+            // The other half is emitted in reverse
+            if ((ai == bi) && (j <= i)) {
+                continue;
+            }
+
+            size_t c = j - hj0;
+            float v = buf.dw[r * wcols + c];
+            if (!(v <= ctx.limit)) {
+                continue;
+            }
+
+            // Of equal neighbors, only the first one counts
+            bool minimum = true;
+            for (int dr = -1; (dr <= 1) && minimum; dr++) {
+                for (int dc = -1; dc <= 1; dc++) {
+                    if ((!dr && !dc) || ((r == 0) && (dr < 0)) || ((c == 0) && (dc < 0)) ||
+                        (r + dr >= wrows) || (c + dc >= wcols))
+                    {
+                        continue;
+                    }
+
+                    float u = buf.dw[(r + dr) * wcols + (c + dc)];
+                    bool before = (dr < 0) || (!dr && (dc < 0));
+                    if (before ? u <= v : u < v) {
+                        minimum = false;
+                        break;
+                    }
+                }
+            }
+            if (!minimum) {
+                continue;
+            }
+
+            // Jump from the middle of one window to right after the middle
+            // of the other
+            float dist = sqrtf(v * ctx.normalization);
+            int ia = i + w / 2, ib = j + w / 2;
+            int ta_frame = std::min<int>(ia + 1, a.frames - 1), tb_frame = std::min<int>(ib + 1, b.frames - 1);
+
+            out.push_back(MotionGraph::Transition{ai, bi, a.first_frame + ia, b.first_frame + tb_frame, dist});
+            out.push_back(MotionGraph::Transition{bi, ai, b.first_frame + ib, a.first_frame + ta_frame, dist});
+        }
+    }
+
+    return true;
+}
+
+
+MotionGraph find_transitions(const std::vector<std::string> &names, const std::vector<const AMC *> &clips,
+                             const MotionGraphOptions &opts, MotionGraphStats *stats)
+{
+    if (clips.empty() || (names.size() != clips.size())) {
+        throw std::invalid_argument("Expected one name per clip");
+    }
+    if ((opts.window < 1) || (opts.tile < 1)) {
+        throw std::invalid_argument("Window and tile sizes must be positive");
+    }
+
+    TRACE_SCOPE("find_transitions");
+
+    auto start = std::chrono::steady_clock::now();
+    unsigned thread_count = opts.threads ? opts.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    const ASF &reference = *clips[0]->skeleton();
+    std::vector<std::string> bone_names;
+    for (int bi: pose_feature_bones(reference)) {
+        bone_names.push_back(reference.bones()[bi].name);
+    }
+
+    TileContext ctx;
+    ctx.feature_count = 3 * bone_names.size();
+    ctx.window = opts.window;
+    ctx.tile = opts.tile;
+    ctx.normalization = 1.f / (opts.window * bone_names.size());
+    ctx.limit = opts.threshold * opts.threshold / ctx.normalization;
+
+    MotionGraphStats st;
+    std::vector<ClipFeatures> features(clips.size());
+
+    {
+        TRACE_SCOPE("find_transitions::features");
+
+        std::vector<std::string> errors(clips.size());
+        parallel_ranges(clips.size(), [&](size_t first, size_t end) {
+            for (size_t i = first; i < end; i++) {
+                try {
+                    compute_features(features[i], *clips[i], bone_names, ctx);
+                } catch (std::exception &e) {
+                    errors[i] = names[i] + ": " + e.what();
+                }
+            }
+        }, thread_count);
+
+        for (const std::string &error: errors) {
+            if (!error.empty()) {
+                throw std::invalid_argument(error);
+            }
+        }
+    }
+
+    st.feature_seconds = seconds_since(start);
+
+    // One job per tile row of every clip, which covers that row in the
+    // matrices with all following clips (and itself); the matrices of the
+    // pairs in the other order are just transposed
+    std::vector<std::pair<uint32_t, uint32_t>> jobs;
+    for (size_t i = 0; i < features.size(); i++) {
+        st.frames += features[i].frames;
+        for (size_t t = 0; t < features[i].radii.size(); t++) {
+            jobs.emplace_back(i, t);
+        }
+    }
+
+    std::atomic<size_t> next_job(0);
+    std::vector<MotionGraph::Transition> transitions;
+    std::mutex result_lock;
+
+    parallel_ranges(thread_count, [&](size_t, size_t) {
+        TRACE_SCOPE("find_transitions::tiles");
+
+        TileBuffers buf;
+        std::vector<MotionGraph::Transition> found;
+        size_t tiles = 0, pruned = 0;
+        uint64_t frame_pairs = 0;
+
+        for (size_t job; (job = next_job++) < jobs.size();) {
+            uint32_t ai = jobs[job].first;
+            size_t ta = jobs[job].second;
+
+            for (uint32_t bi = ai; bi < features.size(); bi++) {
+                for (size_t tb = bi == ai ? ta : 0; tb < features[bi].radii.size(); tb++) {
+                    if (process_tile(features[ai], features[bi], ai, bi, ta, tb, ctx, buf, found, frame_pairs)) {
+                        tiles++;
+                    } else {
+                        pruned++;
+                    }
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(result_lock);
+        transitions.insert(transitions.end(), found.begin(), found.end());
+        st.tiles += tiles;
+        st.pruned_tiles += pruned;
+        st.frame_pairs += frame_pairs;
+    }, thread_count);
+
+    st.seconds = seconds_since(start);
+    if (stats) {
+        *stats = st;
+    }
+
+    std::vector<std::string> clip_names(names);
+    return MotionGraph(std::move(clip_names), std::move(transitions), opts.window);
+}
+
+
+void MotionGraph::write(const std::string &path) const
+{
+    std::ofstream out(path);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    out << "# Motion graph: <from clip> <from frame> <to clip> <to frame> <distance>\n";
+    out << ":window " << win << "\n";
+    for (const std::string &name: clip_names) {
+        out << ":clip " << name << "\n";
+    }
+    for (const Transition &t: trans) {
+        out << t.from_clip << " " << t.from_frame << " " << t.to_clip << " " << t.to_frame << " " << t.distance
+            << "\n";
+    }
+
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
+
+MotionGraph::MotionGraph(const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    std::string line;
+    int line_number = 0;
+
+    while (std::getline(in, line)) {
+        line_number++;
+        if (line.empty() || (line[0] == '#')) {
+            continue;
+        }
+
+        auto error = [&](const std::string &msg) {
+            return std::runtime_error(path + ":" + std::to_string(line_number) + ": " + msg);
+        };
+
+        if (!line.compare(0, 8, ":window ")) {
+            win = atoi(line.c_str() + 8);
+        } else if (!line.compare(0, 6, ":clip ")) {
+            clip_names.push_back(line.substr(6));
+        } else {
+            std::istringstream s(line);
+            Transition t;
+            if (!(s >> t.from_clip >> t.from_frame >> t.to_clip >> t.to_frame >> t.distance)) {
+                throw error("Malformed transition");
+            }
+            if ((t.from_clip >= clip_names.size()) || (t.to_clip >= clip_names.size())) {
+                throw error("Unknown clip");
+            }
+            trans.push_back(t);
+        }
+    }
+
+    if (win < 1) {
+        throw std::runtime_error(path + ": No (valid) window size given");
+    }
+
+    std::sort(trans.begin(), trans.end(), [](const Transition &a, const Transition &b) {
+        return a.from_clip != b.from_clip ? a.from_clip < b.from_clip : a.from_frame < b.from_frame;
+    });
+}
+
+
+// Root rotation matrix as applied by AMC::evaluate()
+static mat4 root_rotation(const ASF &asf, const vec3 &angles)
+{
+    return AMC::rotation(asf.root_axis(), angles.x(), angles.y(), angles.z());
+}
+
+
+// Inverse of root_rotation(), for root axes which are a permutation of x, y
+// and z (returns false otherwise)
+static bool root_angles(const ASF &asf, const mat4 &m, vec3 &angles)
+{
+    const std::vector<ASF::Axis> &axes = asf.root_axis();
+    if ((axes.size() != 3) || (axes[0] == axes[1]) || (axes[0] == axes[2]) || (axes[1] == axes[2]) ||
+        (axes[0] > ASF::RZ) || (axes[1] > ASF::RZ) || (axes[2] > ASF::RZ))
+    {
+        return false;
+    }
+
+    // m = R_i(alpha) * R_j(beta) * R_k(gamma)
+    int i = axes[2], j = axes[1], k = axes[0];
+    float s = j == (i + 1) % 3 ? 1.f : -1.f;
+
+    vec4 cols[3] = {
+        m * vec4(1.f, 0.f, 0.f, 0.f),
+        m * vec4(0.f, 1.f, 0.f, 0.f),
+        m * vec4(0.f, 0.f, 1.f, 0.f)
+    };
+    auto at = [&](int row, int col) {
+        return row == 0 ? cols[col].x() : row == 1 ? cols[col].y() : cols[col].z();
+    };
+
+    float sb = std::min(1.f, std::max(-1.f, s * at(i, k)));
+    float alpha, beta = asinf(sb), gamma;
+
+    if (fabsf(sb) < .9999999f) {
+        alpha = atan2f(-s * at(j, k), at(k, k));
+        gamma = atan2f(-s * at(i, j), at(i, i));
+    } else {
+        // Gimbal lock, put everything into alpha
+        alpha = atan2f(s * at(k, j), at(j, j));
+        gamma = 0.f;
+    }
+
+    float out[3];
+    out[i] = alpha;
+    out[j] = beta;
+    out[k] = gamma;
+    angles = vec3(out[0], out[1], out[2]);
+
+    return true;
+}
+
+
+// Heading of a root rotation (the angle around the y axis of its z axis)
+static float heading(const mat4 &rot)
+{
+    vec4 forward(rot * vec4(0.f, 0.f, 1.f, 0.f));
+    return atan2f(forward.x(), forward.z());
+}
+
+
+AMC *MotionGraph::walk(ASF *asf, const std::vector<const AMC *> &clips, size_t frames, unsigned seed,
+                       std::vector<std::string> *warnings) const
+{
+    if (clips.size() != clip_names.size()) {
+        throw std::invalid_argument("Expected one clip per clip of the motion graph");
+    }
+    for (const AMC *clip: clips) {
+        if ((clip->skeleton() != asf) || clip->frames().empty()) {
+            throw std::invalid_argument("All clips must have frames for the given skeleton");
+        }
+    }
+
+    std::mt19937 rng(seed);
+    std::vector<AMC::Frame> out;
+    out.reserve(frames);
+
+    vec3 dummy;
+    bool can_turn = root_angles(*asf, mat4::identity(), dummy);
+    if (!can_turn && warnings) {
+        warnings->push_back("Unsupported root axis order, motion graph walk parts are not turned");
+    }
+
+    // Applied to the current part
+    float turn = 0.f;
+    vec3 offset(vec3::zero());
+
+    auto aligned = [&](const AMC::Frame &frame) {
+        AMC::Frame f(frame);
+        mat4 t(mat4::identity());
+        t.rotate(turn, vec3(0.f, 1.f, 0.f));
+
+        vec3 p(asf->root_position() + frame.root_translation);
+        vec4 tp(t * vec4(p.x(), p.y(), p.z(), 1.f));
+        f.root_translation = vec3(tp.x(), tp.y(), tp.z()) + offset - asf->root_position();
+        root_angles(*asf, t * root_rotation(*asf, frame.root_rotation), f.root_rotation);
+
+        // Keep the angles continuous (for interpolation)
+        if (!out.empty()) {
+            const vec3 &prev = out.back().root_rotation;
+            float cur[3] = {f.root_rotation.x(), f.root_rotation.y(), f.root_rotation.z()};
+            float last[3] = {prev.x(), prev.y(), prev.z()};
+            const float two_pi = 2.f * static_cast<float>(M_PI);
+            for (int i = 0; i < 3; i++) {
+                cur[i] -= two_pi * roundf((cur[i] - last[i]) / two_pi);
+            }
+            f.root_rotation = vec3(cur[0], cur[1], cur[2]);
+        }
+
+        return f;
+    };
+
+    // Sets turn and offset so that anchor (of the next part) continues
+    // from the last frame (xz position and heading)
+    auto align_to_last = [&](const AMC::Frame &anchor) {
+        const AMC::Frame &last = out.back();
+        turn = can_turn ? heading(root_rotation(*asf, last.root_rotation)) -
+                          heading(root_rotation(*asf, anchor.root_rotation)) : 0.f;
+        offset = vec3::zero();
+
+        AMC::Frame moved(aligned(anchor));
+        offset = last.root_translation - moved.root_translation;
+        offset = vec3(offset.x(), 0.f, offset.z());
+    };
+
+    uint32_t clip = rng() % clips.size();
+    int frame = clips[clip]->first_frame();
+
+    while (out.size() < frames) {
+        const AMC &amc = *clips[clip];
+        int end = amc.first_frame() + amc.frames().size();
+
+        // Transitions leaving this clip at least a window ahead
+        auto first = std::lower_bound(trans.begin(), trans.end(), std::make_pair(clip, frame + win),
+                                      [](const Transition &t, const std::pair<uint32_t, int> &key) {
+            return t.from_clip != key.first ? t.from_clip < key.first : t.from_frame < key.second;
+        });
+        auto last = first;
+        while ((last != trans.end()) && (last->from_clip == clip)) {
+            ++last;
+        }
+
+        const Transition *t = first != last ? &first[rng() % (last - first)] : nullptr;
+        int part_end = t ? t->from_frame + 1 : end;
+
+        for (int f = frame; (f < part_end) && (out.size() < frames); f++) {
+            out.push_back(aligned(amc.frames()[f - amc.first_frame()]));
+        }
+
+        if (t) {
+            // The frame before to_frame matches from_frame
+            const AMC &next = *clips[t->to_clip];
+            int anchor = std::max(t->to_frame - 1, next.first_frame());
+
+            clip = t->to_clip;
+            frame = t->to_frame;
+            align_to_last(next.frames()[anchor - next.first_frame()]);
+        } else {
+            clip = rng() % clips.size();
+            frame = clips[clip]->first_frame();
+            align_to_last(clips[clip]->frames()[0]);
+        }
+    }
+
+    return new AMC(asf, std::move(out), 1);
+}
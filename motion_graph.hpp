@@ -0,0 +1,90 @@
+#ifndef MOTION_GRAPH_HPP
+#define MOTION_GRAPH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "amc.hpp"
+#include "asf.hpp"
+
+
+// Transitions between frames of a set of clips, where the motion of one clip
+// around a frame is similar enough to that of another (or the same) clip
+// around another frame to continue there.
+class MotionGraph {
+    public:
+        struct Transition {
+            // Indices into clips()
+            uint32_t from_clip, to_clip;
+            // After from_frame of the first clip, continue with to_frame of
+            // the second one
+            int from_frame, to_frame;
+            // RMS distance of the bone ends over the window (in meters)
+            float distance;
+        };
+
+        MotionGraph(void) {}
+        MotionGraph(std::vector<std::string> &&clips, std::vector<Transition> &&transitions, int window);
+        // Reads a graph written by write()
+        MotionGraph(const std::string &path);
+
+        void write(const std::string &path) const;
+
+        const std::vector<std::string> &clips(void) const { return clip_names; }
+        // Sorted by source clip and frame
+        const std::vector<Transition> &transitions(void) const { return trans; }
+        // Number of frames compared around each transition
+        int window(void) const { return win; }
+
+        // Bakes a random walk of the given length into a new clip for the
+        // skeleton (clips must have been loaded for it and correspond to
+        // clips()): starts at the first frame of a random clip, follows a
+        // random transition at least window() frames ahead, and restarts
+        // with another clip at dead ends. Every part is moved and turned
+        // around the y axis so that its root continues where the last one
+        // left off. Problems which do not prevent the walk are appended to
+        // warnings (if given).
+        AMC *walk(ASF *asf, const std::vector<const AMC *> &clips, size_t frames, unsigned seed,
+                  std::vector<std::string> *warnings = nullptr) const;
+
+
+    private:
+        std::vector<std::string> clip_names;
+        std::vector<Transition> trans;
+        int win = 0;
+};
+
+
+struct MotionGraphOptions {
+    // Frames compared around a transition
+    int window = 10;
+    // Largest RMS distance of the bone ends (in meters) for a transition
+    float threshold = .05f;
+    // The distance matrices are computed in tiles of this many frames
+    // squared
+    int tile = 128;
+    // 0 means one per hardware thread
+    unsigned threads = 0;
+};
+
+struct MotionGraphStats {
+    size_t frames = 0;
+    // Tiles of the distance matrices computed and skipped (because no
+    // distance in them can be below the threshold)
+    size_t tiles = 0, pruned_tiles = 0;
+    // Frame distances computed
+    uint64_t frame_pairs = 0;
+    double feature_seconds = 0., seconds = 0.;
+};
+
+// Computes the windowed pose distances between all frames of all pairs of
+// clips (for the pose features see PoseIndex; the clips' skeletons must all
+// contain the first one's bones), and turns every local minimum below the
+// threshold into a transition (in both directions). Within a clip, frames
+// less than a window apart are not compared.
+MotionGraph find_transitions(const std::vector<std::string> &names, const std::vector<const AMC *> &clips,
+                             const MotionGraphOptions &opts, MotionGraphStats *stats = nullptr);
+
+#endif
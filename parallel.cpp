@@ -0,0 +1,28 @@
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "parallel.hpp"
+
+
+void parallel_ranges(size_t count, const std::function<void(size_t, size_t)> &func, unsigned thread_count)
+{
+    size_t threads_used = thread_count ? thread_count : std::max(1u, std::thread::hardware_concurrency());
+    threads_used = std::min(threads_used, std::max<size_t>(count, 1));
+
+    if (threads_used == 1) {
+        func(0, count);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threads_used; t++) {
+        threads.emplace_back(func, count * t / threads_used, count * (t + 1) / threads_used);
+    }
+
+    for (std::thread &thread: threads) {
+        thread.join();
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <cstddef>
+#include <functional>
+
+
+// Calls func(first, end) for disjoint ranges covering [0, count), one per
+// thread (thread_count 0 means one per hardware thread)
+void parallel_ranges(size_t count, const std::function<void(size_t, size_t)> &func, unsigned thread_count = 0);
+
+#endif
@@ -0,0 +1,129 @@
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "bone_picker.hpp"
+#include "capsule.hpp"
+
+
+using namespace dake::math;
+
+
+// Compares the bone picking latency of the BVH against testing every capsule,
+// for a crowd of characters playing the given clip (each at a different
+// frame), placed on a grid
+int main(int argc, char *argv[])
+{
+    if ((argc < 3) || (argc > 5)) {
+        fprintf(stderr, "Usage: %s <model.asf> <motion.amc> [characters=1000] [rays=10000]\n", argv[0]);
+        return 1;
+    }
+
+    int characters = argc > 3 ? atoi(argv[3]) : 1000;
+    int rays = argc > 4 ? atoi(argv[4]) : 10000;
+
+    std::ifstream asf_str(argv[1]);
+    if (!asf_str.is_open()) {
+        fprintf(stderr, "%s: Could not open %s: %s\n", argv[0], argv[1], strerror(errno));
+        return 1;
+    }
+
+    std::ifstream amc_str(argv[2]);
+    if (!amc_str.is_open()) {
+        fprintf(stderr, "%s: Could not open %s: %s\n", argv[0], argv[2], strerror(errno));
+        return 1;
+    }
+
+    try {
+        ASF asf(asf_str);
+        AMC amc(amc_str, &asf);
+
+        int frame_count = amc.frames().size();
+        int grid = ceilf(sqrtf(characters));
+
+        // Builds the capsules of the whole crowd for the given frame offset
+        auto crowd = [&](int offset, std::vector<Capsule> &capsules) {
+            capsules.clear();
+            for (int c = 0; c < characters; c++) {
+                amc.apply_frame(amc.first_frame() + (c * 7 + offset) % frame_count);
+
+                size_t base = capsules.size();
+                bone_capsules(asf, capsules);
+
+                vec3 pos(2.f * (c % grid), 0.f, 2.f * (c / grid));
+                for (size_t i = base; i < capsules.size(); i++) {
+                    capsules[i].a += pos;
+                    capsules[i].b += pos;
+                }
+            }
+        };
+
+        std::vector<Capsule> capsules;
+        crowd(0, capsules);
+
+        BonePicker picker;
+
+        auto start = std::chrono::steady_clock::now();
+        picker.build(capsules);
+        std::chrono::duration<double> build_time = std::chrono::steady_clock::now() - start;
+
+        crowd(1, capsules);
+
+        start = std::chrono::steady_clock::now();
+        picker.refit(capsules);
+        std::chrono::duration<double> refit_time = std::chrono::steady_clock::now() - start;
+
+        // Rays from above, aimed somewhere at the crowd
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> target(0.f, 2.f * grid);
+        std::vector<std::pair<vec3, vec3>> ray_list;
+        for (int i = 0; i < rays; i++) {
+            vec3 org(grid, 10.f, -5.f);
+            vec3 dir(vec3(target(rng), 1.f, target(rng)) - org);
+            dir.normalize();
+            ray_list.emplace_back(org, dir);
+        }
+
+        int mismatches = 0;
+        std::vector<float> bvh_hits(rays, -1.f);
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rays; i++) {
+            picker.pick(ray_list[i].first, ray_list[i].second, &bvh_hits[i]);
+        }
+        std::chrono::duration<double> bvh_time = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rays; i++) {
+            // Compare distances, the index may differ where bones touch
+            float dist = -1.f;
+            picker.pick_brute_force(ray_list[i].first, ray_list[i].second, &dist);
+            if (dist != bvh_hits[i]) {
+                mismatches++;
+            }
+        }
+        std::chrono::duration<double> brute_time = std::chrono::steady_clock::now() - start;
+
+        printf("%i characters, %zu capsules, %i rays\n", characters, capsules.size(), rays);
+        printf("build:       %10.3f ms\n", build_time.count() * 1e3);
+        printf("refit:       %10.3f ms\n", refit_time.count() * 1e3);
+        printf("BVH pick:    %10.3f us/ray\n", bvh_time.count() * 1e6 / rays);
+        printf("brute force: %10.3f us/ray\n", brute_time.count() * 1e6 / rays);
+        printf("mismatches:  %10i\n", mismatches);
+    } catch (std::exception &e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+
+    return 0;
+}
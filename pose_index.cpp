@@ -0,0 +1,691 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "pose_index.hpp"
+#include "trace.hpp"
+
+
+using namespace dake::math;
+
+
+static const char index_magic[8] = {'C', 'G', '2', 'P', 'O', 'S', 'E', 'S'};
+static const uint32_t index_version = 1;
+
+
+std::vector<int> pose_feature_bones(const ASF &asf)
+{
+    std::vector<int> bones;
+
+    for (size_t bi = 0; bi < asf.bones().size(); bi++) {
+        if ((static_cast<int>(bi) != asf.root_index()) && (asf.bones()[bi].length > 0.f)) {
+            bones.push_back(bi);
+        }
+    }
+
+    return bones;
+}
+
+
+// Bone end positions relative to the root, rotated around y so that the
+// root faces +z
+void pose_features(const ASF &asf, const AMC::Frame &frame, const std::vector<int> &bones, mat4 *trans, float *out)
+{
+    AMC::evaluate(asf, frame, trans);
+
+    const mat4 &root = trans[asf.root_index()];
+    vec4 origin(root * vec4(0.f, 0.f, 0.f, 1.f));
+    vec4 forward(root * vec4(0.f, 0.f, 1.f, 0.f));
+
+    float heading_len = sqrtf(forward.x() * forward.x() + forward.z() * forward.z());
+    float c = heading_len > 0.f ? forward.z() / heading_len : 1.f;
+    float s = heading_len > 0.f ? forward.x() / heading_len : 0.f;
+
+    for (size_t i = 0; i < bones.size(); i++) {
+        const ASF::Bone &bone = asf.bones()[bones[i]];
+        vec3 tip(bone.length * bone.direction);
+        vec4 end(trans[bones[i]] * vec4(tip.x(), tip.y(), tip.z(), 1.f));
+
+        float dx = end.x() - origin.x(), dz = end.z() - origin.z();
+        out[3 * i + 0] = c * dx - s * dz;
+        out[3 * i + 1] = end.y() - origin.y();
+        out[3 * i + 2] = s * dx + c * dz;
+    }
+}
+
+
+// Eigenvectors (the columns of vecs) and eigenvalues of the symmetric n x n
+// matrix a, by cyclic Jacobi rotations
+static void symmetric_eigen(std::vector<double> a, size_t n, std::vector<double> &values, std::vector<double> &vecs)
+{
+    vecs.assign(n * n, 0.);
+    for (size_t i = 0; i < n; i++) {
+        vecs[i * n + i] = 1.;
+    }
+
+    double scale = 0.;
+    for (size_t i = 0; i < n * n; i++) {
+        scale += a[i] * a[i];
+    }
+
+    for (int sweep = 0; sweep < 64; sweep++) {
+        double off = 0.;
+        for (size_t p = 0; p < n; p++) {
+            for (size_t q = p + 1; q < n; q++) {
+                off += a[p * n + q] * a[p * n + q];
+            }
+        }
+        if (off <= 1e-24 * scale) {
+            break;
+        }
+
+        for (size_t p = 0; p < n; p++) {
+            for (size_t q = p + 1; q < n; q++) {
+                double apq = a[p * n + q];
+                if (fabs(apq) < 1e-300) {
+                    continue;
+                }
+
+                double theta = (a[q * n + q] - a[p * n + p]) / (2. * apq);
+                double t = (theta >= 0. ? 1. : -1.) / (fabs(theta) + sqrt(theta * theta + 1.));
+                double cs = 1. / sqrt(t * t + 1.), sn = t * cs;
+
+                for (size_t k = 0; k < n; k++) {
+                    double akp = a[k * n + p], akq = a[k * n + q];
+                    a[k * n + p] = cs * akp - sn * akq;
+                    a[k * n + q] = sn * akp + cs * akq;
+                }
+                for (size_t k = 0; k < n; k++) {
+                    double apk = a[p * n + k], aqk = a[q * n + k];
+                    a[p * n + k] = cs * apk - sn * aqk;
+                    a[q * n + k] = sn * apk + cs * aqk;
+                }
+                for (size_t k = 0; k < n; k++) {
+                    double vkp = vecs[k * n + p], vkq = vecs[k * n + q];
+                    vecs[k * n + p] = cs * vkp - sn * vkq;
+                    vecs[k * n + q] = sn * vkp + cs * vkq;
+                }
+            }
+        }
+    }
+
+    values.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        values[i] = a[i * n + i];
+    }
+}
+
+
+PoseIndex::PoseIndex(const ASF &reference)
+{
+    for (int bi: pose_feature_bones(reference)) {
+        bone_names.push_back(reference.bones()[bi].name);
+    }
+
+    if (bone_names.empty()) {
+        throw std::invalid_argument("The skeleton has no bones to compare poses by");
+    }
+}
+
+
+std::vector<int> PoseIndex::bone_map(const ASF &asf) const
+{
+    std::vector<int> map;
+    map.reserve(bone_names.size());
+
+    for (const std::string &name: bone_names) {
+        int bi = asf.bone_index(name);
+        if (bi < 0) {
+            throw std::invalid_argument("Skeleton has no bone " + name + " (required by the pose index)");
+        }
+        map.push_back(bi);
+    }
+
+    return map;
+}
+
+
+void PoseIndex::add(const std::string &name, const AMC &amc)
+{
+    if (is_built) {
+        throw std::runtime_error("Cannot add clips to a pose index which has been built");
+    }
+
+    TRACE_SCOPE("PoseIndex::add");
+
+    const ASF &asf = *amc.skeleton();
+    std::vector<int> map(bone_map(asf));
+    size_t feature_count = 3 * map.size();
+
+    const std::vector<AMC::Frame> &frames = amc.frames();
+    std::vector<float> features(frames.size() * feature_count);
+    std::vector<mat4> trans(asf.bones().size());
+
+    for (size_t i = 0; i < frames.size(); i++) {
+        pose_features(asf, frames[i], map, trans.data(), &features[i * feature_count]);
+    }
+
+    std::lock_guard<std::mutex> lock(add_lock);
+
+    uint32_t clip = clip_names.size();
+    clip_names.push_back(name);
+
+    for (size_t i = 0; i < frames.size(); i++) {
+        entries.push_back(Entry{clip, static_cast<int32_t>(amc.first_frame() + i)});
+    }
+    pending.insert(pending.end(), features.begin(), features.end());
+}
+
+
+float PoseIndex::project(const float *features, float *point) const
+{
+    size_t feature_count = mean.size();
+    float norm2 = 0.f;
+
+    for (size_t f = 0; f < feature_count; f++) {
+        float centered = features[f] - mean[f];
+        norm2 += centered * centered;
+    }
+
+    for (int d = 0; d < dims; d++) {
+        const float *component = &components[d * feature_count];
+        float dot = 0.f;
+        for (size_t f = 0; f < feature_count; f++) {
+            dot += component[f] * (features[f] - mean[f]);
+        }
+        point[d] = dot;
+        norm2 -= dot * dot;
+    }
+
+    return sqrtf(std::max(norm2, 0.f));
+}
+
+
+void PoseIndex::build(const BuildOptions &opts)
+{
+    if (is_built) {
+        throw std::runtime_error("Pose index has already been built");
+    }
+    if (entries.empty()) {
+        throw std::runtime_error("Pose index is empty");
+    }
+    if (entries.size() > UINT32_MAX) {
+        throw std::runtime_error("Too many frames for a pose index");
+    }
+
+    TRACE_SCOPE("PoseIndex::build");
+
+    size_t n = entries.size();
+    size_t feature_count = 3 * bone_names.size();
+    unsigned thread_count = opts.threads ? opts.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    dims = std::max(1, std::min(opts.dimensions, static_cast<int>(feature_count)));
+
+    // Principal components of a sample of frames
+    {
+        TRACE_SCOPE("PoseIndex::build::pca");
+
+        size_t samples = std::min(n, std::max<size_t>(opts.pca_samples, 1));
+        std::vector<double> sum(feature_count, 0.), cov(feature_count * feature_count, 0.);
+        std::mutex sum_lock;
+
+        parallel_ranges(samples, [&](size_t first, size_t end) {
+            std::vector<double> s(feature_count, 0.), c(feature_count * feature_count, 0.);
+
+            for (size_t i = first; i < end; i++) {
+                const float *x = &pending[i * n / samples * feature_count];
+                for (size_t p = 0; p < feature_count; p++) {
+                    s[p] += x[p];
+                    for (size_t q = p; q < feature_count; q++) {
+                        c[p * feature_count + q] += static_cast<double>(x[p]) * x[q];
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(sum_lock);
+            for (size_t p = 0; p < feature_count; p++) {
+                sum[p] += s[p];
+            }
+            for (size_t i = 0; i < c.size(); i++) {
+                cov[i] += c[i];
+            }
+        }, thread_count);
+
+        mean.resize(feature_count);
+        for (size_t p = 0; p < feature_count; p++) {
+            mean[p] = sum[p] / samples;
+        }
+        for (size_t p = 0; p < feature_count; p++) {
+            for (size_t q = p; q < feature_count; q++) {
+                double c = cov[p * feature_count + q] / samples - sum[p] / samples * (sum[q] / samples);
+                cov[p * feature_count + q] = cov[q * feature_count + p] = c;
+            }
+        }
+
+        std::vector<double> values, vecs;
+        symmetric_eigen(cov, feature_count, values, vecs);
+
+        std::vector<size_t> by_variance(feature_count);
+        for (size_t i = 0; i < feature_count; i++) {
+            by_variance[i] = i;
+        }
+        std::sort(by_variance.begin(), by_variance.end(), [&](size_t a, size_t b) { return values[a] > values[b]; });
+
+        double total = 0., kept = 0.;
+        for (size_t i = 0; i < feature_count; i++) {
+            total += std::max(values[i], 0.);
+        }
+
+        components.resize(dims * feature_count);
+        for (int d = 0; d < dims; d++) {
+            size_t col = by_variance[d];
+            for (size_t f = 0; f < feature_count; f++) {
+                components[d * feature_count + f] = vecs[f * feature_count + col];
+            }
+            kept += std::max(values[col], 0.);
+        }
+
+        explained = total > 0. ? kept / total : 1.f;
+    }
+
+    std::vector<float> unordered(n * dims);
+    std::vector<float> unordered_residuals(n);
+
+    {
+        TRACE_SCOPE("PoseIndex::build::project");
+
+        parallel_ranges(n, [&](size_t first, size_t end) {
+            for (size_t i = first; i < end; i++) {
+                unordered_residuals[i] = project(&pending[i * feature_count], &unordered[i * dims]);
+            }
+        }, thread_count);
+
+        pending.clear();
+        pending.shrink_to_fit();
+    }
+
+    {
+        TRACE_SCOPE("PoseIndex::build::tree");
+
+        size_t leaf_size = std::max<size_t>(opts.leaf_size, 1);
+        tree_depth = 0;
+        while ((n >> tree_depth) > leaf_size) {
+            tree_depth++;
+        }
+
+        nodes.assign((size_t(1) << tree_depth) - 1, Node{0, 0.f});
+        leaf_begin.assign((size_t(1) << tree_depth) + 1, 0);
+        leaf_begin.back() = n;
+
+        std::vector<uint32_t> order(n);
+        for (size_t i = 0; i < n; i++) {
+            order[i] = i;
+        }
+
+        // Subtrees are built on their own threads down to this level
+        int spawn_levels = 0;
+        while ((1u << spawn_levels) < thread_count) {
+            spawn_levels++;
+        }
+
+        points.swap(unordered);
+        build_tree(0, 0, n, 0, order, spawn_levels);
+        points.swap(unordered);
+
+        std::vector<Entry> ordered_entries(n);
+        residuals.resize(n);
+        points.resize(n * dims);
+
+        parallel_ranges(n, [&](size_t first, size_t end) {
+            for (size_t i = first; i < end; i++) {
+                ordered_entries[i] = entries[order[i]];
+                residuals[i] = unordered_residuals[order[i]];
+                memcpy(&points[i * dims], &unordered[order[i] * dims], dims * sizeof(float));
+            }
+        }, thread_count);
+
+        entries.swap(ordered_entries);
+    }
+
+    is_built = true;
+}
+
+
+// points is still in insertion order while building, order maps the tree
+// order to it
+void PoseIndex::build_tree(size_t node, size_t begin, size_t end, int level, std::vector<uint32_t> &order,
+                           int spawn_levels)
+{
+    if (level == tree_depth) {
+        leaf_begin[node - nodes.size()] = begin;
+        return;
+    }
+
+    // Split along the axis with the largest extent
+    std::vector<float> lo(dims, HUGE_VALF), hi(dims, -HUGE_VALF);
+    for (size_t i = begin; i < end; i++) {
+        const float *p = &points[order[i] * dims];
+        for (int d = 0; d < dims; d++) {
+            lo[d] = std::min(lo[d], p[d]);
+            hi[d] = std::max(hi[d], p[d]);
+        }
+    }
+
+    int axis = 0;
+    for (int d = 1; d < dims; d++) {
+        if (hi[d] - lo[d] > hi[axis] - lo[axis]) {
+            axis = d;
+        }
+    }
+
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](uint32_t a, uint32_t b) {
+        return points[a * dims + axis] < points[b * dims + axis];
+    });
+
+    nodes[node] = Node{axis, points[order[mid] * dims + axis]};
+
+    if (level < spawn_levels) {
+        std::thread left([&]() { build_tree(2 * node + 1, begin, mid, level + 1, order, spawn_levels); });
+        build_tree(2 * node + 2, mid, end, level + 1, order, spawn_levels);
+        left.join();
+    } else {
+        build_tree(2 * node + 1, begin, mid, level + 1, order, spawn_levels);
+        build_tree(2 * node + 2, mid, end, level + 1, order, spawn_levels);
+    }
+}
+
+
+struct PoseIndex::QueryState {
+    // Max-heap of (squared distance, index) of the best points so far
+    std::vector<std::pair<float, uint32_t>> best;
+    size_t k;
+    size_t leaves_left;
+
+    float worst(void) const
+    { return best.size() < k ? HUGE_VALF : best.front().first; }
+};
+
+
+// reduced_dist2 is a lower bound of the squared (reduced) distance from
+// point to the node's region, offsets are the per-axis distances making it
+// up (Arya and Mount's incremental distance)
+void PoseIndex::search(size_t node, int level, const float *point, float residual, float reduced_dist2,
+                       float *offsets, QueryState &state) const
+{
+    if (state.leaves_left == 1) {
+        return;
+    }
+
+    if (level == tree_depth) {
+        size_t leaf = node - nodes.size();
+
+        for (size_t i = leaf_begin[leaf]; i < leaf_begin[leaf + 1]; i++) {
+            const float *p = &points[i * dims];
+            float r = residuals[i] - residual;
+            float dist2 = r * r;
+            for (int d = 0; d < dims; d++) {
+                float diff = p[d] - point[d];
+                dist2 += diff * diff;
+            }
+
+            if (dist2 < state.worst()) {
+                if (state.best.size() == state.k) {
+                    std::pop_heap(state.best.begin(), state.best.end());
+                    state.best.pop_back();
+                }
+                state.best.emplace_back(dist2, i);
+                std::push_heap(state.best.begin(), state.best.end());
+            }
+        }
+
+        if (state.leaves_left) {
+            state.leaves_left--;
+        }
+        return;
+    }
+
+    const Node &n = nodes[node];
+    float diff = point[n.axis] - n.split;
+    size_t near = diff < 0.f ? 2 * node + 1 : 2 * node + 2;
+    size_t far = diff < 0.f ? 2 * node + 2 : 2 * node + 1;
+
+    search(near, level + 1, point, residual, reduced_dist2, offsets, state);
+
+    float old_offset = offsets[n.axis];
+    float far_dist2 = reduced_dist2 - old_offset * old_offset + diff * diff;
+
+    if (far_dist2 < state.worst()) {
+        offsets[n.axis] = diff;
+        search(far, level + 1, point, residual, far_dist2, offsets, state);
+        offsets[n.axis] = old_offset;
+    }
+}
+
+
+std::vector<PoseMatch> PoseIndex::query(const ASF &asf, const AMC::Frame &pose, size_t k, size_t max_leaves) const
+{
+    if (!is_built) {
+        throw std::runtime_error("Pose index has not been built");
+    }
+
+    std::vector<int> map(bone_map(asf));
+    std::vector<mat4> trans(asf.bones().size());
+    std::vector<float> features(3 * map.size());
+    pose_features(asf, pose, map, trans.data(), features.data());
+
+    std::vector<float> point(dims), offsets(dims, 0.f);
+    float residual = project(features.data(), point.data());
+
+    QueryState state;
+    state.k = std::min(k, entries.size());
+    // 1 means that the limit has been reached (0 that there is none)
+    state.leaves_left = max_leaves ? max_leaves + 1 : 0;
+    state.best.reserve(state.k + 1);
+
+    if (state.k) {
+        search(0, 0, point.data(), residual, 0.f, offsets.data(), state);
+    }
+
+    std::sort_heap(state.best.begin(), state.best.end());
+
+    std::vector<PoseMatch> matches;
+    matches.reserve(state.best.size());
+    for (const auto &b: state.best) {
+        const Entry &e = entries[b.second];
+        matches.push_back(PoseMatch{e.clip, e.frame, sqrtf(b.first)});
+    }
+
+    return matches;
+}
+
+
+static void write_u32(std::ofstream &out, uint32_t value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void write_string(std::ofstream &out, const std::string &str)
+{
+    write_u32(out, str.length());
+    out.write(str.data(), str.length());
+}
+
+template<typename T> static void write_array(std::ofstream &out, const std::vector<T> &v)
+{
+    write_u32(out, v.size());
+    out.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+}
+
+
+void PoseIndex::write(const std::string &path) const
+{
+    if (!is_built) {
+        throw std::runtime_error("Pose index has not been built");
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    out.write(index_magic, sizeof(index_magic));
+    write_u32(out, index_version);
+    write_u32(out, dims);
+    write_u32(out, tree_depth);
+    out.write(reinterpret_cast<const char *>(&explained), sizeof(explained));
+
+    write_u32(out, bone_names.size());
+    for (const std::string &name: bone_names) {
+        write_string(out, name);
+    }
+    write_u32(out, clip_names.size());
+    for (const std::string &name: clip_names) {
+        write_string(out, name);
+    }
+
+    write_array(out, mean);
+    write_array(out, components);
+    write_array(out, entries);
+    write_array(out, points);
+    write_array(out, residuals);
+    write_array(out, nodes);
+    write_array(out, leaf_begin);
+
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
+
+static uint32_t read_u32(std::ifstream &in)
+{
+    uint32_t value;
+    if (!in.read(reinterpret_cast<char *>(&value), sizeof(value))) {
+        throw std::runtime_error("Unexpected end of pose index");
+    }
+    return value;
+}
+
+static std::string read_string(std::ifstream &in)
+{
+    std::string str(read_u32(in), '\0');
+    if (!in.read(&str[0], str.length())) {
+        throw std::runtime_error("Unexpected end of pose index");
+    }
+    return str;
+}
+
+template<typename T> static void read_array(std::ifstream &in, std::vector<T> &v, size_t expected)
+{
+    if (read_u32(in) != expected) {
+        throw std::runtime_error("Corrupt pose index");
+    }
+    v.resize(expected);
+    if (!in.read(reinterpret_cast<char *>(v.data()), expected * sizeof(T))) {
+        throw std::runtime_error("Unexpected end of pose index");
+    }
+}
+
+
+PoseIndex::PoseIndex(const std::string &path)
+{
+    TRACE_SCOPE("PoseIndex::read");
+
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    char magic[sizeof(index_magic)];
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, index_magic, sizeof(magic))) {
+        throw std::runtime_error(path + " is not a pose index");
+    }
+    if (read_u32(in) != index_version) {
+        throw std::runtime_error(path + ": Unsupported pose index version");
+    }
+
+    dims = read_u32(in);
+    tree_depth = read_u32(in);
+    if (!in.read(reinterpret_cast<char *>(&explained), sizeof(explained))) {
+        throw std::runtime_error("Unexpected end of pose index");
+    }
+
+    bone_names.resize(read_u32(in));
+    for (std::string &name: bone_names) {
+        name = read_string(in);
+    }
+    clip_names.resize(read_u32(in));
+    for (std::string &name: clip_names) {
+        name = read_string(in);
+    }
+
+    size_t feature_count = 3 * bone_names.size();
+    if ((dims < 1) || (static_cast<size_t>(dims) > feature_count) || (tree_depth < 0) || (tree_depth > 31)) {
+        throw std::runtime_error(path + ": Corrupt pose index");
+    }
+
+    read_array(in, mean, feature_count);
+    read_array(in, components, dims * feature_count);
+
+    // The entry count is only known from the array itself
+    std::streampos entries_pos = in.tellg();
+    size_t n = read_u32(in);
+    in.seekg(entries_pos);
+
+    read_array(in, entries, n);
+    read_array(in, points, n * dims);
+    read_array(in, residuals, n);
+    read_array(in, nodes, (size_t(1) << tree_depth) - 1);
+    read_array(in, leaf_begin, (size_t(1) << tree_depth) + 1);
+
+    for (const Entry &e: entries) {
+        if (e.clip >= clip_names.size()) {
+            throw std::runtime_error(path + ": Corrupt pose index");
+        }
+    }
+    for (const Node &node: nodes) {
+        if ((node.axis < 0) || (node.axis >= dims)) {
+            throw std::runtime_error(path + ": Corrupt pose index");
+        }
+    }
+    for (size_t i = 0; i + 1 < leaf_begin.size(); i++) {
+        if ((leaf_begin[i] > leaf_begin[i + 1]) || (leaf_begin[i + 1] > n)) {
+            throw std::runtime_error(path + ": Corrupt pose index");
+        }
+    }
+
+    is_built = true;
+}
+
+
+size_t PoseIndex::memory_size(void) const
+{
+    size_t size = heap_bytes(bone_names) + heap_bytes(clip_names) + heap_bytes(entries) + heap_bytes(pending)
+                + heap_bytes(mean) + heap_bytes(components) + heap_bytes(points) + heap_bytes(residuals)
+                + heap_bytes(nodes) + heap_bytes(leaf_begin);
+
+    for (const std::string &name: bone_names) {
+        size += heap_bytes(name);
+    }
+    for (const std::string &name: clip_names) {
+        size += heap_bytes(name);
+    }
+
+    return size;
+}
@@ -0,0 +1,143 @@
+#ifndef POSE_INDEX_HPP
+#define POSE_INDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "amc.hpp"
+#include "asf.hpp"
+
+
+// Bones describing a pose (see PoseIndex): all but the root which have a
+// non-zero length
+std::vector<int> pose_feature_bones(const ASF &asf);
+
+// Feature vector of a pose (three floats per entry of bones, which index
+// into asf.bones()); trans receives all bones' motion transformations
+void pose_features(const ASF &asf, const AMC::Frame &frame, const std::vector<int> &bones, dake::math::mat4 *trans,
+                   float *out);
+
+
+struct PoseMatch {
+    // Index into PoseIndex::clips()
+    size_t clip;
+    int frame;
+    // Approximates the euclidean distance between the pose features (in
+    // meters; a lower bound, see PoseIndex)
+    float distance;
+};
+
+
+// Nearest neighbor search over the poses of many clips.
+//
+// A pose's feature vector consists of the end positions of all bones (of
+// the reference skeleton, with non-zero length) relative to the root,
+// rotated around the y axis so that the root faces +z; so poses compare
+// independently of where the character is and where it is heading. The
+// features are reduced to their principal components, which are stored in a
+// k-d tree. The remaining components only contribute the difference of
+// their norms to distances, so those are lower bounds of the actual feature
+// distances.
+class PoseIndex {
+    public:
+        struct BuildOptions {
+            // Principal components kept
+            int dimensions = 16;
+            // Maximum number of points in one k-d tree leaf
+            size_t leaf_size = 32;
+            // The principal components are determined from at most this
+            // many frames (spread evenly over all frames)
+            size_t pca_samples = 100000;
+            // 0 means one per hardware thread
+            unsigned threads = 0;
+        };
+
+        // For building a new index; its features are the bones of the
+        // given skeleton (which need not be kept around)
+        PoseIndex(const ASF &reference);
+        // Reads an index written by write()
+        PoseIndex(const std::string &path);
+
+        // Adds all frames of a clip (before build(); may be called from
+        // multiple threads at once). The clip's skeleton must contain all
+        // bones of the reference skeleton (matched by name). Until build(),
+        // the full features (three floats per bone per frame) are kept.
+        void add(const std::string &name, const AMC &amc);
+
+        void build(const BuildOptions &opts);
+        bool built(void) const { return is_built; }
+
+        void write(const std::string &path) const;
+
+        // The k nearest frames (closest first) to the given pose, which must
+        // be for a skeleton containing all bones of the index. If max_leaves
+        // is not 0, the search stops after visiting that many k-d tree
+        // leaves (so the result may be approximate).
+        std::vector<PoseMatch> query(const ASF &asf, const AMC::Frame &pose, size_t k, size_t max_leaves = 0) const;
+
+        // Names given to add()
+        const std::vector<std::string> &clips(void) const { return clip_names; }
+        // Number of frames
+        size_t size(void) const { return entries.size(); }
+        int dimensions(void) const { return dims; }
+        // Sum of the variances along the kept components relative to the
+        // total variance (set by build())
+        float explained_variance(void) const { return explained; }
+
+        size_t memory_size(void) const;
+
+
+    private:
+        struct Entry {
+            uint32_t clip;
+            int32_t frame;
+        };
+
+        struct QueryState;
+
+        struct Node {
+            int32_t axis;
+            float split;
+        };
+
+        // Maps the index's bones to those of the given skeleton
+        std::vector<int> bone_map(const ASF &asf) const;
+        // Stores the principal components of the features in point, returns
+        // the norm of the remaining components
+        float project(const float *features, float *point) const;
+        void build_tree(size_t node, size_t begin, size_t end, int level, std::vector<uint32_t> &order,
+                        int spawn_levels);
+        void search(size_t node, int level, const float *point, float residual, float reduced_dist2, float *offsets,
+                    QueryState &state) const;
+
+        std::vector<std::string> bone_names;
+        std::vector<std::string> clip_names;
+        std::vector<Entry> entries;
+
+        // Features of all frames added but not built yet
+        std::vector<float> pending;
+        std::mutex add_lock;
+        bool is_built = false;
+
+        // Feature mean and principal components (dims rows of
+        // 3 * bone_names.size() floats)
+        int dims = 0;
+        std::vector<float> mean, components;
+        float explained = 0.f;
+
+        // Reduced points (dims floats per entry, in k-d tree leaf order) and
+        // the norms of their remaining components
+        std::vector<float> points, residuals;
+
+        // Complete binary tree of depth tree_depth: nodes has the
+        // 2^tree_depth - 1 inner nodes (children of n are 2n + 1 and
+        // 2n + 2), leaf i covers [leaf_begin[i], leaf_begin[i + 1])
+        int tree_depth = 0;
+        std::vector<Node> nodes;
+        std::vector<uint32_t> leaf_begin;
+};
+
+#endif
@@ -0,0 +1,224 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <dake/math/matrix.hpp>
+
+#include "asf.hpp"
+#include "pose_publisher.hpp"
+#include "trace.hpp"
+
+
+using namespace dake::math;
+
+
+static const char segment_magic[8] = {'C', 'G', '2', 'P', 'O', 'S', 'E', 0};
+static const uint32_t segment_version = 1;
+
+static_assert(sizeof(mat4) == 16 * sizeof(float), "Matrices are copied as 16 floats");
+
+
+static uint64_t round_up(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+
+PosePublisher::PosePublisher(const std::string &name, const ASF &asf):
+    shm_name(name),
+    bone_count(asf.bones().size())
+{
+    std::string names;
+    for (const ASF::Bone &bone: asf.bones()) {
+        names += bone.name;
+        names.push_back(0);
+    }
+
+    uint64_t buffer_offset = round_up(sizeof(PoseSegmentHeader), 64);
+    uint64_t buffer_stride = round_up(sizeof(PoseBuffer) + bone_count * 16 * sizeof(float), 64);
+    uint64_t names_offset = buffer_offset + 2 * buffer_stride;
+    uint64_t size = names_offset + names.size();
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Could not create shared memory " + name + ": " + strerror(errno));
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        int err = errno;
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Could not resize shared memory " + name + ": " + strerror(err));
+    }
+
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+
+    if (mem == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Could not map shared memory " + name + ": " + strerror(err));
+    }
+
+    // The segment is zeroed by ftruncate(), so both buffers have version 0
+    // (i.e. invalid) and there is no pose yet
+    header = new (mem) PoseSegmentHeader;
+    header->version = segment_version;
+    header->bone_count = bone_count;
+    header->buffer_offset = buffer_offset;
+    header->buffer_stride = buffer_stride;
+    header->names_offset = names_offset;
+    header->names_size = names.size();
+    header->size = size;
+    header->sequence.store(0, std::memory_order_relaxed);
+
+    for (int i = 0; i < 2; i++) {
+        new (static_cast<char *>(mem) + buffer_offset + i * buffer_stride) PoseBuffer;
+    }
+
+    memcpy(static_cast<char *>(mem) + names_offset, names.data(), names.size());
+
+    // Readers check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, segment_magic, sizeof(segment_magic));
+}
+
+
+PosePublisher::~PosePublisher(void)
+{
+    munmap(header, header->size);
+    shm_unlink(shm_name.c_str());
+}
+
+
+void PosePublisher::publish(int frame, const mat4 *transforms)
+{
+    uint64_t seq = header->sequence.load(std::memory_order_relaxed) + 1;
+    PoseBuffer *buf = reinterpret_cast<PoseBuffer *>(reinterpret_cast<char *>(header) + header->buffer_offset +
+                                                     (seq & 1) * header->buffer_stride);
+
+    // Readers of the pose two steps back must notice this buffer is changing
+    buf->version.store(2 * seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    buf->frame = frame;
+    buf->publish_ns = trace_clock();
+    memcpy(static_cast<void *>(buf + 1), transforms, bone_count * sizeof(mat4));
+
+    buf->version.store(2 * seq, std::memory_order_release);
+    header->sequence.store(seq, std::memory_order_release);
+}
+
+
+PoseReader::PoseReader(const std::string &name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open shared memory " + name + ": " + strerror(errno));
+    }
+
+    struct stat st;
+    if ((fstat(fd, &st) < 0) || (static_cast<size_t>(st.st_size) < sizeof(PoseSegmentHeader))) {
+        close(fd);
+        throw std::runtime_error("Shared memory " + name + " is not a pose segment");
+    }
+
+    void *mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("Could not map shared memory " + name + ": " + strerror(err));
+    }
+
+    header = static_cast<const PoseSegmentHeader *>(mem);
+
+    if (memcmp(header->magic, segment_magic, sizeof(segment_magic)) || (header->version != segment_version) ||
+        (header->size != static_cast<uint64_t>(st.st_size)))
+    {
+        munmap(mem, st.st_size);
+        throw std::runtime_error("Shared memory " + name + " is not a (compatible) pose segment");
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    const char *name_data = static_cast<const char *>(mem) + header->names_offset;
+    for (uint32_t i = 0; i < header->bone_count; i++) {
+        names.emplace_back(name_data);
+        name_data += names.back().length() + 1;
+    }
+}
+
+
+PoseReader::~PoseReader(void)
+{
+    munmap(const_cast<PoseSegmentHeader *>(header), header->size);
+}
+
+
+const PoseBuffer *PoseReader::buffer(uint64_t sequence) const
+{
+    return reinterpret_cast<const PoseBuffer *>(reinterpret_cast<const char *>(header) + header->buffer_offset +
+                                                (sequence & 1) * header->buffer_stride);
+}
+
+
+const float *PoseReader::begin_read(uint64_t &sequence, int *frame, uint64_t *publish_ns) const
+{
+    for (;;) {
+        sequence = header->sequence.load(std::memory_order_acquire);
+        if (!sequence) {
+            return nullptr;
+        }
+
+        const PoseBuffer *buf = buffer(sequence);
+        if (buf->version.load(std::memory_order_acquire) != 2 * sequence) {
+            // Already being overwritten by the pose after the next
+            continue;
+        }
+
+        if (frame) {
+            *frame = buf->frame;
+        }
+        if (publish_ns) {
+            *publish_ns = buf->publish_ns;
+        }
+
+        return reinterpret_cast<const float *>(buf + 1);
+    }
+}
+
+
+bool PoseReader::end_read(uint64_t sequence) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return buffer(sequence)->version.load(std::memory_order_relaxed) == 2 * sequence;
+}
+
+
+uint64_t PoseReader::read(std::vector<mat4> &transforms, int *frame) const
+{
+    transforms.resize(header->bone_count);
+
+    for (;;) {
+        uint64_t sequence;
+        const float *data = begin_read(sequence, frame);
+        if (!data) {
+            return 0;
+        }
+
+        memcpy(static_cast<void *>(transforms.data()), data, transforms.size() * sizeof(mat4));
+
+        if (end_read(sequence)) {
+            return sequence;
+        }
+    }
+}
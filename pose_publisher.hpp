@@ -0,0 +1,96 @@
+#ifndef POSE_PUBLISHER_HPP
+#define POSE_PUBLISHER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <dake/math/matrix.hpp>
+
+#include "asf.hpp"
+
+
+// Layout of the shared memory segment: the header, two pose buffers (every
+// pose goes to buffer (sequence & 1)) and the bone names (NUL-terminated, in
+// ASF.bones order). All offsets are relative to the start of the segment.
+struct PoseSegmentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t bone_count;
+    uint64_t buffer_offset, buffer_stride;
+    uint64_t names_offset, names_size;
+    uint64_t size;
+
+    // Number of poses published so far
+    alignas(64) std::atomic<uint64_t> sequence;
+};
+
+struct PoseBuffer {
+    // 2 * sequence while valid, odd while being written
+    std::atomic<uint64_t> version;
+    int32_t frame;
+    uint32_t reserved;
+    // trace_clock() time of publishing
+    uint64_t publish_ns;
+    uint64_t reserved2;
+    // Followed by bone_count column-major 4x4 float matrices (the bones'
+    // world motion transformations, see ASF::Bone::motion_trans)
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory needs lock-free 64-bit atomics");
+
+
+// Publishes poses into a POSIX shared memory segment, so other processes can
+// read them without copying or any syscalls. Consumers use PoseReader.
+class PosePublisher {
+    public:
+        // Creates (or replaces) the segment; name is the shm_open() name
+        // (e.g. "/cg2p2-pose")
+        PosePublisher(const std::string &name, const ASF &asf);
+        // Unlinks the segment
+        ~PosePublisher(void);
+
+        // transforms is indexed like ASF.bones
+        void publish(int frame, const dake::math::mat4 *transforms);
+
+        const std::string &name(void) const { return shm_name; }
+
+
+    private:
+        std::string shm_name;
+        size_t bone_count;
+        PoseSegmentHeader *header;
+};
+
+
+class PoseReader {
+    public:
+        // Throws if the segment does not exist or is not a pose segment
+        PoseReader(const std::string &name);
+        ~PoseReader(void);
+
+        // Zero-copy access to the newest pose: returns its matrices (or
+        // nullptr if there is none yet) and fills in the pose's sequence
+        // number; the data must not be used anymore once end_read() returns
+        // false, then the pose has been overwritten while reading it
+        const float *begin_read(uint64_t &sequence, int *frame = nullptr, uint64_t *publish_ns = nullptr) const;
+        bool end_read(uint64_t sequence) const;
+
+        // Copies the newest pose (retrying until successful); returns its
+        // sequence number (0 if there is none yet)
+        uint64_t read(std::vector<dake::math::mat4> &transforms, int *frame = nullptr) const;
+
+        size_t bone_count(void) const { return header->bone_count; }
+        const std::vector<std::string> &bone_names(void) const { return names; }
+
+
+    private:
+        const PoseBuffer *buffer(uint64_t sequence) const;
+
+        const PoseSegmentHeader *header;
+        std::vector<std::string> names;
+};
+
+#endif
@@ -0,0 +1,84 @@
+// Example consumer of poses published by cg2p2 --publish or amctool publish:
+// follows the newest pose and reports publish-to-read latency
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "pose_publisher.hpp"
+#include "trace.hpp"
+
+
+int main(int argc, char *argv[])
+{
+    if ((argc != 2) && (argc != 3)) {
+        fprintf(stderr, "Usage: %s <shm name> [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    double duration = argc == 3 ? atof(argv[2]) : 10.;
+
+    try {
+        PoseReader reader(argv[1]);
+        printf("%s: %zu bones\n", argv[1], reader.bone_count());
+
+        std::vector<float> latencies;
+        unsigned long missed = 0, torn = 0;
+        uint64_t last_seq = 0;
+
+        auto start = std::chrono::steady_clock::now(), last_print = start;
+        while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < duration) {
+            uint64_t seq, publish_ns;
+            int frame;
+
+            const float *mats = reader.begin_read(seq, &frame, &publish_ns);
+            if (!mats || (seq == last_seq)) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            uint64_t now = trace_clock();
+
+            // The root bone's origin is the translation column of its matrix
+            float root[3] = {mats[12], mats[13], mats[14]};
+
+            if (!reader.end_read(seq)) {
+                torn++;
+                continue;
+            }
+
+            if (last_seq && (seq > last_seq + 1)) {
+                missed += seq - last_seq - 1;
+            }
+            last_seq = seq;
+            latencies.push_back((now - publish_ns) / 1e3f);
+
+            if (std::chrono::steady_clock::now() - last_print >= std::chrono::seconds(1)) {
+                last_print = std::chrono::steady_clock::now();
+                printf("pose %llu (frame %i): first bone at (%.3f, %.3f, %.3f)\n",
+                       static_cast<unsigned long long>(seq), frame, root[0], root[1], root[2]);
+            }
+        }
+
+        if (latencies.empty()) {
+            printf("No poses received\n");
+            return 0;
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        auto pct = [&](double p) { return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))]; };
+
+        printf("%zu poses read, %lu missed, %lu torn reads retried\n", latencies.size(), missed, torn);
+        printf("Latency (us): min %.1f, p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+               latencies.front(), pct(.5), pct(.9), pct(.99), latencies.back());
+    } catch (std::exception &e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+
+    return 0;
+}
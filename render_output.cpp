@@ -1,11 +1,15 @@
 #include <dake/gl/gl.hpp>
 
+#include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <stdexcept>
+#include <vector>
+#include <QFont>
 #include <QGLWidget>
+#include <QLabel>
 #include <QTimer>
 #include <QMouseEvent>
 #include <QWheelEvent>
@@ -16,7 +20,17 @@
 #include <dake/gl/vertex_attrib.hpp>
 
 #include "asf.hpp"
+#include "bone_picker.hpp"
+#include "capsule.hpp"
+#include "draw_list.hpp"
+#include "dtw.hpp"
+#include "frustum.hpp"
+#include "gpu_timer.hpp"
+#include "ik.hpp"
+#include "mass.hpp"
 #include "render_output.hpp"
+#include "self_collision.hpp"
+#include "trace.hpp"
 
 
 using namespace dake;
@@ -30,11 +44,34 @@ RenderOutput::RenderOutput(QGLFormat fmt, QWidget *pw):
 {
     redraw_timer = new QTimer(this);
     connect(redraw_timer, SIGNAL(timeout()), this, SLOT(updateGL()));
+
+    trace_overlay = new QLabel(this);
+    trace_overlay->setFont(QFont("monospace", 8));
+    trace_overlay->setStyleSheet("QLabel { color: white; background-color: rgba(0, 0, 0, 160); padding: 4px; }");
+    trace_overlay->move(8, 8);
+    trace_overlay->hide();
 }
 
 RenderOutput::~RenderOutput(void)
 {
+    delete frame_clip;
+    delete limits_table;
+    delete mass_model;
+    delete com_track;
+    delete ik_solver;
+    delete compare_applier;
+    delete compare_model;
+
+    // Queries belong to the context
+    makeCurrent();
+    delete gpu_timer;
+
     delete bone_prg;
+
+    if (!trace_overlay->isHidden()) {
+        trace_release();
+    }
+    delete trace_overlay;
 }
 
 
@@ -98,6 +135,8 @@ void RenderOutput::initializeGL(void)
     limit_va->attrib(0)->format(2);
     limit_va->attrib(0)->data(angle_data);
 
+    gpu_timer = new GpuTimer;
+
     redraw_timer->start(0);
 }
 
@@ -115,10 +154,26 @@ void RenderOutput::resizeGL(int wdt, int hgt)
 
 void RenderOutput::paintGL(void)
 {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    TRACE_SCOPE("RenderOutput::paintGL");
+
+    gpu_timer->begin_frame();
+
+    {
+        GpuTimerScope gpu_scope(gpu_timer, "GPU clear");
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    int first, end;
+    bool loading;
 
     if (asf_model) {
-        if (amc_ani) {
+        if (live_stream) {
+            if (live_stream->latest(live_frame)) {
+                has_live_frame = true;
+                new_live_frame = true;
+                reset_transform = true;
+            }
+        } else if (clip_range(first, end, loading)) {
             if (play_animation) {
                 std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
                 if (!reset_transform) {
@@ -129,8 +184,13 @@ void RenderOutput::paintGL(void)
 
                 if (partial_frame >= 1.f) {
                     while (partial_frame >= 1.f) {
-                        if (++cur_frame >= amc_ani->first_frame() + static_cast<int>(amc_ani->frames().size())) {
-                            cur_frame = amc_ani->first_frame();
+                        if (++cur_frame >= end) {
+                            // Wait for more frames while loading
+                            if (loading) {
+                                cur_frame--;
+                            } else {
+                                cur_frame = first;
+                            }
                         }
                         partial_frame -= 1.f;
                     }
@@ -143,132 +203,505 @@ void RenderOutput::paintGL(void)
 
         render_asf();
     }
+
+    if (trace_overlay->isVisible()) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        frame_times[frame_time_index++ % frame_times.size()] =
+            std::chrono::duration<float, std::milli>(now - last_paint).count();
+        last_paint = now;
+
+        if (now - last_overlay_update >= std::chrono::milliseconds(250)) {
+            update_trace_overlay();
+            last_overlay_update = now;
+        }
+    }
+}
+
+
+void RenderOutput::show_trace_overlay(int state)
+{
+    // Tracing may have been enabled elsewhere (--trace), so only the
+    // overlay's own reference is given up
+    if (state && trace_overlay->isHidden()) {
+        trace_acquire();
+    } else if (!state && !trace_overlay->isHidden()) {
+        trace_release();
+    }
+    trace_overlay->setVisible(state);
+
+    frame_times.assign(240, 0.f);
+    frame_time_index = 0;
+    last_paint = std::chrono::steady_clock::now();
+}
+
+
+void RenderOutput::update_trace_overlay(void)
+{
+    std::vector<float> sorted(frame_times.begin(), frame_times.begin() + std::min(frame_time_index, frame_times.size()));
+    std::sort(sorted.begin(), sorted.end());
+
+    QString text("Frame time (ms)");
+    if (!sorted.empty()) {
+        text += QString(": p50 %1, p95 %2, p99 %3")
+                .arg(sorted[sorted.size() / 2], 0, 'f', 2)
+                .arg(sorted[std::min(sorted.size() - 1, sorted.size() * 95 / 100)], 0, 'f', 2)
+                .arg(sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)], 0, 'f', 2);
+    }
+
+    if (!gpu_timer->available()) {
+        text += "\n\nNo GPU timings (timer queries not supported)";
+    } else if (gpu_timer->dropped()) {
+        text += QString("\n\nGPU timings dropped (not ready in time): %1").arg(gpu_timer->dropped());
+    }
+
+    text += QString("\n\n%1 %2 %3 %4 %5").arg("Last second (ms)", -32).arg("count", 6).arg("mean", 6)
+            .arg("p95", 6).arg("max", 6);
+
+    for (const TraceStageStats &stage: trace_summary(1.)) {
+        text += QString("\n%1 %2 %3 %4 %5").arg(stage.name, -32).arg(stage.count, 6)
+                .arg(stage.mean_ms, 6, 'f', 3).arg(stage.p95_ms, 6, 'f', 3).arg(stage.max_ms, 6, 'f', 3);
+    }
+
+    trace_overlay->setText(text);
+    trace_overlay->adjustSize();
+}
+
+
+bool RenderOutput::clip_range(int &first, int &end, bool &loading) const
+{
+    if (clip_view && !clip_view->empty()) {
+        first = clip_view->first_frame();
+        end = first + clip_view->size();
+        loading = false;
+        return true;
+    }
+
+    // Progressively loaded clips may not have any frames yet
+    if (amc_ani && !amc_ani->frames().empty()) {
+        first = amc_ani->first_frame();
+        end = first + amc_ani->frames().size();
+        loading = amc_ani->loading();
+        return true;
+    }
+
+    return false;
+}
+
+
+bool RenderOutput::current_pose(AMC::Frame &pose) const
+{
+    int first, end;
+    bool loading;
+
+    if (live_stream && has_live_frame) {
+        pose = live_frame;
+    } else if (!clip_range(first, end, loading) || (cur_frame < first) || (cur_frame >= end)) {
+        return false;
+    } else if (clip_view && !clip_view->empty()) {
+        pose = clip_view->frame(cur_frame);
+    } else {
+        pose = amc_ani->frames()[cur_frame - first];
+    }
+
+    return true;
 }
 
 
 void RenderOutput::render_asf(void)
 {
-    for (gl::program *prg: {bone_prg, cone_prg}) {
-        prg->use();
-        prg->uniform<mat4>("proj") = proj;
+    int first, end;
+    bool loading;
+    bool live_pose = live_stream && has_live_frame;
+    bool anim = !live_pose && clip_range(first, end, loading);
+    bool from_view = anim && clip_view && !clip_view->empty();
+    const void *clip = from_view ? static_cast<const void *>(clip_view) : amc_ani;
+
+    if ((live_pose || from_view || !pins.empty()) && (!frame_clip || (frame_clip->skeleton() != asf_model))) {
+        delete frame_clip;
+        frame_clip = new AMC(asf_model);
     }
 
-    if (reset_transform) {
-        if (amc_ani) {
-            if (cur_frame < amc_ani->first_frame()) {
-                cur_frame = amc_ani->first_frame();
-                partial_frame = 0.f;
-                emit frame_changed(cur_frame);
-            } else if (cur_frame >= amc_ani->first_frame() + static_cast<int>(amc_ani->frames().size())) {
-                cur_frame = amc_ani->first_frame() + amc_ani->frames().size() - 1;
-                partial_frame = 0.f;
-                emit frame_changed(cur_frame);
+    if (reset_transform && anim) {
+        if (cur_frame < first) {
+            cur_frame = first;
+            partial_frame = 0.f;
+            emit frame_changed(cur_frame);
+        } else if (cur_frame >= end) {
+            cur_frame = end - 1;
+            partial_frame = 0.f;
+            emit frame_changed(cur_frame);
+        }
+    }
+
+    // Independent of reset_transform, which stays set while culled
+    if (pose_publisher && (live_pose ? new_live_frame : anim && ((clip != published_clip) || (cur_frame != published_frame)))) {
+        published_trans.resize(asf_model->bones().size());
+
+        if (live_pose) {
+            AMC::evaluate(*asf_model, live_frame, published_trans.data());
+            pose_publisher->publish(-1, published_trans.data());
+            new_live_frame = false;
+        } else {
+            if (from_view) {
+                clip_view->evaluate(cur_frame, published_trans.data());
+            } else {
+                amc_ani->evaluate(cur_frame, published_trans.data());
             }
+            pose_publisher->publish(cur_frame, published_trans.data());
+            published_clip = clip;
+            published_frame = cur_frame;
+        }
+    }
 
-            amc_ani->apply_frame(cur_frame);
+    CullStats old_stats(draw_list.stats);
+    draw_list.clear();
+
+    Frustum frustum(proj * mv);
+    float lod_extent = 0.f;
+    bool visible = true;
+
+    DrawList::Options opts;
+    opts.frustum = culling ? &frustum : nullptr;
+    opts.limits = limits;
+    opts.offset_limits = offset_limits;
+    opts.picked = picked;
+    opts.violating = highlight_limits ? &violating : nullptr;
+
+    // The report is only valid for the clip's own frames
+    if (collision_report && anim && !from_view && pins.empty() && (amc_ani == collision_clip)) {
+        collision_report->colliding_bones(cur_frame, asf_model->bones().size(), colliding);
+        opts.colliding = &colliding;
+    }
+
+    if (culling || lod) {
+        vec3 root_pos(live_pose ? asf_model->root_position() + live_frame.root_translation :
+                      from_view ? clip_view->root_position(cur_frame) :
+                      anim ? amc_ani->root_position(cur_frame) : asf_model->root_position());
+
+        // This sphere is valid for any pose, so culled skeletons do not even
+        // need to be transformed
+        if (culling && !frustum.sphere_visible(root_pos, asf_model->reach())) {
+            visible = false;
+        } else if (lod) {
+            vec4 eye_pos(mv * vec4(root_pos.x(), root_pos.y(), root_pos.z(), 1.f));
+            float distance = vec3(eye_pos.x(), eye_pos.y(), eye_pos.z()).length();
+
+            if (distance > 0.f) {
+                float px_per_unit = h / (2.f * distance * tanf(fov / 2.f));
+
+                lod_extent = lod_pixels / px_per_unit;
+                opts.tips = .03f * px_per_unit >= tip_pixels;
+            }
+        }
+    }
+
+    if (visible) {
+        // Only re-transform for LOD changes if there is a noticeable difference
+        if (reset_transform || (lod_extent < applied_lod_extent) || (lod_extent > 2.f * applied_lod_extent)) {
+            if (!pins.empty()) {
+                solve_pinned_pose();
+                frame_clip->apply(pinned_pose, lod_extent);
+            } else if (live_pose) {
+                frame_clip->apply(live_frame, lod_extent);
+            } else if (from_view) {
+                frame_clip->apply(clip_view->frame(cur_frame), lod_extent);
+            } else if (anim) {
+                amc_ani->apply_frame(cur_frame, lod_extent);
+            } else {
+                asf_model->reset_transforms();
+            }
+
+            if (highlight_limits) {
+                if (limits_dirty) {
+                    delete limits_table;
+                    limits_table = new JointLimits(*asf_model);
+                    limits_dirty = false;
+                }
+
+                if (!pins.empty()) {
+                    limits_table->check(pinned_pose, &violating);
+                } else if (live_pose) {
+                    limits_table->check(live_frame, &violating);
+                } else if (from_view) {
+                    limits_table->check(clip_view->frame(cur_frame), &violating);
+                } else if (anim) {
+                    limits_table->check(amc_ani->frames()[cur_frame - amc_ani->first_frame()], &violating);
+                } else {
+                    violating.assign(asf_model->bones().size(), false);
+                }
+            }
+
+            applied_lod_extent = lod_extent;
+            reset_transform = false;
+            picker_dirty = true;
+        }
+
+        if (culling && !frustum.sphere_visible(asf_model->bound_center(), asf_model->bound_radius())) {
+            visible = false;
         } else {
-            asf_model->reset_transforms();
+            TRACE_SCOPE("DrawList::add_skeleton");
+            draw_list.add_skeleton(*asf_model, proj, mv, opts);
         }
+    }
+
+    if (!visible) {
+        draw_list.stats.culled_bones = asf_model->bones().size() - 1;
+    }
+
+    if (show_com && visible) {
+        add_center_of_mass(anim && !from_view,
+                           !pins.empty() ? &pinned_pose :
+                           live_pose ? &live_frame :
+                           from_view ? &clip_view->frame(cur_frame) : nullptr);
+    }
+
+    for (const IKGoal &pin: pins) {
+        draw_list.add_segment(pin.target + vec3(0.f, .15f, 0.f), pin.target, vec3(.1f, .9f, .9f), mv, true);
+    }
+
+    if (anim && !from_view && compare_clip && compare_alignment &&
+        (compare_alignment->partner.size() == amc_ani->frames().size()))
+    {
+        add_compared_skeleton();
+    }
+
+    submit_draw_list();
 
-        reset_transform = false;
+    const CullStats &stats = draw_list.stats;
+    if ((stats.culled_bones != old_stats.culled_bones) || (stats.lod_bones != old_stats.lod_bones)) {
+        emit cull_stats_changed(stats.culled_bones, stats.lod_bones);
+    }
+}
+
+
+void RenderOutput::compare(const AMC *other, const DTWAlignment *alignment)
+{
+    if (other != compare_clip) {
+        delete compare_applier;
+        delete compare_model;
+        compare_applier = nullptr;
+        compare_model = nullptr;
+
+        if (other) {
+            compare_model = new ASF(*other->skeleton());
+            compare_applier = new AMC(compare_model);
+        }
     }
 
-    render_asf_bone(asf_model->root_index(), 0);
+    compare_clip = other;
+    compare_alignment = alignment;
+    compare_frame = -1;
 }
 
 
-static const vec3 colors[] = {
-    vec3(.6f, .7f, 1.f),
-    vec3(1.f, .25f, 0.f),
-    vec3(.2f, 1.f, 0.f),
-    vec3(0.f, .25f, 1.f),
-    vec3(1.f, 1.f, 0.f),
-    vec3(1.f, 1.f, 1.f),
-    vec3(1.f, 0.f, .8f),
-    vec3(1.f, 0.f, 0.f)
-};
+void RenderOutput::add_compared_skeleton(void)
+{
+    TRACE_SCOPE("RenderOutput::add_compared_skeleton");
+
+    int partner = compare_alignment->partner[cur_frame - amc_ani->first_frame()];
+    if (partner != compare_frame) {
+        compare_applier->apply(compare_clip->frames()[partner - compare_clip->first_frame()]);
+        compare_frame = partner;
+    }
 
+    // Next to the current pose (along the x axis), regardless of where
+    // either clip has wandered off to
+    vec3 root(amc_ani->root_position(cur_frame));
+    vec3 other_root(compare_clip->root_position(partner));
+    vec3 offset(root.x() - other_root.x() + asf_model->reach() + compare_model->reach(), 0.f,
+                root.z() - other_root.z());
+    mat4 other_mv(mv * mat4::identity().translated(offset));
 
-void RenderOutput::render_asf_bone(int bi, int hdepth)
+    Frustum frustum(proj * other_mv);
+
+    DrawList::Options opts;
+    opts.frustum = culling ? &frustum : nullptr;
+    opts.limits = limits;
+    opts.offset_limits = offset_limits;
+
+    draw_list.add_skeleton(*compare_model, proj, other_mv, opts);
+}
+
+
+void RenderOutput::add_center_of_mass(bool from_amc, const AMC::Frame *pose)
 {
-    const ASF::Bone &bone = asf_model->bones()[bi];
+    TRACE_SCOPE("RenderOutput::add_center_of_mass");
+
+    if (mass_dirty) {
+        delete mass_model;
+        delete com_track;
+        mass_model = new MassModel(*asf_model);
+        com_track = nullptr;
+        mass_dirty = false;
+    }
+
+    if (!(mass_model->total() > 0.f)) {
+        return;
+    }
+
+    // The trajectory (and the ground height) takes a pass over the whole
+    // clip, so it is only recomputed when the clip changes; frames merged
+    // while loading are appended
+    if (from_amc) {
+        if (!com_track || (amc_clip_id < 0) || (com_track_clip != amc_clip_id) ||
+            (com_track_replacements != amc_ani->replacements()) ||
+            (com_track->first_frame != amc_ani->first_frame()) ||
+            (com_track->x.size() > amc_ani->frames().size()))
+        {
+            delete com_track;
+            com_track = new CenterOfMassTrack(center_of_mass_track(*amc_ani, *mass_model));
+            com_track_clip = amc_clip_id;
+            com_track_replacements = amc_ani->replacements();
+        } else if (com_track->x.size() < amc_ani->frames().size()) {
+            extend_center_of_mass_track(*amc_ani, *mass_model, *com_track);
+        }
+    }
+
+    // The skeleton's transformations may be stale for bones skipped for
+    // LOD, so the pose is evaluated fully (or taken from the track)
+    int cur = cur_frame - (from_amc ? com_track->first_frame : 0);
+    vec3 com;
+    if (pose || !from_amc) {
+        com_trans.resize(asf_model->bones().size());
+        if (pose) {
+            AMC::evaluate(*asf_model, *pose, com_trans.data());
+        } else {
+            // Rest pose, which is never applied with LOD
+            for (size_t b = 0; b < com_trans.size(); b++) {
+                com_trans[b] = asf_model->bones()[b].motion_trans;
+            }
+        }
+        com = mass_model->center_of_mass(com_trans.data());
+    } else if ((cur >= 0) && (cur < static_cast<int>(com_track->x.size()))) {
+        com = vec3(com_track->x[cur], com_track->y[cur], com_track->z[cur]);
+    } else {
+        return;
+    }
 
+    float ground;
+    if (from_amc) {
+        ground = com_track->ground;
+    } else {
+        // Lowest bone origin of the current pose
+        ground = HUGE_VALF;
+        for (const mat4 &m: com_trans) {
+            ground = std::min(ground, (m * vec4(0.f, 0.f, 0.f, 1.f)).y());
+        }
+    }
 
-    if (bone.id) {
-        // not root
+    draw_list.add_segment(com, vec3(com.x(), ground, com.z()), vec3(1.f, .85f, .1f), mv, true);
 
-        mat4 bone_mv(mv * bone.motion_trans * bone.bone_dir_trans);
-        mat3 bone_nrm(mat3(bone_mv).transposed_inverse());
-        for (bool tip: {false, true}) {
-            gl::program *prg = tip ? cone_prg : bone_prg;
-            gl::vertex_array *va = tip ? cone_va : bone_va;
+    if (!from_amc) {
+        return;
+    }
 
-            prg->use();
-            prg->uniform<vec3>("color") = colors[hdepth % 8];
-            prg->uniform<float>("length") = bone.length;
-            prg->uniform<mat4>("mv") = bone_mv;
-            prg->uniform<mat3>("nrm_mat") = bone_nrm;
+    // Ground projection, with a new segment every 5 cm
+    int first = std::max(cur - 2 * playback_fps, 0);
+    int end = std::min(cur + 2 * playback_fps + 1, static_cast<int>(com_track->x.size()));
+    if (first >= end) {
+        return;
+    }
 
-            va->draw(GL_TRIANGLES);
+    vec3 last(com_track->x[first], ground, com_track->z[first]);
+    for (int i = first + 1; i < end; i++) {
+        vec3 p(com_track->x[i], ground, com_track->z[i]);
+        if ((p - last).length() >= .05f) {
+            draw_list.add_segment(last, p, i <= cur ? vec3(.6f, .5f, .1f) : vec3(1.f, .85f, .1f), mv, false);
+            last = p;
         }
+    }
+}
 
-        if (limits) {
-            limit_prg->use();
-            limit_prg->uniform<mat4>("mvp") = proj * mv * bone.still_trans * bone.local_trans;
 
-            for (const std::pair<const int, std::pair<float, float>> &dof: bone.dof) {
-                ASF::Axis axis = static_cast<ASF::Axis>(dof.first);
-                const std::pair<float, float> &limit = dof.second;
+void RenderOutput::pin_picked_bone(void)
+{
+    if (picked < 0) {
+        return;
+    }
 
-                if ((axis != ASF::RX) && (axis != ASF::RY) && (axis != ASF::RZ)) {
-                    continue;
-                }
+    // Where the bone ends right now (fully evaluated, the bone may have
+    // been skipped for LOD)
+    AMC::Frame pose;
+    if (!pins.empty()) {
+        solve_pinned_pose();
+        pose = pinned_pose;
+    } else if (!current_pose(pose)) {
+        pose.transformations.resize(asf_model->bones().size());
+    }
 
-                float a = limit.first, b = limit.second;
+    std::vector<mat4> trans(asf_model->bones().size());
+    AMC::evaluate(*asf_model, pose, trans.data());
 
-                if (offset_limits) {
-                    vec3 local_bone_dir = mat3(bone.local_trans_inv) * bone.direction;
-                    vec2 projected_bone_dir;
+    const ASF::Bone &bone = asf_model->bones()[picked];
+    vec3 tip(bone.length * bone.direction);
+    vec4 end(trans[picked] * vec4(tip.x(), tip.y(), tip.z(), 1.f));
 
-                    switch (axis) {
-                        case ASF::RX: projected_bone_dir = vec2(local_bone_dir.y(), local_bone_dir.z()); break;
-                        case ASF::RY: projected_bone_dir = vec2(local_bone_dir.z(), local_bone_dir.x()); break;
-                        case ASF::RZ: projected_bone_dir = vec2(local_bone_dir.y(), local_bone_dir.x()); break;
-                        default: throw std::invalid_argument("Bad rotation axis");
-                    }
+    auto pin = std::find_if(pins.begin(), pins.end(), [&](const IKGoal &g) { return g.bone == picked; });
+    if (pin == pins.end()) {
+        pins.push_back(IKGoal{picked, vec3::zero()});
+        pin = pins.end() - 1;
+    }
+    pin->target = vec3(end.x(), end.y(), end.z());
 
-                    if (projected_bone_dir.length() > .1f) {
-                        float ofs = atan2f(projected_bone_dir.y(), projected_bone_dir.x());
-                        a += ofs;
-                        b += ofs;
+    reset_transform = true;
+}
 
-                        limit_prg->uniform<float>("fadeout") = .5f;
-                    } else {
-                        limit_prg->uniform<float>("fadeout") = .2f;
-                    }
-                } else {
-                    limit_prg->uniform<float>("fadeout") = .3f;
-                }
 
-                while (b < a) {
-                    b += 2 * static_cast<float>(M_PI);
-                }
+void RenderOutput::solve_pinned_pose(void)
+{
+    TRACE_SCOPE("RenderOutput::solve_pinned_pose");
 
-                limit_prg->uniform<vec3>("axis") = axis == ASF::RX ? vec3(1.f, 0.f, 0.f)
-                                                 : axis == ASF::RY ? vec3(0.f, 1.f, 0.f)
-                                                 :                   vec3(0.f, 0.f, 1.f);
+    if (ik_dirty) {
+        delete ik_solver;
+        ik_solver = new IKSolver(*asf_model);
+        ik_dirty = false;
+    }
 
-                limit_prg->uniform<float>("l1") = a;
-                limit_prg->uniform<float>("l2") = b;
+    if (!current_pose(pinned_pose)) {
+        pinned_pose = AMC::Frame();
+        pinned_pose.transformations.resize(asf_model->bones().size());
+    }
 
-                limit_va->draw(GL_TRIANGLE_FAN);
-            }
+    ik_solver->solve(pinned_pose, pins);
+}
+
+
+void RenderOutput::submit_draw_list(void)
+{
+    TRACE_SCOPE("RenderOutput::submit_draw_list");
+
+    for (bool tip: {false, true}) {
+        gl::program *prg = tip ? cone_prg : bone_prg;
+        gl::vertex_array *va = tip ? cone_va : bone_va;
+        GpuTimerScope gpu_scope(gpu_timer, tip ? "GPU tips" : "GPU bones");
+
+        prg->use();
+        prg->uniform<mat4>("proj") = proj;
+
+        for (const DrawList::Bone &bone: tip ? draw_list.tips : draw_list.bones) {
+            prg->uniform<vec3>("color") = bone.color;
+            prg->uniform<float>("length") = bone.length;
+            prg->uniform<mat4>("mv") = bone.mv;
+            prg->uniform<mat3>("nrm_mat") = bone.nrm;
+
+            va->draw(GL_TRIANGLES);
         }
     }
 
+    if (!draw_list.limits.empty()) {
+        GpuTimerScope gpu_scope(gpu_timer, "GPU limits");
+        limit_prg->use();
+
+        for (const DrawList::Limit &limit: draw_list.limits) {
+            limit_prg->uniform<mat4>("mvp") = limit.mvp;
+            limit_prg->uniform<float>("fadeout") = limit.fadeout;
+            limit_prg->uniform<vec3>("axis") = limit.axis;
+            limit_prg->uniform<float>("l1") = limit.l1;
+            limit_prg->uniform<float>("l2") = limit.l2;
 
-    for (int child = bone.first_child; child >= 0; child = asf_model->bones()[child].next_sibling) {
-        render_asf_bone(child, hdepth + 1);
+            limit_va->draw(GL_TRIANGLE_FAN);
+        }
     }
 }
 
@@ -279,6 +712,7 @@ void RenderOutput::mousePressEvent(QMouseEvent *evt)
         grabMouse(Qt::ClosedHandCursor);
 
         rotate_camera = true;
+        camera_moved = false;
 
         rot_l_x = evt->x();
         rot_l_y = evt->y();
@@ -298,6 +732,11 @@ void RenderOutput::mouseReleaseEvent(QMouseEvent *evt)
     if ((evt->button() == Qt::LeftButton) && rotate_camera) {
         releaseMouse();
         rotate_camera = false;
+
+        // Just a click
+        if (!camera_moved) {
+            pick_bone(evt->x(), evt->y());
+        }
     } else if ((evt->button() == Qt::RightButton) && move_camera) {
         releaseMouse();
         move_camera = false;
@@ -310,6 +749,12 @@ void RenderOutput::mouseMoveEvent(QMouseEvent *evt)
     int dx = evt->x() - rot_l_x;
     int dy = evt->y() - rot_l_y;
 
+    if (!dx && !dy) {
+        return;
+    }
+
+    camera_moved = true;
+
     if (rotate_camera) {
         mv = mat4::identity().rotated(dy / 4.f * static_cast<float>(M_PI) / 180.f, vec3(1.f, 0.f, 0.f))
                              .rotated(dx / 4.f * static_cast<float>(M_PI) / 180.f, vec3(0.f, 1.f, 0.f))
@@ -331,3 +776,58 @@ void RenderOutput::wheelEvent(QWheelEvent *evt)
 
     reload_uniforms = true;
 }
+
+
+void RenderOutput::pick_bone(int x, int y)
+{
+    TRACE_SCOPE("RenderOutput::pick_bone");
+
+    if (!asf_model) {
+        return;
+    }
+
+    // Culled skeletons are not transformed, so after a culled draw the bones
+    // may still be in an older pose (reset_transform stays set, so the next
+    // visible draw applies the pose again with LOD and limits)
+    if (reset_transform) {
+        if (!frame_clip || (frame_clip->skeleton() != asf_model)) {
+            delete frame_clip;
+            frame_clip = new AMC(asf_model);
+        }
+
+        AMC::Frame pose;
+        if (!pins.empty()) {
+            solve_pinned_pose();
+            frame_clip->apply(pinned_pose);
+        } else if (current_pose(pose)) {
+            frame_clip->apply(pose);
+        } else {
+            asf_model->reset_transforms();
+        }
+        picker_dirty = true;
+    }
+
+    std::vector<Capsule> capsules;
+    bone_capsules(*asf_model, capsules);
+
+    if (picker.size() != capsules.size()) {
+        picker.build(capsules);
+    } else if (picker_dirty) {
+        picker.refit(capsules);
+    }
+    picker_dirty = false;
+
+    mat4 inv_mvp((proj * mv).inverse());
+    float ndc_x = 2.f * x / w - 1.f;
+    float ndc_y = 1.f - 2.f * y / h;
+
+    vec4 near_pt(inv_mvp * vec4(ndc_x, ndc_y, -1.f, 1.f));
+    vec4 far_pt (inv_mvp * vec4(ndc_x, ndc_y,  1.f, 1.f));
+
+    vec3 origin(near_pt.x() / near_pt.w(), near_pt.y() / near_pt.w(), near_pt.z() / near_pt.w());
+    vec3 dir(vec3(far_pt.x() / far_pt.w(), far_pt.y() / far_pt.w(), far_pt.z() / far_pt.w()) - origin);
+    dir.normalize();
+
+    picked = picker.pick(origin, dir);
+    emit bone_picked(picked);
+}
@@ -5,7 +5,9 @@
 
 #include <chrono>
 #include <cmath>
+#include <vector>
 #include <QGLWidget>
+#include <QLabel>
 #include <QTimer>
 #include <QMouseEvent>
 #include <QWheelEvent>
@@ -15,6 +17,18 @@
 
 #include "amc.hpp"
 #include "asf.hpp"
+#include "bone_picker.hpp"
+#include "clip_view.hpp"
+#include "draw_list.hpp"
+#include "dtw.hpp"
+#include "frustum.hpp"
+#include "gpu_timer.hpp"
+#include "ik.hpp"
+#include "joint_limits.hpp"
+#include "live_stream.hpp"
+#include "mass.hpp"
+#include "pose_publisher.hpp"
+#include "self_collision.hpp"
 
 
 class RenderOutput:
@@ -39,12 +53,45 @@ class RenderOutput:
         const ASF *asf(void) const
         { return asf_model; }
         ASF *&asf(void)
-        { reset_transform = true; return asf_model; }
+        {
+            reset_transform = true; picked = -1; limits_dirty = true; mass_dirty = true;
+            ik_dirty = true; pins.clear();
+            return asf_model;
+        }
 
         const AMC *amc(void) const
         { return amc_ani; }
         AMC *&amc(void)
         { reset_transform = true; return amc_ani; }
+        // ID of the clip amc() was taken from (see ClipManager), which keys
+        // caches of per-frame data (clips may be evicted and reloaded)
+        int &amc_id(void)
+        { return amc_clip_id; }
+
+        // While set and not empty, this is played instead of the AMC (it
+        // must be for the current skeleton)
+        const ClipView *&view(void)
+        { reset_transform = true; return clip_view; }
+
+        // While set, the newest frame received on the stream is shown
+        // instead of the AMC
+        LiveStream *&live(void)
+        { reset_transform = true; return live_stream; }
+
+        // If set, every new pose is published there (fully evaluated, i.e.
+        // regardless of culling and LOD)
+        PosePublisher *&publisher(void)
+        { published_clip = nullptr; return pose_publisher; }
+
+        // While set, and while amc() is the first clip of the alignment,
+        // the frame of the second clip aligned to the current one is shown
+        // next to it
+        void compare(const AMC *other, const DTWAlignment *alignment);
+
+        // While set, and while amc() is clip, the bones colliding in the
+        // current frame according to the report are drawn in orange
+        void self_collisions(const AMC *clip, const SelfCollisionReport *report)
+        { collision_clip = clip; collision_report = report; }
 
         int frame(void) const
         { return cur_frame; }
@@ -60,12 +107,42 @@ class RenderOutput:
 
         void invalidate(void);
 
+        // Copies the pose being shown (live, or the current frame of the
+        // clip); false if there is none
+        bool current_pose(AMC::Frame &pose) const;
+
+        // Index of the selected bone (or -1)
+        int picked_bone(void) const
+        { return picked; }
+
+        // Counters of the last frame drawn
+        const CullStats &cull_stats(void) const
+        { return draw_list.stats; }
+
     public slots:
         void show_limits(int state) { limits = state; }
         void adapt_limits(int state) { offset_limits = state; }
+        void set_culling(int state) { culling = state; }
+        void set_lod(int state) { lod = state; }
+        // Shows rolling per-stage CPU timings (see trace.hpp, so this
+        // enables tracing) and frame time percentiles over the scene
+        void show_trace_overlay(int state);
+        // Draws bones outside of their joint limits in the current pose red
+        void highlight_violations(int state) { highlight_limits = state; reset_transform = true; }
+        // Marks the center of mass and its ground projection, and (while
+        // playing an AMC) the projection's trajectory two seconds back and
+        // ahead
+        void show_center_of_mass(int state) { show_com = state; }
+        // Keeps the end point of the selected bone where it is now; the pose
+        // shown (live, from a clip, or the rest pose) is solved by IK to
+        // reach all pins, within the joint limits
+        void pin_picked_bone(void);
+        void clear_pins(void) { pins.clear(); reset_transform = true; }
 
     signals:
         void frame_changed(int frame);
+        void cull_stats_changed(int culled, int lod);
+        void bone_picked(int bone);
 
     protected:
         void initializeGL(void);
@@ -78,26 +155,96 @@ class RenderOutput:
 
     private:
         void render_asf(void);
-        void render_asf_bone(int bone, int depth);
+        // Appends the aligned pose of compare_clip to the draw list
+        void add_compared_skeleton(void);
+        void add_center_of_mass(bool from_amc, const AMC::Frame *pose);
+        // Solves the current pose for the pins into pinned_pose
+        void solve_pinned_pose(void);
+        void update_trace_overlay(void);
+        // Frame numbers [first, end) of the clip being played (the view or
+        // the AMC); false if there are none
+        bool clip_range(int &first, int &end, bool &loading) const;
+        void submit_draw_list(void);
+        void pick_bone(int x, int y);
 
         QTimer *redraw_timer;
         dake::math::mat4 proj, mv;
         dake::math::vec3 light_dir;
         dake::gl::program *bone_prg, *cone_prg, *limit_prg;
         dake::gl::vertex_array *bone_va, *cone_va, *limit_va;
-        bool rotate_camera = false, move_camera = false;
+        bool rotate_camera = false, move_camera = false, camera_moved = false;
         bool reload_uniforms = true;
         bool limits = false, offset_limits = false;
+        bool culling = true, lod = true;
+        // Subtrees smaller than this many pixels are skipped, and tips are
+        // left out if they would be smaller
+        float lod_pixels = 2.f, tip_pixels = 3.f;
+        float applied_lod_extent = 0.f;
+        DrawList draw_list;
+        BonePicker picker;
+        // Set whenever the bone transformations change
+        bool picker_dirty = true;
+        int picked = -1;
+        bool highlight_limits = false;
+        // For asf_model; rebuilt when needed after the skeleton has changed
+        JointLimits *limits_table = nullptr;
+        bool limits_dirty = true;
+        std::vector<bool> violating;
+        bool show_com = false;
+        // For asf_model, like limits_table
+        MassModel *mass_model = nullptr;
+        bool mass_dirty = true;
+        // Of clip com_track_clip (as far as it had been loaded), extended
+        // when more frames are merged
+        CenterOfMassTrack *com_track = nullptr;
+        int com_track_clip = -1;
+        unsigned com_track_replacements = 0;
+        // Fully evaluated pose for the center of mass marker
+        std::vector<dake::math::mat4> com_trans;
+        // For asf_model, like limits_table
+        IKSolver *ik_solver = nullptr;
+        bool ik_dirty = true;
+        std::vector<IKGoal> pins;
+        AMC::Frame pinned_pose;
         float rot_l_x, rot_l_y;
         float fov = static_cast<float>(M_PI) / 4.f;
         int w, h;
         ASF *asf_model = nullptr;
         AMC *amc_ani = nullptr;
+        int amc_clip_id = -1;
+        const ClipView *clip_view = nullptr;
+        LiveStream *live_stream = nullptr;
+        // For applying frames which are not part of amc_ani (live, from the
+        // view, or solved for pins)
+        AMC *frame_clip = nullptr;
+        AMC::Frame live_frame;
+        bool has_live_frame = false, new_live_frame = false;
+        const AMC *compare_clip = nullptr;
+        const DTWAlignment *compare_alignment = nullptr;
+        // Copy of compare_clip's skeleton, posed by compare_applier
+        ASF *compare_model = nullptr;
+        AMC *compare_applier = nullptr;
+        int compare_frame = -1;
+        const AMC *collision_clip = nullptr;
+        const SelfCollisionReport *collision_report = nullptr;
+        std::vector<bool> colliding;
+        PosePublisher *pose_publisher = nullptr;
+        std::vector<dake::math::mat4> published_trans;
+        // Last pose published from a clip (the AMC or the view)
+        const void *published_clip = nullptr;
+        int published_frame = -1;
         bool reset_transform = true;
         int cur_frame = 0, playback_fps = 60;
         float partial_frame = 0.f;
         bool play_animation = false;
         std::chrono::steady_clock::time_point last_frame_time_point;
+
+        QLabel *trace_overlay;
+        GpuTimer *gpu_timer = nullptr;
+        // Intervals between the last frames (in ms; a ring buffer)
+        std::vector<float> frame_times;
+        size_t frame_time_index = 0;
+        std::chrono::steady_clock::time_point last_paint, last_overlay_update;
 };
 
 #endif
@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "capsule.hpp"
+#include "parallel.hpp"
+#include "self_collision.hpp"
+#include "trace.hpp"
+
+
+using namespace dake::math;
+
+
+namespace
+{
+
+struct Hit {
+    int a, b;
+    int frame;
+    float depth;
+};
+
+}
+
+
+// excluded[a * n + b] is set for all pairs at most links apart
+static std::vector<uint8_t> excluded_pairs(const ASF &asf, int links)
+{
+    const std::vector<ASF::Bone> &bones = asf.bones();
+    size_t n = bones.size();
+    std::vector<uint8_t> excluded(n * n, 0);
+    std::vector<int> front, next;
+
+    for (size_t b = 0; b < n; b++) {
+        excluded[b * n + b] = 1;
+
+        // Breadth-first over the (undirected) hierarchy
+        front.assign(1, static_cast<int>(b));
+        for (int l = 0; (l < links) && !front.empty(); l++) {
+            next.clear();
+
+            for (int f: front) {
+                auto visit = [&](int o) {
+                    if (!excluded[b * n + o]) {
+                        excluded[b * n + o] = 1;
+                        next.push_back(o);
+                    }
+                };
+
+                if (bones[f].parent >= 0) {
+                    visit(bones[f].parent);
+                }
+                for (int c = bones[f].first_child; c >= 0; c = bones[c].next_sibling) {
+                    visit(c);
+                }
+            }
+
+            front.swap(next);
+        }
+    }
+
+    return excluded;
+}
+
+
+SelfCollisionReport find_self_collisions(const AMC &amc, const SelfCollisionOptions &opts)
+{
+    TRACE_SCOPE("find_self_collisions");
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (!(opts.radius > 0.f)) {
+        throw std::invalid_argument("The capsule radius must be positive");
+    }
+
+    const ASF &asf = *amc.skeleton();
+    size_t n = asf.bones().size();
+    size_t frames = amc.frames().size();
+    std::vector<uint8_t> excluded(excluded_pairs(asf, opts.skip_links));
+
+    // Only bones with length get a capsule
+    std::vector<int> solid;
+    for (size_t b = 0; b < n; b++) {
+        if (asf.bones()[b].length > 0.f) {
+            solid.push_back(b);
+        }
+    }
+
+    SelfCollisionReport report;
+    report.first_frame = amc.first_frame();
+    report.pairs.resize(frames);
+
+    for (size_t i = 0; i < solid.size(); i++) {
+        for (size_t j = i + 1; j < solid.size(); j++) {
+            report.possible_pairs += !excluded[solid[i] * n + solid[j]];
+        }
+    }
+    report.possible_pairs *= frames;
+
+    std::mutex merge_lock;
+    std::vector<Hit> hits;
+
+    parallel_ranges(frames, [&](size_t first, size_t end) {
+        std::vector<mat4> trans(n);
+        std::vector<Capsule> caps;
+        // Capsule boxes; lo[3 * b + axis], hi[3 * b + axis]
+        std::vector<float> lo(3 * n), hi(3 * n);
+        // Sweep order, by lo along x
+        std::vector<int> order(solid);
+        std::vector<Hit> local_hits;
+        size_t candidates = 0;
+
+        for (size_t i = first; i < end; i++) {
+            int frame = report.first_frame + i;
+            amc.evaluate(frame, trans.data());
+
+            caps.clear();
+            bone_capsules(asf, trans.data(), opts.radius, caps);
+
+            for (int b: solid) {
+                const Capsule &c = caps[b];
+                lo[3 * b    ] = std::min(c.a.x(), c.b.x()) - c.radius;
+                lo[3 * b + 1] = std::min(c.a.y(), c.b.y()) - c.radius;
+                lo[3 * b + 2] = std::min(c.a.z(), c.b.z()) - c.radius;
+                hi[3 * b    ] = std::max(c.a.x(), c.b.x()) + c.radius;
+                hi[3 * b + 1] = std::max(c.a.y(), c.b.y()) + c.radius;
+                hi[3 * b + 2] = std::max(c.a.z(), c.b.z()) + c.radius;
+            }
+
+            // Nearly sorted from the last frame already
+            for (size_t k = 1; k < order.size(); k++) {
+                int b = order[k];
+                size_t m = k;
+                for (; m > 0 && lo[3 * order[m - 1]] > lo[3 * b]; m--) {
+                    order[m] = order[m - 1];
+                }
+                order[m] = b;
+            }
+
+            int count = 0;
+            for (size_t k = 0; k < order.size(); k++) {
+                int a = order[k];
+
+                for (size_t m = k + 1; (m < order.size()) && (lo[3 * order[m]] <= hi[3 * a]); m++) {
+                    int b = order[m];
+
+                    if (excluded[a * n + b] ||
+                        (lo[3 * b + 1] > hi[3 * a + 1]) || (lo[3 * a + 1] > hi[3 * b + 1]) ||
+                        (lo[3 * b + 2] > hi[3 * a + 2]) || (lo[3 * a + 2] > hi[3 * b + 2]))
+                    {
+                        continue;
+                    }
+
+                    candidates++;
+
+                    float depth = -capsule_distance(caps[a], caps[b]);
+                    if (depth > opts.min_depth) {
+                        local_hits.push_back(Hit{std::min(a, b), std::max(a, b), frame, depth});
+                        count++;
+                    }
+                }
+            }
+
+            report.pairs[i] = count;
+        }
+
+        std::lock_guard<std::mutex> lock(merge_lock);
+        hits.insert(hits.end(), local_hits.begin(), local_hits.end());
+        report.candidates += candidates;
+    }, opts.threads);
+
+    // Runs of consecutive frames per pair
+    std::sort(hits.begin(), hits.end(), [](const Hit &x, const Hit &y) {
+        return std::make_tuple(x.a, x.b, x.frame) < std::make_tuple(y.a, y.b, y.frame);
+    });
+
+    for (const Hit &h: hits) {
+        SelfCollision *last = report.collisions.empty() ? nullptr : &report.collisions.back();
+
+        if (last && (last->bone_a == h.a) && (last->bone_b == h.b) && (last->last + 1 == h.frame)) {
+            last->last = h.frame;
+            if (h.depth > last->max_depth) {
+                last->max_depth = h.depth;
+                last->deepest_frame = h.frame;
+            }
+        } else {
+            report.collisions.push_back(SelfCollision{h.a, h.b, h.frame, h.frame, h.depth, h.frame});
+        }
+    }
+
+    std::stable_sort(report.collisions.begin(), report.collisions.end(),
+                     [](const SelfCollision &x, const SelfCollision &y) { return x.first < y.first; });
+
+    report.seconds = seconds_since(start);
+
+    return report;
+}
+
+
+std::vector<std::pair<int, int>> SelfCollisionReport::frame_ranges(void) const
+{
+    std::vector<std::pair<int, int>> ranges;
+
+    for (size_t i = 0; i < pairs.size(); i++) {
+        if (!pairs[i]) {
+            continue;
+        }
+
+        int frame = first_frame + i;
+        if (!ranges.empty() && (ranges.back().second + 1 == frame)) {
+            ranges.back().second = frame;
+        } else {
+            ranges.emplace_back(frame, frame);
+        }
+    }
+
+    return ranges;
+}
+
+
+void SelfCollisionReport::colliding_bones(int frame, size_t bone_count, std::vector<bool> &bones) const
+{
+    bones.assign(bone_count, false);
+
+    // Sorted by their first frames
+    for (const SelfCollision &c: collisions) {
+        if (c.first > frame) {
+            break;
+        }
+        if ((c.last >= frame) && (static_cast<size_t>(std::max(c.bone_a, c.bone_b)) < bone_count)) {
+            bones[c.bone_a] = true;
+            bones[c.bone_b] = true;
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef SELF_COLLISION_HPP
+#define SELF_COLLISION_HPP
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "amc.hpp"
+#include "asf.hpp"
+
+
+struct SelfCollisionOptions {
+    // Of every bone's capsule (in meters); bones without length have none
+    float radius = .03f;
+    // Capsules have to interpenetrate by more than this to count
+    float min_depth = .01f;
+    // Bones at most this many links apart in the hierarchy (1: parent and
+    // child, 2: also siblings and grandparents) touch at their joints
+    // anyway, so they are never tested against each other
+    int skip_links = 2;
+    // 0 means one per hardware thread
+    unsigned threads = 0;
+};
+
+// One pair of bones interpenetrating over a run of consecutive frames
+struct SelfCollision {
+    // bone_a < bone_b
+    int bone_a, bone_b;
+    // Frame numbers (inclusive)
+    int first, last;
+    float max_depth;
+    int deepest_frame;
+};
+
+struct SelfCollisionReport {
+    int first_frame = 0;
+    // Sorted by first frame
+    std::vector<SelfCollision> collisions;
+    // One per frame: the number of interpenetrating bone pairs
+    std::vector<int> pairs;
+    // Over all frames: bone pairs which could have been tested, and pairs
+    // left by the broad phase (which were tested exactly)
+    size_t possible_pairs = 0, candidates = 0;
+    double seconds = 0.;
+
+    // Runs of consecutive frames (first and last frame number) with any
+    // collision
+    std::vector<std::pair<int, int>> frame_ranges(void) const;
+    // Marks all bones involved in a collision in the given frame
+    void colliding_bones(int frame, size_t bone_count, std::vector<bool> &bones) const;
+};
+
+// Evaluates every frame of the clip (blocks of frames on multiple threads),
+// puts a capsule around every bone and finds the interpenetrating pairs:
+// sweep and prune along x (the order of the previous frame is only
+// insertion sorted, as it barely changes), then exact capsule tests
+SelfCollisionReport find_self_collisions(const AMC &amc,
+                                         const SelfCollisionOptions &opts = SelfCollisionOptions());
+
+#endif
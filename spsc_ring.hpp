@@ -0,0 +1,63 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+
+// Lock-free ring buffer for exactly one producer and one consumer thread.
+// Slots are written and read in place, so elements owning heap memory keep
+// it across uses.
+template<typename T> class SpscRing {
+    public:
+        // capacity must be a power of two
+        SpscRing(size_t capacity):
+            slots(capacity),
+            mask(capacity - 1)
+        {
+            if (!capacity || (capacity & mask)) {
+                throw std::invalid_argument("Ring capacity must be a power of two");
+            }
+        }
+
+        // Producer: slot to fill next (nullptr if the ring is full); it is
+        // handed to the consumer by push()
+        T *write_slot(void)
+        {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) == slots.size()) {
+                return nullptr;
+            }
+            return &slots[h & mask];
+        }
+
+        void push(void)
+        { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+        // Consumer: oldest filled slot (nullptr if the ring is empty); it is
+        // returned to the producer by pop()
+        T *read_slot(void)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t == head.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            return &slots[t & mask];
+        }
+
+        void pop(void)
+        { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+
+    private:
+        std::vector<T> slots;
+        size_t mask;
+
+        // Separate cache lines so producer and consumer do not contend
+        alignas(64) std::atomic<size_t> head{0};
+        alignas(64) std::atomic<size_t> tail{0};
+};
+
+#endif
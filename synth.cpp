@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "synth.hpp"
+
+
+namespace {
+
+struct SynthBone {
+    int parent = -1, depth = 0, children = 0;
+    float direction[3], length, axis[3];
+    std::string axis_order;
+    // DOF axes (0 to 2 for rx to rz), in order, with their limits and motion
+    // parameters (in degrees)
+    std::vector<int> dofs;
+    std::vector<float> lower, upper, phase, speed;
+};
+
+}
+
+
+static std::vector<SynthBone> synth_skeleton(const SynthOptions &opts)
+{
+    std::mt19937 rng(opts.seed);
+    std::uniform_real_distribution<float> unit(-1.f, 1.f);
+    std::uniform_real_distribution<float> len(1.f, 8.f);
+    std::uniform_real_distribution<float> angle(-180.f, 180.f);
+    std::uniform_real_distribution<float> limit(10.f, 170.f);
+    std::uniform_real_distribution<float> phase(0.f, 2.f * static_cast<float>(M_PI));
+    std::uniform_real_distribution<float> speed(.01f, .1f);
+
+    if (opts.dof_sets.empty()) {
+        throw std::invalid_argument("At least one DOF set is required");
+    }
+
+    std::vector<std::vector<int>> dof_sets;
+    for (const std::string &set: opts.dof_sets) {
+        std::stringstream set_ss(set);
+        std::string axis;
+
+        dof_sets.emplace_back();
+        while (set_ss >> axis) {
+            if ((axis != "rx") && (axis != "ry") && (axis != "rz")) {
+                throw std::invalid_argument("Invalid DOF axis " + axis);
+            }
+            dof_sets.back().push_back(axis[1] - 'x');
+        }
+    }
+
+    std::vector<SynthBone> bones(std::max(opts.bones, 1));
+    // Bones which can still take children
+    std::vector<int> open(1, 0);
+
+    // bones[0] is the root
+    for (size_t i = 1; i < bones.size(); i++) {
+        SynthBone &bone = bones[i];
+
+        if (open.empty()) {
+            throw std::invalid_argument("Cannot fit " + std::to_string(bones.size()) +
+                                        " bones into the given depth and branching");
+        }
+
+        // Prefer the most recent bones, giving chains with some branching
+        std::uniform_int_distribution<int> choice(std::max<int>(0, open.size() - 3), open.size() - 1);
+        int oi = choice(rng);
+
+        bone.parent = open[oi];
+        bone.depth = bones[bone.parent].depth + 1;
+
+        if (++bones[bone.parent].children >= opts.max_children) {
+            open.erase(open.begin() + oi);
+        }
+        if (!opts.max_depth || (bone.depth < opts.max_depth)) {
+            open.push_back(i);
+        }
+
+        float dlen;
+        do {
+            for (float &d: bone.direction) {
+                d = unit(rng);
+            }
+            dlen = sqrtf(bone.direction[0] * bone.direction[0] +
+                         bone.direction[1] * bone.direction[1] +
+                         bone.direction[2] * bone.direction[2]);
+        } while ((dlen < .1f) || (dlen > 1.f));
+
+        for (float &d: bone.direction) {
+            d /= dlen;
+        }
+
+        bone.length = len(rng);
+
+        for (float &a: bone.axis) {
+            a = angle(rng);
+        }
+
+        bone.axis_order = "XYZ";
+        if (opts.random_axis_order) {
+            std::shuffle(bone.axis_order.begin(), bone.axis_order.end(), rng);
+        }
+
+        std::uniform_int_distribution<size_t> set_choice(0, dof_sets.size() - 1);
+        bone.dofs = dof_sets[set_choice(rng)];
+
+        for (size_t j = 0; j < bone.dofs.size(); j++) {
+            bone.lower.push_back(-limit(rng));
+            bone.upper.push_back(limit(rng));
+            bone.phase.push_back(phase(rng));
+            bone.speed.push_back(speed(rng));
+        }
+    }
+
+    return bones;
+}
+
+
+// Formats into a local buffer and writes it out
+template<typename... Args> static void print(std::ostream &s, const char *fmt, Args... args)
+{
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), fmt, args...);
+
+    s.write(buf, std::min<int>(len, sizeof(buf) - 1));
+}
+
+
+void synth_asf(std::ostream &s, const SynthOptions &opts)
+{
+    std::vector<SynthBone> bones(synth_skeleton(opts));
+
+    s << "# Synthetic skeleton (" << bones.size() << " bones, seed " << opts.seed << ")\n"
+      << ":version 1.10\n"
+      << ":name synth\n"
+      << ":units\n"
+      << "  mass 1.0\n"
+      << "  length 0.45\n"
+      << "  angle deg\n"
+      << ":documentation\n"
+      << "  Generated for testing\n"
+      << ":root\n"
+      << "  order TX TY TZ RX RY RZ\n"
+      << "  axis XYZ\n"
+      << "  position 0 0 0\n"
+      << "  orientation 0 0 0\n"
+      << ":bonedata\n";
+
+    for (size_t i = 1; i < bones.size(); i++) {
+        const SynthBone &bone = bones[i];
+
+        print(s, "  begin\n    id %zu\n    name b%zu\n", i, i);
+        print(s, "    direction %.6f %.6f %.6f\n", bone.direction[0], bone.direction[1], bone.direction[2]);
+        print(s, "    length %.6f\n", bone.length);
+        print(s, "    axis %.6f %.6f %.6f %s\n", bone.axis[0], bone.axis[1], bone.axis[2], bone.axis_order.c_str());
+
+        if (!bone.dofs.empty()) {
+            s << "    dof";
+            for (int dof: bone.dofs) {
+                s << " r" << static_cast<char>('x' + dof);
+            }
+            s << "\n";
+
+            for (size_t j = 0; j < bone.dofs.size(); j++) {
+                print(s, j ? "           (%.6f %.6f)\n" : "    limits (%.6f %.6f)\n", bone.lower[j], bone.upper[j]);
+            }
+        }
+
+        s << "  end\n";
+    }
+
+    s << ":hierarchy\n  begin\n";
+
+    std::vector<std::vector<int>> children(bones.size());
+    for (size_t i = 1; i < bones.size(); i++) {
+        children[bones[i].parent].push_back(i);
+    }
+
+    for (size_t i = 0; i < bones.size(); i++) {
+        if (children[i].empty()) {
+            continue;
+        }
+
+        s << "    " << (i ? "b" + std::to_string(i) : std::string("root"));
+        for (int child: children[i]) {
+            s << " b" << child;
+        }
+        s << "\n";
+    }
+
+    s << "  end\n";
+}
+
+
+static void synth_frame(std::ostream &s, const std::vector<SynthBone> &bones, int f)
+{
+    print(s, "%i\n", f);
+    print(s, "root %.6f %.6f %.6f %.6f %.6f %.6f\n",
+          10.f * sinf(f * .01f), 17.f + sinf(f * .1f), 10.f * cosf(f * .01f),
+          5.f * sinf(f * .05f), fmodf(f * .5f, 360.f), 3.f * cosf(f * .07f));
+
+    char line[256];
+    for (size_t i = 1; i < bones.size(); i++) {
+        const SynthBone &bone = bones[i];
+
+        if (bone.dofs.empty()) {
+            continue;
+        }
+
+        int len = snprintf(line, sizeof(line), "b%zu", i);
+
+        // Oscillate within the limits
+        for (size_t j = 0; j < bone.dofs.size(); j++) {
+            float mid = .5f * (bone.lower[j] + bone.upper[j]);
+            float amp = .5f * (bone.upper[j] - bone.lower[j]);
+
+            len += snprintf(line + len, sizeof(line) - len, " %.6f", mid + amp * sinf(bone.phase[j] + f * bone.speed[j]));
+        }
+
+        line[len++] = '\n';
+        s.write(line, len);
+    }
+}
+
+
+void synth_amc(std::ostream &s, const SynthOptions &opts)
+{
+    std::vector<SynthBone> bones(synth_skeleton(opts));
+
+    // Separate from the skeleton's RNG, so the skeleton does not depend on
+    // the motion options
+    std::mt19937 rng(opts.seed ^ 0x5eed);
+    std::uniform_real_distribution<float> chance(0.f, 1.f);
+
+    s << "# Synthetic motion (" << opts.frames << " frames, seed " << opts.seed << ")\n"
+      << ":FULLY-SPECIFIED\n"
+      << ":DEGREES\n";
+
+    int last = opts.first_frame + opts.frames - 1;
+    for (int f = opts.first_frame; f <= last; f++) {
+        if ((f < last) && (chance(rng) < opts.out_of_order)) {
+            synth_frame(s, bones, f + 1);
+            synth_frame(s, bones, f);
+            f++;
+        } else if ((f == opts.first_frame) || (f == last) || (chance(rng) >= opts.missing)) {
+            // Keep the first and last frame so the range stays the same
+            synth_frame(s, bones, f);
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef SYNTH_HPP
+#define SYNTH_HPP
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+// Generates valid ASF skeletons and matching AMC clips of arbitrary size.
+// The output is streamed, so it can be larger than the available memory.
+struct SynthOptions {
+    // Including the root
+    int bones = 31;
+    // Maximum hierarchy depth (0 for unlimited) and children per bone
+    int max_depth = 0;
+    int max_children = 3;
+    // Pick a random rotation order for every bone (instead of XYZ)
+    bool random_axis_order = false;
+    // Every bone gets one of these DOF sets (as in the ASF "dof" line, e.g.
+    // "rz rx"; an empty string means no DOF at all)
+    std::vector<std::string> dof_sets = {"rx ry rz"};
+
+    int frames = 1000;
+    int first_frame = 1;
+    // Probability for every frame to be swapped with its successor, and to
+    // be left out
+    float out_of_order = 0.f;
+    float missing = 0.f;
+
+    unsigned seed = 42;
+};
+
+
+// Both need to be called with the same options for the AMC to match the ASF
+void synth_asf(std::ostream &s, const SynthOptions &opts);
+void synth_amc(std::ostream &s, const SynthOptions &opts);
+
+#endif
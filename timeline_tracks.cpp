@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <cmath>
+#include <QColor>
+#include <QFont>
+#include <QMouseEvent>
+#include <QPainter>
+#include <QPaintEvent>
+#include <QSize>
+#include <QString>
+#include <QWidget>
+#include <vector>
+
+#include "asf.hpp"
+#include "kinematics.hpp"
+#include "self_collision.hpp"
+#include "timeline_tracks.hpp"
+#include "trace.hpp"
+
+
+TimelineTracks::TimelineTracks(QWidget *parent):
+    QWidget(parent)
+{
+    setFont(QFont("monospace", 8));
+    setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Fixed);
+    hide();
+}
+
+
+void TimelineTracks::set_kinematics(const ClipKinematics *kinematics, const ASF *asf)
+{
+    kin = kinematics;
+    skeleton = asf;
+
+    if (kin) {
+        set_speed_bone(speed_bone);
+    }
+    updateGeometry();
+    setVisible(kin || collisions);
+}
+
+
+void TimelineTracks::set_collisions(const SelfCollisionReport *report)
+{
+    collisions = report;
+
+    updateGeometry();
+    setVisible(kin || collisions);
+    update();
+}
+
+
+size_t TimelineTracks::frame_count(void) const
+{
+    return kin ? kin->frame_count() : collisions ? collisions->pairs.size() : 0;
+}
+
+
+int TimelineTracks::first_frame(void) const
+{
+    return kin ? kin->first_frame() : collisions ? collisions->first_frame : 0;
+}
+
+
+QSize TimelineTracks::sizeHint(void) const
+{
+    int rows = (kin ? kin->contacts().size() + 3 : 0) + (collisions ? 1 : 0);
+    return QSize(400, rows * row_height);
+}
+
+
+void TimelineTracks::set_frame(int frame)
+{
+    cur_frame = frame;
+    update();
+}
+
+
+void TimelineTracks::set_speed_bone(int bone)
+{
+    // Bones of another skeleton
+    speed_bone = kin && (bone >= static_cast<int>(kin->bone_count())) ? -1 : bone;
+    max_speed = 0.f;
+
+    if (kin) {
+        int b = speed_bone >= 0 ? speed_bone : skeleton->root_index();
+        const float *vx = kin->channel(b, ClipKinematics::VX);
+        const float *vy = kin->channel(b, ClipKinematics::VY);
+        const float *vz = kin->channel(b, ClipKinematics::VZ);
+
+        for (size_t i = 0; i < kin->frame_count(); i++) {
+            max_speed = std::max(max_speed, vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]);
+        }
+        max_speed = sqrtf(max_speed);
+    }
+
+    update();
+}
+
+
+void TimelineTracks::paintEvent(QPaintEvent *)
+{
+    if (!frame_count()) {
+        return;
+    }
+
+    TRACE_SCOPE("TimelineTracks::paintEvent");
+
+    QPainter p(this);
+    p.fillRect(rect(), QColor(32, 32, 32));
+
+    int track_width = width() - label_width;
+    if (track_width <= 0) {
+        return;
+    }
+
+    size_t frames = frame_count();
+    auto frame_at = [&](int x) {
+        return std::min<size_t>(static_cast<size_t>(x) * frames / track_width, frames);
+    };
+
+    int y = 0;
+    if (collisions) {
+        p.setPen(Qt::white);
+        p.drawText(2, y, label_width - 4, row_height, Qt::AlignVCenter, "collisions");
+
+        const std::vector<int> &pairs = collisions->pairs;
+        for (int x = 0; x < track_width; x++) {
+            size_t first = frame_at(x), end = std::min(std::max(frame_at(x + 1), first + 1), pairs.size());
+            if (std::find_if(pairs.begin() + std::min(first, end), pairs.begin() + end,
+                             [](int n) { return n > 0; }) != pairs.begin() + end)
+            {
+                p.fillRect(label_width + x, y + 2, 1, row_height - 4, QColor(255, 140, 15));
+            }
+        }
+
+        y += row_height;
+    }
+
+    if (kin) {
+        paint_kinematics(p, y, track_width);
+    }
+
+    int cursor = label_width + static_cast<int>((cur_frame - first_frame() + .5) * track_width / frames);
+    p.setPen(QColor(255, 80, 80));
+    p.drawLine(cursor, 0, cursor, height());
+}
+
+
+void TimelineTracks::paint_kinematics(QPainter &p, int y, int track_width)
+{
+    size_t frames = kin->frame_count();
+    auto frame_at = [&](int x) {
+        return std::min<size_t>(static_cast<size_t>(x) * frames / track_width, frames);
+    };
+
+    for (const ClipKinematics::Contacts &c: kin->contacts()) {
+        p.setPen(Qt::white);
+        p.drawText(2, y, label_width - 4, row_height, Qt::AlignVCenter,
+                   QString::fromStdString(skeleton->bones()[c.bone].name));
+
+        for (int x = 0; x < track_width; x++) {
+            size_t first = frame_at(x), end = std::min(std::max(frame_at(x + 1), first + 1), frames);
+            if (std::find(c.frames.begin() + first, c.frames.begin() + end, 1) != c.frames.begin() + end) {
+                p.fillRect(label_width + x, y + 2, 1, row_height - 4, QColor(80, 200, 120));
+            }
+        }
+
+        y += row_height;
+    }
+
+    // The speed track is three rows high
+    int b = speed_bone >= 0 ? speed_bone : skeleton->root_index();
+    int speed_height = 3 * row_height;
+
+    p.setPen(Qt::white);
+    p.drawText(2, y, label_width - 4, speed_height, Qt::AlignVCenter,
+               QString("%1\n%2 m/s").arg(QString::fromStdString(skeleton->bones()[b].name))
+                                    .arg(max_speed, 0, 'f', 1));
+
+    if (max_speed > 0.f) {
+        const float *vx = kin->channel(b, ClipKinematics::VX);
+        const float *vy = kin->channel(b, ClipKinematics::VY);
+        const float *vz = kin->channel(b, ClipKinematics::VZ);
+
+        for (int x = 0; x < track_width; x++) {
+            size_t first = frame_at(x), end = std::min(std::max(frame_at(x + 1), first + 1), frames);
+
+            float speed = 0.f;
+            for (size_t i = first; i < end; i++) {
+                speed = std::max(speed, vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]);
+            }
+
+            int h = lrintf(sqrtf(speed) / max_speed * (speed_height - 2));
+            p.fillRect(label_width + x, y + speed_height - 1 - h, 1, h, QColor(90, 150, 230));
+        }
+    }
+}
+
+
+void TimelineTracks::select_frame(int x)
+{
+    if (!frame_count() || (width() <= label_width)) {
+        return;
+    }
+
+    int track_width = width() - label_width;
+    int i = static_cast<int>(static_cast<double>(x - label_width) * frame_count() / track_width);
+    i = std::max(0, std::min(i, static_cast<int>(frame_count()) - 1));
+
+    emit frame_selected(first_frame() + i);
+}
+
+
+void TimelineTracks::mousePressEvent(QMouseEvent *evt)
+{
+    select_frame(evt->x());
+}
+
+
+void TimelineTracks::mouseMoveEvent(QMouseEvent *evt)
+{
+    if (evt->buttons() & Qt::LeftButton) {
+        select_frame(evt->x());
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef TIMELINE_TRACKS_HPP
+#define TIMELINE_TRACKS_HPP
+
+#include <QMouseEvent>
+#include <QPainter>
+#include <QPaintEvent>
+#include <QSize>
+#include <QWidget>
+
+#include "asf.hpp"
+#include "kinematics.hpp"
+#include "self_collision.hpp"
+
+
+// Per-frame tracks of a clip's kinematics, one row each: the contacts of
+// every contact bone, and the speed of the selected bone (or the root); and
+// of its self-collisions. Every pixel column covers a range of frames,
+// showing a contact or collision if there is one anywhere in it and the
+// highest speed. Clicking selects a frame.
+class TimelineTracks:
+    public QWidget
+{
+    Q_OBJECT
+
+    public:
+        TimelineTracks(QWidget *parent = nullptr);
+
+        // Hides the widget while there is nothing to show
+        void set_kinematics(const ClipKinematics *kinematics, const ASF *asf);
+        // Must be for the same clip as the kinematics (if any)
+        void set_collisions(const SelfCollisionReport *report);
+
+        QSize sizeHint(void) const;
+
+    public slots:
+        void set_frame(int frame);
+        void set_speed_bone(int bone);
+
+    signals:
+        void frame_selected(int frame);
+
+    protected:
+        void paintEvent(QPaintEvent *evt);
+        void mousePressEvent(QMouseEvent *evt);
+        void mouseMoveEvent(QMouseEvent *evt);
+
+    private:
+        // Contact and speed rows, starting at y
+        void paint_kinematics(QPainter &p, int y, int track_width);
+        void select_frame(int x);
+        // Of the clip shown
+        size_t frame_count(void) const;
+        int first_frame(void) const;
+
+        const ClipKinematics *kin = nullptr;
+        const SelfCollisionReport *collisions = nullptr;
+        const ASF *skeleton = nullptr;
+        int cur_frame = 0, speed_bone = -1;
+        // Of the speed track's bone over the whole clip
+        float max_speed = 0.f;
+
+        static const int label_width = 80, row_height = 12;
+};
+
+#endif
@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "trace.hpp"
+
+
+std::atomic<bool> trace_enabled{false};
+
+static const size_t ring_size = 1 << 16;
+
+struct ThreadBuffer {
+    // Name of every thread which has used the buffer (with the number of
+    // events written before it did), so events keep their thread's name
+    // after a reuse
+    std::vector<std::pair<uint64_t, std::string>> names;
+    TraceEvent events[ring_size];
+    std::atomic<uint64_t> written{0};
+    // Index in the registry
+    size_t index;
+};
+
+// Buffers are never freed, so events of threads which have already exited
+// can still be exported. Instead, the buffers of exited threads are reused
+// by new ones (keeping the old events until they are overwritten), so there
+// are only as many as there were threads recording at the same time.
+// Everything but the events and written is protected by registry_lock.
+static std::mutex registry_lock;
+static std::vector<ThreadBuffer *> registry, free_buffers;
+
+namespace
+{
+
+struct LocalBuffer {
+    ThreadBuffer *buf = nullptr;
+    // Events written to buf before this thread got it
+    uint64_t first_event = 0;
+
+    ~LocalBuffer(void)
+    {
+        if (buf) {
+            std::lock_guard<std::mutex> guard(registry_lock);
+            free_buffers.push_back(buf);
+        }
+    }
+};
+
+}
+
+static thread_local LocalBuffer local_buffer;
+
+
+static ThreadBuffer *thread_buffer(void)
+{
+    if (!local_buffer.buf) {
+        std::lock_guard<std::mutex> guard(registry_lock);
+
+        ThreadBuffer *buf;
+        if (!free_buffers.empty()) {
+            buf = free_buffers.back();
+            free_buffers.pop_back();
+        } else {
+            buf = new ThreadBuffer;
+            buf->index = registry.size();
+            registry.push_back(buf);
+        }
+
+        // Nobody writes to a free buffer; consecutive threads with the
+        // default name share an entry
+        uint64_t written = buf->written.load(std::memory_order_relaxed);
+        std::string name("Thread " + std::to_string(buf->index));
+        if (buf->names.empty() || (buf->names.back().second != name)) {
+            buf->names.emplace_back(written, name);
+        }
+
+        // Forget the names of threads whose events have all been overwritten
+        while ((buf->names.size() > 1) && (buf->names[1].first + ring_size <= written)) {
+            buf->names.erase(buf->names.begin());
+        }
+
+        local_buffer.buf = buf;
+        local_buffer.first_event = written;
+    }
+
+    return local_buffer.buf;
+}
+
+
+static std::mutex users_lock;
+static int users;
+
+
+void trace_acquire(void)
+{
+    std::lock_guard<std::mutex> lock(users_lock);
+    if (!users++) {
+        trace_enabled.store(true, std::memory_order_relaxed);
+    }
+}
+
+
+void trace_release(void)
+{
+    std::lock_guard<std::mutex> lock(users_lock);
+    if (users > 0 && !--users) {
+        trace_enabled.store(false, std::memory_order_relaxed);
+    }
+}
+
+
+uint64_t trace_clock(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+double seconds_since(const std::chrono::steady_clock::time_point &start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+static void record(ThreadBuffer *buf, const char *name, uint64_t start_ns, uint64_t end_ns)
+{
+    uint64_t index = buf->written.load(std::memory_order_relaxed);
+
+    // The thread index is filled in by trace_events()
+    buf->events[index % ring_size] = TraceEvent{name, start_ns, end_ns, 0};
+    buf->written.store(index + 1, std::memory_order_release);
+}
+
+
+void trace_record(const char *name, uint64_t start_ns, uint64_t end_ns)
+{
+    record(thread_buffer(), name, start_ns, end_ns);
+}
+
+
+int trace_add_track(const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(registry_lock);
+
+    registry.push_back(new ThreadBuffer);
+    registry.back()->names.emplace_back(0, name);
+    registry.back()->index = registry.size() - 1;
+
+    return registry.size() - 1;
+}
+
+
+void trace_record(int track, const char *name, uint64_t start_ns, uint64_t end_ns)
+{
+    ThreadBuffer *buf;
+
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        buf = registry[track];
+    }
+
+    record(buf, name, start_ns, end_ns);
+}
+
+
+void trace_thread_name(const std::string &name)
+{
+    ThreadBuffer *buf = thread_buffer();
+
+    std::lock_guard<std::mutex> guard(registry_lock);
+    if (buf->names.back().first != local_buffer.first_event) {
+        // Shared with earlier threads
+        buf->names.emplace_back(local_buffer.first_event, name);
+    } else {
+        buf->names.back().second = name;
+    }
+}
+
+
+// Every name of every buffer is a track of its own; fills in names (indexed
+// by TraceEvent.thread) if given
+static std::vector<TraceEvent> collect_events(uint64_t since_ns, std::vector<std::string> *names)
+{
+    std::vector<TraceEvent> events, copied;
+    std::lock_guard<std::mutex> guard(registry_lock);
+
+    int first_track = 0;
+    for (ThreadBuffer *buf: registry) {
+        if (names) {
+            for (const auto &name: buf->names) {
+                names->push_back(name.second);
+            }
+        }
+
+        uint64_t end = buf->written.load(std::memory_order_acquire);
+        uint64_t begin = end > ring_size ? end - ring_size : 0;
+
+        copied.clear();
+        for (uint64_t i = begin; i < end; i++) {
+            copied.push_back(buf->events[i % ring_size]);
+        }
+
+        // The thread may have overwritten events while they were copied (and
+        // may be writing the slot of the oldest remaining one right now)
+        uint64_t valid_begin = begin;
+        // Keeps the copies above from being done after this load
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now_written = buf->written.load(std::memory_order_acquire);
+        if (now_written + 1 > begin + ring_size) {
+            valid_begin = std::min(end, now_written + 1 - ring_size);
+        }
+
+        for (size_t i = valid_begin - begin; i < copied.size(); i++) {
+            if (copied[i].end_ns >= since_ns) {
+                // Recorded by the last thread which had started using the
+                // buffer by then
+                auto name = std::upper_bound(buf->names.begin() + 1, buf->names.end(), begin + i,
+                                             [](uint64_t index, const std::pair<uint64_t, std::string> &n) {
+                                                 return index < n.first;
+                                             });
+
+                events.push_back(copied[i]);
+                events.back().thread = first_track + (name - buf->names.begin()) - 1;
+            }
+        }
+
+        first_track += buf->names.size();
+    }
+
+    std::sort(events.begin(), events.end(),
+              [](const TraceEvent &a, const TraceEvent &b) { return a.start_ns < b.start_ns; });
+
+    return events;
+}
+
+
+std::vector<TraceEvent> trace_events(uint64_t since_ns)
+{
+    return collect_events(since_ns, nullptr);
+}
+
+
+// Names are string literals, but may still contain quotes
+static void write_json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str; str++) {
+        if ((*str == '"') || (*str == '\\')) {
+            fputc('\\', fp);
+            fputc(*str, fp);
+        } else if (static_cast<unsigned char>(*str) < 0x20) {
+            fprintf(fp, "\\u%04x", *str);
+        } else {
+            fputc(*str, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+
+void write_chrome_trace(const std::string &path)
+{
+    std::vector<std::string> thread_names;
+    std::vector<TraceEvent> events(collect_events(0, &thread_names));
+
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (size_t i = 0; i < thread_names.size(); i++) {
+        fprintf(fp, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":", i);
+        write_json_string(fp, thread_names[i].c_str());
+        fprintf(fp, "}},\n");
+    }
+
+    // Timestamps are in µs (relative to the first event)
+    uint64_t base = events.empty() ? 0 : events.front().start_ns;
+    for (size_t i = 0; i < events.size(); i++) {
+        const TraceEvent &event = events[i];
+
+        fprintf(fp, "{\"ph\":\"X\",\"name\":");
+        write_json_string(fp, event.name);
+        fprintf(fp, ",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f}%s\n", event.thread,
+                (event.start_ns - base) / 1e3, (event.end_ns - event.start_ns) / 1e3,
+                i + 1 < events.size() ? "," : "");
+    }
+
+    fprintf(fp, "]}\n");
+
+    if (ferror(fp) | fclose(fp)) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
+
+std::vector<TraceStageStats> trace_summary(double window_seconds)
+{
+    uint64_t now = trace_clock();
+    uint64_t window = static_cast<uint64_t>(window_seconds * 1e9);
+    std::vector<TraceEvent> events(trace_events(now > window ? now - window : 0));
+
+    // Names are literals, but the same literal may have several addresses
+    std::map<std::string, std::vector<double>> durations;
+    std::map<std::string, const char *> names;
+    for (const TraceEvent &event: events) {
+        durations[event.name].push_back((event.end_ns - event.start_ns) / 1e6);
+        names.emplace(event.name, event.name);
+    }
+
+    std::vector<TraceStageStats> summary;
+    for (auto &entry: durations) {
+        std::vector<double> &ms = entry.second;
+        std::sort(ms.begin(), ms.end());
+
+        double sum = 0.;
+        for (double d: ms) {
+            sum += d;
+        }
+
+        summary.push_back(TraceStageStats{names[entry.first], ms.size(), sum / ms.size(),
+                                          ms[std::min(ms.size() - 1, ms.size() * 95 / 100)], ms.back()});
+    }
+
+    return summary;
+}
@@ -0,0 +1,91 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// Scoped tracing of hot paths: TRACE_SCOPE("name") records the time spent in
+// the rest of the enclosing scope into a ring buffer of the calling thread
+// (names must be string literals). While tracing is disabled, a scope only
+// costs a relaxed atomic load.
+struct TraceEvent {
+    const char *name;
+    uint64_t start_ns, end_ns;
+    // Track of the recording thread (see trace_thread_name()) or the one
+    // given to trace_record()
+    int thread;
+};
+
+extern std::atomic<bool> trace_enabled;
+
+inline bool tracing(void) { return trace_enabled.load(std::memory_order_relaxed); }
+// Tracing is enabled while anything (e.g. --trace, or a timing overlay)
+// holds a reference; every trace_acquire() needs one trace_release()
+void trace_acquire(void);
+void trace_release(void);
+
+// Monotonic time in ns (the time base of all events)
+uint64_t trace_clock(void);
+// Seconds elapsed since start (for the timing statistics of analyses)
+double seconds_since(const std::chrono::steady_clock::time_point &start);
+
+void trace_record(const char *name, uint64_t start_ns, uint64_t end_ns);
+
+// Names the calling thread in exported traces (its buffer is reused by new
+// threads once it has exited, but its events keep the name)
+void trace_thread_name(const std::string &name);
+
+// Additional tracks for work not done on a CPU thread (e.g. GPU passes);
+// every track may only be written by one thread at a time
+int trace_add_track(const std::string &name);
+void trace_record(int track, const char *name, uint64_t start_ns, uint64_t end_ns);
+
+
+class TraceScope {
+    public:
+        TraceScope(const char *scope_name):
+            name(scope_name), start(tracing() ? trace_clock() : 0)
+        {}
+
+        ~TraceScope(void)
+        {
+            if (start) {
+                trace_record(name, start, trace_clock());
+            }
+        }
+
+    private:
+        const char *name;
+        uint64_t start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+
+// Events of all threads which are still in the buffers and ended at or after
+// the given time (every thread keeps the last 65536), sorted by start time
+std::vector<TraceEvent> trace_events(uint64_t since_ns = 0);
+
+// Writes trace_events() in the Chrome trace event format (which Perfetto and
+// chrome://tracing can open)
+void write_chrome_trace(const std::string &path);
+
+
+// Duration statistics of all events with the same name
+struct TraceStageStats {
+    const char *name;
+    size_t count;
+    double mean_ms, p95_ms, max_ms;
+};
+
+// Over all events of the last window_seconds, sorted by name
+std::vector<TraceStageStats> trace_summary(double window_seconds);
+
+#endif
@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <dake/math/matrix.hpp>
+
+#include "amc.hpp"
+#include "asf.hpp"
+#include "clip_view.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+#include "track_export.hpp"
+
+
+using namespace dake::math;
+
+
+const char *const track_channel_names[track_channel_count] = {
+    "px", "py", "pz", "qw", "qx", "qy", "qz"
+};
+
+static const char columnar_magic[8] = {'C', 'G', '2', 'T', 'R', 'A', 'K', 'S'};
+static const uint32_t columnar_version = 1;
+
+
+void bone_track_channels(const mat4 &m, float *out)
+{
+    vec4 c0(m * vec4(1.f, 0.f, 0.f, 0.f));
+    vec4 c1(m * vec4(0.f, 1.f, 0.f, 0.f));
+    vec4 c2(m * vec4(0.f, 0.f, 1.f, 0.f));
+    vec4 c3(m * vec4(0.f, 0.f, 0.f, 1.f));
+
+    out[0] = c3.x();
+    out[1] = c3.y();
+    out[2] = c3.z();
+
+    float trace = c0.x() + c1.y() + c2.z();
+    float w, x, y, z;
+
+    if (trace > 0.f) {
+        float s = 2.f * sqrtf(trace + 1.f);
+        w = .25f * s;
+        x = (c1.z() - c2.y()) / s;
+        y = (c2.x() - c0.z()) / s;
+        z = (c0.y() - c1.x()) / s;
+    } else if ((c0.x() > c1.y()) && (c0.x() > c2.z())) {
+        float s = 2.f * sqrtf(1.f + c0.x() - c1.y() - c2.z());
+        w = (c1.z() - c2.y()) / s;
+        x = .25f * s;
+        y = (c1.x() + c0.y()) / s;
+        z = (c2.x() + c0.z()) / s;
+    } else if (c1.y() > c2.z()) {
+        float s = 2.f * sqrtf(1.f + c1.y() - c0.x() - c2.z());
+        w = (c2.x() - c0.z()) / s;
+        x = (c1.x() + c0.y()) / s;
+        y = .25f * s;
+        z = (c2.y() + c1.z()) / s;
+    } else {
+        float s = 2.f * sqrtf(1.f + c2.z() - c0.x() - c1.y());
+        w = (c0.y() - c1.x()) / s;
+        x = (c2.x() + c0.z()) / s;
+        y = (c2.y() + c1.z()) / s;
+        z = .25f * s;
+    }
+
+    float norm = sqrtf(w * w + x * x + y * y + z * z);
+    if (w < 0.f) {
+        norm = -norm;
+    }
+
+    out[3] = w / norm;
+    out[4] = x / norm;
+    out[5] = y / norm;
+    out[6] = z / norm;
+}
+
+
+static void append(std::vector<char> &buf, const void *data, size_t size)
+{
+    buf.insert(buf.end(), static_cast<const char *>(data), static_cast<const char *>(data) + size);
+}
+
+
+static void append_name(std::vector<char> &buf, const std::string &name)
+{
+    uint32_t length = name.length();
+    append(buf, &length, sizeof(length));
+    append(buf, name.data(), length);
+}
+
+
+static void write_all(int fd, const char *data, size_t size, uint64_t offset)
+{
+    while (size) {
+        ssize_t ret = pwrite(fd, data, size, offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Could not write track file: ") + strerror(errno));
+        }
+
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+}
+
+
+// Appends the shortest representation that reads back as the same float
+static void format_float(std::string &out, float value)
+{
+    char buf[32];
+    std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, res.ptr);
+}
+
+
+void export_tracks(const ClipView &clip, const std::string &path, const TrackExportOptions &opts, TrackExportStats *stats)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    if (!clip.skeleton()) {
+        throw std::invalid_argument("Cannot export an empty clip view");
+    }
+
+    const ASF &asf = *clip.skeleton();
+    size_t bone_count = asf.bones().size();
+    size_t column_count = bone_count * track_channel_count;
+    size_t frame_count = clip.size();
+    size_t block_frames = std::max<size_t>(opts.block_frames, 1);
+    bool csv = opts.format == TrackExportOptions::CSV;
+
+    unsigned thread_count = opts.threads ? opts.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    uint64_t offset = 0, data_offset = 0;
+    std::thread writer;
+    std::string write_error;
+    TrackExportStats st;
+
+    // Two buffers: one being filled while the other one is written
+    std::vector<float> columns[2];
+    std::vector<std::string> rows[2];
+
+    auto wait_for_writer = [&]() {
+        if (writer.joinable()) {
+            auto wait_start = std::chrono::steady_clock::now();
+            writer.join();
+            st.write_wait_seconds += seconds_since(wait_start);
+        }
+        if (!write_error.empty()) {
+            throw std::runtime_error(write_error);
+        }
+    };
+
+    try {
+        if (csv) {
+            std::string header("frame");
+            for (const ASF::Bone &bone: asf.bones()) {
+                for (const char *channel: track_channel_names) {
+                    header += "," + bone.name + "." + channel;
+                }
+            }
+            header += "\n";
+
+            write_all(fd, header.data(), header.size(), 0);
+            offset = header.size();
+        } else {
+            std::vector<char> header;
+            uint32_t fields[] = {
+                columnar_version,
+                static_cast<uint32_t>(bone_count),
+                static_cast<uint32_t>(track_channel_count),
+                static_cast<uint32_t>(frame_count)
+            };
+            int32_t first = clip.first_frame();
+            uint32_t reserved = 0;
+
+            append(header, columnar_magic, sizeof(columnar_magic));
+            append(header, fields, sizeof(fields));
+            append(header, &first, sizeof(first));
+            append(header, &reserved, sizeof(reserved));
+
+            size_t data_offset_pos = header.size();
+            append(header, &data_offset, sizeof(data_offset));
+
+            for (const ASF::Bone &bone: asf.bones()) {
+                int32_t parent = bone.parent;
+                append(header, &parent, sizeof(parent));
+                append_name(header, bone.name);
+            }
+            for (const char *channel: track_channel_names) {
+                append_name(header, channel);
+            }
+
+            data_offset = (header.size() + 4095) / 4096 * 4096;
+            memcpy(header.data() + data_offset_pos, &data_offset, sizeof(data_offset));
+            header.resize(data_offset);
+
+            write_all(fd, header.data(), header.size(), 0);
+
+            uint64_t size = data_offset + static_cast<uint64_t>(column_count) * frame_count * sizeof(float);
+            if (ftruncate(fd, size) < 0) {
+                throw std::runtime_error("Could not resize " + path + ": " + strerror(errno));
+            }
+            st.bytes = size;
+        }
+
+        for (size_t block_start = 0, block = 0; block_start < frame_count; block_start += block_frames, block++) {
+            size_t n = std::min(block_frames, frame_count - block_start);
+            int bi = block & 1;
+
+            // Filled while the previous block (from the other buffer) is
+            // being written
+            auto compute_start = std::chrono::steady_clock::now();
+            uint64_t trace_start = tracing() ? trace_clock() : 0;
+
+            if (csv) {
+                rows[bi].resize(thread_count);
+                parallel_ranges(thread_count, [&](size_t first_chunk, size_t end_chunk) {
+                    std::vector<mat4> trans(bone_count);
+                    float channels[track_channel_count];
+
+                    for (size_t c = first_chunk; c < end_chunk; c++) {
+                        std::string &out = rows[bi][c];
+                        out.clear();
+
+                        for (size_t i = n * c / thread_count; i < n * (c + 1) / thread_count; i++) {
+                            int frame = clip.first_frame() + block_start + i;
+                            clip.evaluate(frame, trans.data());
+
+                            char num[16];
+                            out.append(num, std::to_chars(num, num + sizeof(num), frame).ptr);
+
+                            for (size_t b = 0; b < bone_count; b++) {
+                                bone_track_channels(trans[b], channels);
+                                for (float value: channels) {
+                                    out += ',';
+                                    format_float(out, value);
+                                }
+                            }
+                            out += '\n';
+                        }
+                    }
+                }, thread_count);
+            } else {
+                columns[bi].resize(column_count * block_frames);
+                parallel_ranges(n, [&](size_t first, size_t end) {
+                    std::vector<mat4> trans(bone_count);
+                    float channels[track_channel_count];
+
+                    for (size_t i = first; i < end; i++) {
+                        clip.evaluate(clip.first_frame() + block_start + i, trans.data());
+
+                        for (size_t b = 0; b < bone_count; b++) {
+                            bone_track_channels(trans[b], channels);
+                            for (int c = 0; c < track_channel_count; c++) {
+                                columns[bi][(b * track_channel_count + c) * block_frames + i] = channels[c];
+                            }
+                        }
+                    }
+                }, thread_count);
+            }
+
+            st.compute_seconds += seconds_since(compute_start);
+            if (trace_start) {
+                trace_record("export_tracks::bake", trace_start, trace_clock());
+            }
+
+            {
+                TRACE_SCOPE("export_tracks::wait");
+                wait_for_writer();
+            }
+
+            if (csv) {
+                uint64_t block_offset = offset;
+                for (const std::string &chunk: rows[bi]) {
+                    offset += chunk.size();
+                }
+
+                writer = std::thread([&, bi, block_offset]() {
+                    TRACE_SCOPE("export_tracks::write");
+                    try {
+                        uint64_t o = block_offset;
+                        for (const std::string &chunk: rows[bi]) {
+                            write_all(fd, chunk.data(), chunk.size(), o);
+                            o += chunk.size();
+                        }
+                    } catch (std::exception &e) {
+                        write_error = e.what();
+                    }
+                });
+            } else {
+                writer = std::thread([&, bi, n, block_start]() {
+                    TRACE_SCOPE("export_tracks::write");
+                    try {
+                        for (size_t c = 0; c < column_count; c++) {
+                            write_all(fd, reinterpret_cast<const char *>(&columns[bi][c * block_frames]), n * sizeof(float),
+                                      data_offset + (c * frame_count + block_start) * sizeof(float));
+                        }
+                    } catch (std::exception &e) {
+                        write_error = e.what();
+                    }
+                });
+            }
+        }
+
+        wait_for_writer();
+    } catch (...) {
+        if (writer.joinable()) {
+            writer.join();
+        }
+        close(fd);
+        throw;
+    }
+
+    if (close(fd) < 0) {
+        throw std::runtime_error("Could not write " + path + ": " + strerror(errno));
+    }
+
+    if (csv) {
+        st.bytes = offset;
+    }
+    st.frames = frame_count;
+    st.seconds = seconds_since(start);
+
+    if (stats) {
+        *stats = st;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef TRACK_EXPORT_HPP
+#define TRACK_EXPORT_HPP
+
+#include <cstddef>
+#include <string>
+#include <dake/math/matrix.hpp>
+
+#include "clip_view.hpp"
+
+
+// Every bone gets these channels per frame: the world position of its origin
+// and its world orientation as a unit quaternion (w >= 0)
+static const int track_channel_count = 7;
+extern const char *const track_channel_names[track_channel_count];
+
+// Fills the channels of one bone from its motion transformation (see ASF::Bone)
+void bone_track_channels(const dake::math::mat4 &motion_trans, float *out);
+
+
+// Columnar files consist of a header and one column of frame_count floats
+// (native byte order) per bone channel:
+//   char     magic[8]       "CG2TRAKS"
+//   uint32_t version        1
+//   uint32_t bone_count
+//   uint32_t channel_count  (per bone)
+//   uint32_t frame_count
+//   int32_t  first_frame
+//   uint32_t reserved
+//   uint64_t data_offset    (a multiple of 4096)
+//   per bone:    int32_t parent, uint32_t name length, name
+//   per channel: uint32_t name length, name
+// The column for bone b, channel c starts at
+// data_offset + (b * channel_count + c) * frame_count * 4.
+//
+// CSV files have a header row ("frame,<bone>.<channel>,...") and one row per
+// frame.
+struct TrackExportOptions {
+    enum Format {
+        COLUMNAR,
+        CSV
+    };
+
+    Format format = COLUMNAR;
+    // Frames baked at once; memory use is proportional to this, not to the
+    // clip length
+    size_t block_frames = 4096;
+    // 0: one per hardware thread
+    unsigned threads = 0;
+};
+
+struct TrackExportStats {
+    size_t frames = 0, bytes = 0;
+    // Time spent baking (and formatting) and time spent waiting for the disk
+    double compute_seconds = 0., write_wait_seconds = 0., seconds = 0.;
+};
+
+
+// Bakes all frames of the clip (an AMC or a view) into the given file. Blocks
+// are baked on multiple threads while the previous block is being written.
+void export_tracks(const ClipView &clip, const std::string &path,
+                   const TrackExportOptions &opts = TrackExportOptions(), TrackExportStats *stats = nullptr);
+
+#endif
@@ -1,13 +1,19 @@
 #include <dake/gl/gl.hpp>
 
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <cmath>
 #include <cstdint>
 #include <cstring>
+#include <ctime>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <typeinfo>
+#include <utility>
+#include <vector>
 #include <unistd.h>
 
 #include <QApplication>
@@ -19,6 +25,7 @@
 #include <QCheckBox>
 #include <QPushButton>
 #include <QFileDialog>
+#include <QFont>
 #include <QStringList>
 #include <QMessageBox>
 #include <QVariant>
@@ -26,9 +33,21 @@
 #include <QSpinBox>
 #include <QLabel>
 #include <QSlider>
+#include <QProgressBar>
+#include <QStatusBar>
+#include <QTimer>
 
 #include "amc.hpp"
+#include "asf.hpp"
+#include "clip_loader.hpp"
+#include "dtw.hpp"
+#include "kinematics.hpp"
+#include "motion_graph.hpp"
+#include "pose_index.hpp"
 #include "render_output.hpp"
+#include "self_collision.hpp"
+#include "timeline_tracks.hpp"
+#include "trace.hpp"
 #include "window.hpp"
 
 
@@ -55,7 +74,8 @@ static const int ogl_version[] = {
 
 
 Window::Window(void):
-    QMainWindow(nullptr)
+    QMainWindow(nullptr),
+    clips(512 << 20)
 {
     i_hate_qt = new QWidget(this);
     setCentralWidget(i_hate_qt);
@@ -74,7 +94,7 @@ Window::Window(void):
 
     load = new QPushButton("Load AMC");
     amcs = new QComboBox;
-    amcs->addItem("(none)", 0);
+    amcs->addItem("(none)", -1);
 
     play = new QPushButton(QIcon::fromTheme("media-playback-start"), "");
     play->setCheckable(true);
@@ -92,6 +112,19 @@ Window::Window(void):
     frame_slider->setRange(-1, -1);
     frame_slider->setValue(-1);
 
+    // Frame numbers are clamped to the clip by ClipView::slice()
+    play_range = new QCheckBox("Play range");
+    range_first = new QSpinBox;
+    range_first->setRange(0, 9999999);
+    range_first->setPrefix("from ");
+    range_last = new QSpinBox;
+    range_last->setRange(0, 9999999);
+    range_last->setValue(9999999);
+    range_last->setPrefix("to ");
+    range_stride = new QSpinBox;
+    range_stride->setRange(1, 1000);
+    range_stride->setPrefix("every ");
+
     play->setEnabled(false);
     fps->setEnabled(false);
     cur_frame->setEnabled(false);
@@ -99,6 +132,50 @@ Window::Window(void):
 
     show_limits = new QCheckBox("Show limits");
     adapt_limits = new QCheckBox("Adapt to still bones");
+    highlight_violations = new QCheckBox("Highlight limit violations");
+    show_com = new QCheckBox("Show center of mass");
+
+    culling = new QCheckBox("Frustum culling");
+    culling->setChecked(true);
+    lod = new QCheckBox("Level of detail");
+    lod->setChecked(true);
+    cull_info = new QLabel("Culled: 0, LOD: 0");
+
+    bone_info = new QLabel("Click a bone to select it");
+    bone_info->setTextFormat(Qt::PlainText);
+
+    cache_label = new QLabel("Clip cache");
+    cache_budget = new QSpinBox;
+    cache_budget->setRange(1, 65536);
+    cache_budget->setValue(clips.budget() >> 20);
+    cache_budget->setSuffix(" MB");
+    cache_info = new QLabel;
+
+    live_info = new QLabel;
+    live_info->hide();
+
+    open_index = new QPushButton("Open pose index...");
+    find_similar = new QPushButton("Find similar poses");
+    find_similar->setEnabled(false);
+    similar_info = new QLabel;
+    similar_info->setTextFormat(Qt::PlainText);
+    similar_info->setFont(QFont("monospace", 8));
+    similar_info->hide();
+
+    graph_walk = new QPushButton("Motion graph walk...");
+
+    align_take = new QPushButton("Compare aligned take...");
+    stop_compare = new QPushButton("Stop comparing");
+    stop_compare->setEnabled(false);
+
+    analyze = new QPushButton("Analyze kinematics");
+    find_collisions = new QPushButton("Find self-collisions");
+
+    pin_bone = new QPushButton("Pin selected bone");
+    clear_pins = new QPushButton("Clear pins");
+
+    trace_overlay = new QCheckBox("Trace timings");
+    save_trace_button = new QPushButton("Save trace...");
 
     l3 = new QHBoxLayout;
     l3->addWidget(play);
@@ -110,16 +187,66 @@ Window::Window(void):
     l4->addWidget(cur_frame, 1);
     l4->addWidget(max_frame, 1);
 
+    l11 = new QHBoxLayout;
+    l11->addWidget(play_range);
+    l11->addWidget(range_first, 1);
+    l11->addWidget(range_last, 1);
+    l11->addWidget(range_stride, 1);
+
+    l5 = new QHBoxLayout;
+    l5->addWidget(cache_label);
+    l5->addWidget(cache_budget, 1);
+
+    l7 = new QHBoxLayout;
+    l7->addWidget(open_index);
+    l7->addWidget(find_similar);
+
+    l8 = new QHBoxLayout;
+    l8->addWidget(align_take);
+    l8->addWidget(stop_compare);
+
+    l10 = new QHBoxLayout;
+    l10->addWidget(pin_bone);
+    l10->addWidget(clear_pins);
+
+    l6 = new QHBoxLayout;
+    l6->addWidget(trace_overlay, 1);
+    l6->addWidget(save_trace_button);
+
     l2 = new QVBoxLayout;
     l2->addWidget(load);
     l2->addWidget(amcs);
+    loads = new QVBoxLayout;
+    l2->addLayout(loads);
     l2->addLayout(l3);
     l2->addLayout(l4);
     l2->addWidget(frame_slider);
+    l2->addLayout(l11);
     l2->addWidget(frames[0]);
     l2->addWidget(show_limits);
     l2->addWidget(adapt_limits);
+    l2->addWidget(highlight_violations);
+    l2->addWidget(show_com);
+    l2->addWidget(frames[1]);
+    l2->addWidget(culling);
+    l2->addWidget(lod);
+    l2->addWidget(cull_info);
+    l2->addWidget(frames[2]);
+    l2->addLayout(l5);
+    l2->addWidget(cache_info);
+    l2->addWidget(live_info);
+    l2->addWidget(frames[3]);
+    l2->addWidget(bone_info);
+    l2->addLayout(l10);
+    l2->addWidget(frames[4]);
+    l2->addLayout(l7);
+    l2->addWidget(similar_info);
+    l2->addWidget(graph_walk);
+    l2->addLayout(l8);
+    l2->addWidget(analyze);
+    l2->addWidget(find_collisions);
     l2->addStretch();
+    l2->addLayout(l6);
 
 
     int highest = fls(QGLFormat::openGLVersionFlags());
@@ -143,18 +270,62 @@ Window::Window(void):
 
     connect(show_limits, SIGNAL(stateChanged(int)), gl, SLOT(show_limits(int)));
     connect(adapt_limits, SIGNAL(stateChanged(int)), gl, SLOT(adapt_limits(int)));
+    connect(highlight_violations, SIGNAL(stateChanged(int)), gl, SLOT(highlight_violations(int)));
+    connect(show_com, SIGNAL(stateChanged(int)), gl, SLOT(show_center_of_mass(int)));
+    connect(culling, SIGNAL(stateChanged(int)), gl, SLOT(set_culling(int)));
+    connect(lod, SIGNAL(stateChanged(int)), gl, SLOT(set_lod(int)));
+    connect(trace_overlay, SIGNAL(stateChanged(int)), gl, SLOT(show_trace_overlay(int)));
+    connect(save_trace_button, SIGNAL(pressed()), this, SLOT(save_trace()));
+    connect(open_index, SIGNAL(pressed()), this, SLOT(open_pose_index()));
+    connect(find_similar, SIGNAL(pressed()), this, SLOT(find_similar_poses()));
+    connect(graph_walk, SIGNAL(pressed()), this, SLOT(walk_motion_graph()));
+    connect(align_take, SIGNAL(pressed()), this, SLOT(compare_aligned_take()));
+    connect(stop_compare, SIGNAL(pressed()), this, SLOT(stop_comparing()));
+    connect(analyze, SIGNAL(pressed()), this, SLOT(analyze_kinematics()));
+    connect(find_collisions, SIGNAL(pressed()), this, SLOT(find_self_collisions()));
+    connect(pin_bone, SIGNAL(pressed()), gl, SLOT(pin_picked_bone()));
+    connect(clear_pins, SIGNAL(pressed()), gl, SLOT(clear_pins()));
+
+    loader = new ClipLoader;
+    load_timer = new QTimer;
+    load_timer->setInterval(100);
+
+    live_timer = new QTimer;
+    live_timer->setInterval(250);
+
+    connect(loader, SIGNAL(started(int, QString, qulonglong)), this, SLOT(clip_started(int, QString, qulonglong)));
+    connect(loader, SIGNAL(loaded(int, QString)), this, SLOT(clip_loaded(int, QString)));
+    connect(loader, SIGNAL(failed(int, QString, QString)), this, SLOT(clip_failed(int, QString, QString)));
+    connect(loader, SIGNAL(cancelled(int, QString)), this, SLOT(clip_cancelled(int, QString)));
+    connect(load_timer, SIGNAL(timeout()), this, SLOT(update_load_progress()));
+    connect(live_timer, SIGNAL(timeout()), this, SLOT(update_live_info()));
 
     connect(load, SIGNAL(pressed()), this, SLOT(load_amc()));
     connect(amcs, SIGNAL(currentIndexChanged(int)), this, SLOT(refresh_amc(int)));
+    connect(cache_budget, SIGNAL(valueChanged(int)), this, SLOT(set_cache_budget(int)));
     connect(play, SIGNAL(toggled(bool)), this, SLOT(toggle_playback(bool)));
     connect(fps, SIGNAL(valueChanged(int)), this, SLOT(set_fps(int)));
     connect(cur_frame, SIGNAL(valueChanged(int)), this, SLOT(set_frame(int)));
     connect(frame_slider, SIGNAL(valueChanged(int)), this, SLOT(set_frame(int)));
+    connect(play_range, SIGNAL(stateChanged(int)), this, SLOT(update_view()));
+    connect(range_first, SIGNAL(valueChanged(int)), this, SLOT(update_view()));
+    connect(range_last, SIGNAL(valueChanged(int)), this, SLOT(update_view()));
+    connect(range_stride, SIGNAL(valueChanged(int)), this, SLOT(update_view()));
 
     connect(gl, SIGNAL(frame_changed(int)), this, SLOT(changed_frame(int)));
+    connect(gl, SIGNAL(cull_stats_changed(int, int)), this, SLOT(update_cull_stats(int, int)));
+    connect(gl, SIGNAL(bone_picked(int)), this, SLOT(show_bone_info(int)));
+
+    timeline = new TimelineTracks;
+    connect(gl, SIGNAL(bone_picked(int)), timeline, SLOT(set_speed_bone(int)));
+    connect(timeline, SIGNAL(frame_selected(int)), this, SLOT(set_frame(int)));
+
+    l9 = new QVBoxLayout;
+    l9->addWidget(gl, 1);
+    l9->addWidget(timeline);
 
     l1 = new QHBoxLayout;
-    l1->addWidget(gl, 1);
+    l1->addLayout(l9, 1);
     l1->addLayout(l2);
 
     i_hate_qt->setLayout(l1);
@@ -163,18 +334,70 @@ Window::Window(void):
 
 Window::~Window(void)
 {
-    for (int i = 0; i < amcs->count(); i++) {
-        delete reinterpret_cast<AMC *>(static_cast<uintptr_t>(amcs->itemData(i).value<qulonglong>()));
+    // Cancels and waits for all running loads; AMCs whose loaded() signal has
+    // not been delivered yet are simply leaked at this point
+    delete loader;
+    delete load_timer;
+    delete live_timer;
+
+    while (!load_rows.empty()) {
+        remove_load_row(load_rows.begin()->first);
     }
 
     delete l1;
     delete l2;
+    delete loads;
     delete l3;
     delete l4;
+    delete l5;
+    delete l6;
+    delete l7;
+    delete l8;
+    delete l9;
+    delete l10;
+    delete l11;
     delete gl;
+    delete timeline;
+    delete live;
+    delete publisher;
+    delete bone_info;
+    delete save_trace_button;
+    delete open_index;
+    delete find_similar;
+    delete similar_info;
+    delete graph_walk;
+    delete align_take;
+    delete stop_compare;
+    delete analyze;
+    delete find_collisions;
+    delete pin_bone;
+    delete clear_pins;
+    delete pose_index;
+    delete compare_clip;
+    delete alignment;
+    for (auto &k: kinematics) {
+        delete k.second;
+    }
+    for (auto &c: collision_reports) {
+        delete c.second;
+    }
+    delete trace_overlay;
+    delete cache_info;
+    delete live_info;
+    delete cache_budget;
+    delete cache_label;
+    delete cull_info;
+    delete culling;
+    delete lod;
     delete adapt_limits;
+    delete highlight_violations;
+    delete show_com;
     delete show_limits;
     delete frame_slider;
+    delete range_stride;
+    delete range_last;
+    delete range_first;
+    delete play_range;
     delete max_frame;
     delete cur_frame;
     delete fps_label;
@@ -194,43 +417,214 @@ Window::~Window(void)
 }
 
 
+void Window::start_live(const std::string &address)
+{
+    LiveStream *stream = new LiveStream(address, gl->asf());
+
+    gl->live() = stream;
+    delete live;
+    live = stream;
+
+    live_info->show();
+    update_live_info();
+    live_timer->start();
+}
+
+
+void Window::start_publishing(const std::string &shm_name)
+{
+    PosePublisher *pub = new PosePublisher(shm_name, *gl->asf());
+
+    gl->publisher() = pub;
+    delete publisher;
+    publisher = pub;
+}
+
+
+void Window::update_live_info(void)
+{
+    LiveStream::Stats stats = live->stats();
+
+    live_info->setText(QString("Live %1: %2 frames\n%3 dropped, %4 skipped, %5 errors\nLatency: %6 ms")
+                       .arg(QString::fromStdString(live->address())).arg(stats.received)
+                       .arg(stats.dropped).arg(stats.superseded).arg(stats.errors)
+                       .arg(stats.latency_ms, 0, 'f', 2));
+}
+
+
 void Window::load_amc(void)
 {
-    QStringList paths = QFileDialog::getOpenFileNames(this, "Load AMC", QString(), "Animations (*.amc);;All files (*.*)");
+    QStringList paths = QFileDialog::getOpenFileNames(this, "Load AMC", QString(), "Animations (*.amc *.amcb);;All files (*.*)");
+    if (paths.isEmpty()) {
+        return;
+    }
 
-    for (const auto &path: paths) {
-        std::ifstream inp(path.toUtf8().constData());
-        if (!inp.is_open()) {
-            QMessageBox::critical(this, "Could not open file", QString("Could not open ") + path + QString(": ") + QString(strerror(errno)));
-            continue;
-        }
+    std::vector<int> ids = loader->load(paths, gl->asf());
+
+    for (int i = 0; i < paths.size(); i++) {
+        std::string name_copy(paths[i].toUtf8().constData());
+
+        LoadRow row;
+        row.layout = new QHBoxLayout;
+        row.name = new QLabel(QString(basename(name_copy.c_str())));
+        row.progress = new QProgressBar;
+        row.progress->setRange(0, 1000);
+        row.progress->setTextVisible(false);
+        row.cancel = new QPushButton(QIcon::fromTheme("process-stop"), "");
+        row.cancel->setProperty("load_id", ids[i]);
+
+        row.layout->addWidget(row.name);
+        row.layout->addWidget(row.progress, 1);
+        row.layout->addWidget(row.cancel);
+        loads->addLayout(row.layout);
+
+        connect(row.cancel, SIGNAL(pressed()), this, SLOT(cancel_load()));
+
+        load_rows[ids[i]] = row;
+    }
+
+    load_timer->start();
+}
+
+
+void Window::remove_load_row(int id)
+{
+    auto row = load_rows.find(id);
+    if (row == load_rows.end()) {
+        return;
+    }
+
+    loads->removeItem(row->second.layout);
+
+    delete row->second.cancel;
+    delete row->second.progress;
+    delete row->second.name;
+    delete row->second.layout;
+
+    load_rows.erase(row);
+
+    if (load_rows.empty()) {
+        load_timer->stop();
+    }
+}
+
+
+void Window::clip_started(int, QString path, qulonglong amc)
+{
+    std::string name_copy(path.toUtf8().constData());
+
+    int clip = clips.add(name_copy, reinterpret_cast<AMC *>(static_cast<uintptr_t>(amc)), gl->asf());
+    amcs->addItem(QString(basename(name_copy.c_str())), clip);
+
+    update_cache_info();
+}
+
+
+void Window::clip_loaded(int id, QString)
+{
+    remove_load_row(id);
+
+    merge_loaded_frames();
+    update_frame_range();
+}
+
+
+void Window::merge_loaded_frames(void)
+{
+    if (clips.merge_loaded_frames()) {
+        // Views only cover the frames merged when they were made
+        update_view();
+        gl->invalidate();
+    }
+
+    update_cache_info();
+}
 
-        try {
-            std::string name_copy(path.toUtf8().constData());
-            QString name(basename(name_copy.c_str()));
 
-            AMC *amc = new AMC(inp, gl->asf());
-            // i haet qt
-            amcs->addItem(name, static_cast<qulonglong>(reinterpret_cast<uintptr_t>(amc)));
+void Window::clip_failed(int id, QString path, QString error)
+{
+    remove_load_row(id);
+    merge_loaded_frames();
+
+    statusBar()->showMessage(QString("Could not load ") + path + QString(": ") + error);
+}
+
+
+void Window::clip_cancelled(int id, QString path)
+{
+    remove_load_row(id);
+    merge_loaded_frames();
+
+    statusBar()->showMessage(QString("Cancelled loading ") + path, 5000);
+}
+
+
+void Window::cancel_load(void)
+{
+    loader->cancel(sender()->property("load_id").toInt());
+}
+
+
+void Window::update_load_progress(void)
+{
+    for (auto &row: load_rows) {
+        row.second.progress->setValue(lrintf(loader->progress(row.first) * 1000.f));
+    }
+
+    merge_loaded_frames();
+}
+
+
+void Window::refresh_amc(int)
+{
+    int clip = amcs->currentIndex() < 0 ? -1 : amcs->currentData().toInt();
+
+    // The view refers to the old clip, which may be dropped by get()
+    gl->view() = nullptr;
+    gl->amc() = nullptr;
+    gl->amc_id() = -1;
+    if (clip >= 0) {
+        try {
+            gl->amc() = clips.get(clip);
+            gl->amc_id() = clip;
         } catch (std::exception &e) {
-            QMessageBox::critical(this, "Error", QString("Could not load ") + path + QString(": ") + QString(e.what()));
+            statusBar()->showMessage(QString(e.what()));
         }
     }
 
-    refresh_amc(-1);
+    gl->compare(clip >= 0 && clip == compare_base ? compare_clip : nullptr, alignment);
+
+    const RenderOutput *r = gl;
+    auto kit = kinematics.find(clip);
+    auto cit = collision_reports.find(clip);
+    const SelfCollisionReport *report = cit != collision_reports.end() ? cit->second : nullptr;
+    gl->self_collisions(r->amc(), report);
+    timeline->set_collisions(report);
+    timeline->set_kinematics(kit != kinematics.end() ? kit->second : nullptr, r->asf());
 
-    gl->invalidate();
+    update_cache_info();
+    update_view();
 }
 
 
-void Window::refresh_amc(int)
+void Window::update_view(void)
 {
-    if (amcs->currentIndex() < 0) {
-        gl->amc() = nullptr;
-    } else {
-        gl->amc() = reinterpret_cast<AMC *>(static_cast<uintptr_t>(amcs->currentData().value<qulonglong>()));
+    gl->view() = nullptr;
+    view = ClipView();
+
+    int first = range_first->value(), last = range_last->value();
+    if (play_range->isChecked() && gl->amc() && (last >= first)) {
+        view = ClipView(*gl->amc()).slice(first, last - first + 1, range_stride->value());
+        gl->view() = &view;
     }
 
+    update_frame_range();
+}
+
+
+// Frames may still be arriving, so this is called again whenever they do
+void Window::update_frame_range(void)
+{
     bool has_amc = gl->amc();
     play->setEnabled(has_amc);
     fps->setEnabled(has_amc);
@@ -238,11 +632,12 @@ void Window::refresh_amc(int)
     frame_slider->setEnabled(has_amc);
 
     if (has_amc) {
-        int min = gl->amc()->first_frame();
-        int max = min + gl->amc()->frames().size();
+        // Views are numbered consecutively from their first frame on
+        int min = view.empty() ? gl->amc()->first_frame() : view.first_frame();
+        int max = min + (view.empty() ? gl->amc()->frames().size() : view.size());
         cur_frame->setRange(min, max);
         cur_frame->setValue(gl->frame());
-        max_frame->setText(QString(" / %1").arg(max));
+        max_frame->setText(QString(" / %1%2").arg(max).arg(gl->amc()->loading() ? " (loading)" : ""));
         frame_slider->setRange(min, max);
         frame_slider->setValue(gl->frame());
     } else {
@@ -255,6 +650,36 @@ void Window::refresh_amc(int)
 }
 
 
+void Window::set_cache_budget(int mb)
+{
+    clips.set_budget(static_cast<size_t>(mb) << 20);
+    update_cache_info();
+}
+
+
+void Window::update_cache_info(void)
+{
+    // The non-const accessors would reset the renderer's state
+    const RenderOutput *r = gl;
+
+    QString text = QString("Resident: %1 MB, hits: %2, misses: %3")
+                   .arg(clips.resident_bytes() / 1048576., 0, 'f', 1)
+                   .arg(clips.hits()).arg(clips.misses());
+
+    if (r->asf()) {
+        text += QString("\nSkeleton: %1 kB").arg(r->asf()->memory_usage().total() / 1024., 0, 'f', 1);
+    }
+    if (r->amc()) {
+        AMC::MemoryUsage usage = r->amc()->memory_usage();
+        text += QString("\nClip: %1 MB (frames %2 MB, transformations %3 MB)")
+                .arg(usage.total() / 1048576., 0, 'f', 1).arg(usage.frames / 1048576., 0, 'f', 1)
+                .arg(usage.transformations / 1048576., 0, 'f', 1);
+    }
+
+    cache_info->setText(text);
+}
+
+
 void Window::toggle_playback(bool state)
 {
     gl->play(state);
@@ -273,8 +698,11 @@ void Window::changed_frame(int frame)
 
     cur_frame->setValue(frame);
     frame_slider->setValue(frame);
+    timeline->set_frame(frame);
 
     ignore_set_frame = false;
+
+    show_bone_info(gl->picked_bone());
 }
 
 
@@ -288,4 +716,330 @@ void Window::set_frame(int frame)
 
     cur_frame->setValue(frame);
     frame_slider->setValue(frame);
+    timeline->set_frame(frame);
+
+    show_bone_info(gl->picked_bone());
+}
+
+
+void Window::update_cull_stats(int culled, int lod)
+{
+    cull_info->setText(QString("Culled: %1, LOD: %2").arg(culled).arg(lod));
+}
+
+
+static const char *axis_name(ASF::Axis axis)
+{
+    switch (axis) {
+        case ASF::RX: return "rx";
+        case ASF::RY: return "ry";
+        case ASF::RZ: return "rz";
+        case ASF::TX: return "tx";
+        case ASF::TY: return "ty";
+        case ASF::TZ: return "tz";
+    }
+
+    return "?";
+}
+
+
+void Window::show_bone_info(int bi)
+{
+    const ASF *asf = gl->asf();
+
+    if (!asf || (bi < 0)) {
+        bone_info->setText("Click a bone to select it");
+        return;
+    }
+
+    const ASF::Bone &bone = asf->bones()[bi];
+    QString text = QString("%1 (ID %2)").arg(QString::fromStdString(bone.name)).arg(bone.id);
+
+    const AMC::Frame *frame = nullptr;
+    if (gl->amc()) {
+        int fi = gl->frame() - gl->amc()->first_frame();
+        if ((fi >= 0) && (fi < static_cast<int>(gl->amc()->frames().size()))) {
+            frame = &gl->amc()->frames()[fi];
+        }
+    }
+
+    const std::vector<ASF::Axis> &order = bi == asf->root_index() ? asf->root_order() : bone.dof_order;
+
+    for (ASF::Axis axis: order) {
+        text += QString("\n%1:").arg(axis_name(axis));
+
+        if (frame) {
+            float value;
+            if (bi == asf->root_index()) {
+                switch (axis) {
+                    case ASF::RX: value = frame->root_rotation.x(); break;
+                    case ASF::RY: value = frame->root_rotation.y(); break;
+                    case ASF::RZ: value = frame->root_rotation.z(); break;
+                    case ASF::TX: value = frame->root_translation.x(); break;
+                    case ASF::TY: value = frame->root_translation.y(); break;
+                    case ASF::TZ: value = frame->root_translation.z(); break;
+                    default: value = 0.f;
+                }
+            } else {
+                const AMC::Transformation &trans = frame->transformations[bi];
+                value = axis == ASF::RX ? trans.rx : axis == ASF::RY ? trans.ry : trans.rz;
+            }
+
+            if ((axis == ASF::RX) || (axis == ASF::RY) || (axis == ASF::RZ)) {
+                text += QString(" %1°").arg(value * 180.f / static_cast<float>(M_PI), 0, 'f', 1);
+            } else {
+                text += QString(" %1").arg(value, 0, 'f', 3);
+            }
+        }
+
+        auto limit = bone.dof.find(static_cast<int>(axis));
+        if (limit != bone.dof.end() && std::isfinite(limit->second.first) && std::isfinite(limit->second.second)) {
+            text += QString(" [%1°, %2°]").arg(limit->second.first  * 180.f / static_cast<float>(M_PI), 0, 'f', 1)
+                                         .arg(limit->second.second * 180.f / static_cast<float>(M_PI), 0, 'f', 1);
+        }
+    }
+
+    bone_info->setText(text);
+}
+
+
+void Window::save_trace(void)
+{
+    QString path = QFileDialog::getSaveFileName(this, "Save trace", "trace.json", "Chrome traces (*.json)");
+    if (path.isEmpty()) {
+        return;
+    }
+
+    try {
+        write_chrome_trace(path.toUtf8().constData());
+        statusBar()->showMessage(QString("Trace saved to ") + path, 5000);
+    } catch (std::exception &e) {
+        statusBar()->showMessage(QString(e.what()));
+    }
+}
+
+
+void Window::open_pose_index(void)
+{
+    QString path = QFileDialog::getOpenFileName(this, "Open pose index", QString(),
+                                                "Pose indices (*.idx);;All files (*.*)");
+    if (path.isEmpty()) {
+        return;
+    }
+
+    try {
+        PoseIndex *index = new PoseIndex(std::string(path.toUtf8().constData()));
+
+        delete pose_index;
+        pose_index = index;
+        find_similar->setEnabled(true);
+
+        statusBar()->showMessage(QString("Pose index with %1 frames from %2 clips").arg(pose_index->size())
+                                 .arg(pose_index->clips().size()), 5000);
+    } catch (std::exception &e) {
+        QMessageBox::critical(this, "Error opening pose index", e.what());
+    }
+}
+
+
+void Window::find_similar_poses(void)
+{
+    const RenderOutput *r = gl;
+    AMC::Frame pose;
+    if (!pose_index || !r->asf() || !gl->current_pose(pose)) {
+        statusBar()->showMessage("No pose to search for", 5000);
+        return;
+    }
+
+    try {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<PoseMatch> matches(pose_index->query(*r->asf(), pose, 10));
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        QString text;
+        for (const PoseMatch &m: matches) {
+            const std::string &clip = pose_index->clips()[m.clip];
+            QString name = QString::fromStdString(clip.substr(clip.rfind('/') + 1));
+            text += QString("%1  %2:%3\n").arg(m.distance, 7, 'f', 3).arg(name).arg(m.frame);
+        }
+        text += QString("(%1 ms)").arg(ms, 0, 'f', 2);
+
+        similar_info->setText(text);
+        similar_info->show();
+    } catch (std::exception &e) {
+        statusBar()->showMessage(QString(e.what()));
+    }
+}
+
+
+void Window::walk_motion_graph(void)
+{
+    const RenderOutput *r = gl;
+    if (!r->asf()) {
+        statusBar()->showMessage("Load a skeleton first", 5000);
+        return;
+    }
+
+    QString path = QFileDialog::getOpenFileName(this, "Open motion graph", QString(),
+                                                "Motion graphs (*.graph);;All files (*.*)");
+    if (path.isEmpty()) {
+        return;
+    }
+
+    try {
+        std::string path_copy(path.toUtf8().constData());
+        MotionGraph graph(path_copy);
+        ASF *asf = gl->asf();
+
+        std::vector<std::unique_ptr<AMC>> parts;
+        std::vector<const AMC *> part_ptrs;
+        for (const std::string &part: graph.clips()) {
+            std::ifstream s(part, std::ios::binary);
+            if (!s.is_open()) {
+                throw std::runtime_error("Could not open " + part + ": " + strerror(errno));
+            }
+
+            parts.emplace_back(new AMC(s, asf));
+            part_ptrs.push_back(parts.back().get());
+        }
+
+        // A minute at the current playback rate
+        std::vector<std::string> warnings;
+        AMC *walk = graph.walk(asf, part_ptrs, 60 * fps->value(), time(nullptr), &warnings);
+
+        std::string name = std::string("Walk through ") + basename(path_copy.c_str());
+        int clip = clips.add(name, walk, asf);
+        amcs->addItem(QString::fromStdString(name), clip);
+        amcs->setCurrentIndex(amcs->count() - 1);
+
+        update_cache_info();
+
+        if (!warnings.empty()) {
+            statusBar()->showMessage(QString::fromStdString(warnings.front()), 5000);
+        }
+    } catch (std::exception &e) {
+        QMessageBox::critical(this, "Error walking the motion graph", e.what());
+    }
+}
+
+
+void Window::compare_aligned_take(void)
+{
+    const RenderOutput *r = gl;
+    int clip = amcs->currentIndex() < 0 ? -1 : amcs->currentData().toInt();
+    if (!r->asf() || !r->amc() || (clip < 0) || r->amc()->loading()) {
+        statusBar()->showMessage("Select a fully loaded clip first", 5000);
+        return;
+    }
+
+    QString path = QFileDialog::getOpenFileName(this, "Compare with take", QString(),
+                                                "Animations (*.amc *.amcb);;All files (*.*)");
+    if (path.isEmpty()) {
+        return;
+    }
+
+    try {
+        std::string path_copy(path.toUtf8().constData());
+        std::ifstream s(path_copy, std::ios::binary);
+        if (!s.is_open()) {
+            throw std::runtime_error("Could not open " + path_copy + ": " + strerror(errno));
+        }
+
+        std::unique_ptr<AMC> take(new AMC(s, gl->asf()));
+        std::unique_ptr<DTWAlignment> al(new DTWAlignment(align_clips(*r->amc(), *take)));
+
+        gl->compare(nullptr, nullptr);
+        delete compare_clip;
+        delete alignment;
+        compare_clip = take.release();
+        alignment = al.release();
+        compare_base = clip;
+        gl->compare(compare_clip, alignment);
+
+        stop_compare->setEnabled(true);
+
+        statusBar()->showMessage(QString("Aligned %1 in %2 s, mean distance %3 m")
+                                 .arg(QString(basename(path_copy.c_str()))).arg(alignment->seconds, 0, 'f', 2)
+                                 .arg(alignment->cost, 0, 'f', 3), 5000);
+    } catch (std::exception &e) {
+        QMessageBox::critical(this, "Error aligning takes", e.what());
+    }
+}
+
+
+void Window::stop_comparing(void)
+{
+    gl->compare(nullptr, nullptr);
+
+    delete compare_clip;
+    delete alignment;
+    compare_clip = nullptr;
+    alignment = nullptr;
+    compare_base = -1;
+
+    stop_compare->setEnabled(false);
+}
+
+
+void Window::analyze_kinematics(void)
+{
+    const RenderOutput *r = gl;
+    int clip = amcs->currentIndex() < 0 ? -1 : amcs->currentData().toInt();
+    if (!r->amc() || (clip < 0) || r->amc()->loading()) {
+        statusBar()->showMessage("Select a fully loaded clip first", 5000);
+        return;
+    }
+
+    try {
+        // AMC files do not store their frame rate, so take the playback rate
+        KinematicsOptions opts;
+        opts.fps = fps->value();
+
+        ClipKinematics *kin = new ClipKinematics(*r->amc(), opts);
+
+        delete kinematics[clip];
+        kinematics[clip] = kin;
+        timeline->set_kinematics(kin, r->asf());
+        timeline->set_speed_bone(r->picked_bone());
+        timeline->set_frame(r->frame());
+
+        statusBar()->showMessage(QString("Analyzed %1 frames in %2 s").arg(kin->frame_count())
+                                 .arg(kin->seconds(), 0, 'f', 3), 5000);
+    } catch (std::exception &e) {
+        QMessageBox::critical(this, "Error analyzing the clip", e.what());
+    }
+}
+
+
+void Window::find_self_collisions(void)
+{
+    const RenderOutput *r = gl;
+    int clip = amcs->currentIndex() < 0 ? -1 : amcs->currentData().toInt();
+    if (!r->amc() || (clip < 0) || r->amc()->loading()) {
+        statusBar()->showMessage("Select a fully loaded clip first", 5000);
+        return;
+    }
+
+    try {
+        SelfCollisionReport *report = new SelfCollisionReport(::find_self_collisions(*r->amc()));
+
+        gl->self_collisions(r->amc(), report);
+        timeline->set_collisions(report);
+        delete collision_reports[clip];
+        collision_reports[clip] = report;
+
+        std::vector<std::pair<int, int>> ranges(report->frame_ranges());
+        QString msg = QString("%1 colliding bone pairs in %2 frame ranges").arg(report->collisions.size())
+                      .arg(ranges.size());
+        for (size_t i = 0; i < std::min<size_t>(ranges.size(), 3); i++) {
+            msg += QString(i ? ", %1-%2" : ": %1-%2").arg(ranges[i].first).arg(ranges[i].second);
+        }
+        if (ranges.size() > 3) {
+            msg += ", ...";
+        }
+
+        statusBar()->showMessage(msg, 10000);
+    } catch (std::exception &e) {
+        QMessageBox::critical(this, "Error checking the clip", e.what());
+    }
 }
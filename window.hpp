@@ -1,6 +1,8 @@
 #ifndef WINDOW_HPP
 #define WINDOW_HPP
 
+#include <map>
+#include <string>
 #include <QMainWindow>
 #include <QBoxLayout>
 #include <QWidget>
@@ -11,9 +13,21 @@
 #include <QSpinBox>
 #include <QLabel>
 #include <QSlider>
+#include <QProgressBar>
+#include <QTimer>
 
 #include "asf.hpp"
+#include "clip_loader.hpp"
+#include "clip_manager.hpp"
+#include "clip_view.hpp"
+#include "dtw.hpp"
+#include "kinematics.hpp"
+#include "live_stream.hpp"
+#include "pose_index.hpp"
+#include "pose_publisher.hpp"
 #include "render_output.hpp"
+#include "self_collision.hpp"
+#include "timeline_tracks.hpp"
 
 
 class Window:
@@ -28,6 +42,14 @@ class Window:
         RenderOutput *renderer(void)
         { return gl; }
 
+        // Shows frames received on the given address (see LiveStream)
+        // instead of the selected clip; requires the ASF to be set
+        void start_live(const std::string &address);
+
+        // Publishes every pose shown into the given shared memory segment
+        // (see PosePublisher); requires the ASF to be set
+        void start_publishing(const std::string &shm_name);
+
     public slots:
         void load_amc(void);
         void refresh_amc(int);
@@ -35,22 +57,79 @@ class Window:
         void set_fps(int count);
         void changed_frame(int frame);
         void set_frame(int frame);
+        void update_cull_stats(int culled, int lod);
+        void show_bone_info(int bone);
+
+        void clip_started(int id, QString path, qulonglong amc);
+        void clip_loaded(int id, QString path);
+        void clip_failed(int id, QString path, QString error);
+        void clip_cancelled(int id, QString path);
+        void cancel_load(void);
+        void update_load_progress(void);
+        void set_cache_budget(int mb);
+        void update_live_info(void);
+        void save_trace(void);
+        void open_pose_index(void);
+        void find_similar_poses(void);
+        void walk_motion_graph(void);
+        void compare_aligned_take(void);
+        void stop_comparing(void);
+        void analyze_kinematics(void);
+        void find_self_collisions(void);
+        void update_view(void);
 
     private:
         QWidget *i_hate_qt;
 
         RenderOutput *gl;
+        TimelineTracks *timeline;
         QComboBox *amcs;
-        QPushButton *load, *play;
-        QCheckBox *show_limits, *adapt_limits;
-        QSpinBox *fps, *cur_frame;
-        QLabel *fps_label, *max_frame;
+        QPushButton *load, *play, *save_trace_button, *open_index, *find_similar, *graph_walk,
+                    *align_take, *stop_compare, *analyze, *find_collisions, *pin_bone,
+                    *clear_pins;
+        QCheckBox *play_range, *show_limits, *adapt_limits, *highlight_violations, *show_com, *culling, *lod,
+                  *trace_overlay;
+        QSpinBox *fps, *cur_frame, *range_first, *range_last, *range_stride, *cache_budget;
+        QLabel *fps_label, *max_frame, *cull_info, *bone_info, *cache_label, *cache_info, *live_info, *similar_info;
         QSlider *frame_slider;
 
-        QFrame *frames[1], *vframes[1];
+        QFrame *frames[5], *vframes[1];
+
+        QHBoxLayout *l1, *l3, *l4, *l5, *l6, *l7, *l8, *l10, *l11;
+        QVBoxLayout *l2, *l9;
+
+        // One row per file currently being loaded
+        struct LoadRow {
+            QHBoxLayout *layout;
+            QLabel *name;
+            QProgressBar *progress;
+            QPushButton *cancel;
+        };
+
+        void remove_load_row(int id);
+        void update_cache_info(void);
+        void update_frame_range(void);
+        void merge_loaded_frames(void);
+
+        ClipLoader *loader;
+        ClipManager clips;
+        std::map<int, LoadRow> load_rows;
+        QVBoxLayout *loads;
+        QTimer *load_timer;
 
-        QHBoxLayout *l1, *l3, *l4;
-        QVBoxLayout *l2;
+        LiveStream *live = nullptr;
+        PosePublisher *publisher = nullptr;
+        PoseIndex *pose_index = nullptr;
+        // Shown next to the clip with ID compare_base
+        AMC *compare_clip = nullptr;
+        DTWAlignment *alignment = nullptr;
+        int compare_base = -1;
+        // By clip ID
+        std::map<int, ClipKinematics *> kinematics;
+        std::map<int, SelfCollisionReport *> collision_reports;
+        // Played instead of the current clip while play_range is checked
+        ClipView view;
+        QTimer *live_timer;
 
         bool ignore_set_frame = false;
 };